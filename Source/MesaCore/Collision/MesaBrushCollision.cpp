@@ -0,0 +1,527 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaBrushCollision.h"
+#include "MesaCoreMacros.h"
+
+#include "Async/MappedFileHandle.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/Crc.h"
+
+namespace MesaBrushCollision
+{
+	// Brushes per BVH leaf. Small leaves, clipping a brush is far more expensive than a box test.
+	static constexpr int32 MaxLeafBrushes = 4;
+	static constexpr int32 MaxTraversalDepth = 64;
+	static constexpr uint64 SectionAlignment = 16;
+
+	// Support distance of an upright capsule along a plane normal.
+	static FORCEINLINE float CapsulePlaneOffset(const FPlane4f& Plane, float Radius, float HalfSegment)
+	{
+		return Radius + HalfSegment * FMath::Abs(Plane.Z);
+	}
+
+	// Plane distance done in double, brushes are stored single precision but pawn locations aren't.
+	static FORCEINLINE float PlaneDist(const FPlane4f& Plane, const FVector& Point)
+	{
+		return (float)((double)Plane.X * Point.X + (double)Plane.Y * Point.Y + (double)Plane.Z * Point.Z - (double)Plane.W);
+	}
+
+	static FORCEINLINE bool BoundsOverlap(const FVector3f& AMin, const FVector3f& AMax, const FVector3f& BMin, const FVector3f& BMax)
+	{
+		return AMin.X <= BMax.X && AMax.X >= BMin.X
+			&& AMin.Y <= BMax.Y && AMax.Y >= BMin.Y
+			&& AMin.Z <= BMax.Z && AMax.Z >= BMin.Z;
+	}
+}
+
+FMesaBrushWorld::FMesaBrushWorld() = default;
+FMesaBrushWorld::~FMesaBrushWorld() = default;
+
+void FMesaBrushWorld::UseOwnedData()
+{
+	MappedRegion.Reset();
+	MappedFile.Reset();
+
+	Nodes = OwnedNodes;
+	Brushes = OwnedBrushes;
+	Planes = OwnedPlanes;
+}
+
+void FMesaBrushWorld::AddBrush(const TArray<FPlane>& InPlanes, const FBox& Bounds)
+{
+	check(!IsMapped());
+
+	FMesaBrush& Brush = OwnedBrushes.AddDefaulted_GetRef();
+	Brush.Min = FVector3f(Bounds.Min);
+	Brush.Max = FVector3f(Bounds.Max);
+	Brush.FirstPlane = OwnedPlanes.Num();
+
+	for (const FPlane& Plane : InPlanes)
+	{
+		OwnedPlanes.Add(FPlane4f(Plane));
+	}
+
+	// Axial bevels, skipping any axis the brush already has a face for.
+	static const FVector Axes[6] = { FVector::ForwardVector, FVector::BackwardVector, FVector::RightVector, FVector::LeftVector, FVector::UpVector, FVector::DownVector };
+	for (const FVector& Axis : Axes)
+	{
+		bool bHasFace = false;
+		for (const FPlane& Plane : InPlanes)
+		{
+			if ((Plane.GetNormal() | Axis) > 0.9999f)
+			{
+				bHasFace = true;
+				break;
+			}
+		}
+
+		if (!bHasFace)
+		{
+			const FVector Extreme = FVector(Axis.X > 0.f ? Bounds.Max.X : Bounds.Min.X, Axis.Y > 0.f ? Bounds.Max.Y : Bounds.Min.Y, Axis.Z > 0.f ? Bounds.Max.Z : Bounds.Min.Z);
+			OwnedPlanes.Add(FPlane4f(FPlane(Extreme, Axis)));
+		}
+	}
+
+	Brush.NumPlanes = OwnedPlanes.Num() - Brush.FirstPlane;
+
+	// Any previous BVH no longer covers everything.
+	OwnedNodes.Reset();
+	UseOwnedData();
+}
+
+void FMesaBrushWorld::BuildBVH()
+{
+	check(!IsMapped());
+	OwnedNodes.Reset();
+
+	if (OwnedBrushes.Num() == 0)
+	{
+		UseOwnedData();
+		return;
+	}
+
+	struct FBuildTask
+	{
+		int32 Node;
+		int32 Begin;
+		int32 End;
+	};
+
+	TArray<FBuildTask, TInlineAllocator<64>> Tasks;
+	OwnedNodes.AddDefaulted();
+	Tasks.Add({ 0, 0, OwnedBrushes.Num() });
+
+	while (Tasks.Num() > 0)
+	{
+		const FBuildTask Task = Tasks.Pop(false);
+
+		FBox3f Bounds(ForceInit);
+		FBox3f CentroidBounds(ForceInit);
+		for (int32 Index = Task.Begin; Index < Task.End; ++Index)
+		{
+			const FMesaBrush& Brush = OwnedBrushes[Index];
+			Bounds += FBox3f(Brush.Min, Brush.Max);
+			CentroidBounds += (Brush.Min + Brush.Max) * 0.5f;
+		}
+
+		OwnedNodes[Task.Node].Min = Bounds.Min;
+		OwnedNodes[Task.Node].Max = Bounds.Max;
+
+		const FVector3f CentroidExtent = CentroidBounds.GetSize();
+		const int32 Axis = CentroidExtent.X >= CentroidExtent.Y && CentroidExtent.X >= CentroidExtent.Z ? 0 : (CentroidExtent.Y >= CentroidExtent.Z ? 1 : 2);
+		const int32 Count = Task.End - Task.Begin;
+
+		if (Count <= MesaBrushCollision::MaxLeafBrushes || CentroidExtent[Axis] <= KINDA_SMALL_NUMBER)
+		{
+			OwnedNodes[Task.Node].First = Task.Begin;
+			OwnedNodes[Task.Node].Count = Count;
+			continue;
+		}
+
+		// Median split on the longest centroid axis. Brushes are reordered in place, planes don't move.
+		Sort(OwnedBrushes.GetData() + Task.Begin, Count, [Axis](const FMesaBrush& A, const FMesaBrush& B)
+		{
+			return (A.Min[Axis] + A.Max[Axis]) < (B.Min[Axis] + B.Max[Axis]);
+		});
+
+		const int32 Mid = Task.Begin + Count / 2;
+		const int32 FirstChild = OwnedNodes.AddDefaulted(2);
+		OwnedNodes[Task.Node].First = FirstChild;
+		OwnedNodes[Task.Node].Count = 0;
+
+		Tasks.Add({ FirstChild, Task.Begin, Mid });
+		Tasks.Add({ FirstChild + 1, Mid, Task.End });
+	}
+
+	UseOwnedData();
+}
+
+void FMesaBrushWorld::Reset()
+{
+	OwnedNodes.Empty();
+	OwnedBrushes.Empty();
+	OwnedPlanes.Empty();
+	UseOwnedData();
+}
+
+uint32 FMesaBrushWorld::ComputePayloadCrc() const
+{
+	uint32 Crc = FCrc::MemCrc32(Nodes.GetData(), Nodes.Num() * sizeof(FMesaBVHNode));
+	Crc = FCrc::MemCrc32(Brushes.GetData(), Brushes.Num() * sizeof(FMesaBrush), Crc);
+	return FCrc::MemCrc32(Planes.GetData(), Planes.Num() * sizeof(FPlane4f), Crc);
+}
+
+bool FMesaBrushWorld::SaveToFile(const FString& Filename) const
+{
+	if (Brushes.Num() > 0 && Nodes.Num() == 0)
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaCollision: Refusing to save %s without a BVH"), *Filename);
+		return false;
+	}
+
+	TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*Filename));
+	if (!Writer)
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaCollision: Failed to open %s for writing"), *Filename);
+		return false;
+	}
+
+	auto AlignSection = [](uint64 Offset) { return Align(Offset, MesaBrushCollision::SectionAlignment); };
+
+	FMesaCollisionFileHeader Header;
+	Header.NumNodes = Nodes.Num();
+	Header.NumBrushes = Brushes.Num();
+	Header.NumPlanes = Planes.Num();
+	Header.PayloadCrc = ComputePayloadCrc();
+	Header.NodesOffset = AlignSection(sizeof(FMesaCollisionFileHeader));
+	Header.BrushesOffset = AlignSection(Header.NodesOffset + Nodes.Num() * sizeof(FMesaBVHNode));
+	Header.PlanesOffset = AlignSection(Header.BrushesOffset + Brushes.Num() * sizeof(FMesaBrush));
+
+	auto WriteSection = [&Writer](uint64 Offset, const void* Data, int64 Size)
+	{
+		static const uint8 Padding[MesaBrushCollision::SectionAlignment] = {};
+		const int64 PadSize = (int64)Offset - Writer->Tell();
+		check(PadSize >= 0 && PadSize < (int64)MesaBrushCollision::SectionAlignment);
+		Writer->Serialize(const_cast<uint8*>(Padding), PadSize);
+		Writer->Serialize(const_cast<void*>(Data), Size);
+	};
+
+	Writer->Serialize(&Header, sizeof(Header));
+	WriteSection(Header.NodesOffset, Nodes.GetData(), Nodes.Num() * sizeof(FMesaBVHNode));
+	WriteSection(Header.BrushesOffset, Brushes.GetData(), Brushes.Num() * sizeof(FMesaBrush));
+	WriteSection(Header.PlanesOffset, Planes.GetData(), Planes.Num() * sizeof(FPlane4f));
+
+	return Writer->Close();
+}
+
+bool FMesaBrushWorld::LoadFromFile(const FString& Filename, bool bVerifyCrc)
+{
+	Reset();
+
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	TUniquePtr<IMappedFileHandle> File(PlatformFile.OpenMapped(*Filename));
+	if (!File)
+	{
+		return false;
+	}
+
+	const int64 FileSize = File->GetFileSize();
+	if (FileSize < (int64)sizeof(FMesaCollisionFileHeader))
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s is truncated"), *Filename);
+		return false;
+	}
+
+	TUniquePtr<IMappedFileRegion> Region(File->MapRegion(0, FileSize));
+	if (!Region)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: Failed to map %s"), *Filename);
+		return false;
+	}
+
+	const uint8* Data = Region->GetMappedPtr();
+	const FMesaCollisionFileHeader& Header = *reinterpret_cast<const FMesaCollisionFileHeader*>(Data);
+
+	if (Header.Magic != FMesaCollisionFileHeader::MagicValue)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s is not a collision file"), *Filename);
+		return false;
+	}
+
+	if (Header.Version != FMesaCollisionFileHeader::CurrentVersion)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has version %u, expected %u"), *Filename, Header.Version, FMesaCollisionFileHeader::CurrentVersion);
+		return false;
+	}
+
+	auto SectionValid = [FileSize](uint64 Offset, uint64 Count, uint64 ElementSize)
+	{
+		return (Offset % MesaBrushCollision::SectionAlignment) == 0 && Offset + Count * ElementSize <= (uint64)FileSize;
+	};
+
+	if (!SectionValid(Header.NodesOffset, Header.NumNodes, sizeof(FMesaBVHNode))
+		|| !SectionValid(Header.BrushesOffset, Header.NumBrushes, sizeof(FMesaBrush))
+		|| !SectionValid(Header.PlanesOffset, Header.NumPlanes, sizeof(FPlane4f)))
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has sections outside the file"), *Filename);
+		return false;
+	}
+
+	const TConstArrayView<FMesaBVHNode> FileNodes(reinterpret_cast<const FMesaBVHNode*>(Data + Header.NodesOffset), Header.NumNodes);
+	const TConstArrayView<FMesaBrush> FileBrushes(reinterpret_cast<const FMesaBrush*>(Data + Header.BrushesOffset), Header.NumBrushes);
+	const TConstArrayView<FPlane4f> FilePlanes(reinterpret_cast<const FPlane4f*>(Data + Header.PlanesOffset), Header.NumPlanes);
+
+	// Bounds check every index up front so queries never have to. Small compared to the planes, and these pages
+	// are shared with every other process that mapped the file.
+	// Children always come after their parent, which also rules out cycles and means a parent's depth is known by the
+	// time we reach its children. Traversal keeps at most one sibling per level on a fixed stack, so cap the depth too.
+	TArray<uint8> NodeDepths;
+	NodeDepths.SetNumZeroed(FileNodes.Num());
+
+	for (int32 NodeIndex = 0; NodeIndex < FileNodes.Num(); ++NodeIndex)
+	{
+		const FMesaBVHNode& Node = FileNodes[NodeIndex];
+		const bool bValid = Node.Count > 0
+			? (Node.First >= 0 && Node.First + Node.Count <= FileBrushes.Num())
+			: (Node.First > NodeIndex && Node.First + 1 < FileNodes.Num());
+		if (!bValid)
+		{
+			UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has an invalid BVH node"), *Filename);
+			return false;
+		}
+
+		if (Node.Count == 0)
+		{
+			if (NodeDepths[NodeIndex] + 2 > MesaBrushCollision::MaxTraversalDepth)
+			{
+				UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has a BVH deeper than %d levels"), *Filename, MesaBrushCollision::MaxTraversalDepth - 2);
+				return false;
+			}
+
+			const uint8 ChildDepth = NodeDepths[NodeIndex] + 1;
+			NodeDepths[Node.First] = FMath::Max(NodeDepths[Node.First], ChildDepth);
+			NodeDepths[Node.First + 1] = FMath::Max(NodeDepths[Node.First + 1], ChildDepth);
+		}
+	}
+
+	for (const FMesaBrush& Brush : FileBrushes)
+	{
+		if (Brush.FirstPlane < 0 || Brush.NumPlanes <= 0 || Brush.FirstPlane + Brush.NumPlanes > FilePlanes.Num())
+		{
+			UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has an invalid brush"), *Filename);
+			return false;
+		}
+	}
+
+	if (FileBrushes.Num() > 0 && FileNodes.Num() == 0)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has brushes but no BVH"), *Filename);
+		return false;
+	}
+
+	if (bVerifyCrc)
+	{
+		Nodes = FileNodes;
+		Brushes = FileBrushes;
+		Planes = FilePlanes;
+
+		const uint32 Crc = ComputePayloadCrc();
+		if (Crc != Header.PayloadCrc)
+		{
+			UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s is corrupt, payload CRC %08x, expected %08x"), *Filename, Crc, Header.PayloadCrc);
+			UseOwnedData();
+			return false;
+		}
+	}
+
+	MappedFile = MoveTemp(File);
+	MappedRegion = MoveTemp(Region);
+	Nodes = FileNodes;
+	Brushes = FileBrushes;
+	Planes = FilePlanes;
+	return true;
+}
+
+template<typename VisitorType>
+void FMesaBrushWorld::ForEachBrushInBounds(const FVector3f& BoundsMin, const FVector3f& BoundsMax, VisitorType&& Visitor) const
+{
+	if (Nodes.Num() == 0)
+	{
+		return;
+	}
+
+	int32 Stack[MesaBrushCollision::MaxTraversalDepth];
+	int32 StackSize = 0;
+	Stack[StackSize++] = 0;
+
+	while (StackSize > 0)
+	{
+		const FMesaBVHNode& Node = Nodes[Stack[--StackSize]];
+		if (!MesaBrushCollision::BoundsOverlap(Node.Min, Node.Max, BoundsMin, BoundsMax))
+		{
+			continue;
+		}
+
+		if (Node.Count > 0)
+		{
+			for (int32 BrushIndex = Node.First; BrushIndex < Node.First + Node.Count; ++BrushIndex)
+			{
+				const FMesaBrush& Brush = Brushes[BrushIndex];
+				if (MesaBrushCollision::BoundsOverlap(Brush.Min, Brush.Max, BoundsMin, BoundsMax) && !Visitor(BrushIndex))
+				{
+					return;
+				}
+			}
+		}
+		else
+		{
+			// LoadFromFile rejects anything deep enough to overflow, and BuildBVH splits at the median.
+			checkSlow(StackSize + 2 <= MesaBrushCollision::MaxTraversalDepth);
+			Stack[StackSize++] = Node.First;
+			Stack[StackSize++] = Node.First + 1;
+		}
+	}
+}
+
+bool FMesaBrushWorld::SweepCapsule(const FVector& Start, const FVector& Delta, float Radius, float HalfHeight, FMesaBrushHit& OutHit) const
+{
+	OutHit = FMesaBrushHit();
+
+	const float HalfSegment = FMath::Max(0.f, HalfHeight - Radius);
+	const FVector End = Start + Delta;
+	const FVector Extent(Radius + MESA_SURFACE_CLIP_EPSILON, Radius + MESA_SURFACE_CLIP_EPSILON, HalfHeight + MESA_SURFACE_CLIP_EPSILON);
+	const FVector3f SweepMin = FVector3f(Start.ComponentMin(End) - Extent);
+	const FVector3f SweepMax = FVector3f(Start.ComponentMax(End) + Extent);
+
+	ForEachBrushInBounds(SweepMin, SweepMax, [&](int32 BrushIndex)
+	{
+		ClipCapsuleToBrush(Brushes[BrushIndex], BrushIndex, Start, End, Radius, HalfSegment, OutHit);
+		return !OutHit.bStartPenetrating;
+	});
+
+	return OutHit.bBlockingHit;
+}
+
+void FMesaBrushWorld::ClipCapsuleToBrush(const FMesaBrush& Brush, int32 BrushIndex, const FVector& Start, const FVector& End, float Radius, float HalfSegment, FMesaBrushHit& InOutHit) const
+{
+	float EnterFrac = -1.f;
+	float LeaveFrac = 1.f;
+	int32 ClipPlane = INDEX_NONE;
+	bool bStartOut = false;
+	bool bGetOut = false;
+
+	float ShallowestDist = -BIG_NUMBER;
+	int32 ShallowestPlane = INDEX_NONE;
+
+	for (int32 PlaneIndex = Brush.FirstPlane; PlaneIndex < Brush.FirstPlane + Brush.NumPlanes; ++PlaneIndex)
+	{
+		const FPlane4f& Plane = Planes[PlaneIndex];
+		const float Offset = MesaBrushCollision::CapsulePlaneOffset(Plane, Radius, HalfSegment);
+
+		const float D1 = MesaBrushCollision::PlaneDist(Plane, Start) - Offset;
+		const float D2 = MesaBrushCollision::PlaneDist(Plane, End) - Offset;
+
+		if (D2 > 0.f)
+		{
+			bGetOut = true; // Endpoint is not in solid.
+		}
+		if (D1 > 0.f)
+		{
+			bStartOut = true;
+		}
+
+		// Completely in front of this face, no intersection with the brush.
+		if (D1 > 0.f && (D2 >= MESA_SURFACE_CLIP_EPSILON || D2 >= D1))
+		{
+			return;
+		}
+
+		if (D1 > ShallowestDist)
+		{
+			ShallowestDist = D1;
+			ShallowestPlane = PlaneIndex;
+		}
+
+		// Completely behind this face, keep going.
+		if (D1 <= 0.f && D2 <= 0.f)
+		{
+			continue;
+		}
+
+		if (D1 > D2) // Entering
+		{
+			const float Frac = FMath::Max(0.f, (D1 - MESA_SURFACE_CLIP_EPSILON) / (D1 - D2));
+			if (Frac > EnterFrac)
+			{
+				EnterFrac = Frac;
+				ClipPlane = PlaneIndex;
+			}
+		}
+		else // Leaving
+		{
+			const float Frac = FMath::Min(1.f, (D1 + MESA_SURFACE_CLIP_EPSILON) / (D1 - D2));
+			if (Frac < LeaveFrac)
+			{
+				LeaveFrac = Frac;
+			}
+		}
+	}
+
+	if (!bStartOut)
+	{
+		const FVector PushOut = FVector(Planes[ShallowestPlane].GetNormal());
+
+		// Allow moves that leave the brush, otherwise we could never slide out of an initial overlap.
+		if (bGetOut && ((End - Start) | PushOut) > 0.f)
+		{
+			return;
+		}
+
+		InOutHit.Time = 0.f;
+		InOutHit.Normal = PushOut;
+		InOutHit.PenetrationDepth = -ShallowestDist;
+		InOutHit.Brush = BrushIndex;
+		InOutHit.bBlockingHit = true;
+		InOutHit.bStartPenetrating = true;
+		return;
+	}
+
+	if (EnterFrac < LeaveFrac && EnterFrac > -1.f && EnterFrac < InOutHit.Time && ClipPlane != INDEX_NONE)
+	{
+		InOutHit.Time = FMath::Max(0.f, EnterFrac);
+		InOutHit.Normal = FVector(Planes[ClipPlane].GetNormal());
+		InOutHit.Brush = BrushIndex;
+		InOutHit.bBlockingHit = true;
+	}
+}
+
+bool FMesaBrushWorld::OverlapCapsule(const FVector& Location, float Radius, float HalfHeight, float Inflation) const
+{
+	const float InflatedRadius = Radius + Inflation;
+	const float HalfSegment = FMath::Max(0.f, HalfHeight - Radius);
+	const FVector Extent(InflatedRadius, InflatedRadius, HalfSegment + InflatedRadius);
+
+	bool bOverlap = false;
+	ForEachBrushInBounds(FVector3f(Location - Extent), FVector3f(Location + Extent), [&](int32 BrushIndex)
+	{
+		bOverlap = CapsuleInsideBrush(Brushes[BrushIndex], Location, InflatedRadius, HalfSegment);
+		return !bOverlap;
+	});
+
+	return bOverlap;
+}
+
+bool FMesaBrushWorld::CapsuleInsideBrush(const FMesaBrush& Brush, const FVector& Location, float Radius, float HalfSegment) const
+{
+	for (int32 PlaneIndex = Brush.FirstPlane; PlaneIndex < Brush.FirstPlane + Brush.NumPlanes; ++PlaneIndex)
+	{
+		const FPlane4f& Plane = Planes[PlaneIndex];
+		if (MesaBrushCollision::PlaneDist(Plane, Location) - MesaBrushCollision::CapsulePlaneOffset(Plane, Radius, HalfSegment) >= 0.f)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,150 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/UniquePtr.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+/*
+	Brush Collision.
+	Static level collision stored the way Quake 3 stores it: each brush is a convex volume described by its bounding
+	planes. An upright capsule is swept against a brush by pushing every plane out by the capsule's support distance
+	along that plane's normal and clipping the swept centre line against the expanded planes (CM_ClipBoxToBrush).
+
+	Expanding planes is exact on faces but conservative around edges and corners, so every brush also gets the axial
+	bevel planes of its bounds (CM_AddBrushBevels) to keep corner catches down to the diagonal edges.
+
+	Brushes sit under a BVH. Everything is stored in flat, pointer free, single precision records so a world can be
+	cooked offline and memory mapped straight from disk (see FMesaCollisionFileHeader), in which case every server
+	process on the box shares the same physical pages.
+
+	Plain math and file IO, no world or components, brushes are built elsewhere (see UMesaCollisionSubsystem).
+*/
+
+// Distance we keep from brush surfaces after a sweep, also the slop allowed when deciding we start inside.
+static constexpr float MESA_SURFACE_CLIP_EPSILON = 0.125f;
+
+struct FMesaBrush
+{
+	FVector3f Min;
+	int32 FirstPlane = 0;
+	FVector3f Max;
+	int32 NumPlanes = 0;
+};
+
+// Count > 0 is a leaf holding brushes [First, First + Count), otherwise the children are nodes First and First + 1.
+struct FMesaBVHNode
+{
+	FVector3f Min;
+	int32 First = 0;
+	FVector3f Max;
+	int32 Count = 0;
+};
+
+static_assert(sizeof(FMesaBrush) == 32, "FMesaBrush is part of the cooked collision format");
+static_assert(sizeof(FMesaBVHNode) == 32, "FMesaBVHNode is part of the cooked collision format");
+static_assert(sizeof(FPlane4f) == 16, "FPlane4f is part of the cooked collision format");
+
+/*
+	Cooked movement collision file (.mcol), little endian, written by the MesaBakeCollision commandlet.
+
+		FMesaCollisionFileHeader
+		FMesaBVHNode[NumNodes]		@ NodesOffset
+		FMesaBrush[NumBrushes]		@ BrushesOffset
+		FPlane4f[NumPlanes]			@ PlanesOffset
+
+	Sections are 16 byte aligned so they can be used in place from a mapping. Bump Version on any layout change,
+	older files are rejected and the runtime falls back to building from the level.
+*/
+struct FMesaCollisionFileHeader
+{
+	static constexpr uint32 MagicValue = 0x4C4F434D; // "MCOL"
+	static constexpr uint32 CurrentVersion = 1;
+
+	uint32 Magic = MagicValue;
+	uint32 Version = CurrentVersion;
+	uint32 NumNodes = 0;
+	uint32 NumBrushes = 0;
+	uint32 NumPlanes = 0;
+	uint32 PayloadCrc = 0;
+	uint64 NodesOffset = 0;
+	uint64 BrushesOffset = 0;
+	uint64 PlanesOffset = 0;
+};
+
+struct FMesaBrushHit
+{
+	// Direction to push out along, the clip plane for a hit or the shallowest plane when starting inside.
+	FVector Normal = FVector::ZeroVector;
+	float Time = 1.f;
+	float PenetrationDepth = 0.f;
+	int32 Brush = INDEX_NONE;
+	bool bBlockingHit = false;
+	bool bStartPenetrating = false;
+};
+
+class MESACORE_API FMesaBrushWorld
+{
+public:
+
+	FMesaBrushWorld();
+	~FMesaBrushWorld();
+
+	// Adds a convex brush from world space planes (normals pointing out). Axial bevels are added from Bounds.
+	void AddBrush(const TArray<FPlane>& Planes, const FBox& Bounds);
+
+	// Builds the BVH over everything added so far. Required before querying a world built with AddBrush.
+	void BuildBVH();
+
+	void Reset();
+
+	// Cooked file IO. Load maps the file read only and queries run directly on the mapping. Verifying the CRC touches
+	// every page of the mapping up front, rather than as queries reach them.
+	bool SaveToFile(const FString& Filename) const;
+	bool LoadFromFile(const FString& Filename, bool bVerifyCrc = false);
+
+	int32 NumBrushes() const { return Brushes.Num(); }
+	bool IsEmpty() const { return Brushes.Num() == 0; }
+	bool IsMapped() const { return MappedRegion.IsValid(); }
+	uint32 ComputePayloadCrc() const;
+
+	/**
+	 * Sweeps an upright capsule from Start by Delta against all brushes.
+	 * Starting inside a brush reports a penetrating hit with Time 0, unless the move is heading out of it in which
+	 * case that brush is ignored for the sweep (same rules MoveComponent uses for initial overlaps).
+	 */
+	bool SweepCapsule(const FVector& Start, const FVector& Delta, float Radius, float HalfHeight, FMesaBrushHit& OutHit) const;
+
+	// True if an upright capsule at Location, inflated by Inflation, is inside any brush.
+	bool OverlapCapsule(const FVector& Location, float Radius, float HalfHeight, float Inflation = 0.f) const;
+
+	TConstArrayView<FMesaBrush> GetBrushes() const { return Brushes; }
+	TConstArrayView<FPlane4f> GetPlanes() const { return Planes; }
+	TConstArrayView<FMesaBVHNode> GetNodes() const { return Nodes; }
+
+protected:
+
+	void ClipCapsuleToBrush(const FMesaBrush& Brush, int32 BrushIndex, const FVector& Start, const FVector& End, float Radius, float HalfSegment, FMesaBrushHit& InOutHit) const;
+	bool CapsuleInsideBrush(const FMesaBrush& Brush, const FVector& Location, float Radius, float HalfSegment) const;
+
+	// Calls Visitor(BrushIndex) for every brush whose leaf overlaps Bounds. Visitor returns false to stop.
+	template<typename VisitorType>
+	void ForEachBrushInBounds(const FVector3f& BoundsMin, const FVector3f& BoundsMax, VisitorType&& Visitor) const;
+
+	void UseOwnedData();
+
+	// Views queried at runtime, either onto the owned arrays below or onto a mapped cooked file.
+	TConstArrayView<FMesaBVHNode> Nodes;
+	TConstArrayView<FMesaBrush> Brushes;
+	TConstArrayView<FPlane4f> Planes;
+
+	TArray<FMesaBVHNode> OwnedNodes;
+	TArray<FMesaBrush> OwnedBrushes;
+	TArray<FPlane4f> OwnedPlanes;
+
+	TUniquePtr<IMappedFileHandle> MappedFile;
+	TUniquePtr<IMappedFileRegion> MappedRegion;
+};
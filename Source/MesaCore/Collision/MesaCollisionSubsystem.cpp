@@ -0,0 +1,216 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaCollisionSubsystem.h"
+#include "MesaCoreMacros.h"
+
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Components/PrimitiveComponent.h"
+#include "EngineUtils.h"
+#include "Misc/Paths.h"
+#include "PhysicsEngine/BodySetup.h"
+
+namespace MesaCollisionCVars
+{
+	static int32 NativeCollision = 0;
+	static FAutoConsoleVariableRef CVarNativeCollision(
+		TEXT("MesaMovement.NativeCollision"),
+		NativeCollision,
+		TEXT("Sweep movement against baked static brushes instead of the physics scene.\n")
+		TEXT("Movable objects are still queried through the physics scene."),
+		ECVF_Default
+	);
+
+	static int32 VerifyCrc = 1;
+	static FAutoConsoleVariableRef CVarVerifyCrc(
+		TEXT("MesaMovement.NativeCollision.VerifyCrc"),
+		VerifyCrc,
+		TEXT("Check the payload CRC of cooked collision files on load. Reads the whole file up front."),
+		ECVF_Default
+	);
+}
+
+void UMesaCollisionSubsystem::OnWorldBeginPlay(UWorld& InWorld)
+{
+	Super::OnWorldBeginPlay(InWorld);
+	BuildStaticCollision(InWorld);
+}
+
+void UMesaCollisionSubsystem::Deinitialize()
+{
+	BrushWorld.Reset();
+	bCoversStaticGeometry = false;
+
+	Super::Deinitialize();
+}
+
+bool UMesaCollisionSubsystem::IsNativeCollisionActive() const
+{
+	return MesaCollisionCVars::NativeCollision && bCoversStaticGeometry;
+}
+
+FString UMesaCollisionSubsystem::GetCookedCollisionFilename(const UWorld& InWorld)
+{
+	FString MapPath = UWorld::RemovePIEPrefix(InWorld.GetOutermost()->GetName());
+	MapPath.RemoveFromStart(TEXT("/Game/"));
+
+	return FPaths::ProjectContentDir() / TEXT("MovementCollision") / MapPath + TEXT(".mcol");
+}
+
+void UMesaCollisionSubsystem::BuildStaticCollision(UWorld& InWorld)
+{
+	BrushWorld.Reset();
+	bCoversStaticGeometry = false;
+
+	const double StartTime = FPlatformTime::Seconds();
+
+	// Only trust the cooked file outside the editor, in the editor the level may have changed since it was baked.
+	const FString CookedFilename = GetCookedCollisionFilename(InWorld);
+	if (!GIsEditor && BrushWorld.LoadFromFile(CookedFilename, MesaCollisionCVars::VerifyCrc != 0))
+	{
+		bCoversStaticGeometry = true;
+		UE_LOG(LogMesa, Log, TEXT("MesaCollision: Mapped %d brushes from %s in %.2f ms"),
+			BrushWorld.NumBrushes(), *CookedFilename, (FPlatformTime::Seconds() - StartTime) * 1000.0);
+		return;
+	}
+
+	int32 NumPrimitives = 0;
+	if (!GatherStaticBrushes(InWorld, BrushWorld, &NumPrimitives))
+	{
+		return;
+	}
+
+	BrushWorld.BuildBVH();
+	bCoversStaticGeometry = true;
+
+	UE_LOG(LogMesa, Log, TEXT("MesaCollision: Built %d brushes from %d primitives in %.2f ms"),
+		BrushWorld.NumBrushes(), NumPrimitives, (FPlatformTime::Seconds() - StartTime) * 1000.0);
+}
+
+bool UMesaCollisionSubsystem::GatherStaticBrushes(UWorld& InWorld, FMesaBrushWorld& OutBrushWorld, int32* OutNumPrimitives)
+{
+	OutBrushWorld.Reset();
+	int32 NumPrimitives = 0;
+
+	for (TActorIterator<AActor> It(&InWorld); It; ++It)
+	{
+		TInlineComponentArray<UPrimitiveComponent*> Primitives(*It);
+		for (const UPrimitiveComponent* Primitive : Primitives)
+		{
+			if (!Primitive->IsRegistered() || Primitive->Mobility == EComponentMobility::Movable)
+			{
+				continue;
+			}
+
+			if (!Primitive->IsQueryCollisionEnabled() || Primitive->GetCollisionResponseToChannel(ECC_Pawn) != ECR_Block)
+			{
+				continue;
+			}
+
+			if (!AddPrimitiveBrushes(Primitive, OutBrushWorld))
+			{
+				UE_LOG(LogMesa, Warning, TEXT("MesaCollision: %s has static blocking collision that can't be baked to brushes, native movement collision disabled for this world."),
+					*GetPathNameSafe(Primitive));
+				OutBrushWorld.Reset();
+				return false;
+			}
+
+			++NumPrimitives;
+		}
+	}
+
+	if (OutNumPrimitives)
+	{
+		*OutNumPrimitives = NumPrimitives;
+	}
+
+	return true;
+}
+
+bool UMesaCollisionSubsystem::AddPrimitiveBrushes(const UPrimitiveComponent* Primitive, FMesaBrushWorld& OutBrushWorld)
+{
+	UBodySetup* BodySetup = Primitive->GetBodySetup();
+	if (!BodySetup || BodySetup->GetCollisionTraceFlag() == CTF_UseComplexAsSimple)
+	{
+		return false;
+	}
+
+	const FKAggregateGeom& AggGeom = BodySetup->AggGeom;
+	if (AggGeom.SphereElems.Num() > 0 || AggGeom.SphylElems.Num() > 0 || AggGeom.TaperedCapsuleElems.Num() > 0)
+	{
+		return false;
+	}
+
+	if (AggGeom.BoxElems.Num() == 0 && AggGeom.ConvexElems.Num() == 0)
+	{
+		return false;
+	}
+
+	// Instanced meshes (HISM, foliage, modular kits) share one body setup, every instance is a copy of it at its own
+	// transform. The component transform on its own is nowhere in particular.
+	TArray<FTransform, TInlineAllocator<1>> Transforms;
+	if (const UInstancedStaticMeshComponent* Instanced = Cast<UInstancedStaticMeshComponent>(Primitive))
+	{
+		for (int32 Index = 0; Index < Instanced->GetInstanceCount(); ++Index)
+		{
+			Instanced->GetInstanceTransform(Index, Transforms.AddDefaulted_GetRef(), true);
+		}
+	}
+	else
+	{
+		Transforms.Add(Primitive->GetComponentTransform());
+	}
+
+	TArray<FPlane> Planes;
+	for (const FTransform& ComponentTransform : Transforms)
+	{
+		for (const FKBoxElem& Box : AggGeom.BoxElems)
+		{
+			const FMatrix ElemToWorld = (Box.GetTransform() * ComponentTransform).ToMatrixWithScale();
+			const FVector HalfExtent(Box.X * 0.5f, Box.Y * 0.5f, Box.Z * 0.5f);
+
+			Planes.Reset();
+			Planes.Add(FPlane(FVector( HalfExtent.X, 0.f, 0.f), FVector::ForwardVector).TransformBy(ElemToWorld));
+			Planes.Add(FPlane(FVector(-HalfExtent.X, 0.f, 0.f), FVector::BackwardVector).TransformBy(ElemToWorld));
+			Planes.Add(FPlane(FVector(0.f,  HalfExtent.Y, 0.f), FVector::RightVector).TransformBy(ElemToWorld));
+			Planes.Add(FPlane(FVector(0.f, -HalfExtent.Y, 0.f), FVector::LeftVector).TransformBy(ElemToWorld));
+			Planes.Add(FPlane(FVector(0.f, 0.f,  HalfExtent.Z), FVector::UpVector).TransformBy(ElemToWorld));
+			Planes.Add(FPlane(FVector(0.f, 0.f, -HalfExtent.Z), FVector::DownVector).TransformBy(ElemToWorld));
+
+			FBox Bounds(ForceInit);
+			for (int32 Corner = 0; Corner < 8; ++Corner)
+			{
+				const FVector Local((Corner & 1) ? HalfExtent.X : -HalfExtent.X, (Corner & 2) ? HalfExtent.Y : -HalfExtent.Y, (Corner & 4) ? HalfExtent.Z : -HalfExtent.Z);
+				Bounds += ElemToWorld.TransformPosition(Local);
+			}
+
+			OutBrushWorld.AddBrush(Planes, Bounds);
+		}
+
+		for (const FKConvexElem& Convex : AggGeom.ConvexElems)
+		{
+			const FMatrix ElemToWorld = (Convex.GetTransform() * ComponentTransform).ToMatrixWithScale();
+
+			Planes.Reset();
+			Convex.GetPlanes(Planes);
+			if (Planes.Num() < 4)
+			{
+				return false;
+			}
+
+			for (FPlane& Plane : Planes)
+			{
+				Plane = Plane.TransformBy(ElemToWorld);
+			}
+
+			FBox Bounds(ForceInit);
+			for (const FVector& Vertex : Convex.VertexData)
+			{
+				Bounds += ElemToWorld.TransformPosition(Vertex);
+			}
+
+			OutBrushWorld.AddBrush(Planes, Bounds);
+		}
+	}
+
+	return true;
+}
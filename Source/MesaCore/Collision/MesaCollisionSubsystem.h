@@ -0,0 +1,59 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "MesaBrushCollision.h"
+#include "MesaCollisionSubsystem.generated.h"
+
+class UPrimitiveComponent;
+
+/*
+	UMesaCollisionSubsystem.
+	Owns the native movement collision for a world: every static, pawn blocking primitive whose simple collision is
+	made of boxes and convex hulls gets baked into a FMesaBrushWorld at BeginPlay. Movement sweeps the static part of
+	the level against that and only goes to the physics scene for movable objects.
+
+	If any blocking static geometry can't be represented as brushes (complex as simple, spheres, capsules, BSP,
+	landscape) the world is left on the physics scene entirely rather than letting pawns fall through it.
+
+	Maps baked with the MesaBakeCollision commandlet load their .mcol from Content/MovementCollision instead, mapped
+	read only so every server process on the host shares one copy. Building from the level is only the fallback.
+*/
+UCLASS()
+class MESACORE_API UMesaCollisionSubsystem : public UWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+
+	virtual void OnWorldBeginPlay(UWorld& InWorld) override;
+	virtual void Deinitialize() override;
+
+	// True if movement should use the brush world for static geometry.
+	bool IsNativeCollisionActive() const;
+
+	const FMesaBrushWorld& GetBrushWorld() const { return BrushWorld; }
+
+	// Where the cooked collision for a world lives, Content/MovementCollision/<map path>.mcol.
+	static FString GetCookedCollisionFilename(const UWorld& InWorld);
+
+	/**
+	 * Gathers every static pawn blocking primitive in the world into OutBrushWorld, without building the BVH.
+	 * Returns false and leaves OutBrushWorld empty if any of them can't be represented as brushes.
+	 */
+	static bool GatherStaticBrushes(UWorld& InWorld, FMesaBrushWorld& OutBrushWorld, int32* OutNumPrimitives = nullptr);
+
+protected:
+
+	void BuildStaticCollision(UWorld& InWorld);
+
+	// Appends the brushes for a primitive, returns false if its collision can't be represented as brushes.
+	static bool AddPrimitiveBrushes(const UPrimitiveComponent* Primitive, FMesaBrushWorld& OutBrushWorld);
+
+	FMesaBrushWorld BrushWorld;
+
+	// False if the level has static blocking geometry we could not turn into brushes.
+	bool bCoversStaticGeometry = false;
+};
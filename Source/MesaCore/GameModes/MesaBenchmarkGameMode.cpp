@@ -0,0 +1,365 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "GameModes/MesaBenchmarkGameMode.h"
+#include "Player/MesaMovementSimulation.h"
+#include "Player/MesaPawn.h"
+#include "Player/MesaPlayerController.h"
+#include "MesaCoreMacros.h"
+
+#include "Engine/NetDriver.h"
+#include "EngineUtils.h"
+#include "GameFramework/PlayerStart.h"
+#include "GameMapsSettings.h"
+#include "Kismet/GameplayStatics.h"
+#include "Misc/App.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace MesaBenchmark
+{
+	// Bots per row when they're laid out around a player start, and the gap between them.
+	static constexpr int32 GridColumns = 8;
+	static constexpr float GridSpacing = 150.f;
+
+	static float Percentile(const TArray<float>& Sorted, double Fraction)
+	{
+		return Sorted.Num() > 0 ? Sorted[FMath::Clamp(FMath::FloorToInt(Fraction * Sorted.Num()), 0, Sorted.Num() - 1)] : 0.f;
+	}
+
+	static float Mean(const TArray<float>& Values)
+	{
+		double Sum = 0.0;
+		for (const float Value : Values)
+		{
+			Sum += Value;
+		}
+		return Values.Num() > 0 ? (float)(Sum / Values.Num()) : 0.f;
+	}
+
+	static FString TimingJson(TArray<float> Values)
+	{
+		Values.Sort();
+		return FString::Printf(TEXT("{ \"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f, \"mean\": %.4f }"),
+			Percentile(Values, 0.5), Percentile(Values, 0.99), Values.Num() > 0 ? Values.Last() : 0.f, Mean(Values));
+	}
+}
+
+AMesaBenchmarkGameMode::AMesaBenchmarkGameMode()
+{
+	PrimaryActorTick.bCanEverTick = true;
+	PlayerControllerClass = AMesaPlayerController::StaticClass();
+}
+
+void AMesaBenchmarkGameMode::InitGame(const FString& MapName, const FString& Options, FString& ErrorMessage)
+{
+	Super::InitGame(MapName, Options, ErrorMessage);
+
+	NumBots = FMath::Max(UGameplayStatics::GetIntOption(Options, TEXT("Bots"), NumBots), 0);
+	NumClients = FMath::Max(UGameplayStatics::GetIntOption(Options, TEXT("Clients"), NumClients), 0);
+	WarmupSeconds = UGameplayStatics::GetIntOption(Options, TEXT("Warmup"), (int32)WarmupSeconds);
+	DurationSeconds = FMath::Max(UGameplayStatics::GetIntOption(Options, TEXT("Duration"), (int32)DurationSeconds), 1);
+	ClientExecutable = UGameplayStatics::ParseOption(Options, TEXT("ClientExe"));
+	ReportFilename = UGameplayStatics::ParseOption(Options, TEXT("Report"));
+	bExitWhenDone = UGameplayStatics::HasOption(Options, TEXT("Exit"));
+
+	const FString PatternName = UGameplayStatics::ParseOption(Options, TEXT("Pattern"));
+	const int64 PatternValue = PatternName.IsEmpty() ? INDEX_NONE : StaticEnum<EMesaBotPattern>()->GetValueByNameString(PatternName);
+	Pattern = PatternValue > (int64)EMesaBotPattern::None && PatternValue < (int64)EMesaBotPattern::Num ? (EMesaBotPattern)PatternValue : EMesaBotPattern::None;
+
+	if (ReportFilename.IsEmpty())
+	{
+		ReportFilename = FPaths::ProjectSavedDir() / TEXT("Benchmarks") / FString::Printf(TEXT("Movement_%d_%s.json"), NumBots, *FDateTime::Now().ToString());
+	}
+
+	// Headless clients get a real pawn too, they just don't move it.
+	if (UClass* PawnClass = ResolveBotClass())
+	{
+		DefaultPawnClass = PawnClass;
+	}
+}
+
+UClass* AMesaBenchmarkGameMode::ResolveBotClass() const
+{
+	if (UClass* Class = BotClass.LoadSynchronous())
+	{
+		return Class;
+	}
+
+	// AMesaPawn is abstract, use whatever the project's default game mode gives players.
+	const UClass* GameModeClass = LoadClass<AGameModeBase>(nullptr, *UGameMapsSettings::GetGlobalDefaultGameMode());
+	UClass* PawnClass = GameModeClass ? GameModeClass->GetDefaultObject<AGameModeBase>()->DefaultPawnClass.Get() : nullptr;
+
+	return PawnClass && PawnClass->IsChildOf<AMesaPawn>() && !PawnClass->HasAnyClassFlags(CLASS_Abstract) ? PawnClass : nullptr;
+}
+
+void AMesaBenchmarkGameMode::StartPlay()
+{
+	Super::StartPlay();
+
+	UClass* PawnClass = ResolveBotClass();
+	if (!PawnClass)
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaBenchmark: No bot class, set BotClass or give the default game mode a MesaPawn"));
+		Phase = EPhase::Done;
+		if (bExitWhenDone)
+		{
+			FPlatformMisc::RequestExitWithStatus(false, 1);
+		}
+		return;
+	}
+
+	SpawnBots(PawnClass);
+	LaunchClients();
+
+	Phase = EPhase::Warmup;
+	PhaseStartSeconds = FPlatformTime::Seconds();
+
+	UE_LOG(LogMesa, Display, TEXT("MesaBenchmark: %d %s bots, %d clients. Measuring for %.0fs after %.0fs warmup"),
+		NumBots, Pattern == EMesaBotPattern::None ? TEXT("Mixed") : *StaticEnum<EMesaBotPattern>()->GetNameStringByValue((int64)Pattern),
+		NumClients, DurationSeconds, WarmupSeconds);
+}
+
+void AMesaBenchmarkGameMode::SpawnBots(UClass* PawnClass)
+{
+	TArray<const APlayerStart*> Starts;
+	for (TActorIterator<APlayerStart> It(GetWorld()); It; ++It)
+	{
+		Starts.Add(*It);
+	}
+
+	for (int32 Index = 0; Index < NumBots; ++Index)
+	{
+		// A grid behind each start in turn, so the bots share the map's spawn areas evenly.
+		const FTransform Start = Starts.Num() > 0 ? Starts[Index % Starts.Num()]->GetActorTransform() : FTransform::Identity;
+		const int32 Slot = Starts.Num() > 0 ? Index / Starts.Num() : Index;
+		const FVector Offset((Slot / MesaBenchmark::GridColumns) * -MesaBenchmark::GridSpacing, ((Slot % MesaBenchmark::GridColumns) - (MesaBenchmark::GridColumns - 1) * 0.5f) * MesaBenchmark::GridSpacing, 0.f);
+		const FTransform Transform(Start.GetRotation(), Start.TransformPosition(Offset));
+
+		AMesaPawn* Bot = GetWorld()->SpawnActorDeferred<AMesaPawn>(PawnClass, Transform, nullptr, nullptr, ESpawnActorCollisionHandlingMethod::AdjustIfPossibleButAlwaysSpawn);
+		if (!Bot)
+		{
+			continue;
+		}
+
+		Bot->bFakeAutonomousProxy = true;
+		Bot->SetBotPattern(Pattern != EMesaBotPattern::None ? Pattern : (EMesaBotPattern)(1 + Index % ((int32)EMesaBotPattern::Num - 1)), Index + 1);
+		Bot->FinishSpawning(Transform);
+		Bots.Add(Bot);
+	}
+}
+
+void AMesaBenchmarkGameMode::LaunchClients()
+{
+	if (NumClients <= 0)
+	{
+		return;
+	}
+
+	FString Executable = ClientExecutable;
+	if (Executable.IsEmpty())
+	{
+		const FString ServerExecutable = FPlatformProcess::ExecutablePath();
+		Executable = FPaths::GetPath(ServerExecutable) / FPaths::GetCleanFilename(ServerExecutable).Replace(TEXT("Server"), TEXT(""));
+	}
+
+	FString Args = FString::Printf(TEXT("127.0.0.1:%d -nullrhi -nosound -unattended -nosplash"), GetWorld()->URL.Port);
+	if (!FPlatformProperties::RequiresCookedData())
+	{
+		Args = FString::Printf(TEXT("\"%s\" %s -game"), *FPaths::ConvertRelativePathToFull(FPaths::GetProjectFilePath()), *Args);
+	}
+
+	for (int32 Index = 0; Index < NumClients; ++Index)
+	{
+		const FString ClientArgs = FString::Printf(TEXT("%s -log=MesaBenchClient%d.log"), *Args, Index);
+		FProcHandle Handle = FPlatformProcess::CreateProc(*Executable, *ClientArgs, true, true, true, nullptr, 0, nullptr, nullptr);
+		if (!Handle.IsValid())
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaBenchmark: Failed to launch %s %s"), *Executable, *ClientArgs);
+			break;
+		}
+
+		ClientProcesses.Add(Handle);
+	}
+}
+
+void AMesaBenchmarkGameMode::Tick(float DeltaSeconds)
+{
+	Super::Tick(DeltaSeconds);
+
+	const double Elapsed = FPlatformTime::Seconds() - PhaseStartSeconds;
+	switch (Phase)
+	{
+	case EPhase::Warmup:
+		if (Elapsed >= WarmupSeconds)
+		{
+			BeginMeasuring();
+		}
+		break;
+
+	case EPhase::Measuring:
+	{
+		// Time spent in the frame that just finished, without the wait for the server tick rate.
+		FrameMS.Add((float)((FApp::GetDeltaTime() - FApp::GetIdleTime()) * 1000.0));
+
+		const uint64 MovementCycles = FMesaSimulationTickStats::Get().Cycles;
+		MovementMS.Add((float)FPlatformTime::ToMilliseconds64(MovementCycles - LastMovementCycles));
+		LastMovementCycles = MovementCycles;
+
+		if (Elapsed >= DurationSeconds)
+		{
+			EndMeasuring();
+		}
+		break;
+	}
+
+	case EPhase::CollectingClientStats:
+		if (ClientsReported >= MeasuredClients || Elapsed >= ClientStatsTimeout)
+		{
+			WriteReport();
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void AMesaBenchmarkGameMode::BeginMeasuring()
+{
+	FMesaRollbackStats::Get() = FMesaRollbackStats();
+
+	const FMesaSimulationTickStats& TickStats = FMesaSimulationTickStats::Get();
+	LastMovementCycles = TickStats.Cycles;
+	StartMovementTicks = TickStats.Ticks;
+
+	const UNetDriver* NetDriver = GetWorld()->GetNetDriver();
+	StartOutBytes = NetDriver ? NetDriver->OutTotalBytes : 0;
+	StartOutPackets = NetDriver ? NetDriver->OutTotalPackets : 0;
+
+	for (FConstPlayerControllerIterator It = GetWorld()->GetPlayerControllerIterator(); It; ++It)
+	{
+		AMesaPlayerController* PC = Cast<AMesaPlayerController>(It->Get());
+		if (PC && !PC->IsLocalController())
+		{
+			PC->ClientBenchmarkStats(true);
+		}
+	}
+
+	FrameMS.Reset();
+	MovementMS.Reset();
+	FrameMS.Reserve(FMath::CeilToInt(DurationSeconds * 120.f));
+	MovementMS.Reserve(FrameMS.Max());
+
+	Phase = EPhase::Measuring;
+	PhaseStartSeconds = FPlatformTime::Seconds();
+}
+
+void AMesaBenchmarkGameMode::EndMeasuring()
+{
+	MeasuredSeconds = FPlatformTime::Seconds() - PhaseStartSeconds;
+
+	// The driver's totals are 32 bit, the difference survives one wrap.
+	const UNetDriver* NetDriver = GetWorld()->GetNetDriver();
+	OutBytes = NetDriver ? (uint32)(NetDriver->OutTotalBytes - (uint32)StartOutBytes) : 0;
+	OutPackets = NetDriver ? (uint32)(NetDriver->OutTotalPackets - (uint32)StartOutPackets) : 0;
+
+	MeasuredClients = 0;
+	for (FConstPlayerControllerIterator It = GetWorld()->GetPlayerControllerIterator(); It; ++It)
+	{
+		AMesaPlayerController* PC = Cast<AMesaPlayerController>(It->Get());
+		if (PC && !PC->IsLocalController())
+		{
+			PC->ClientBenchmarkStats(false);
+			++MeasuredClients;
+		}
+	}
+
+	Phase = EPhase::CollectingClientStats;
+	PhaseStartSeconds = FPlatformTime::Seconds();
+}
+
+void AMesaBenchmarkGameMode::AddClientStats(int64 Resimulated, int64 Replayed, int64 MovementTicks)
+{
+	if (Phase == EPhase::CollectingClientStats)
+	{
+		++ClientsReported;
+		ClientResimulated += Resimulated;
+		ClientReplayed += Replayed;
+		ClientMovementTicks += MovementTicks;
+	}
+}
+
+void AMesaBenchmarkGameMode::WriteReport()
+{
+	Phase = EPhase::Done;
+
+	int32 PatternCounts[(int32)EMesaBotPattern::Num] = {};
+	for (const AMesaPawn* Bot : Bots)
+	{
+		if (Bot)
+		{
+			++PatternCounts[(int32)Bot->GetBotPattern()];
+		}
+	}
+
+	FString Patterns;
+	for (int32 Index = 1; Index < (int32)EMesaBotPattern::Num; ++Index)
+	{
+		Patterns += FString::Printf(TEXT("%s\"%s\": %d"), Index > 1 ? TEXT(", ") : TEXT(""), *StaticEnum<EMesaBotPattern>()->GetNameStringByValue(Index), PatternCounts[Index]);
+	}
+
+	const FMesaSimulationTickStats& TickStats = FMesaSimulationTickStats::Get();
+	const FMesaRollbackStats& RollbackStats = FMesaRollbackStats::Get();
+	const uint64 MovementTicks = TickStats.Ticks - StartMovementTicks;
+	const double MovementTotalMS = MesaBenchmark::Mean(MovementMS) * MovementMS.Num();
+	const double Seconds = FMath::Max(MeasuredSeconds, 1e-3);
+
+	FString Json = TEXT("{\n");
+	Json += FString::Printf(TEXT("\t\"map\": \"%s\",\n"), *GetWorld()->GetOutermost()->GetName());
+	Json += FString::Printf(TEXT("\t\"bots\": %d,\n\t\"patterns\": { %s },\n"), Bots.Num(), *Patterns);
+	Json += FString::Printf(TEXT("\t\"clients\": %d,\n\t\"seconds\": %.3f,\n\t\"frames\": %d,\n"), MeasuredClients, MeasuredSeconds, FrameMS.Num());
+	Json += FString::Printf(TEXT("\t\"frameTimeMs\": %s,\n"), *MesaBenchmark::TimingJson(FrameMS));
+	Json += FString::Printf(TEXT("\t\"movementTickMsPerFrame\": %s,\n"), *MesaBenchmark::TimingJson(MovementMS));
+	Json += FString::Printf(TEXT("\t\"movementTicks\": %llu,\n\t\"movementTickUs\": %.3f,\n"), MovementTicks, MovementTicks > 0 ? MovementTotalMS * 1000.0 / MovementTicks : 0.0);
+	Json += FString::Printf(TEXT("\t\"serverResimulated\": %llu,\n\t\"serverReplayed\": %llu,\n"), RollbackStats.Resimulated, RollbackStats.Replayed);
+	Json += FString::Printf(TEXT("\t\"clientsReported\": %d,\n\t\"clientResimulated\": %lld,\n\t\"clientReplayed\": %lld,\n\t\"clientMovementTicks\": %lld,\n"),
+		ClientsReported, ClientResimulated, ClientReplayed, ClientMovementTicks);
+	Json += FString::Printf(TEXT("\t\"bytesSent\": %llu,\n\t\"packetsSent\": %llu,\n\t\"bytesSentPerSecond\": %.1f,\n\t\"bytesSentPerClientPerSecond\": %.1f\n"),
+		OutBytes, OutPackets, OutBytes / Seconds, MeasuredClients > 0 ? OutBytes / Seconds / MeasuredClients : 0.0);
+	Json += TEXT("}\n");
+
+	if (FFileHelper::SaveStringToFile(Json, *ReportFilename))
+	{
+		UE_LOG(LogMesa, Display, TEXT("MesaBenchmark: Wrote %s"), *ReportFilename);
+	}
+	else
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaBenchmark: Failed to write %s"), *ReportFilename);
+	}
+	UE_LOG(LogMesa, Display, TEXT("MesaBenchmark: %s"), *Json);
+
+	for (FProcHandle& Handle : ClientProcesses)
+	{
+		FPlatformProcess::TerminateProc(Handle, true);
+		FPlatformProcess::CloseProc(Handle);
+	}
+	ClientProcesses.Reset();
+
+	if (bExitWhenDone)
+	{
+		FPlatformMisc::RequestExitWithStatus(false, 0);
+	}
+}
+
+void AMesaBenchmarkGameMode::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	for (FProcHandle& Handle : ClientProcesses)
+	{
+		FPlatformProcess::TerminateProc(Handle, true);
+		FPlatformProcess::CloseProc(Handle);
+	}
+	ClientProcesses.Reset();
+
+	Super::EndPlay(EndPlayReason);
+}
@@ -0,0 +1,106 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameModes/MesaGameModeBase.h"
+#include "Player/MesaBotInput.h"
+#include "MesaBenchmarkGameMode.generated.h"
+
+class AMesaPawn;
+
+/*
+	Movement scale benchmark.
+	Spawns bot pawns (bFakeAutonomousProxy, scripted input from FMesaBotInput) around the player starts, lets them run
+	for a warmup, then measures for a while and writes a JSON report: frame time, movement tick cost, resims and bytes
+	sent. Loaded with ?game=MesaBench on any map, Surf has the ramps the surf bots want. URL options:
+
+		Bots=16				Bot pawns to spawn.
+		Pattern=Mixed		Idle, StrafeJump, WallSlide, Surf, or Mixed to cycle through all four.
+		Warmup=5			Seconds before measuring.
+		Duration=60			Seconds measured.
+		Clients=0			Headless clients to launch against this server over loopback, see ClientExecutable.
+		ClientExe=<path>	Client binary, defaults to this one without "Server" in the name.
+		Report=<path>		Defaults to Saved/Benchmarks/Movement_<bots>_<timestamp>.json.
+		Exit				Quit once the report is written, for CI.
+
+	e.g. MesaServer /Game/Maps/Surf?game=MesaBench?Bots=64?Clients=4?Exit -log
+*/
+UCLASS(Config=Game)
+class MESACORE_API AMesaBenchmarkGameMode : public AMesaGameModeBase
+{
+	GENERATED_BODY()
+
+public:
+
+	AMesaBenchmarkGameMode();
+
+	virtual void InitGame(const FString& MapName, const FString& Options, FString& ErrorMessage) override;
+	virtual void StartPlay() override;
+	virtual void Tick(float DeltaSeconds) override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	// Bot class when set, otherwise the pawn of the project's default game mode.
+	UPROPERTY(EditDefaultsOnly, Config, Category = "Benchmark")
+	TSoftClassPtr<AMesaPawn> BotClass;
+
+	// Seconds to wait for clients to send their stats once measuring ends.
+	UPROPERTY(EditDefaultsOnly, Category = "Benchmark")
+	float ClientStatsTimeout = 3.f;
+
+	// From AMesaPlayerController::ServerReportBenchmarkStats.
+	void AddClientStats(int64 Resimulated, int64 Replayed, int64 MovementTicks);
+
+protected:
+
+	enum class EPhase : uint8
+	{
+		Warmup,
+		Measuring,
+		CollectingClientStats,
+		Done
+	};
+
+	UClass* ResolveBotClass() const;
+	void SpawnBots(UClass* PawnClass);
+	void LaunchClients();
+	void BeginMeasuring();
+	void EndMeasuring();
+	void WriteReport();
+
+	EPhase Phase = EPhase::Warmup;
+	double PhaseStartSeconds = 0.0;
+
+	// Options
+	int32 NumBots = 16;
+	int32 NumClients = 0;
+	float WarmupSeconds = 5.f;
+	float DurationSeconds = 60.f;
+	EMesaBotPattern Pattern = EMesaBotPattern::None; // None cycles through all of them.
+	FString ClientExecutable;
+	FString ReportFilename;
+	bool bExitWhenDone = false;
+
+	UPROPERTY(Transient)
+	TArray<AMesaPawn*> Bots;
+
+	TArray<FProcHandle> ClientProcesses;
+
+	// Per frame while measuring.
+	TArray<float> FrameMS;
+	TArray<float> MovementMS;
+	uint64 LastMovementCycles = 0;
+	uint64 StartMovementTicks = 0;
+	uint64 StartOutBytes = 0;
+	uint64 StartOutPackets = 0;
+	uint64 OutBytes = 0;
+	uint64 OutPackets = 0;
+	double MeasuredSeconds = 0.0;
+	int32 MeasuredClients = 0;
+
+	// Summed over the clients that answered.
+	int32 ClientsReported = 0;
+	int64 ClientResimulated = 0;
+	int64 ClientReplayed = 0;
+	int64 ClientMovementTicks = 0;
+};
@@ -1,4 +1,40 @@
 // Copyright Snaps 2022, All Rights Reserved.
 
 #include "GameModes/MesaGameModeBase.h"
+#include "Player/MesaMatchRecorder.h"
+#include "Player/MesaMatchReplay.h"
 
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+
+void AMesaGameModeBase::StartPlay()
+{
+	Super::StartPlay();
+
+	// Headless replay runs instead of the match, it never records.
+	if (MesaMatchReplay::RunFromCommandLine(GetWorld()))
+	{
+		return;
+	}
+
+	if (FParse::Param(FCommandLine::Get(), TEXT("MesaRecord")) || FCString::Strifind(FCommandLine::Get(), TEXT("-MesaRecord=")))
+	{
+		const FString MapName = GetWorld()->GetOutermost()->GetName();
+
+		FString Filename;
+		if (!FParse::Value(FCommandLine::Get(), TEXT("MesaRecord="), Filename))
+		{
+			Filename = MesaMatchRecorder::MakeFilename(MapName);
+		}
+
+		MesaMatchRecorder::Start(Filename, MapName);
+	}
+}
+
+void AMesaGameModeBase::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	// Also finishes a recording started from the console, so the file gets its index.
+	MesaMatchRecorder::Stop();
+
+	Super::EndPlay(EndPlayReason);
+}
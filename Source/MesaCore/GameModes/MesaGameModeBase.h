@@ -8,10 +8,16 @@
 
 /*
 	MesaGameModeBase.
+	Records the match (MesaMatchRecorder.h) when the server is started with -MesaRecord, or -MesaRecord=<file>.
+	With -MesaReplay=<file> it replays a recording instead and exits (MesaMatchReplay.h).
 */
 UCLASS()
 class MESACORE_API AMesaGameModeBase : public AGameModeBase
 {
 	GENERATED_BODY()
-	
+
+public:
+
+	virtual void StartPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 };
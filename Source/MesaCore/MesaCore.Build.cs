@@ -19,6 +19,7 @@ public class MesaCore : ModuleRules
 			"Core",
 			"CoreUObject",
 			"Engine",
+			"EngineSettings",
 			"EnhancedInput",
 			"NetworkPrediction",
 			"NetworkPredictionExtras",
@@ -0,0 +1,215 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaInterpolationSubsystem.h"
+#include "MesaCoreMacros.h"
+
+#include "Engine/NetConnection.h"
+#include "Engine/NetDriver.h"
+#include "Engine/World.h"
+#include "HAL/IConsoleManager.h"
+#include "NetworkPredictionSettings.h"
+#include "NetworkPredictionWorldManager.h"
+
+namespace MesaInterpolationCVars
+{
+	static int32 Enabled = 1;
+	static FAutoConsoleVariableRef CVarEnabled(
+		TEXT("MesaNet.InterpolationBuffer.Adaptive"),
+		Enabled,
+		TEXT("Size the interpolation buffer from measured arrival jitter instead of IndependentTickInterpolationBufferedMS. Only matters with SimulatedProxyNetworkLOD=Interpolated."),
+		ECVF_Default
+	);
+
+	static float Percentile = 0.95f;
+	static FAutoConsoleVariableRef CVarPercentile(
+		TEXT("MesaNet.InterpolationBuffer.Percentile"),
+		Percentile,
+		TEXT("Fraction of packet gaps the buffer should cover."),
+		ECVF_Default
+	);
+
+	static float MarginMS = 10.f;
+	static FAutoConsoleVariableRef CVarMarginMS(
+		TEXT("MesaNet.InterpolationBuffer.MarginMS"),
+		MarginMS,
+		TEXT("Added on top of the gap percentile."),
+		ECVF_Default
+	);
+
+	static float MinMS = 30.f;
+	static FAutoConsoleVariableRef CVarMinMS(
+		TEXT("MesaNet.InterpolationBuffer.MinMS"),
+		MinMS,
+		TEXT("Smallest buffer, whatever the connection looks like. The top is IndependentTickInterpolationMaxBufferedMS."),
+		ECVF_Default
+	);
+
+	static float TimeScale = 0.05f;
+	static FAutoConsoleVariableRef CVarTimeScale(
+		TEXT("MesaNet.InterpolationBuffer.TimeScale"),
+		TimeScale,
+		TEXT("Most the playback rate is bent to grow or drain the buffer, 0.05 = 5% fast or slow."),
+		ECVF_Default
+	);
+
+	static int32 Window = 256;
+	static FAutoConsoleVariableRef CVarWindow(
+		TEXT("MesaNet.InterpolationBuffer.Window"),
+		Window,
+		TEXT("Packet gaps kept for the percentile, up to 512."),
+		ECVF_Default
+	);
+}
+
+FMesaInterpolationBufferStats& FMesaInterpolationBufferStats::Get()
+{
+	static FMesaInterpolationBufferStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdInterpolationBuffer(
+	TEXT("MesaNet.InterpolationBuffer"),
+	TEXT("Prints the current interpolation buffer depth, its target and how often it starved. Pass 'reset' to clear the counts."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaInterpolationBufferStats& Stats = FMesaInterpolationBufferStats::Get();
+
+		UE_LOG(LogMesa, Display, TEXT("MesaNet.InterpolationBuffer: %.1f ms, target %.1f ms, gap p%.0f %.1f ms, %llu starvations in %llu arrivals (%.2f%%)"),
+			Stats.BufferMS, Stats.TargetMS, MesaInterpolationCVars::Percentile * 100.f, Stats.GapPercentileMS, Stats.Starvations, Stats.Arrivals,
+			100.0 * Stats.Starvations / FMath::Max<double>(Stats.Arrivals, 1.0));
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats.Arrivals = 0;
+			Stats.Starvations = 0;
+		}
+	})
+);
+
+bool UMesaInterpolationSubsystem::ShouldCreateSubsystem(UObject* Outer) const
+{
+	const UWorld* World = Cast<UWorld>(Outer);
+	return Super::ShouldCreateSubsystem(Outer) && World && World->IsGameWorld();
+}
+
+void UMesaInterpolationSubsystem::OnWorldBeginPlay(UWorld& InWorld)
+{
+	Super::OnWorldBeginPlay(InWorld);
+
+	// Net mode isn't known when the subsystem is created, only clients interpolate anything, and only when NP is
+	// told to. Forward predicted proxies never read the buffer.
+	const FNetworkPredictionSettings& Settings = GetDefault<UNetworkPredictionSettingsObject>()->Settings;
+	bActive = InWorld.GetNetMode() == NM_Client && Settings.SimulatedProxyNetworkLOD == ENetworkLOD::Interpolated
+		&& Settings.PreferredTickingPolicy == ENetworkPredictionTickingPolicy::Independent;
+	if (!bActive)
+	{
+		return;
+	}
+
+	WorldSettings = NewObject<UNetworkPredictionSettingsObject>(this);
+	WorldSettings->Settings = Settings;
+	BufferMS = TargetMS = (float)Settings.IndependentTickInterpolationBufferedMS;
+
+	Gaps.Reset();
+	NextGap = 0;
+	LastReceiveTime = 0.0;
+}
+
+void UMesaInterpolationSubsystem::Deinitialize()
+{
+	WorldSettings = nullptr;
+	bActive = false;
+	Super::Deinitialize();
+}
+
+TStatId UMesaInterpolationSubsystem::GetStatId() const
+{
+	RETURN_QUICK_DECLARE_CYCLE_STAT(UMesaInterpolationSubsystem, STATGROUP_Tickables);
+}
+
+void UMesaInterpolationSubsystem::Tick(float DeltaTime)
+{
+	Super::Tick(DeltaTime);
+
+	using namespace MesaInterpolationCVars;
+
+	const UNetDriver* NetDriver = bActive && Enabled ? GetWorld()->GetNetDriver() : nullptr;
+	const UNetConnection* Connection = NetDriver ? NetDriver->ServerConnection : nullptr;
+	if (!Connection)
+	{
+		return;
+	}
+
+	// Polled once a frame, so gaps are only as fine as the frame time. Packets that land in the same frame are
+	// processed together by the interpolation too, so that is the resolution that matters.
+	if (Connection->LastReceiveRealtime != LastReceiveTime)
+	{
+		if (LastReceiveTime > 0.0)
+		{
+			AddGap(Connection->LastReceiveRealtime - LastReceiveTime);
+		}
+		LastReceiveTime = Connection->LastReceiveRealtime;
+	}
+
+	// Drain or fill at a bounded rate, that is the time scale playback runs at while it does.
+	const float MaxStepMS = DeltaTime * 1000.f * FMath::Max(TimeScale, 0.f);
+	BufferMS += FMath::Clamp(TargetMS - BufferMS, -MaxStepMS, MaxStepMS);
+
+	ApplyBuffer();
+
+	FMesaInterpolationBufferStats& Stats = FMesaInterpolationBufferStats::Get();
+	Stats.BufferMS = BufferMS;
+	Stats.TargetMS = TargetMS;
+}
+
+void UMesaInterpolationSubsystem::AddGap(double GapSeconds)
+{
+	using namespace MesaInterpolationCVars;
+
+	const float GapMS = (float)(GapSeconds * 1000.0);
+
+	FMesaInterpolationBufferStats& Stats = FMesaInterpolationBufferStats::Get();
+	++Stats.Arrivals;
+	Stats.Starvations += GapMS > BufferMS ? 1 : 0;
+
+	const int32 WindowSize = FMath::Clamp(Window, 8, MaxGaps);
+	if (Gaps.Num() < WindowSize)
+	{
+		Gaps.Add(GapMS);
+	}
+	else
+	{
+		Gaps.SetNum(WindowSize);
+		Gaps[NextGap % WindowSize] = GapMS;
+	}
+	NextGap = (NextGap + 1) % WindowSize;
+
+	// Small enough window to sort a copy on every arrival.
+	TArray<float, TInlineAllocator<MaxGaps>> Sorted(Gaps);
+	Sorted.Sort();
+
+	const int32 PercentileIndex = FMath::Clamp(FMath::CeilToInt32(Percentile * Sorted.Num()) - 1, 0, Sorted.Num() - 1);
+	Stats.GapPercentileMS = Sorted[PercentileIndex];
+
+	const float MaxMS = (float)WorldSettings->Settings.IndependentTickInterpolationMaxBufferedMS;
+	TargetMS = FMath::Clamp(Stats.GapPercentileMS + MarginMS, FMath::Min(MinMS, MaxMS), MaxMS);
+}
+
+void UMesaInterpolationSubsystem::ApplyBuffer()
+{
+	const int32 NewBufferMS = FMath::RoundToInt32(BufferMS);
+	if (NewBufferMS == AppliedBufferMS)
+	{
+		return;
+	}
+
+	AppliedBufferMS = NewBufferMS;
+
+	// NP caches its settings per world, so only this world's manager sees the new buffer.
+	WorldSettings->Settings.IndependentTickInterpolationBufferedMS = NewBufferMS;
+
+	if (UNetworkPredictionWorldManager* WorldManager = GetWorld()->GetSubsystem<UNetworkPredictionWorldManager>())
+	{
+		WorldManager->SyncNetworkPredictionSettings(WorldSettings);
+	}
+}
@@ -0,0 +1,73 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "MesaInterpolationSubsystem.generated.h"
+
+class UNetworkPredictionSettingsObject;
+
+// Interpolation buffer of the local connection, game thread only. See MesaNet.InterpolationBuffer.
+struct FMesaInterpolationBufferStats
+{
+	float BufferMS = 0.f;		// What NP is running with right now.
+	float TargetMS = 0.f;		// Where BufferMS is heading.
+	float GapPercentileMS = 0.f;
+	uint64 Arrivals = 0;
+	uint64 Starvations = 0;		// Gaps between packets longer than the buffer at the time.
+
+	static MESACORE_API FMesaInterpolationBufferStats& Get();
+};
+
+/*
+	UMesaInterpolationSubsystem.
+	Clients only. Replaces the fixed IndependentTickInterpolationBufferedMS with one sized from this connection's
+	measured arrival jitter. The gaps between packets from the server are kept over a sliding window, and the buffer
+	targets a percentile of them plus a margin. It stays between MesaNet.InterpolationBuffer.MinMS and the configured
+	IndependentTickInterpolationMaxBufferedMS.
+
+	The buffer is never jumped to the target. It moves by at most MesaNet.InterpolationBuffer.TimeScale of real time,
+	so playback runs a few percent fast or slow while it drains or fills instead of skipping.
+
+	Only active when NP interpolates simulated proxies, SimulatedProxyNetworkLOD=Interpolated with Independent ticking.
+	The buffer goes to this world's NetworkPrediction manager through a settings object of our own, the CDO is shared
+	by every world in the process and left alone.
+*/
+UCLASS()
+class MESACORE_API UMesaInterpolationSubsystem : public UTickableWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+
+	virtual bool ShouldCreateSubsystem(UObject* Outer) const override;
+	virtual void OnWorldBeginPlay(UWorld& InWorld) override;
+	virtual void Deinitialize() override;
+
+	virtual void Tick(float DeltaTime) override;
+	virtual TStatId GetStatId() const override;
+
+	float GetBufferMS() const { return BufferMS; }
+	float GetTargetMS() const { return TargetMS; }
+
+protected:
+
+	void AddGap(double GapSeconds);
+	void ApplyBuffer();
+
+	static constexpr int32 MaxGaps = 512;
+
+	TArray<float> Gaps;		// Ring, milliseconds.
+	int32 NextGap = 0;
+
+	double LastReceiveTime = 0.0;
+	float BufferMS = 0.f;
+	float TargetMS = 0.f;
+	int32 AppliedBufferMS = INDEX_NONE;
+	bool bActive = false;
+
+	// Copy of the configured settings, with our buffer, that this world's manager is synced to.
+	UPROPERTY(Transient)
+	UNetworkPredictionSettingsObject* WorldSettings = nullptr;
+};
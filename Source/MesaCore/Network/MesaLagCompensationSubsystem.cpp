@@ -0,0 +1,267 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaLagCompensationSubsystem.h"
+#include "Player/MesaPawn.h"
+#include "MesaCoreMacros.h"
+
+#include "Components/CapsuleComponent.h"
+#include "HAL/IConsoleManager.h"
+
+namespace MesaLagCompensationCVars
+{
+	static float MaxRewindMS = 250.f;
+	static FAutoConsoleVariableRef CVarMaxRewindMS(
+		TEXT("MesaNet.LagCompensation.MaxRewindMS"),
+		MaxRewindMS,
+		TEXT("Furthest back a rewind query may go. Older requests are clamped rather than trusted."),
+		ECVF_Default
+	);
+}
+
+void FMesaCapsuleHistory::Add(const FMesaCapsuleSnapshot& Snapshot)
+{
+	Snapshots[Next] = Snapshot;
+	Next = (Next + 1) % Capacity;
+	Num = FMath::Min(Num + 1, Capacity);
+
+	// Cheaper to rebuild than to work out whether the overwritten snapshot was on the boundary.
+	Bounds = FBox(ForceInit);
+	for (int32 Index = 0; Index < Num; ++Index)
+	{
+		const FMesaCapsuleSnapshot& Each = Snapshots[Index];
+		const FVector Extent(Each.Radius, Each.Radius, Each.HalfHeight);
+		Bounds += FBox(Each.Location - Extent, Each.Location + Extent);
+	}
+}
+
+bool FMesaCapsuleHistory::Sample(double Time, FMesaCapsuleSnapshot& OutSnapshot) const
+{
+	if (Num == 0 || Time < Get(0).Time)
+	{
+		return false;
+	}
+
+	if (Time >= Get(Num - 1).Time)
+	{
+		OutSnapshot = Get(Num - 1);
+		return true;
+	}
+
+	// Times only go up, binary search for the first snapshot after Time.
+	int32 Low = 0;
+	int32 High = Num - 1;
+	while (Low < High)
+	{
+		const int32 Mid = (Low + High) / 2;
+		if (Get(Mid).Time <= Time)
+		{
+			Low = Mid + 1;
+		}
+		else
+		{
+			High = Mid;
+		}
+	}
+
+	const FMesaCapsuleSnapshot& From = Get(Low - 1);
+	const FMesaCapsuleSnapshot& To = Get(Low);
+	const float Alpha = (float)((Time - From.Time) / FMath::Max(To.Time - From.Time, UE_DOUBLE_SMALL_NUMBER));
+
+	OutSnapshot.Time = Time;
+	OutSnapshot.Frame = From.Frame;
+	OutSnapshot.Location = FMath::Lerp(From.Location, To.Location, (double)Alpha);
+	OutSnapshot.Yaw = FRotator::NormalizeAxis(From.Yaw + FRotator::NormalizeAxis(To.Yaw - From.Yaw) * Alpha);
+	OutSnapshot.Radius = FMath::Lerp(From.Radius, To.Radius, Alpha);
+	OutSnapshot.HalfHeight = FMath::Lerp(From.HalfHeight, To.HalfHeight, Alpha);
+	return true;
+}
+
+void UMesaLagCompensationSubsystem::Deinitialize()
+{
+	for (AMesaPawn* Pawn : Pawns)
+	{
+		if (UMesaMovementComponent* MovementComponent = Pawn ? Pawn->GetMesaPawnMovement() : nullptr)
+		{
+			MovementComponent->LagCompensationIndex = INDEX_NONE;
+			MovementComponent->LagCompensationSubsystem = nullptr;
+		}
+	}
+
+	Pawns.Reset();
+	Histories.Reset();
+
+	Super::Deinitialize();
+}
+
+void UMesaLagCompensationSubsystem::AddPawn(AMesaPawn* Pawn)
+{
+	UMesaMovementComponent* MovementComponent = Pawn->GetMesaPawnMovement();
+	if (!MovementComponent || MovementComponent->LagCompensationIndex != INDEX_NONE)
+	{
+		return;
+	}
+
+	MovementComponent->LagCompensationIndex = Pawns.Add(Pawn);
+	MovementComponent->LagCompensationSubsystem = this;
+	Histories.AddDefaulted();
+}
+
+void UMesaLagCompensationSubsystem::RemovePawn(AMesaPawn* Pawn)
+{
+	UMesaMovementComponent* MovementComponent = Pawn->GetMesaPawnMovement();
+	if (!MovementComponent || !Pawns.IsValidIndex(MovementComponent->LagCompensationIndex) || Pawns[MovementComponent->LagCompensationIndex] != Pawn)
+	{
+		return;
+	}
+
+	const int32 Index = MovementComponent->LagCompensationIndex;
+	Pawns.RemoveAtSwap(Index, 1, false);
+	Histories.RemoveAtSwap(Index, 1, false);
+
+	if (Pawns.IsValidIndex(Index))
+	{
+		Pawns[Index]->GetMesaPawnMovement()->LagCompensationIndex = Index;
+	}
+
+	MovementComponent->LagCompensationIndex = INDEX_NONE;
+	MovementComponent->LagCompensationSubsystem = nullptr;
+}
+
+void UMesaLagCompensationSubsystem::RecordPawn(int32 PawnIndex, const FVector& Location, float Yaw, const UCapsuleComponent* Capsule)
+{
+	FMesaCapsuleSnapshot Snapshot;
+	Snapshot.Time = GetWorld()->GetTimeSeconds();
+	Snapshot.Frame = (uint32)GFrameCounter;
+	Snapshot.Location = Location;
+	Snapshot.Yaw = Yaw;
+	Snapshot.Radius = Capsule ? Capsule->GetScaledCapsuleRadius() : 0.f;
+	Snapshot.HalfHeight = Capsule ? Capsule->GetScaledCapsuleHalfHeight() : 0.f;
+
+	// NP can finalize more than once in a frame, the last one is where the pawn ended up.
+	FMesaCapsuleHistory& History = Histories[PawnIndex];
+	if (History.Num > 0 && History.Get(History.Num - 1).Frame == Snapshot.Frame)
+	{
+		--History.Num;
+		History.Next = (History.Next + FMesaCapsuleHistory::Capacity - 1) % FMesaCapsuleHistory::Capacity;
+	}
+
+	History.Add(Snapshot);
+}
+
+double UMesaLagCompensationSubsystem::IntersectCapsule(const FVector& Start, const FVector& Dir, const FVector& Center, double HalfHeight, double Radius)
+{
+	// Capsule as the segment A-B swept by Radius, Z up.
+	const double SegmentHalf = FMath::Max(HalfHeight - Radius, 0.0);
+	const FVector A = Center - FVector(0.0, 0.0, SegmentHalf);
+	const FVector B = Center + FVector(0.0, 0.0, SegmentHalf);
+
+	if (FMath::PointDistToSegmentSquared(Start, A, B) <= Radius * Radius)
+	{
+		return 0.0;
+	}
+
+	// Ray against a sphere at one end, returns the entry distance or -1.
+	auto IntersectSphere = [&Start, &Dir, Radius](const FVector& SphereCenter)
+	{
+		const FVector ToStart = Start - SphereCenter;
+		const double HalfB = ToStart | Dir;
+		const double C = ToStart.SizeSquared() - Radius * Radius;
+		const double Discriminant = HalfB * HalfB - C;
+		return Discriminant >= 0.0 && HalfB <= 0.0 ? -HalfB - FMath::Sqrt(Discriminant) : -1.0;
+	};
+
+	// Infinite cylinder around the segment first, then the caps if the entry is past either end.
+	const FVector Axis = B - A;
+	const FVector ToStart = Start - A;
+	const double AxisAxis = Axis | Axis;
+	const double AxisDir = Axis | Dir;
+	const double AxisStart = Axis | ToStart;
+
+	if (AxisAxis > UE_DOUBLE_SMALL_NUMBER)
+	{
+		const double QuadA = AxisAxis - AxisDir * AxisDir;
+		if (QuadA > UE_DOUBLE_SMALL_NUMBER)
+		{
+			const double QuadB = AxisAxis * (Dir | ToStart) - AxisStart * AxisDir;
+			const double QuadC = AxisAxis * (ToStart | ToStart) - AxisStart * AxisStart - Radius * Radius * AxisAxis;
+			const double Discriminant = QuadB * QuadB - QuadA * QuadC;
+			if (Discriminant < 0.0)
+			{
+				return -1.0;
+			}
+
+			const double Distance = (-QuadB - FMath::Sqrt(Discriminant)) / QuadA;
+			const double AlongAxis = AxisStart + Distance * AxisDir;
+			if (AlongAxis > 0.0 && AlongAxis < AxisAxis)
+			{
+				return Distance >= 0.0 ? Distance : -1.0;
+			}
+
+			return IntersectSphere(AlongAxis <= 0.0 ? A : B);
+		}
+
+		// Straight along the axis, only a cap can be hit first.
+		return IntersectSphere(AxisDir > 0.0 ? A : B);
+	}
+
+	return IntersectSphere(A);
+}
+
+bool UMesaLagCompensationSubsystem::RewindSweep(double ServerTime, const FVector& Start, const FVector& End, float SweepRadius, FMesaRewindHit& OutHit, const AActor* IgnoreActor) const
+{
+	const double Now = GetWorld()->GetTimeSeconds();
+	const double Time = FMath::Clamp(ServerTime, Now - MesaLagCompensationCVars::MaxRewindMS / 1000.0, Now);
+
+	const FVector Delta = End - Start;
+	const double Length = Delta.Size();
+	const FVector Dir = Length > UE_DOUBLE_SMALL_NUMBER ? Delta / Length : FVector::ZeroVector;
+	const FVector InvDelta(Delta.X != 0.0 ? 1.0 / Delta.X : UE_BIG_NUMBER, Delta.Y != 0.0 ? 1.0 / Delta.Y : UE_BIG_NUMBER, Delta.Z != 0.0 ? 1.0 / Delta.Z : UE_BIG_NUMBER);
+
+	bool bHit = false;
+	double BestDistance = Length;
+
+	for (int32 Index = 0; Index < Pawns.Num(); ++Index)
+	{
+		const AMesaPawn* Pawn = Pawns[Index];
+		const FMesaCapsuleHistory& History = Histories[Index];
+		if (!Pawn || Pawn == IgnoreActor || History.Num == 0)
+		{
+			continue;
+		}
+
+		// Broadphase against everywhere the pawn has been over the whole history.
+		const FBox Bounds = History.Bounds.ExpandBy(SweepRadius);
+		if (!Bounds.IsInside(Start) && !FMath::LineBoxIntersection(Bounds, Start, End, Delta, InvDelta))
+		{
+			continue;
+		}
+
+		FMesaCapsuleSnapshot Capsule;
+		if (!History.Sample(Time, Capsule))
+		{
+			Capsule = History.Get(0); // Older than the whole history, the oldest is the closest we have.
+		}
+
+		// A sphere sweep against a capsule is a ray against the capsule grown by the sphere.
+		const double Distance = IntersectCapsule(Start, Dir, Capsule.Location, Capsule.HalfHeight + SweepRadius, Capsule.Radius + SweepRadius);
+		if (Distance < 0.0 || Distance > BestDistance)
+		{
+			continue;
+		}
+
+		bHit = true;
+		BestDistance = Distance;
+
+		const FVector SegmentHalf(0.0, 0.0, FMath::Max(Capsule.HalfHeight - Capsule.Radius, 0.f));
+		const FVector HitCenter = Start + Dir * Distance;
+		const FVector Closest = FMath::ClosestPointOnSegment(HitCenter, Capsule.Location - SegmentHalf, Capsule.Location + SegmentHalf);
+
+		OutHit.Pawn = Pawns[Index];
+		OutHit.Distance = (float)Distance;
+		OutHit.Location = HitCenter;
+		OutHit.Normal = (HitCenter - Closest).GetSafeNormal();
+		OutHit.Capsule = Capsule;
+	}
+
+	return bHit;
+}
@@ -0,0 +1,94 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Subsystems/WorldSubsystem.h"
+#include "MesaLagCompensationSubsystem.generated.h"
+
+class AMesaPawn;
+class UCapsuleComponent;
+
+// Where a pawn's capsule was at the end of one server frame.
+struct FMesaCapsuleSnapshot
+{
+	double Time = 0.0;			// Server world time.
+	uint32 Frame = 0;			// Server GFrameCounter, for debugging.
+	float Yaw = 0.f;
+	FVector Location = FVector::ZeroVector;
+	float Radius = 0.f;
+	float HalfHeight = 0.f;
+};
+
+/*
+	A pawn's recent capsules, oldest overwritten first. Fixed size and inline so the whole history of a pawn is one
+	contiguous block, and the rewind query only touches the two snapshots around the time it asks for.
+*/
+struct MESACORE_API FMesaCapsuleHistory
+{
+	static constexpr int32 Capacity = 64; // About a second at 60 Hz, more than MesaNet.LagCompensation.MaxRewindMS.
+
+	void Reset() { Num = 0; Next = 0; }
+	void Add(const FMesaCapsuleSnapshot& Snapshot);
+
+	// Capsule at Time, interpolated between the snapshots either side. False if Time is outside the history.
+	bool Sample(double Time, FMesaCapsuleSnapshot& OutSnapshot) const;
+
+	const FMesaCapsuleSnapshot& Get(int32 Index) const { return Snapshots[(Next - Num + Index + Capacity) % Capacity]; } // 0 is oldest.
+
+	FMesaCapsuleSnapshot Snapshots[Capacity];
+	int32 Num = 0;
+	int32 Next = 0;
+	FBox Bounds = FBox(ForceInit); // Every capsule in the history, the broadphase.
+};
+
+struct FMesaRewindHit
+{
+	AMesaPawn* Pawn = nullptr;
+	float Distance = 0.f;		// Along the trace.
+	FVector Location = FVector::ZeroVector;	// Center of the traced sphere (the impact point for rays).
+	FVector Normal = FVector::ZeroVector;
+	FMesaCapsuleSnapshot Capsule;	// The rewound capsule that was hit.
+};
+
+/*
+	UMesaLagCompensationSubsystem.
+	Server side capsule history for every AMesaPawn, written from the finalized sync state each frame, so hitscan
+	can be validated against where pawns were when the shooter saw them. Queries test rays and sphere sweeps against
+	interpolated historical capsules directly, no component is ever moved back.
+*/
+UCLASS()
+class MESACORE_API UMesaLagCompensationSubsystem : public UWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+
+	virtual void Deinitialize() override;
+
+	void AddPawn(AMesaPawn* Pawn);
+	void RemovePawn(AMesaPawn* Pawn);
+	void RecordPawn(int32 PawnIndex, const FVector& Location, float Yaw, const UCapsuleComponent* Capsule);
+
+	/**
+	 * Closest pawn capsule a sphere of SweepRadius (0 for a ray) swept from Start to End hits, with every pawn where
+	 * it was at ServerTime. ServerTime is clamped to MesaNet.LagCompensation.MaxRewindMS in the past.
+	 */
+	bool RewindSweep(double ServerTime, const FVector& Start, const FVector& End, float SweepRadius, FMesaRewindHit& OutHit, const AActor* IgnoreActor = nullptr) const;
+
+	bool RewindRaycast(double ServerTime, const FVector& Start, const FVector& End, FMesaRewindHit& OutHit, const AActor* IgnoreActor = nullptr) const
+	{
+		return RewindSweep(ServerTime, Start, End, 0.f, OutHit, IgnoreActor);
+	}
+
+	// Distance along Dir (normalized) at which a ray from Start enters the capsule, or a negative number if it misses.
+	// 0 if Start is already inside.
+	static double IntersectCapsule(const FVector& Start, const FVector& Dir, const FVector& Center, double HalfHeight, double Radius);
+
+protected:
+
+	UPROPERTY(Transient)
+	TArray<AMesaPawn*> Pawns;
+
+	TArray<FMesaCapsuleHistory> Histories;
+};
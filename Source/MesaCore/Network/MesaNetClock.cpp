@@ -0,0 +1,125 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaNetClock.h"
+#include "MesaCoreMacros.h"
+
+#include "HAL/IConsoleManager.h"
+
+FMesaNetClockStats& FMesaNetClockStats::Get()
+{
+	static FMesaNetClockStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdClockStats(
+	TEXT("MesaNet.ClockStats"),
+	TEXT("Prints the local player's server clock estimate and how far off it is likely to be."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		const FMesaNetClockStats& Stats = FMesaNetClockStats::Get();
+
+		UE_LOG(LogMesa, Display, TEXT("MesaNet.ClockStats: error %.3f ms, offset %.3f ms, skew %.1f ppm, rtt %.2f ms, %llu samples, resync every %.1fs"),
+			Stats.ErrorMS, Stats.OffsetMS, Stats.SkewPPM, Stats.RoundTripMS, Stats.Samples, Stats.ResyncInterval);
+	})
+);
+
+namespace MesaNetClock
+{
+	static double Median(TArrayView<double> Values)
+	{
+		check(Values.Num() > 0);
+		Values.Sort();
+
+		const int32 Mid = Values.Num() / 2;
+		return (Values.Num() & 1) ? Values[Mid] : 0.5 * (Values[Mid - 1] + Values[Mid]);
+	}
+
+	// Skew can't be told apart from noise over short spans, and no real clock is off by more than this.
+	static constexpr double MinSkewSpan = 2.0;
+	static constexpr double MaxSkew = 1e-3;
+}
+
+void FMesaNetClock::Reset()
+{
+	*this = FMesaNetClock();
+}
+
+void FMesaNetClock::AddSample(double ClientSendTime, double ClientReceiveTime, double ServerTime)
+{
+	const double SampleRoundTrip = ClientReceiveTime - ClientSendTime;
+	if (SampleRoundTrip < 0.0)
+	{
+		return;
+	}
+
+	FSample& Sample = Samples[NextSample];
+	Sample.ClientTime = 0.5 * (ClientSendTime + ClientReceiveTime);
+	Sample.Offset = ServerTime - Sample.ClientTime;
+	Sample.RoundTripTime = SampleRoundTrip;
+
+	NextSample = (NextSample + 1) % Capacity;
+	NumSamples = FMath::Min(NumSamples + 1, Capacity);
+
+	Solve();
+}
+
+void FMesaNetClock::Solve()
+{
+	using namespace MesaNetClock;
+
+	TArray<const FSample*, TInlineAllocator<Capacity>> Kept;
+	for (int32 Index = 0; Index < NumSamples; ++Index)
+	{
+		Kept.Add(&Samples[Index]);
+	}
+
+	// Lowest round trip half, but never fewer than three while we have them.
+	Kept.Sort([](const FSample& A, const FSample& B) { return A.RoundTripTime < B.RoundTripTime; });
+	Kept.SetNum(FMath::Min(Kept.Num(), FMath::Max((Kept.Num() + 1) / 2, 3)));
+
+	RoundTripTime = Kept[0]->RoundTripTime;
+	ReferenceTime = Kept[0]->ClientTime;
+	double FirstTime = ReferenceTime;
+	for (const FSample* Sample : Kept)
+	{
+		ReferenceTime = FMath::Max(ReferenceTime, Sample->ClientTime);
+		FirstTime = FMath::Min(FirstTime, Sample->ClientTime);
+	}
+
+	TArray<double, TInlineAllocator<Capacity * Capacity / 2>> Values;
+
+	Skew = 0.0;
+	if (ReferenceTime - FirstTime >= MinSkewSpan)
+	{
+		for (int32 I = 0; I < Kept.Num(); ++I)
+		{
+			for (int32 J = I + 1; J < Kept.Num(); ++J)
+			{
+				const double DeltaTime = Kept[J]->ClientTime - Kept[I]->ClientTime;
+				if (FMath::Abs(DeltaTime) >= MinSkewSpan * 0.25)
+				{
+					Values.Add((Kept[J]->Offset - Kept[I]->Offset) / DeltaTime);
+				}
+			}
+		}
+
+		if (Values.Num() > 0)
+		{
+			Skew = FMath::Clamp(Median(Values), -MaxSkew, MaxSkew);
+		}
+	}
+
+	Values.Reset();
+	for (const FSample* Sample : Kept)
+	{
+		Values.Add(Sample->Offset - Skew * (Sample->ClientTime - ReferenceTime));
+	}
+	Offset = Median(Values);
+
+	// Median absolute deviation, scaled to match a standard deviation for well behaved noise.
+	for (double& Value : Values)
+	{
+		Value = FMath::Abs(Value - Offset);
+	}
+	Error = Kept.Num() > 1 ? 1.4826 * Median(Values) : RoundTripTime * 0.5;
+}
@@ -0,0 +1,65 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+// The local player's clock sync, game thread only. See MesaNet.ClockStats.
+struct FMesaNetClockStats
+{
+	double ErrorMS = 0.0;			// Robust spread of the samples around the fitted clock.
+	double OffsetMS = 0.0;			// Server minus client time, now.
+	double SkewPPM = 0.0;			// How much faster the server clock runs, parts per million.
+	double RoundTripMS = 0.0;		// Best recent round trip.
+	double ResyncInterval = 0.0;	// Seconds until the next sample is requested.
+	uint64 Samples = 0;
+
+	static MESACORE_API FMesaNetClockStats& Get();
+};
+
+/*
+	Estimates the server clock from (client send, server, client receive) timestamp triples.
+	Samples live in a fixed ring. Each solve keeps the lowest round trip half, since slow samples are the ones
+	skewed by queueing on one leg, and fits offset and skew with Theil-Sen (median of pairwise slopes, then median
+	intercept) so a few bad samples can't drag the line.
+	All times are doubles in seconds, a float world clock is down to about 2 ms resolution after a day.
+*/
+struct MESACORE_API FMesaNetClock
+{
+	static constexpr int32 Capacity = 32;
+
+	void Reset();
+	void AddSample(double ClientSendTime, double ClientReceiveTime, double ServerTime);
+
+	double ToServerTime(double ClientTime) const { return ClientTime + GetOffset(ClientTime); }
+	double GetOffset(double ClientTime) const { return Offset + Skew * (ClientTime - ReferenceTime); }
+
+	bool HasEstimate() const { return NumSamples > 0; }
+	bool IsConverged(int32 MinSamples, double MaxErrorSeconds) const { return NumSamples >= MinSamples && Error <= MaxErrorSeconds; }
+
+	double GetError() const { return Error; }
+	double GetSkew() const { return Skew; }
+	double GetRoundTripTime() const { return RoundTripTime; }
+	int32 Num() const { return NumSamples; }
+
+private:
+
+	void Solve();
+
+	struct FSample
+	{
+		double ClientTime = 0.0;	// Midpoint of send and receive.
+		double Offset = 0.0;		// Server time minus ClientTime.
+		double RoundTripTime = 0.0;
+	};
+
+	FSample Samples[Capacity];
+	int32 NumSamples = 0;
+	int32 NextSample = 0;
+
+	double ReferenceTime = 0.0;
+	double Offset = 0.0;
+	double Skew = 0.0;
+	double Error = 0.0;
+	double RoundTripTime = 0.0;
+};
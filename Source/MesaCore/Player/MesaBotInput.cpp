@@ -0,0 +1,57 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaBotInput.h"
+#include "MesaMovementSimulation.h"
+
+void FMesaBotInput::Init(EMesaBotPattern InPattern, int32 Seed)
+{
+	FRandomStream Stream(Seed);
+	Pattern = InPattern;
+	Seconds = 0.0;
+	Phase = Stream.FRandRange(0.f, 8.f);
+	Direction = Stream.FRand() < 0.5f ? -1.f : 1.f;
+}
+
+void FMesaBotInput::Produce(int32 DeltaMS, FMesaMovementInputCmd& Cmd)
+{
+	const float Time = (float)Seconds + Phase;
+	const float DeltaSeconds = DeltaMS / 1000.f;
+	Seconds += DeltaMS / 1000.0;
+
+	// Flips every Period seconds, starting on Direction.
+	auto Alternate = [this, Time](float Period) { return FMath::FloorToInt(Time / Period) % 2 == 0 ? Direction : -Direction; };
+
+	Cmd.MovementInput = FVector::ZeroVector;
+	Cmd.YawInput = 0.f;
+	Cmd.bJumpPressed = false;
+
+	switch (Pattern)
+	{
+	case EMesaBotPattern::StrafeJump:
+	{
+		// Turn into the strafe, the same hand as a player does it.
+		const float Side = Alternate(0.5f);
+		Cmd.MovementInput = FVector(1.0, Side, 0.0);
+		Cmd.YawInput = Side * 120.f * DeltaSeconds;
+		Cmd.bJumpPressed = true;
+		break;
+	}
+	case EMesaBotPattern::WallSlide:
+	{
+		// Reverse every eight seconds so the bot stays around the walls it found rather than wandering off.
+		const float Side = Alternate(8.f);
+		Cmd.MovementInput = FVector(Side, 0.5 * Direction, 0.0);
+		Cmd.YawInput = FMath::Sin(Time * 0.5f) * 20.f * DeltaSeconds;
+		break;
+	}
+	case EMesaBotPattern::Surf:
+	{
+		Cmd.MovementInput = FVector(0.0, Alternate(3.f), 0.0);
+		Cmd.YawInput = FMath::Sin(Time) * 30.f * DeltaSeconds;
+		Cmd.bJumpPressed = FMath::Fmod(Time, 3.f) < 0.1f;
+		break;
+	}
+	default:
+		break;
+	}
+}
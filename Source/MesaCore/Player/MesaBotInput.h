@@ -0,0 +1,41 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaBotInput.generated.h"
+
+struct FMesaMovementInputCmd;
+
+// Scripted input a bot pawn produces on the server, see AMesaBenchmarkGameMode.
+UENUM()
+enum class EMesaBotPattern : uint8
+{
+	None,
+	Idle,			// No input, stands where it spawned. The cheapest case, ground contact is reused every tick.
+	StrafeJump,		// Holds forward and jump, swings strafe and yaw together every half second.
+	WallSlide,		// Runs diagonally with a slow yaw sweep, so it ends up pressed against and sliding along walls.
+	Surf,			// Strafe only with a jump every few seconds, air strafes on ramps when there are any.
+	Num UMETA(Hidden)
+};
+
+/*
+	Bot Input.
+	Deterministic per bot, the pattern is a function of simulated time and a phase picked from the seed, so two runs of
+	the same benchmark feed the simulation the same commands.
+*/
+struct MESACORE_API FMesaBotInput
+{
+	EMesaBotPattern Pattern = EMesaBotPattern::None;
+
+	void Init(EMesaBotPattern InPattern, int32 Seed);
+
+	// Fills in the command for the next DeltaMS and advances the script.
+	void Produce(int32 DeltaMS, FMesaMovementInputCmd& Cmd);
+
+private:
+
+	double Seconds = 0.0;
+	float Phase = 0.f;
+	float Direction = 1.f;
+};
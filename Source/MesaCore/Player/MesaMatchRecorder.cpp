@@ -0,0 +1,549 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMatchRecorder.h"
+#include "MesaMovementSimulation.h"
+#include "MesaCoreMacros.h"
+
+#include "Algo/BinarySearch.h"
+#include "Containers/Queue.h"
+#include "Engine/World.h"
+#include "HAL/Event.h"
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/Compression.h"
+#include "Misc/DateTime.h"
+#include "Misc/Paths.h"
+
+#include <atomic>
+
+namespace MesaMatchRecorderCVars
+{
+	static int32 ChunkKB = 256;
+	static FAutoConsoleVariableRef CVarChunkKB(
+		TEXT("MesaMovement.Record.ChunkKB"),
+		ChunkKB,
+		TEXT("Uncompressed size of a match recording chunk. 256KB is about a second of 64 pawns at 60Hz. Read on Start."),
+		ECVF_Default
+	);
+
+	static int32 NumChunks = 8;
+	static FAutoConsoleVariableRef CVarNumChunks(
+		TEXT("MesaMovement.Record.NumChunks"),
+		NumChunks,
+		TEXT("Chunks allocated up front when a match recording starts. More are only allocated if the writer falls this far behind."),
+		ECVF_Default
+	);
+}
+
+void FMesaMatchSyncState::From(const FMesaMovementSyncState& Sync)
+{
+	Location = Sync.Location;
+	Velocity = Sync.Velocity;
+	Rotation = Sync.Rotation;
+	GroundNormal = Sync.GroundNormal;
+	GroundDistance = Sync.GroundDistance;
+	MovementType = (uint8)Sync.MovementType;
+	GroundContact = (uint8)Sync.GroundContact;
+	GroundAge = Sync.GroundAge;
+	Pad = 0;
+}
+
+void FMesaMatchSyncState::To(FMesaMovementSyncState& Sync) const
+{
+	Sync.Location = Location;
+	Sync.Velocity = Velocity;
+	Sync.Rotation = Rotation;
+	Sync.GroundNormal = GroundNormal;
+	Sync.GroundDistance = GroundDistance;
+	Sync.MovementType = (EMovementType)MovementType;
+	Sync.GroundContact = (EMesaGroundContact)GroundContact;
+	Sync.GroundAge = GroundAge;
+}
+
+namespace MesaMatchRecorder
+{
+	struct FChunk
+	{
+		TArray<uint8> Data;		// Reserved up front, the game thread only ever copies into it.
+		uint32 FirstTick = 0;
+		uint32 LastTick = 0;
+		uint32 NumRecords = 0;
+	};
+
+	/*
+		Owns the file while recording. The game thread pushes full chunks onto Full and takes empty ones from Free,
+		both single producer single consumer, so neither side ever waits on the other.
+	*/
+	class FWriter : public FRunnable
+	{
+	public:
+
+		TQueue<FChunk*, EQueueMode::Spsc> Full;
+		TQueue<FChunk*, EQueueMode::Spsc> Free;
+		FEvent* WorkEvent = nullptr;
+		std::atomic<bool> bStopping { false };
+
+		TUniquePtr<FArchive> File;
+		TArray<FMesaMatchIndexEntry> Index;
+		TArray<uint8> Compressed;
+
+		std::atomic<uint64> RawBytes { 0 };
+		std::atomic<uint64> CompressedBytes { 0 };
+		std::atomic<uint64> WriteCycles { 0 };
+
+		virtual uint32 Run() override
+		{
+			for (;;)
+			{
+				WorkEvent->Wait(100);
+
+				// Read before draining, Stop queues the last chunk before it sets the flag.
+				const bool bStop = bStopping.load(std::memory_order_acquire);
+
+				FChunk* Chunk = nullptr;
+				while (Full.Dequeue(Chunk))
+				{
+					WriteChunk(*Chunk);
+					Chunk->Data.Reset();
+					Chunk->NumRecords = 0;
+					Free.Enqueue(Chunk);
+				}
+
+				if (bStop)
+				{
+					break;
+				}
+			}
+
+			WriteFooter();
+			return 0;
+		}
+
+		void WriteChunk(const FChunk& Chunk)
+		{
+			if (Chunk.NumRecords == 0)
+			{
+				return;
+			}
+
+			const uint64 StartCycles = FPlatformTime::Cycles64();
+			const int32 RawSize = Chunk.Data.Num();
+
+			Compressed.SetNumUninitialized(FCompression::CompressMemoryBound(NAME_Oodle, RawSize), false);
+			int32 CompressedSize = Compressed.Num();
+			if (!FCompression::CompressMemory(NAME_Oodle, Compressed.GetData(), CompressedSize, Chunk.Data.GetData(), RawSize) || CompressedSize >= RawSize)
+			{
+				CompressedSize = RawSize;
+			}
+
+			FMesaMatchChunkHeader ChunkHeader;
+			ChunkHeader.FirstTick = Chunk.FirstTick;
+			ChunkHeader.LastTick = Chunk.LastTick;
+			ChunkHeader.NumRecords = Chunk.NumRecords;
+			ChunkHeader.RawSize = RawSize;
+			ChunkHeader.CompressedSize = CompressedSize;
+
+			FMesaMatchIndexEntry& Entry = Index.AddDefaulted_GetRef();
+			Entry.FirstTick = Chunk.FirstTick;
+			Entry.LastTick = Chunk.LastTick;
+			Entry.Offset = File->Tell();
+
+			File->Serialize(&ChunkHeader, sizeof(ChunkHeader));
+			File->Serialize(CompressedSize < RawSize ? Compressed.GetData() : const_cast<uint8*>(Chunk.Data.GetData()), CompressedSize);
+
+			RawBytes += RawSize;
+			CompressedBytes += sizeof(ChunkHeader) + CompressedSize;
+			WriteCycles += FPlatformTime::Cycles64() - StartCycles;
+		}
+
+		void WriteFooter()
+		{
+			FMesaMatchFileTrailer Trailer;
+			Trailer.IndexOffset = File->Tell();
+			Trailer.NumChunks = Index.Num();
+
+			File->Serialize(Index.GetData(), Index.Num() * sizeof(FMesaMatchIndexEntry));
+			File->Serialize(&Trailer, sizeof(Trailer));
+			File->Close();
+		}
+	};
+
+	// Game thread state. Chunks are owned here, the writer only borrows them between Full and Free.
+	static TUniquePtr<FWriter> Writer;
+	static FRunnableThread* WriterThread = nullptr;
+	static TArray<TUniquePtr<FChunk>> Chunks;
+	static FChunk* OpenChunk = nullptr;
+	static int32 ChunkBytes = 0;
+	static FString RecordingFilename;
+
+	static uint64 NumRecords = 0;
+	static uint32 NumChunksAllocated = 0;	// Past the preallocated ones, each is a writer stall.
+
+	static FChunk* AllocateChunk()
+	{
+		FChunk* Chunk = Chunks.Add_GetRef(MakeUnique<FChunk>()).Get();
+		Chunk->Data.Reserve(ChunkBytes);
+		return Chunk;
+	}
+
+	static FChunk* TakeFreeChunk()
+	{
+		FChunk* Chunk = nullptr;
+		if (!Writer->Free.Dequeue(Chunk))
+		{
+			++NumChunksAllocated;
+			Chunk = AllocateChunk();
+		}
+
+		return Chunk;
+	}
+
+	static void SubmitOpenChunk()
+	{
+		if (OpenChunk->NumRecords > 0)
+		{
+			Writer->Full.Enqueue(OpenChunk);
+			Writer->WorkEvent->Trigger();
+			OpenChunk = TakeFreeChunk();
+		}
+	}
+
+	bool IsRecording()
+	{
+		return Writer.IsValid();
+	}
+
+	bool Start(const FString& Filename, const FString& MapName)
+	{
+		check(IsInGameThread());
+		if (IsRecording())
+		{
+			UE_LOG(LogMesa, Warning, TEXT("MesaMatchRecorder: Already recording to %s"), *RecordingFilename);
+			return false;
+		}
+
+		TUniquePtr<FArchive> File(IFileManager::Get().CreateFileWriter(*Filename));
+		if (!File)
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMatchRecorder: Failed to open %s for writing"), *Filename);
+			return false;
+		}
+
+		ChunkBytes = FMath::Max(MesaMatchRecorderCVars::ChunkKB * 1024, (int32)sizeof(FMesaMatchRecord)) / sizeof(FMesaMatchRecord) * sizeof(FMesaMatchRecord);
+
+		FMesaMatchFileHeader Header;
+		Header.ChunkSize = ChunkBytes;
+		FCStringAnsi::Strncpy(Header.MapName, TCHAR_TO_ANSI(*MapName), UE_ARRAY_COUNT(Header.MapName));
+		File->Serialize(&Header, sizeof(Header));
+
+		Writer = MakeUnique<FWriter>();
+		Writer->File = MoveTemp(File);
+		Writer->WorkEvent = FPlatformProcess::GetSynchEventFromPool();
+
+		for (int32 Index = 0; Index < FMath::Max(MesaMatchRecorderCVars::NumChunks, 2) - 1; ++Index)
+		{
+			Writer->Free.Enqueue(AllocateChunk());
+		}
+		OpenChunk = AllocateChunk();
+
+		NumRecords = 0;
+		NumChunksAllocated = 0;
+		RecordingFilename = Filename;
+
+		WriterThread = FRunnableThread::Create(Writer.Get(), TEXT("MesaMatchRecorder"), 0, TPri_BelowNormal);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMatchRecorder: Recording %s to %s"), *MapName, *Filename);
+		return true;
+	}
+
+	void Stop()
+	{
+		check(IsInGameThread());
+		if (!IsRecording())
+		{
+			return;
+		}
+
+		SubmitOpenChunk();
+		Writer->bStopping.store(true, std::memory_order_release);
+		Writer->WorkEvent->Trigger();
+
+		WriterThread->WaitForCompletion();
+		delete WriterThread;
+		WriterThread = nullptr;
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMatchRecorder: Wrote %llu records in %d chunks to %s, %.1fMB compressed from %.1fMB, %.1fms writing. %u chunks allocated while recording"),
+			NumRecords, Writer->Index.Num(), *RecordingFilename, Writer->CompressedBytes / (1024.0 * 1024.0), Writer->RawBytes / (1024.0 * 1024.0),
+			FPlatformTime::ToMilliseconds64(Writer->WriteCycles), NumChunksAllocated);
+
+		FPlatformProcess::ReturnSynchEventToPool(Writer->WorkEvent);
+		Writer.Reset();
+		Chunks.Empty();
+		OpenChunk = nullptr;
+	}
+
+	void Record(const FMesaMatchRecord& Record)
+	{
+		checkSlow(IsInGameThread() && IsRecording());
+
+		if (OpenChunk->Data.Num() + (int32)sizeof(FMesaMatchRecord) > ChunkBytes)
+		{
+			SubmitOpenChunk();
+		}
+
+		if (OpenChunk->NumRecords == 0)
+		{
+			OpenChunk->FirstTick = Record.Tick;
+		}
+		OpenChunk->LastTick = Record.Tick;
+		++OpenChunk->NumRecords;
+		++NumRecords;
+
+		OpenChunk->Data.Append(reinterpret_cast<const uint8*>(&Record), sizeof(FMesaMatchRecord));
+	}
+
+	FString MakeFilename(const FString& MapName)
+	{
+		return FPaths::ProjectSavedDir() / TEXT("MatchRecords") / FPaths::GetBaseFilename(MapName) + TEXT("_") + FDateTime::Now().ToString() + TEXT(".mrec");
+	}
+}
+
+bool FMesaMatchReader::Open(const FString& InFilename)
+{
+	Filename = InFilename;
+	Index.Reset();
+	CompressedSize = 0;
+	RawSize = 0;
+
+	File.Reset(IFileManager::Get().CreateFileReader(*Filename));
+	if (!File)
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaMatchReader: Failed to read %s"), *Filename);
+		return false;
+	}
+
+	if (File->TotalSize() < (int64)sizeof(FMesaMatchFileHeader))
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaMatchReader: %s is truncated"), *Filename);
+		return false;
+	}
+
+	File->Serialize(&Header, sizeof(Header));
+	if (Header.Magic != FMesaMatchFileHeader::MagicValue || Header.Version != FMesaMatchFileHeader::CurrentVersion
+		|| Header.RecordSize != sizeof(FMesaMatchRecord))
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaMatchReader: %s is not a version %u match recording"), *Filename, FMesaMatchFileHeader::CurrentVersion);
+		return false;
+	}
+
+	bHasFooter = ReadFooter();
+	if (!bHasFooter)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaMatchReader: %s has no index, recording didn't finish. Rebuilding it from the chunks"), *Filename);
+		RebuildIndex();
+	}
+
+	return true;
+}
+
+bool FMesaMatchReader::ReadFooter()
+{
+	const int64 TotalSize = File->TotalSize();
+	if (TotalSize < (int64)(sizeof(FMesaMatchFileHeader) + sizeof(FMesaMatchFileTrailer)))
+	{
+		return false;
+	}
+
+	FMesaMatchFileTrailer Trailer;
+	File->Seek(TotalSize - sizeof(Trailer));
+	File->Serialize(&Trailer, sizeof(Trailer));
+
+	if (Trailer.Magic != FMesaMatchFileTrailer::MagicValue
+		|| Trailer.IndexOffset + (uint64)Trailer.NumChunks * sizeof(FMesaMatchIndexEntry) + sizeof(Trailer) != (uint64)TotalSize)
+	{
+		return false;
+	}
+
+	Index.SetNumUninitialized(Trailer.NumChunks);
+	File->Seek(Trailer.IndexOffset);
+	File->Serialize(Index.GetData(), Index.Num() * sizeof(FMesaMatchIndexEntry));
+
+	CompressedSize = Trailer.IndexOffset - sizeof(FMesaMatchFileHeader);
+	RawSize = 0;
+	for (const FMesaMatchIndexEntry& Entry : Index)
+	{
+		FMesaMatchChunkHeader ChunkHeader;
+		File->Seek(Entry.Offset);
+		File->Serialize(&ChunkHeader, sizeof(ChunkHeader));
+		RawSize += ChunkHeader.RawSize;
+	}
+
+	return !File->IsError();
+}
+
+void FMesaMatchReader::RebuildIndex()
+{
+	Index.Reset();
+	RawSize = 0;
+
+	const int64 TotalSize = File->TotalSize();
+	int64 Offset = sizeof(FMesaMatchFileHeader);
+	while (Offset + (int64)sizeof(FMesaMatchChunkHeader) <= TotalSize)
+	{
+		FMesaMatchChunkHeader ChunkHeader;
+		File->Seek(Offset);
+		File->Serialize(&ChunkHeader, sizeof(ChunkHeader));
+
+		// The last chunk can be cut short, everything before it is still good.
+		const int64 End = Offset + sizeof(ChunkHeader) + ChunkHeader.CompressedSize;
+		if (ChunkHeader.Magic != FMesaMatchChunkHeader::MagicValue || End > TotalSize)
+		{
+			break;
+		}
+
+		FMesaMatchIndexEntry& Entry = Index.AddDefaulted_GetRef();
+		Entry.FirstTick = ChunkHeader.FirstTick;
+		Entry.LastTick = ChunkHeader.LastTick;
+		Entry.Offset = Offset;
+
+		RawSize += ChunkHeader.RawSize;
+		Offset = End;
+	}
+
+	CompressedSize = Offset - sizeof(FMesaMatchFileHeader);
+}
+
+int32 FMesaMatchReader::FindChunk(uint32 Tick) const
+{
+	// Chunks are written in tick order, so their last ticks are sorted.
+	const int32 ChunkIndex = Algo::LowerBoundBy(Index, Tick, [](const FMesaMatchIndexEntry& Entry) { return Entry.LastTick; });
+	return ChunkIndex < Index.Num() ? ChunkIndex : INDEX_NONE;
+}
+
+bool FMesaMatchReader::ReadChunk(int32 ChunkIndex, TArray<FMesaMatchRecord>& OutRecords)
+{
+	OutRecords.Reset();
+	if (!File || !Index.IsValidIndex(ChunkIndex))
+	{
+		return false;
+	}
+
+	FMesaMatchChunkHeader ChunkHeader;
+	File->Seek(Index[ChunkIndex].Offset);
+	File->Serialize(&ChunkHeader, sizeof(ChunkHeader));
+
+	if (ChunkHeader.Magic != FMesaMatchChunkHeader::MagicValue || ChunkHeader.RawSize != ChunkHeader.NumRecords * sizeof(FMesaMatchRecord))
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaMatchReader: Chunk %d of %s is corrupt"), ChunkIndex, *Filename);
+		return false;
+	}
+
+	OutRecords.SetNumUninitialized(ChunkHeader.NumRecords);
+	if (ChunkHeader.CompressedSize == ChunkHeader.RawSize)
+	{
+		File->Serialize(OutRecords.GetData(), ChunkHeader.RawSize);
+	}
+	else
+	{
+		Compressed.SetNumUninitialized(ChunkHeader.CompressedSize, false);
+		File->Serialize(Compressed.GetData(), ChunkHeader.CompressedSize);
+
+		if (!FCompression::UncompressMemory(NAME_Oodle, OutRecords.GetData(), ChunkHeader.RawSize, Compressed.GetData(), ChunkHeader.CompressedSize))
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMatchReader: Failed to decompress chunk %d of %s"), ChunkIndex, *Filename);
+			OutRecords.Reset();
+			return false;
+		}
+	}
+
+	return !File->IsError();
+}
+
+bool FMesaMatchReader::ReadTicks(uint32 FirstTick, uint32 LastTick, TArray<FMesaMatchRecord>& OutRecords)
+{
+	TArray<FMesaMatchRecord> ChunkRecords;
+	for (int32 ChunkIndex = FindChunk(FirstTick); ChunkIndex != INDEX_NONE && ChunkIndex < Index.Num() && Index[ChunkIndex].FirstTick <= LastTick; ++ChunkIndex)
+	{
+		if (!ReadChunk(ChunkIndex, ChunkRecords))
+		{
+			return false;
+		}
+
+		for (const FMesaMatchRecord& Record : ChunkRecords)
+		{
+			if (Record.Tick >= FirstTick && Record.Tick <= LastTick)
+			{
+				OutRecords.Add(Record);
+			}
+		}
+	}
+
+	return true;
+}
+
+static FAutoConsoleCommandWithWorldAndArgs CmdRecordStart(
+	TEXT("MesaMovement.Record.Start"),
+	TEXT("Server. Records every authoritative movement step to a .mrec file until MesaMovement.Record.Stop. Optional filename, defaults to Saved/MatchRecords/<map>_<timestamp>.mrec"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
+	{
+		const FString MapName = World ? World->GetOutermost()->GetName() : FString();
+		MesaMatchRecorder::Start(Args.Num() > 0 ? Args[0] : MesaMatchRecorder::MakeFilename(MapName), MapName);
+	})
+);
+
+static FAutoConsoleCommand CmdRecordStop(
+	TEXT("MesaMovement.Record.Stop"),
+	TEXT("Finishes the match recording started by MesaMovement.Record.Start."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		MesaMatchRecorder::Stop();
+	})
+);
+
+static FAutoConsoleCommand CmdRecordInfo(
+	TEXT("MesaMovement.Record.Info"),
+	TEXT("Logs what a .mrec holds. Args: <file> [tick, also logs the records of that tick]"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		if (Args.Num() == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("Usage: MesaMovement.Record.Info <file> [tick]"));
+			return;
+		}
+
+		FMesaMatchReader Reader;
+		if (!Reader.Open(Args[0]))
+		{
+			return;
+		}
+
+		const TArray<FMesaMatchIndexEntry>& Index = Reader.GetIndex();
+		const uint64 NumRecords = Reader.GetRawSize() / sizeof(FMesaMatchRecord);
+		UE_LOG(LogMesa, Display, TEXT("MesaMatchReader: %s, map %s, %d chunks, %llu records, ticks %u to %u, %.1fMB compressed from %.1fMB (%.1fx)%s"),
+			*Args[0], ANSI_TO_TCHAR(Reader.GetHeader().MapName), Index.Num(), NumRecords,
+			Index.Num() > 0 ? Index[0].FirstTick : 0, Index.Num() > 0 ? Index.Last().LastTick : 0,
+			Reader.GetCompressedSize() / (1024.0 * 1024.0), Reader.GetRawSize() / (1024.0 * 1024.0),
+			Reader.GetCompressedSize() > 0 ? (double)Reader.GetRawSize() / Reader.GetCompressedSize() : 0.0,
+			Reader.HasFooter() ? TEXT("") : TEXT(", no footer"));
+
+		if (Args.Num() > 1)
+		{
+			const uint32 Tick = (uint32)FCString::Strtoui64(*Args[1], nullptr, 10);
+
+			TArray<FMesaMatchRecord> Records;
+			Reader.ReadTicks(Tick, Tick, Records);
+			for (const FMesaMatchRecord& Record : Records)
+			{
+				UE_LOG(LogMesa, Display, TEXT("  Instance %u Frame %d Seq %u Step %ums%s Cmd (%d, %d, %d, %u) In X=%.2f Y=%.2f Z=%.2f Out X=%.2f Y=%.2f Z=%.2f"),
+					Record.InstanceId, Record.Frame, Record.Sequence, Record.StepMS,
+					EnumHasAnyFlags((EMesaMatchRecordFlags)Record.Flags, EMesaMatchRecordFlags::Recovered) ? TEXT(" recovered") : TEXT(""),
+					Record.Command.Forward, Record.Command.Right, Record.Command.YawDelta, Record.Command.Buttons,
+					Record.InSync.Location.X, Record.InSync.Location.Y, Record.InSync.Location.Z,
+					Record.OutSync.Location.X, Record.OutSync.Location.Y, Record.OutSync.Location.Z);
+			}
+		}
+	})
+);
@@ -0,0 +1,173 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaMovementTypes.h"
+
+struct FMesaMovementInputCmd;
+struct FMesaMovementSyncState;
+
+/*
+	Match Recorder.
+	Records every authoritative movement step on the server, the command it ran and the sync state before and after,
+	into a .mrec file. Unlike the movement trace this is meant to run for a whole match: the game thread copies each
+	record into a preallocated chunk and nothing else. A full chunk is handed to a writer thread, which compresses it
+	and appends it to the file, then gives the chunk back for reuse.
+
+	Stopping writes an index footer, one entry per chunk with its tick range and offset, so a reader can find a tick
+	by reading the trailer, the index and one chunk. Files cut short by a crash have no footer, FMesaMatchReader
+	rebuilds the index by walking the chunk headers instead.
+
+	Start with MesaMovement.Record.Start or -MesaRecord on the server command line (see AMesaGameModeBase).
+*/
+
+enum class EMesaMatchRecordFlags : uint8
+{
+	None		= 0,
+	Recovered	= 1 << 0,	// Rebuilt from the redundant tail of a later command, ran inside that command's NP frame.
+};
+ENUM_CLASS_FLAGS(EMesaMatchRecordFlags);
+
+// Sync state as recorded. Full precision so a replay starts from exactly what the server had.
+struct FMesaMatchSyncState
+{
+	FVector		Location;
+	FVector		Velocity;
+	FRotator	Rotation;
+	FVector		GroundNormal;
+	float		GroundDistance;
+	uint8		MovementType;		// EMovementType
+	uint8		GroundContact;		// EMesaGroundContact
+	uint8		GroundAge;
+	uint8		Pad;
+
+	MESACORE_API void From(const FMesaMovementSyncState& Sync);
+	MESACORE_API void To(FMesaMovementSyncState& Sync) const;
+};
+
+static_assert(sizeof(FMesaMatchSyncState) == 104, "FMesaMatchSyncState is part of the .mrec format");
+
+// One SimulateFrame on the server. Padded by hand so the layout doesn't depend on the compiler.
+struct FMesaMatchRecord
+{
+	uint32				Tick;			// Low 32 bits of GFrameCounter when the step ran, what the index is keyed on.
+	uint32				InstanceId;		// UObject unique id of the updated component, as in the movement trace.
+	int32				Frame;			// NP simulation frame. Recovered steps share the frame of the command that carried them.
+	uint16				StepMS;
+	uint16				Sequence;		// Client command number.
+	FMovementCommand	Command;		// Exactly what the server ran, commands are quantized before they are simulated.
+	uint8				Flags;			// EMesaMatchRecordFlags
+	uint8				Pad;
+
+	FMesaMatchSyncState	InSync;
+	FMesaMatchSyncState	OutSync;
+};
+
+static_assert(sizeof(FMesaMatchRecord) == 232, "FMesaMatchRecord is part of the .mrec format");
+
+// Start of a .mrec file.
+struct FMesaMatchFileHeader
+{
+	static constexpr uint32 MagicValue = 0x4345524D; // "MREC"
+	static constexpr uint32 CurrentVersion = 2; // 2: FMovementCommand sends a yaw delta, not a rate.
+
+	uint32 Magic = MagicValue;
+	uint32 Version = CurrentVersion;
+	uint32 RecordSize = sizeof(FMesaMatchRecord);
+	uint32 ChunkSize = 0;		// Largest uncompressed chunk in bytes.
+	ANSICHAR MapName[64] = {};	// Package name of the map that was recorded, truncated.
+};
+
+// Before every chunk. The records follow, Oodle compressed, or stored as is when CompressedSize == RawSize.
+struct FMesaMatchChunkHeader
+{
+	static constexpr uint32 MagicValue = 0x4B48434D; // "MCHK"
+
+	uint32 Magic = MagicValue;
+	uint32 FirstTick = 0;
+	uint32 LastTick = 0;
+	uint32 NumRecords = 0;
+	uint32 RawSize = 0;
+	uint32 CompressedSize = 0;
+};
+
+// Footer, one per chunk in file order.
+struct FMesaMatchIndexEntry
+{
+	uint32 FirstTick = 0;
+	uint32 LastTick = 0;
+	uint64 Offset = 0;			// Of the chunk header.
+};
+
+// Last bytes of a finished file.
+struct FMesaMatchFileTrailer
+{
+	static constexpr uint32 MagicValue = 0x5844494D; // "MIDX"
+
+	uint64 IndexOffset = 0;
+	uint32 NumChunks = 0;
+	uint32 Magic = MagicValue;
+};
+
+namespace MesaMatchRecorder
+{
+	// Game thread only, like the rest of the recording side.
+	MESACORE_API bool IsRecording();
+
+	// Opens Filename and starts the writer thread. False if already recording or the file can't be opened.
+	MESACORE_API bool Start(const FString& Filename, const FString& MapName);
+
+	// Hands the open chunk to the writer, waits for it to finish the file and write the footer.
+	MESACORE_API void Stop();
+
+	// Copies Record into the open chunk. Only call while recording.
+	MESACORE_API void Record(const FMesaMatchRecord& Record);
+
+	// Default file for a recording of MapName, Saved/MatchRecords/<map>_<timestamp>.mrec.
+	MESACORE_API FString MakeFilename(const FString& MapName);
+}
+
+/*
+	Reads a .mrec back, a chunk at a time.
+*/
+class MESACORE_API FMesaMatchReader
+{
+public:
+
+	// Reads the header and the index. Logs and returns false if the file is missing, another version or unreadable.
+	bool Open(const FString& Filename);
+
+	const FMesaMatchFileHeader& GetHeader() const { return Header; }
+	const TArray<FMesaMatchIndexEntry>& GetIndex() const { return Index; }
+
+	// False when the footer was missing and the index was rebuilt from the chunks.
+	bool HasFooter() const { return bHasFooter; }
+
+	// First chunk that holds Tick or anything after it, INDEX_NONE if the recording ends before Tick.
+	int32 FindChunk(uint32 Tick) const;
+
+	// Replaces OutRecords with the records of one chunk.
+	bool ReadChunk(int32 ChunkIndex, TArray<FMesaMatchRecord>& OutRecords);
+
+	// Appends every record from FirstTick to LastTick inclusive.
+	bool ReadTicks(uint32 FirstTick, uint32 LastTick, TArray<FMesaMatchRecord>& OutRecords);
+
+	// Compressed bytes on disk and uncompressed bytes of all the chunks.
+	uint64 GetCompressedSize() const { return CompressedSize; }
+	uint64 GetRawSize() const { return RawSize; }
+
+private:
+
+	bool ReadFooter();
+	void RebuildIndex();
+
+	TUniquePtr<FArchive> File;
+	FString Filename;
+	FMesaMatchFileHeader Header;
+	TArray<FMesaMatchIndexEntry> Index;
+	TArray<uint8> Compressed;
+	uint64 CompressedSize = 0;
+	uint64 RawSize = 0;
+	bool bHasFooter = false;
+};
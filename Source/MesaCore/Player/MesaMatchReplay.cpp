@@ -0,0 +1,278 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMatchReplay.h"
+#include "MesaPawn.h"
+#include "MesaCoreMacros.h"
+
+#include "Components/CapsuleComponent.h"
+#include "Engine/World.h"
+#include "GameFramework/GameModeBase.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+
+namespace MesaMatchReplay
+{
+	// A recorded pawn. The simulation moves a bare capsule, nothing else about the pawn matters to a step.
+	struct FInstance
+	{
+		AActor* Actor = nullptr;
+		TUniquePtr<FMesaMovementSimulation> Simulation;
+		FMesaMovementSyncState Chained;
+		bool bHasChained = false;
+	};
+
+	static UCapsuleComponent* GetCapsuleTemplate(UWorld* World)
+	{
+		const AGameModeBase* GameMode = World->GetAuthGameMode();
+		const UClass* PawnClass = GameMode && GameMode->DefaultPawnClass && GameMode->DefaultPawnClass->IsChildOf<AMesaPawn>()
+			? GameMode->DefaultPawnClass.Get()
+			: AMesaPawn::StaticClass();
+
+		return Cast<UCapsuleComponent>(PawnClass->GetDefaultObject<AActor>()->GetRootComponent());
+	}
+
+	static void AddInstance(UWorld* World, UCapsuleComponent* Template, TMap<uint32, FInstance>& Instances, uint32 InstanceId)
+	{
+		if (Instances.Contains(InstanceId))
+		{
+			return;
+		}
+
+		FActorSpawnParameters SpawnParams;
+		SpawnParams.SpawnCollisionHandlingOverride = ESpawnActorCollisionHandlingMethod::AlwaysSpawn;
+		SpawnParams.ObjectFlags |= RF_Transient;
+
+		FInstance& Instance = Instances.Add(InstanceId);
+		Instance.Actor = World->SpawnActor<AActor>(AActor::StaticClass(), FTransform::Identity, SpawnParams);
+
+		UCapsuleComponent* Capsule = NewObject<UCapsuleComponent>(Instance.Actor, TEXT("ReplayCapsule"), RF_Transient, Template);
+		Instance.Actor->SetRootComponent(Capsule);
+		Capsule->RegisterComponent();
+
+		Instance.Simulation = MakeUnique<FMesaMovementSimulation>();
+		Instance.Simulation->SetComponents(Capsule, Capsule);
+	}
+
+	static bool HasDiverged(const FMesaMovementSyncState& Recorded, const FMesaMovementSyncState& Replayed, float Tolerance)
+	{
+		if (Tolerance <= 0.f)
+		{
+			return !Replayed.Identical(Recorded);
+		}
+
+		return FVector::DistSquared(Recorded.Location, Replayed.Location) > FMath::Square(Tolerance) || Recorded.MovementType != Replayed.MovementType;
+	}
+
+	bool Run(UWorld* World, const FString& Filename, const FMesaMatchReplayOptions& Options, FMesaMatchReplayResult& OutResult)
+	{
+		OutResult = FMesaMatchReplayResult();
+
+		FMesaMatchReader Reader;
+		if (!World || !Reader.Open(Filename))
+		{
+			return false;
+		}
+
+		const FString MapName = World->GetOutermost()->GetName();
+		const FString RecordedMapName = ANSI_TO_TCHAR(Reader.GetHeader().MapName);
+		if (MapName != RecordedMapName)
+		{
+			UE_LOG(LogMesa, Warning, TEXT("MesaMatchReplay: %s was recorded on %s but %s is loaded, collision won't match"), *Filename, *RecordedMapName, *MapName);
+		}
+
+		UCapsuleComponent* Template = GetCapsuleTemplate(World);
+		const TArray<FMesaMatchIndexEntry>& Index = Reader.GetIndex();
+		const int32 FirstChunk = Reader.FindChunk(Options.FirstTick);
+
+		TMap<uint32, FInstance> Instances;
+		TArray<FMesaMatchRecord> Records;
+		bool bReadOK = true;
+
+		for (int32 Pass = 0; Pass < FMath::Max(Options.Passes, 1) && bReadOK; ++Pass)
+		{
+			for (TPair<uint32, FInstance>& Pair : Instances)
+			{
+				Pair.Value.bHasChained = false;
+			}
+
+			uint64 SimCycles = 0;
+			uint64 ReadCycles = 0;
+
+			for (int32 ChunkIndex = FirstChunk; ChunkIndex != INDEX_NONE && ChunkIndex < Index.Num() && Index[ChunkIndex].FirstTick <= Options.LastTick; ++ChunkIndex)
+			{
+				uint64 StartCycles = FPlatformTime::Cycles64();
+				if (!Reader.ReadChunk(ChunkIndex, Records))
+				{
+					bReadOK = false;
+					break;
+				}
+				ReadCycles += FPlatformTime::Cycles64() - StartCycles;
+
+				// Spawn outside the timed part.
+				for (const FMesaMatchRecord& Record : Records)
+				{
+					AddInstance(World, Template, Instances, Record.InstanceId);
+				}
+
+				StartCycles = FPlatformTime::Cycles64();
+				for (const FMesaMatchRecord& Record : Records)
+				{
+					if (Record.Tick < Options.FirstTick || Record.Tick > Options.LastTick)
+					{
+						continue;
+					}
+
+					FInstance& Instance = Instances.FindChecked(Record.InstanceId);
+
+					FMesaMovementInputCmd Cmd;
+					Cmd.Unpack(Record.Command);
+					Cmd.Sequence = Record.Sequence;
+
+					FMesaMovementSyncState InSync;
+					if (Options.bChained && Instance.bHasChained)
+					{
+						InSync = Instance.Chained;
+					}
+					else
+					{
+						Record.InSync.To(InSync);
+					}
+
+					FMesaMovementSyncState OutSync;
+					Instance.Simulation->ReplayStep(Record.StepMS, Cmd, InSync, OutSync);
+					Instance.Chained = OutSync;
+					Instance.bHasChained = true;
+
+					if (Pass > 0)
+					{
+						continue;
+					}
+
+					if (OutResult.NumSteps++ == 0)
+					{
+						OutResult.FirstTick = Record.Tick;
+					}
+					OutResult.LastTick = Record.Tick;
+
+					FMesaMovementSyncState Recorded;
+					Record.OutSync.To(Recorded);
+					if (HasDiverged(Recorded, OutSync, Options.Tolerance) && OutResult.NumDiverged++ == 0)
+					{
+						OutResult.bDiverged = true;
+						OutResult.FirstDiverged = Record;
+						OutResult.FirstDivergedOutput = OutSync;
+					}
+				}
+				SimCycles += FPlatformTime::Cycles64() - StartCycles;
+			}
+
+			const double SimSeconds = FPlatformTime::ToSeconds64(SimCycles);
+			OutResult.SimSeconds = Pass == 0 ? SimSeconds : FMath::Min(OutResult.SimSeconds, SimSeconds);
+			if (Pass == 0)
+			{
+				OutResult.ReadSeconds = FPlatformTime::ToSeconds64(ReadCycles);
+			}
+		}
+
+		OutResult.NumInstances = Instances.Num();
+
+		for (TPair<uint32, FInstance>& Pair : Instances)
+		{
+			Pair.Value.Simulation.Reset();
+			if (Pair.Value.Actor)
+			{
+				Pair.Value.Actor->Destroy();
+			}
+		}
+
+		return bReadOK;
+	}
+
+	void LogResult(const FString& Filename, const FMesaMatchReplayResult& Result)
+	{
+		UE_LOG(LogMesa, Display, TEXT("MesaMatchReplay: %s, %llu steps from %d pawns over ticks %u to %u. Sim %.2f ms (%.0f steps/sec, %.2f us/step), read %.2f ms"),
+			*Filename, Result.NumSteps, Result.NumInstances, Result.FirstTick, Result.LastTick,
+			Result.SimSeconds * 1000.0, Result.SimSeconds > 0.0 ? Result.NumSteps / Result.SimSeconds : 0.0,
+			Result.NumSteps > 0 ? Result.SimSeconds * 1e6 / Result.NumSteps : 0.0, Result.ReadSeconds * 1000.0);
+
+		if (!Result.bDiverged)
+		{
+			UE_LOG(LogMesa, Display, TEXT("MesaMatchReplay: No divergence"));
+			return;
+		}
+
+		const FMesaMatchRecord& Record = Result.FirstDiverged;
+		FMesaMovementSyncState Recorded;
+		Record.OutSync.To(Recorded);
+		const FMesaMovementSyncState& Replayed = Result.FirstDivergedOutput;
+
+		UE_LOG(LogMesa, Error, TEXT("MesaMatchReplay: %llu of %llu steps diverged. First at tick %u, instance %u frame %d sequence %u step %ums%s, cmd (%d, %d, %d, %u)"),
+			Result.NumDiverged, Result.NumSteps, Record.Tick, Record.InstanceId, Record.Frame, Record.Sequence, Record.StepMS,
+			EnumHasAnyFlags((EMesaMatchRecordFlags)Record.Flags, EMesaMatchRecordFlags::Recovered) ? TEXT(" recovered") : TEXT(""),
+			Record.Command.Forward, Record.Command.Right, Record.Command.YawDelta, Record.Command.Buttons);
+
+		UE_LOG(LogMesa, Error, TEXT("  From     Loc X=%.4f Y=%.4f Z=%.4f Vel X=%.4f Y=%.4f Z=%.4f Mode %d Ground %d"),
+			Record.InSync.Location.X, Record.InSync.Location.Y, Record.InSync.Location.Z,
+			Record.InSync.Velocity.X, Record.InSync.Velocity.Y, Record.InSync.Velocity.Z, Record.InSync.MovementType, Record.InSync.GroundContact);
+		UE_LOG(LogMesa, Error, TEXT("  Recorded Loc X=%.4f Y=%.4f Z=%.4f Vel X=%.4f Y=%.4f Z=%.4f Mode %d Ground %d"),
+			Recorded.Location.X, Recorded.Location.Y, Recorded.Location.Z,
+			Recorded.Velocity.X, Recorded.Velocity.Y, Recorded.Velocity.Z, (int32)Recorded.MovementType, (int32)Recorded.GroundContact);
+		UE_LOG(LogMesa, Error, TEXT("  Replayed Loc X=%.4f Y=%.4f Z=%.4f Vel X=%.4f Y=%.4f Z=%.4f Mode %d Ground %d, off by %.4f uu"),
+			Replayed.Location.X, Replayed.Location.Y, Replayed.Location.Z,
+			Replayed.Velocity.X, Replayed.Velocity.Y, Replayed.Velocity.Z, (int32)Replayed.MovementType, (int32)Replayed.GroundContact,
+			FVector::Dist(Recorded.Location, Replayed.Location));
+	}
+
+	bool RunFromCommandLine(UWorld* World)
+	{
+		const TCHAR* CommandLine = FCommandLine::Get();
+
+		FString Filename;
+		if (!FParse::Value(CommandLine, TEXT("MesaReplay="), Filename))
+		{
+			return false;
+		}
+
+		FMesaMatchReplayOptions Options;
+		FParse::Value(CommandLine, TEXT("MesaReplayFrom="), Options.FirstTick);
+		FParse::Value(CommandLine, TEXT("MesaReplayTo="), Options.LastTick);
+		FParse::Value(CommandLine, TEXT("MesaReplayPasses="), Options.Passes);
+		FParse::Value(CommandLine, TEXT("MesaReplayTolerance="), Options.Tolerance);
+		Options.bChained = FParse::Param(CommandLine, TEXT("MesaReplayChained"));
+
+		FMesaMatchReplayResult Result;
+		const bool bReadOK = Run(World, Filename, Options, Result);
+		if (bReadOK)
+		{
+			LogResult(Filename, Result);
+		}
+
+		FPlatformMisc::RequestExitWithStatus(false, bReadOK && !Result.bDiverged ? 0 : 1);
+		return true;
+	}
+}
+
+static FAutoConsoleCommandWithWorldAndArgs CmdReplay(
+	TEXT("MesaMovement.Replay"),
+	TEXT("Replays a .mrec match recording through the movement simulation in this world and reports speed and the first desync. Args: <file> [passes=1] [chained=0] [tolerance=0]"),
+	FConsoleCommandWithWorldAndArgsDelegate::CreateLambda([](const TArray<FString>& Args, UWorld* World)
+	{
+		if (Args.Num() == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("Usage: MesaMovement.Replay <file> [passes=1] [chained=0] [tolerance=0]"));
+			return;
+		}
+
+		FMesaMatchReplayOptions Options;
+		Options.Passes = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 1;
+		Options.bChained = Args.Num() > 2 && FCString::Atoi(*Args[2]) != 0;
+		Options.Tolerance = Args.Num() > 3 ? FCString::Atof(*Args[3]) : 0.f;
+
+		FMesaMatchReplayResult Result;
+		if (MesaMatchReplay::Run(World, Args[0], Options, Result))
+		{
+			MesaMatchReplay::LogResult(Args[0], Result);
+		}
+	})
+);
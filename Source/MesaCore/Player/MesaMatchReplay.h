@@ -0,0 +1,64 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaMatchRecorder.h"
+#include "MesaMovementSimulation.h"
+
+class UWorld;
+
+/*
+	Match Replay.
+	Feeds a .mrec (MesaMatchRecorder.h) back through FMesaMovementSimulation as fast as it will go, no NP, no
+	networking, no rendering, and checks every step against what the server recorded. Each recorded pawn gets a bare
+	capsule actor of the default pawn's shape in the current world, so the map the recording was made on has to be
+	loaded for collision to match.
+
+	Every record carries the state its step started from, so by default each step is checked on its own and the
+	first one that comes out different is exactly the first desync. Chained runs feed each pawn's own output into its
+	next step instead, to see how far a difference carries.
+
+	Headless: start the dedicated server on the recorded map with -MesaReplay=<file>. It replays, logs the report and
+	exits with 1 if anything diverged, see RunFromCommandLine for the other switches. MesaMovement.Replay does the
+	same from the console.
+*/
+
+struct FMesaMatchReplayOptions
+{
+	uint32 FirstTick = 0;
+	uint32 LastTick = MAX_uint32;
+	int32 Passes = 1;			// Timed runs, the report keeps the fastest. Divergence comes from the first.
+	float Tolerance = 0.f;		// Location error allowed before a step counts as diverged. 0 means bit identical.
+	bool bChained = false;		// Each pawn's step starts from its replayed output rather than the recorded state.
+};
+
+struct FMesaMatchReplayResult
+{
+	uint64 NumSteps = 0;
+	uint64 NumDiverged = 0;
+	int32 NumInstances = 0;
+	uint32 FirstTick = 0;
+	uint32 LastTick = 0;
+
+	double SimSeconds = 0.0;	// Fastest pass, simulation only.
+	double ReadSeconds = 0.0;	// Reading and decompressing, first pass.
+
+	// First step that came out different, and what the replay produced for it.
+	bool bDiverged = false;
+	FMesaMatchRecord FirstDiverged;
+	FMesaMovementSyncState FirstDivergedOutput;
+};
+
+namespace MesaMatchReplay
+{
+	// Replays Filename in World. False if the file can't be read.
+	MESACORE_API bool Run(UWorld* World, const FString& Filename, const FMesaMatchReplayOptions& Options, FMesaMatchReplayResult& OutResult);
+
+	MESACORE_API void LogResult(const FString& Filename, const FMesaMatchReplayResult& Result);
+
+	// Handles -MesaReplay=<file> [-MesaReplayFrom=<tick>] [-MesaReplayTo=<tick>] [-MesaReplayPasses=<n>]
+	// [-MesaReplayTolerance=<uu>] [-MesaReplayChained]. Returns false when there is no -MesaReplay. Otherwise replays,
+	// logs and asks the engine to exit, with 1 on divergence or a bad file.
+	MESACORE_API bool RunFromCommandLine(UWorld* World);
+}
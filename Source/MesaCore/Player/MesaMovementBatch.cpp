@@ -0,0 +1,192 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMovementBatch.h"
+#include "MesaMovementKernelSIMD.h"
+
+#include "HAL/IConsoleManager.h"
+
+namespace MesaMovementBatchCVars
+{
+	static int32 UseSIMD = 0;
+	static FAutoConsoleVariableRef CVarUseSIMD(
+		TEXT("MesaMovement.Batch.SIMD"),
+		UseSIMD,
+		TEXT("Run the batched velocity phase four pawns at a time with the SIMD kernel.\n")
+		TEXT("Single precision, so results differ from the scalar kernel by float error."),
+		ECVF_Default
+	);
+}
+
+int32 FMesaMovementBatch::Add(IMesaMoveCollision* Collision, const FRotator& Rotation, const FVector& Velocity)
+{
+	check(Collision);
+
+	Locations.Add(Collision->GetLocation());
+	Velocities.Add(Velocity);
+	Rotations.Add(Rotation);
+	MovementTypes.Add(EMovementType::Falling);
+	Grounds.AddDefaulted();
+	MovementInputs.Add(FVector::ZeroVector);
+	YawInputs.Add(0.f);
+	PendingJumps.Add(false);
+	PlayerRotations.Add(Rotation);
+	return Collisions.Add(Collision);
+}
+
+void FMesaMovementBatch::RemoveAtSwap(int32 Index)
+{
+	Locations.RemoveAtSwap(Index, 1, false);
+	Velocities.RemoveAtSwap(Index, 1, false);
+	Rotations.RemoveAtSwap(Index, 1, false);
+	MovementTypes.RemoveAtSwap(Index, 1, false);
+	Grounds.RemoveAtSwap(Index, 1, false);
+	MovementInputs.RemoveAtSwap(Index, 1, false);
+	YawInputs.RemoveAtSwap(Index, 1, false);
+	PendingJumps.RemoveAtSwap(Index, 1, false);
+	PlayerRotations.RemoveAtSwap(Index, 1, false);
+	Collisions.RemoveAtSwap(Index, 1, false);
+}
+
+void FMesaMovementBatch::Reset()
+{
+	Locations.Reset();
+	Velocities.Reset();
+	Rotations.Reset();
+	MovementTypes.Reset();
+	Grounds.Reset();
+	MovementInputs.Reset();
+	YawInputs.Reset();
+	PendingJumps.Reset();
+	PlayerRotations.Reset();
+	Collisions.Reset();
+}
+
+void FMesaMovementBatch::SetInput(int32 Index, const FVector& MovementInput, float YawInput, bool bJumpPressed)
+{
+	MovementInputs[Index] = MovementInput;
+	YawInputs[Index] = YawInput;
+	PendingJumps[Index] = bJumpPressed;
+}
+
+void FMesaMovementBatch::Tick(float DeltaSeconds)
+{
+	TickProbe(DeltaSeconds);
+	TickVelocity(DeltaSeconds);
+	TickCollision(DeltaSeconds);
+}
+
+void FMesaMovementBatch::TickProbe(float DeltaSeconds)
+{
+	const int32 Count = Num();
+	FMesaPMoveState State;
+
+	for (int32 Index = 0; Index < Count; ++Index)
+	{
+		PlayerRotations[Index] = Rotations[Index];
+
+		FRotator& Rotation = Rotations[Index];
+		Rotation.Yaw += YawInputs[Index];
+		Rotation.Normalize();
+
+		State.Ground = Grounds[Index];
+		MesaPMove::CategorizePosition(State, *Collisions[Index]);
+		MovementTypes[Index] = State.MovementType;
+		Grounds[Index] = State.Ground;
+	}
+}
+
+void FMesaMovementBatch::TickVelocity(float DeltaSeconds)
+{
+	const int32 Count = Num();
+	FMesaPMoveState State;
+
+	auto LoadState = [this, &State](int32 Index)
+	{
+		State.PlayerRotation = PlayerRotations[Index];
+		State.MovementInput = MovementInputs[Index];
+		State.Velocity = Velocities[Index];
+		State.MovementType = MovementTypes[Index];
+		State.bPendingJump = PendingJumps[Index];
+	};
+
+	auto StoreState = [this, &State](int32 Index)
+	{
+		Velocities[Index] = State.Velocity;
+		MovementTypes[Index] = State.MovementType;
+	};
+
+	if (MesaMovementBatchCVars::UseSIMD)
+	{
+		FMesaPMoveLanes Lanes;
+
+		for (int32 GroupStart = 0; GroupStart < Count; GroupStart += FMesaPMoveLanes::Width)
+		{
+			const int32 GroupCount = FMath::Min(FMesaPMoveLanes::Width, Count - GroupStart);
+
+			// The vector path only applies yaw, anything pitched or rolled goes through the scalar kernel.
+			bool bYawOnly = true;
+			for (int32 Lane = 0; Lane < GroupCount; ++Lane)
+			{
+				const FRotator& Rotation = PlayerRotations[GroupStart + Lane];
+				bYawOnly &= (Rotation.Pitch == 0.f && Rotation.Roll == 0.f);
+			}
+
+			if (!bYawOnly)
+			{
+				for (int32 Lane = 0; Lane < GroupCount; ++Lane)
+				{
+					LoadState(GroupStart + Lane);
+					MesaPMove::UpdateVelocity(State, DeltaSeconds);
+					StoreState(GroupStart + Lane);
+				}
+				continue;
+			}
+
+			for (int32 Lane = 0; Lane < FMesaPMoveLanes::Width; ++Lane)
+			{
+				if (Lane < GroupCount)
+				{
+					LoadState(GroupStart + Lane);
+					Lanes.Load(Lane, State);
+				}
+				else
+				{
+					Lanes.Clear(Lane);
+				}
+			}
+
+			MesaPMoveSIMD::UpdateVelocity(Lanes, DeltaSeconds);
+
+			for (int32 Lane = 0; Lane < GroupCount; ++Lane)
+			{
+				Lanes.Store(Lane, State);
+				StoreState(GroupStart + Lane);
+			}
+		}
+		return;
+	}
+
+	for (int32 Index = 0; Index < Count; ++Index)
+	{
+		LoadState(Index);
+		MesaPMove::UpdateVelocity(State, DeltaSeconds);
+		StoreState(Index);
+	}
+}
+
+void FMesaMovementBatch::TickCollision(float DeltaSeconds)
+{
+	const int32 Count = Num();
+	for (int32 Index = 0; Index < Count; ++Index)
+	{
+		IMesaMoveCollision* Collision = Collisions[Index];
+		const FVector Delta = Velocities[Index] * DeltaSeconds;
+
+		FMesaMoveHit GroundHit;
+		MesaPMove::SlideMove(*Collision, Delta, Rotations[Index].Quaternion(), &GroundHit);
+
+		const FVector GroundDelta = MovementTypes[Index] == EMovementType::Walking ? MesaPMove::StepDown(*Collision, Delta, Rotations[Index].Quaternion(), GroundHit) : Delta;
+		Locations[Index] = Collision->GetLocation();
+		MesaPMove::UpdateGroundFromMove(Grounds[Index], GroundDelta, GroundHit, Locations[Index]);
+	}
+}
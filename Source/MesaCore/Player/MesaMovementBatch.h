@@ -0,0 +1,60 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaMovementKernel.h"
+
+/*
+	FMesaMovementBatch.
+	Structure-of-arrays PMove state for many pawns, ticked in passes instead of pawn by pawn:
+
+		1. Rotation + ground probe	(per pawn, collision read only)
+		2. Velocity					(one tight loop over the batch, no collision)
+		3. Slide move				(per pawn, through its IMesaMoveCollision)
+
+	Each pawn sees exactly the same sequence of kernel calls as MesaPMove::Tick, so results match the per-instance
+	path bit for bit as long as pawns in the batch don't collide with each other inside the same frame (the per
+	instance path would let pawn A's move affect pawn B's probe, the batch probes everyone first).
+
+	With MesaMovement.Batch.SIMD the velocity pass runs four pawns per instruction (MesaMovementKernelSIMD.h)
+	and only matches the scalar path to float precision.
+*/
+class MESACORE_API FMesaMovementBatch
+{
+public:
+
+	// Adds a pawn to the batch. Collision must outlive the batch entry.
+	int32 Add(IMesaMoveCollision* Collision, const FRotator& Rotation = FRotator::ZeroRotator, const FVector& Velocity = FVector::ZeroVector);
+	void RemoveAtSwap(int32 Index);
+	void Reset();
+	int32 Num() const { return Collisions.Num(); }
+
+	// YawInput is degrees to turn this tick, as in FMesaMovementInputCmd.
+	void SetInput(int32 Index, const FVector& MovementInput, float YawInput, bool bJumpPressed);
+
+	void Tick(float DeltaSeconds);
+
+	void TickProbe(float DeltaSeconds);
+	void TickVelocity(float DeltaSeconds);
+	void TickCollision(float DeltaSeconds);
+
+public:
+
+	// Sync state
+	TArray<FVector>					Locations;
+	TArray<FVector>					Velocities;
+	TArray<FRotator>				Rotations;
+	TArray<EMovementType>			MovementTypes;
+	TArray<FMesaGroundState>		Grounds;
+
+	// Input
+	TArray<FVector>					MovementInputs;
+	TArray<float>					YawInputs;
+	TArray<bool>					PendingJumps;
+
+	// Rotation the frame started with, the wish direction is built from this rather than the updated rotation.
+	TArray<FRotator>				PlayerRotations;
+
+	TArray<IMesaMoveCollision*>		Collisions;
+};
@@ -0,0 +1,788 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMovementKernel.h"
+#include "MesaMovementBatch.h"
+#include "MesaMovementKernelSIMD.h"
+#include "MesaMovementSimulation.h"
+#include "MesaMovementTrace.h"
+#include "MesaCoreMacros.h"
+
+#include "HAL/IConsoleManager.h"
+#include "Math/RandomStream.h"
+#include "UObject/CoreNet.h"
+
+/*
+	Headless PMove benchmarks.
+	Runs the movement kernel against a flat floor with scripted input, no world, no components, no NP.
+	Usable from a -nullrhi server or commandlet on the build boxes.
+	Bench.NetSync, Bench.DeadReckoning and Bench.Interpolation are the exception, they replay a recorded movement trace (.mtr) rather than scripted input.
+	Bench.InputLoss runs a client and a server kernel with the command wire format and a lossy link in between.
+*/
+
+namespace MesaMovementBenchmark
+{
+	static constexpr float CapsuleHalfHeight = 88.f;
+	static constexpr float DeltaSeconds = 1.f / 60.f;
+
+	// Infinite floor at Z = 0. Just enough collision for the ground probe and slide paths to run.
+	class FMesaMoveCollisionFloor : public IMesaMoveCollision
+	{
+	public:
+
+		FVector Location = FVector(0.f, 0.f, CapsuleHalfHeight);
+
+		virtual void Sweep(const FVector& Delta, const FQuat& Rotation, FMesaMoveHit& OutHit) override
+		{
+			OutHit = FMesaMoveHit();
+
+			const double Bottom = Location.Z - CapsuleHalfHeight;
+			if (Delta.Z < 0.f && Bottom + Delta.Z < 0.f)
+			{
+				OutHit.Time = FMath::Clamp((float)(Bottom / -Delta.Z), 0.f, 1.f);
+				OutHit.Normal = FVector::UpVector;
+				OutHit.bBlockingHit = true;
+				Location += Delta * OutHit.Time;
+				return;
+			}
+
+			Location += Delta;
+		}
+
+		virtual bool Overlap(const FVector& InLocation, const FQuat& Rotation) const override
+		{
+			return InLocation.Z - CapsuleHalfHeight < 0.f;
+		}
+
+		virtual bool ProbeGround(FMesaMoveHit& OutHit) override
+		{
+			OutHit = FMesaMoveHit();
+			OutHit.bBlockingHit = (Location.Z - CapsuleHalfHeight) <= 1.f;
+			OutHit.Normal = OutHit.bBlockingHit ? FVector::UpVector : FVector::ZeroVector;
+			return OutHit.bBlockingHit;
+		}
+
+		virtual FVector GetLocation() const override
+		{
+			return Location;
+		}
+	};
+
+	// Scripted input: hold a random direction for a while, turn, and bunny hop every so often.
+	// The turn is per command, like the client's, at up to 90 degrees a second.
+	static void GenerateInput(FRandomStream& Stream, int32 Tick, FVector& OutMovementInput, float& OutYawInput, bool& bOutJump)
+	{
+		OutMovementInput = FVector(Stream.FRandRange(-1.f, 1.f), Stream.FRandRange(-1.f, 1.f), 0.f);
+		OutYawInput = Stream.FRandRange(-90.f, 90.f) * DeltaSeconds;
+		bOutJump = (Tick % 45) == 0;
+	}
+
+	static void RunKernel(const TArray<FString>& Args)
+	{
+		const int32 NumPawns = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 64;
+		const int32 NumTicks = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 10000;
+
+		TArray<FMesaMoveCollisionFloor> Collision;
+		TArray<FMesaPMoveState> States;
+		TArray<FRotator> Rotations;
+		Collision.SetNum(NumPawns);
+		States.SetNum(NumPawns);
+		Rotations.SetNum(NumPawns);
+
+		FRandomStream Stream(1337);
+		const FMesaGroundStats StartStats = FMesaGroundStats::Get();
+		const double StartTime = FPlatformTime::Seconds();
+
+		for (int32 Tick = 0; Tick < NumTicks; ++Tick)
+		{
+			for (int32 Index = 0; Index < NumPawns; ++Index)
+			{
+				float YawInput;
+				GenerateInput(Stream, Tick + Index, States[Index].MovementInput, YawInput, States[Index].bPendingJump);
+				MesaPMove::Tick(States[Index], Rotations[Index], YawInput, Collision[Index], DeltaSeconds);
+			}
+		}
+
+		const double Elapsed = FPlatformTime::Seconds() - StartTime;
+		const double TotalTicks = (double)NumPawns * NumTicks;
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.Kernel: %d pawns x %d ticks in %.3f ms (%.0f pawn-ticks/sec), %llu ground probes avoided"),
+			NumPawns, NumTicks, Elapsed * 1000.0, Elapsed > 0.0 ? TotalTicks / Elapsed : 0.0, FMesaGroundStats::Get().Avoided - StartStats.Avoided);
+	}
+
+	// Runs the same scripted input through per-instance MesaPMove::Tick and FMesaMovementBatch, timing both and
+	// checking the results stay bit identical.
+	static void RunBatch(const TArray<FString>& Args)
+	{
+		const int32 NumPawns = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 64;
+		const int32 NumTicks = Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 10000;
+
+		TArray<FMesaMoveCollisionFloor> InstanceCollision;
+		TArray<FMesaPMoveState> InstanceStates;
+		TArray<FRotator> InstanceRotations;
+		InstanceCollision.SetNum(NumPawns);
+		InstanceStates.SetNum(NumPawns);
+		InstanceRotations.SetNum(NumPawns);
+
+		TArray<FMesaMoveCollisionFloor> BatchCollision;
+		BatchCollision.SetNum(NumPawns);
+		FMesaMovementBatch Batch;
+		for (int32 Index = 0; Index < NumPawns; ++Index)
+		{
+			Batch.Add(&BatchCollision[Index]);
+		}
+
+		TArray<FVector> MovementInputs;
+		TArray<float> YawInputs;
+		TArray<bool> Jumps;
+		MovementInputs.SetNum(NumPawns);
+		YawInputs.SetNum(NumPawns);
+		Jumps.SetNum(NumPawns);
+
+		FRandomStream Stream(1337);
+		uint64 InstanceCycles = 0;
+		uint64 BatchCycles = 0;
+		int32 FirstMismatchTick = INDEX_NONE;
+
+		for (int32 Tick = 0; Tick < NumTicks; ++Tick)
+		{
+			for (int32 Index = 0; Index < NumPawns; ++Index)
+			{
+				GenerateInput(Stream, Tick + Index, MovementInputs[Index], YawInputs[Index], Jumps[Index]);
+			}
+
+			uint64 StartCycles = FPlatformTime::Cycles64();
+			for (int32 Index = 0; Index < NumPawns; ++Index)
+			{
+				InstanceStates[Index].MovementInput = MovementInputs[Index];
+				InstanceStates[Index].bPendingJump = Jumps[Index];
+				MesaPMove::Tick(InstanceStates[Index], InstanceRotations[Index], YawInputs[Index], InstanceCollision[Index], DeltaSeconds);
+			}
+			InstanceCycles += FPlatformTime::Cycles64() - StartCycles;
+
+			StartCycles = FPlatformTime::Cycles64();
+			for (int32 Index = 0; Index < NumPawns; ++Index)
+			{
+				Batch.SetInput(Index, MovementInputs[Index], YawInputs[Index], Jumps[Index]);
+			}
+			Batch.Tick(DeltaSeconds);
+			BatchCycles += FPlatformTime::Cycles64() - StartCycles;
+
+			if (FirstMismatchTick == INDEX_NONE)
+			{
+				for (int32 Index = 0; Index < NumPawns; ++Index)
+				{
+					if (InstanceStates[Index].Velocity != Batch.Velocities[Index]
+						|| InstanceCollision[Index].Location != Batch.Locations[Index]
+						|| InstanceRotations[Index] != Batch.Rotations[Index]
+						|| InstanceStates[Index].MovementType != Batch.MovementTypes[Index])
+					{
+						FirstMismatchTick = Tick;
+						break;
+					}
+				}
+			}
+		}
+
+		const double InstanceMS = FPlatformTime::ToMilliseconds64(InstanceCycles);
+		const double BatchMS = FPlatformTime::ToMilliseconds64(BatchCycles);
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.Batch: %d pawns x %d ticks. Per-instance %.3f ms, batched %.3f ms (%.2fx)"),
+			NumPawns, NumTicks, InstanceMS, BatchMS, BatchMS > 0.0 ? InstanceMS / BatchMS : 0.0);
+
+		if (FirstMismatchTick != INDEX_NONE)
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovement.Bench.Batch: batched results diverged from per-instance path at tick %d"), FirstMismatchTick);
+		}
+	}
+
+	static FMesaPMoveState RandomState(FRandomStream& Stream)
+	{
+		FMesaPMoveState State;
+		State.PlayerRotation = FRotator(0.f, Stream.FRandRange(-180.f, 180.f), 0.f);
+		State.MovementInput = Stream.FRand() < 0.2f ? FVector::ZeroVector : FVector(Stream.FRandRange(-1.f, 1.f), Stream.FRandRange(-1.f, 1.f), 0.f);
+		State.MovementType = (EMovementType)Stream.RandRange(0, 2);
+		State.bPendingJump = Stream.FRand() < 0.25f;
+
+		// Mix of resting, slow (under the friction cutoffs) and surfing speeds.
+		const float SpeedScale = Stream.FRand() < 0.1f ? 0.5f : Stream.FRandRange(0.f, 2000.f);
+		State.Velocity = Stream.GetUnitVector() * SpeedScale;
+		return State;
+	}
+
+	static bool NearlyEqual(const FVector& Scalar, const FVector& Vector, float Tolerance, double& InOutMaxError)
+	{
+		const double Error = (Scalar - Vector).GetAbsMax();
+		InOutMaxError = FMath::Max(InOutMaxError, Error);
+
+		// Relative to speed, friction and acceleration scale with it.
+		return Error <= Tolerance * FMath::Max(1.0, Scalar.GetAbsMax());
+	}
+
+	template<bool bQuakeStyle>
+	static int32 VerifyFriction(FRandomStream& Stream, int32 NumSamples, double& OutMaxError)
+	{
+		int32 Failures = 0;
+		FMesaPMoveLanes Lanes;
+		FMesaPMoveState States[FMesaPMoveLanes::Width];
+
+		for (int32 Sample = 0; Sample < NumSamples; Sample += FMesaPMoveLanes::Width)
+		{
+			for (int32 Lane = 0; Lane < FMesaPMoveLanes::Width; ++Lane)
+			{
+				States[Lane] = RandomState(Stream);
+				Lanes.Load(Lane, States[Lane]);
+
+				if (bQuakeStyle)
+				{
+					MesaPMove::ApplyFrictionQuake(States[Lane].Velocity, States[Lane].MovementType, DeltaSeconds);
+				}
+				else
+				{
+					MesaPMove::ApplyFrictionSource(States[Lane].Velocity, States[Lane].MovementType, DeltaSeconds);
+				}
+			}
+
+			MesaPMoveSIMD::ApplyFriction<bQuakeStyle>(Lanes, DeltaSeconds);
+
+			for (int32 Lane = 0; Lane < FMesaPMoveLanes::Width; ++Lane)
+			{
+				const FVector VectorResult(Lanes.VelocityX[Lane], Lanes.VelocityY[Lane], Lanes.VelocityZ[Lane]);
+				Failures += NearlyEqual(States[Lane].Velocity, VectorResult, 1e-4f, OutMaxError) ? 0 : 1;
+			}
+		}
+
+		return Failures;
+	}
+
+	// Checks the SIMD velocity phase against the scalar kernel: both friction styles on their own, then the full
+	// velocity update for the compiled style. Also times scalar against vector on the same states.
+	static void RunVerifySIMD(const TArray<FString>& Args)
+	{
+		const int32 NumSamples = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 100000;
+
+		FRandomStream Stream(1337);
+		double QuakeMaxError = 0.0;
+		double SourceMaxError = 0.0;
+		const int32 QuakeFailures = VerifyFriction<true>(Stream, NumSamples, QuakeMaxError);
+		const int32 SourceFailures = VerifyFriction<false>(Stream, NumSamples, SourceMaxError);
+
+		const int32 NumGroups = FMath::DivideAndRoundUp(NumSamples, FMesaPMoveLanes::Width);
+		TArray<FMesaPMoveState> ScalarStates;
+		TArray<FMesaPMoveLanes> VectorLanes;
+		ScalarStates.SetNum(NumGroups * FMesaPMoveLanes::Width);
+		VectorLanes.SetNum(NumGroups);
+
+		for (int32 Index = 0; Index < ScalarStates.Num(); ++Index)
+		{
+			ScalarStates[Index] = RandomState(Stream);
+			VectorLanes[Index / FMesaPMoveLanes::Width].Load(Index % FMesaPMoveLanes::Width, ScalarStates[Index]);
+		}
+
+		uint64 StartCycles = FPlatformTime::Cycles64();
+		for (FMesaPMoveState& State : ScalarStates)
+		{
+			MesaPMove::UpdateVelocity(State, DeltaSeconds);
+		}
+		const double ScalarMS = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles);
+
+		StartCycles = FPlatformTime::Cycles64();
+		for (FMesaPMoveLanes& Lanes : VectorLanes)
+		{
+			MesaPMoveSIMD::UpdateVelocity(Lanes, DeltaSeconds);
+		}
+		const double VectorMS = FPlatformTime::ToMilliseconds64(FPlatformTime::Cycles64() - StartCycles);
+
+		int32 VelocityFailures = 0;
+		double VelocityMaxError = 0.0;
+		for (int32 Index = 0; Index < ScalarStates.Num(); ++Index)
+		{
+			FMesaPMoveState VectorState;
+			VectorLanes[Index / FMesaPMoveLanes::Width].Store(Index % FMesaPMoveLanes::Width, VectorState);
+
+			const bool bMatch = NearlyEqual(ScalarStates[Index].Velocity, VectorState.Velocity, 1e-4f, VelocityMaxError)
+				&& ScalarStates[Index].MovementType == VectorState.MovementType;
+			VelocityFailures += bMatch ? 0 : 1;
+		}
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.VerifySIMD: %d samples"), NumSamples);
+		UE_LOG(LogMesa, Display, TEXT("  Quake friction:  %d mismatches, max error %.6f"), QuakeFailures, QuakeMaxError);
+		UE_LOG(LogMesa, Display, TEXT("  Source friction: %d mismatches, max error %.6f"), SourceFailures, SourceMaxError);
+		UE_LOG(LogMesa, Display, TEXT("  UpdateVelocity (%s): %d mismatches, max error %.6f"), QUAKESTYLE ? TEXT("Quake") : TEXT("Source"), VelocityFailures, VelocityMaxError);
+		UE_LOG(LogMesa, Display, TEXT("  Scalar %.3f ms, SIMD %.3f ms (%.2fx)"), ScalarMS, VectorMS, VectorMS > 0.0 ? ScalarMS / VectorMS : 0.0);
+
+		if (QuakeFailures + SourceFailures + VelocityFailures > 0)
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovement.Bench.VerifySIMD: SIMD velocity phase does not match the scalar kernel"));
+		}
+	}
+
+	// The sync state format before quantization, kept here as the baseline.
+	static void SerializeFullPrecision(FMesaMovementSyncState& State, FArchive& Ar)
+	{
+		Ar << State.Location;
+		Ar << State.Velocity;
+		Ar << State.Rotation;
+		State.NetSerializeGround(Ar);
+	}
+
+	// Output state of a traced tick.
+	static FMesaMovementSyncState StateFromRecord(const FMesaMoveTraceRecord& Record)
+	{
+		// The trace doesn't keep the ground normal, walking on flat ground is the common case.
+		const EMesaMoveTraceFlags Flags = (EMesaMoveTraceFlags)Record.Flags;
+		const bool bWalking = EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Walking);
+
+		FMesaMovementSyncState State;
+		State.Location = Record.OutLocation;
+		State.Velocity = FVector(Record.OutVelocity);
+		State.Rotation = FRotator(0.f, Record.OutYaw, 0.f);
+		State.MovementType = bWalking ? EMovementType::Walking : (EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Flying) ? EMovementType::Flying : EMovementType::Falling);
+		State.GroundContact = bWalking ? EMesaGroundContact::Ground : EMesaGroundContact::Air;
+		State.GroundNormal = bWalking ? FVector::UpVector : FVector::ZeroVector;
+		return State;
+	}
+
+	struct FTraceFrame
+	{
+		double Time = 0.0; // Seconds since the first record in the trace.
+		FMesaMoveTraceRecord Record;
+	};
+
+	// Loads the trace named by Args[0] and groups its ticks per pawn, oldest first. Resims are left out, they overwrite
+	// history rather than produce a new state. Logs Usage and returns false when there is no file to load.
+	static bool LoadTracePawns(const TArray<FString>& Args, const TCHAR* Usage, TMap<uint32, TArray<FTraceFrame>>& OutPawns)
+	{
+		if (Args.Num() == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("Usage: %s"), Usage);
+			return false;
+		}
+
+		FMesaMoveTraceFileHeader Header;
+		TArray<FMesaMoveTraceRecord> Records;
+		if (!MesaMovementTrace::LoadFromFile(Args[0], Header, Records))
+		{
+			return false;
+		}
+
+		const uint64 FirstCycles = Records.Num() > 0 ? Records[0].Cycles : 0;
+		for (const FMesaMoveTraceRecord& Record : Records)
+		{
+			if (!EnumHasAnyFlags((EMesaMoveTraceFlags)Record.Flags, EMesaMoveTraceFlags::Resimulation))
+			{
+				OutPawns.FindOrAdd(Record.InstanceId).Add({ (Record.Cycles - FirstCycles) * Header.SecondsPerCycle, Record });
+			}
+		}
+		return true;
+	}
+
+	// Pushes every frame of a recorded trace through both sync state formats and reports bytes per pawn per second,
+	// plus the worst quantization error the packed format introduced.
+	static void RunNetSync(const TArray<FString>& Args)
+	{
+		TMap<uint32, TArray<FTraceFrame>> Pawns;
+		if (!LoadTracePawns(Args, TEXT("MesaMovement.Bench.NetSync <trace file>"), Pawns))
+		{
+			return;
+		}
+
+		// Averaged per pawn so a long lived pawn doesn't outweigh the rest.
+		int32 NumTimedPawns = 0;
+		uint64 NumStates = 0;
+		double FullBytesPerSecond = 0.0;
+		double PackedBytesPerSecond = 0.0;
+		double FullBytes = 0.0;
+		double PackedBytes = 0.0;
+		double MaxLocationError = 0.0;
+		double MaxVelocityError = 0.0;
+		double MaxYawError = 0.0;
+
+		for (const TPair<uint32, TArray<FTraceFrame>>& Pair : Pawns)
+		{
+			const TArray<FTraceFrame>& Frames = Pair.Value;
+			uint64 FullBits = 0;
+			uint64 PackedBits = 0;
+
+			for (const FTraceFrame& Frame : Frames)
+			{
+				const FMesaMovementSyncState State = StateFromRecord(Frame.Record);
+
+				FNetBitWriter FullWriter(1024);
+				FMesaMovementSyncState FullState = State;
+				SerializeFullPrecision(FullState, FullWriter);
+
+				FNetBitWriter PackedWriter(1024);
+				FMesaMovementSyncState PackedState = State;
+				PackedState.NetSerialize(FNetSerializeParams(PackedWriter));
+
+				FNetBitReader Reader(nullptr, PackedWriter.GetData(), PackedWriter.GetNumBits());
+				FMesaMovementSyncState Decoded;
+				Decoded.NetSerialize(FNetSerializeParams(Reader));
+
+				MaxLocationError = FMath::Max(MaxLocationError, (Decoded.Location - State.Location).GetAbsMax());
+				MaxVelocityError = FMath::Max(MaxVelocityError, (Decoded.Velocity - State.Velocity).GetAbsMax());
+				MaxYawError = FMath::Max(MaxYawError, FMath::Abs(FRotator::NormalizeAxis(Decoded.Rotation.Yaw - State.Rotation.Yaw)));
+
+				FullBits += FullWriter.GetNumBits();
+				PackedBits += PackedWriter.GetNumBits();
+			}
+
+			NumStates += Frames.Num();
+			FullBytes += FullBits / 8.0;
+			PackedBytes += PackedBits / 8.0;
+
+			const double Seconds = Frames.Last().Time - Frames[0].Time;
+			if (Frames.Num() > 1 && Seconds > 0.0)
+			{
+				++NumTimedPawns;
+				FullBytesPerSecond += FullBits / 8.0 / Seconds;
+				PackedBytesPerSecond += PackedBits / 8.0 / Seconds;
+			}
+		}
+
+		if (NumStates == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.NetSync: %s has no simulated frames"), *Args[0]);
+			return;
+		}
+
+		NumTimedPawns = FMath::Max(NumTimedPawns, 1);
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.NetSync: %llu states from %d pawns in %s"), NumStates, Pawns.Num(), *Args[0]);
+		UE_LOG(LogMesa, Display, TEXT("  Full precision: %.1f bytes/state, %.0f bytes/pawn/sec"), FullBytes / NumStates, FullBytesPerSecond / NumTimedPawns);
+		UE_LOG(LogMesa, Display, TEXT("  Quantized:      %.1f bytes/state, %.0f bytes/pawn/sec (%.1f%%)"), PackedBytes / NumStates, PackedBytesPerSecond / NumTimedPawns,
+			FullBytes > 0.0 ? 100.0 * PackedBytes / FullBytes : 0.0);
+		UE_LOG(LogMesa, Display, TEXT("  Max error: location %.3f, velocity %.3f, yaw %.4f"), MaxLocationError, MaxVelocityError, MaxYawError);
+		UE_LOG(LogMesa, Display, TEXT("  Every simulated frame counted as a send, scale by NetUpdateFrequency / tick rate for the real figure."));
+	}
+
+	// Samples a recorded trace at the net update rate and runs every sample past FMesaDeadReckoning, as the server would
+	// before replicating to simulated proxies. Reports how much of the stream was suppressed and the error that left.
+	static void RunDeadReckoning(const TArray<FString>& Args)
+	{
+		TMap<uint32, TArray<FTraceFrame>> Pawns;
+		if (!LoadTracePawns(Args, TEXT("MesaMovement.Bench.DeadReckoning <trace file> [UpdateHz=30]"), Pawns))
+		{
+			return;
+		}
+
+		const double UpdateInterval = 1.0 / (Args.Num() > 1 ? FMath::Max(1.0, FCString::Atod(*Args[1])) : 30.0);
+
+		uint64 NumSamples = 0;
+		uint64 NumSent[4] = {};
+		uint64 SampleBits = 0;
+		uint64 SentBits = 0;
+		double SumError = 0.0;
+		double MaxError = 0.0;
+
+		for (const TPair<uint32, TArray<FTraceFrame>>& Pair : Pawns)
+		{
+			FMesaDeadReckoning DeadReckoning;
+			double NextSample = -1.0;
+
+			for (const FTraceFrame& Frame : Pair.Value)
+			{
+				if (Frame.Time < NextSample)
+				{
+					continue;
+				}
+
+				NextSample = Frame.Time + UpdateInterval;
+
+				const FMesaMoveTraceRecord& Record = Frame.Record;
+				FMesaMovementSyncState State = StateFromRecord(Record);
+				FNetBitWriter Writer(1024);
+				State.NetSerialize(FNetSerializeParams(Writer));
+
+				// What a proxy would be handed alongside the state, and repeats until the next one.
+				FMesaMovementInputCmd Cmd;
+				Cmd.YawInput = Record.YawInput;
+				Cmd.MovementInput = FVector(Record.MovementInput);
+				Cmd.bJumpPressed = EnumHasAnyFlags((EMesaMoveTraceFlags)Record.Flags, EMesaMoveTraceFlags::JumpPressed);
+				Cmd.Quantize();
+				Cmd.StepMS = (uint8)FMath::Min<int32>(Record.StepMS, MAX_uint8);
+
+				double Error;
+				const EMesaSendReason Reason = DeadReckoning.Update(State, Cmd, Record.StepMS, Frame.Time, &Error);
+
+				++NumSamples;
+				++NumSent[(int32)Reason];
+				SampleBits += Writer.GetNumBits();
+
+				if (Reason == EMesaSendReason::None)
+				{
+					SumError += Error;
+					MaxError = FMath::Max(MaxError, Error);
+				}
+				else
+				{
+					SentBits += Writer.GetNumBits();
+				}
+			}
+		}
+
+		if (NumSamples == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.DeadReckoning: %s has no simulated frames"), *Args[0]);
+			return;
+		}
+
+		const uint64 NumSuppressed = NumSent[(int32)EMesaSendReason::None];
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.DeadReckoning: %llu samples at %.0f Hz from %d pawns in %s"), NumSamples, 1.0 / UpdateInterval, Pawns.Num(), *Args[0]);
+		UE_LOG(LogMesa, Display, TEXT("  Sent %llu (%llu diverged, %llu heartbeats, %llu initial), suppressed %llu (%.1f%%)"),
+			NumSamples - NumSuppressed, NumSent[(int32)EMesaSendReason::Diverged], NumSent[(int32)EMesaSendReason::Heartbeat],
+			NumSent[(int32)EMesaSendReason::Initial], NumSuppressed, 100.0 * NumSuppressed / NumSamples);
+		UE_LOG(LogMesa, Display, TEXT("  Sync state bytes: %.0f every sample, %.0f dead reckoned (%.1f%%)"), SampleBits / 8.0, SentBits / 8.0, 100.0 * SentBits / FMath::Max<uint64>(SampleBits, 1));
+		UE_LOG(LogMesa, Display, TEXT("  Extrapolation error while suppressed: mean %.2f, max %.2f"), NumSuppressed > 0 ? SumError / NumSuppressed : 0.0, MaxError);
+	}
+
+	// Visual error against update rate for linear and Hermite proxy interpolation. Every traced tick is the truth, the
+	// proxy only gets quantized snapshots at the update rate and interpolates the ticks in between.
+	static void RunInterpolation(const TArray<FString>& Args)
+	{
+		TMap<uint32, TArray<FTraceFrame>> Pawns;
+		if (!LoadTracePawns(Args, TEXT("MesaMovement.Bench.Interpolation <trace file>"), Pawns))
+		{
+			return;
+		}
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.Interpolation: %d pawns in %s"), Pawns.Num(), *Args[0]);
+		UE_LOG(LogMesa, Display, TEXT("  Rate   Bytes/pawn/s   Linear mean / max   Hermite mean / max"));
+
+		for (const double UpdateHz : { 60.0, 30.0, 20.0, 15.0, 10.0 })
+		{
+			uint64 SnapshotBits = 0;
+			double Seconds = 0.0;
+			uint64 NumSamples = 0;
+			double SumError[2] = {};
+			double MaxError[2] = {};
+
+			for (const TPair<uint32, TArray<FTraceFrame>>& Pair : Pawns)
+			{
+				const TArray<FTraceFrame>& Frames = Pair.Value;
+				if (Frames.Num() < 2)
+				{
+					continue;
+				}
+
+				Seconds += Frames.Last().Time - Frames[0].Time; // Pawn seconds, so bytes over it are per pawn.
+
+				// What the proxy received, after the trip through the wire format.
+				TArray<int32> SnapshotIndices;
+				TArray<FMesaMovementSyncState> Snapshots;
+				double NextSample = -1.0;
+				for (int32 Index = 0; Index < Frames.Num(); ++Index)
+				{
+					if (Frames[Index].Time < NextSample)
+					{
+						continue;
+					}
+
+					NextSample = Frames[Index].Time + 1.0 / UpdateHz;
+
+					FNetBitWriter Writer(1024);
+					FMesaMovementSyncState State = StateFromRecord(Frames[Index].Record);
+					State.NetSerialize(FNetSerializeParams(Writer));
+					SnapshotBits += Writer.GetNumBits();
+
+					FNetBitReader Reader(nullptr, Writer.GetData(), Writer.GetNumBits());
+					FMesaMovementSyncState& Decoded = Snapshots.AddDefaulted_GetRef();
+					Decoded.NetSerialize(FNetSerializeParams(Reader));
+					SnapshotIndices.Add(Index);
+				}
+
+				for (int32 Snapshot = 0; Snapshot + 1 < Snapshots.Num(); ++Snapshot)
+				{
+					const FTraceFrame& From = Frames[SnapshotIndices[Snapshot]];
+					const FTraceFrame& To = Frames[SnapshotIndices[Snapshot + 1]];
+
+					for (int32 Index = SnapshotIndices[Snapshot] + 1; Index < SnapshotIndices[Snapshot + 1]; ++Index)
+					{
+						const float PCT = (float)((Frames[Index].Time - From.Time) / FMath::Max(To.Time - From.Time, UE_DOUBLE_SMALL_NUMBER));
+						const FVector Truth = Frames[Index].Record.OutLocation;
+						++NumSamples;
+
+						for (int32 Mode = 0; Mode < 2; ++Mode)
+						{
+							FMesaMovementSyncState Interpolated;
+							Interpolated.Interpolate(&Snapshots[Snapshot], &Snapshots[Snapshot + 1], PCT, Mode == 1);
+
+							const double Error = FVector::Dist(Interpolated.Location, Truth);
+							SumError[Mode] += Error;
+							MaxError[Mode] = FMath::Max(MaxError[Mode], Error);
+						}
+					}
+				}
+			}
+
+			const double MeanDivisor = FMath::Max<double>(NumSamples, 1.0);
+			UE_LOG(LogMesa, Display, TEXT("  %4.0f   %12.0f   %6.2f / %7.2f    %6.2f / %7.2f"),
+				UpdateHz, Seconds > 0.0 ? SnapshotBits / 8.0 / Seconds : 0.0,
+				SumError[0] / MeanDivisor, MaxError[0], SumError[1] / MeanDivisor, MaxError[1]);
+		}
+	}
+
+	struct FInputLossResult
+	{
+		int32 Sent = 0;
+		int32 Dropped = 0;
+		int32 Starved = 0;		// Commands the server never ran.
+		int32 Recovered = 0;
+		int32 Corrections = 0;	// Server states the client would have had to reconcile to.
+		uint64 Bits = 0;
+	};
+
+	static FInputLossResult RunInputLossCase(int32 NumCommands, int32 NumRedundant, float LossRate)
+	{
+		FInputLossResult Result;
+
+		FMesaMoveCollisionFloor ClientCollision;
+		FMesaPMoveState ClientState;
+		FRotator ClientRotation = FRotator::ZeroRotator;
+
+		FMesaMoveCollisionFloor ServerCollision;
+		FMesaPMoveState ServerState;
+		FRotator ServerRotation = FRotator::ZeroRotator;
+
+		FMesaInputReceiver Receiver;
+		TArray<FMesaRedundantCommand> RecentCommands;
+		TArray<FMesaRedundantCommand, TInlineAllocator<8>> Recovered;
+
+		const FMesaInputStats SavedStats = FMesaInputStats::Get();
+		FMesaInputStats::Get() = FMesaInputStats();
+
+		// Same streams for every case so only the loss rate and redundancy change.
+		FRandomStream InputStream(1337);
+		FRandomStream LossStream(7331);
+		const uint8 StepMS = (uint8)FMath::RoundToInt(DeltaSeconds * 1000.f);
+
+		auto RunCommand = [](FMesaPMoveState& State, FRotator& Rotation, FMesaMoveCollisionFloor& Collision, const FMesaMovementInputCmd& Cmd)
+		{
+			State.MovementInput = Cmd.MovementInput;
+			State.bPendingJump = Cmd.bJumpPressed;
+			MesaPMove::Tick(State, Rotation, Cmd.YawInput, Collision, DeltaSeconds);
+		};
+
+		for (int32 Tick = 0; Tick < NumCommands; ++Tick)
+		{
+			FMesaMovementInputCmd Cmd;
+			GenerateInput(InputStream, Tick, Cmd.MovementInput, Cmd.YawInput, Cmd.bJumpPressed);
+			Cmd.Quantize();
+			Cmd.Sequence = (uint16)Tick;
+			Cmd.StepMS = StepMS;
+			Cmd.Redundant.Append(RecentCommands.GetData(), FMath::Min(RecentCommands.Num(), NumRedundant));
+
+			RecentCommands.Insert(FMesaRedundantCommand{ Cmd.Pack(), StepMS }, 0);
+			RecentCommands.SetNum(FMath::Min(RecentCommands.Num(), FMesaMovementInputCmd::MaxRedundant), false);
+
+			RunCommand(ClientState, ClientRotation, ClientCollision, Cmd);
+
+			FNetBitWriter Writer(1024);
+			Cmd.NetSerialize(FNetSerializeParams(Writer));
+			Result.Bits += Writer.GetNumBits();
+			++Result.Sent;
+
+			if (LossStream.FRand() < LossRate)
+			{
+				++Result.Dropped;
+				continue;
+			}
+
+			FNetBitReader Reader(nullptr, Writer.GetData(), Writer.GetNumBits());
+			FMesaMovementInputCmd Received;
+			Received.NetSerialize(FNetSerializeParams(Reader));
+
+			if (!Receiver.Receive(Received, Recovered))
+			{
+				continue;
+			}
+
+			for (const FMesaRedundantCommand& Command : Recovered)
+			{
+				FMesaMovementInputCmd RecoveredCmd;
+				RecoveredCmd.Unpack(Command.Command);
+				RunCommand(ServerState, ServerRotation, ServerCollision, RecoveredCmd);
+			}
+
+			RunCommand(ServerState, ServerRotation, ServerCollision, Received);
+
+			// The server's answer to this command, as the client would reconcile it.
+			const FVector Error = ServerCollision.Location - ClientCollision.Location;
+			if (FMesaMovementSimulation::ClassifyError(Error, ServerState.Velocity) != EMesaReconcileTier::Accept)
+			{
+				++Result.Corrections;
+				ClientState = ServerState;
+				ClientRotation = ServerRotation;
+				ClientCollision.Location = ServerCollision.Location;
+			}
+		}
+
+		const FMesaInputStats& Stats = FMesaInputStats::Get();
+		Result.Starved = (int32)Stats.Lost;
+		Result.Recovered = (int32)Stats.Recovered;
+		FMesaInputStats::Get() = SavedStats;
+
+		return Result;
+	}
+
+	// Loss emulation for redundant input. Each loss rate runs without redundancy and with it, same input and same drops.
+	static void RunInputLoss(const TArray<FString>& Args)
+	{
+		const int32 NumCommands = Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 20000;
+		const int32 NumRedundant = FMath::Clamp(Args.Num() > 1 ? FCString::Atoi(*Args[1]) : 3, 0, FMesaMovementInputCmd::MaxRedundant);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.Bench.InputLoss: %d commands, redundancy %d"), NumCommands, NumRedundant);
+
+		for (const float LossRate : { 0.02f, 0.05f, 0.10f })
+		{
+			for (const int32 Redundancy : { 0, NumRedundant })
+			{
+				const FInputLossResult Result = RunInputLossCase(NumCommands, Redundancy, LossRate);
+				const double Sent = FMath::Max(Result.Sent, 1);
+
+				UE_LOG(LogMesa, Display, TEXT("  %2.0f%% loss, redundancy %d: %.1f bytes/cmd, %d dropped, %d recovered, %d starved (%.2f%%), %d corrections (%.2f%%)"),
+					LossRate * 100.f, Redundancy, Result.Bits / 8.0 / Sent, Result.Dropped, Result.Recovered,
+					Result.Starved, 100.0 * Result.Starved / Sent, Result.Corrections, 100.0 * Result.Corrections / Sent);
+			}
+		}
+	}
+}
+
+static FAutoConsoleCommand CVarMesaBenchKernel(
+	TEXT("MesaMovement.Bench.Kernel"),
+	TEXT("Ticks the PMove kernel headless against a flat floor. Usage: MesaMovement.Bench.Kernel [NumPawns=64] [NumTicks=10000]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunKernel)
+);
+
+static FAutoConsoleCommand CVarMesaBenchBatch(
+	TEXT("MesaMovement.Bench.Batch"),
+	TEXT("Compares per-instance and batched SoA PMove ticking for speed and exact equality. Usage: MesaMovement.Bench.Batch [NumPawns=64] [NumTicks=10000]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunBatch)
+);
+
+static FAutoConsoleCommand CVarMesaBenchVerifySIMD(
+	TEXT("MesaMovement.Bench.VerifySIMD"),
+	TEXT("Checks the SIMD velocity kernel against the scalar kernel (both friction styles) and times them. Usage: MesaMovement.Bench.VerifySIMD [NumSamples=100000]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunVerifySIMD)
+);
+
+static FAutoConsoleCommand CVarMesaBenchNetSync(
+	TEXT("MesaMovement.Bench.NetSync"),
+	TEXT("Replays a recorded movement trace through the full precision and quantized sync state formats. Usage: MesaMovement.Bench.NetSync <trace file>"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunNetSync)
+);
+
+static FAutoConsoleCommand CVarMesaBenchInputLoss(
+	TEXT("MesaMovement.Bench.InputLoss"),
+	TEXT("Emulates 2%, 5% and 10% upstream packet loss with and without redundant input. Usage: MesaMovement.Bench.InputLoss [NumCommands=20000] [Redundancy=3]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunInputLoss)
+);
+
+static FAutoConsoleCommand CVarMesaBenchDeadReckoning(
+	TEXT("MesaMovement.Bench.DeadReckoning"),
+	TEXT("Replays a recorded movement trace through the dead reckoning send filter and reports bytes saved and extrapolation error. Usage: MesaMovement.Bench.DeadReckoning <trace file> [UpdateHz=30]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunDeadReckoning)
+);
+
+static FAutoConsoleCommand CVarMesaBenchInterpolation(
+	TEXT("MesaMovement.Bench.Interpolation"),
+	TEXT("Replays a recorded movement trace at 60 to 10 Hz and reports linear and Hermite interpolation error against sync state bandwidth. Usage: MesaMovement.Bench.Interpolation <trace file>"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(MesaMovementBenchmark::RunInterpolation)
+);
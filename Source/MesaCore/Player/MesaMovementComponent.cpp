@@ -4,15 +4,82 @@
 #include "MesaMovementSimulation.h"
 #include "MesaPawn.h"
 #include "MesaPlayerController.h"
+#include "Network/MesaLagCompensationSubsystem.h"
 #include "MesaCoreMacros.h"
 
+#include "Camera/PlayerCameraManager.h"
 #include "Components/CapsuleComponent.h"
+#include "Engine/Engine.h"
+#include "Engine/NetConnection.h"
+#include "GameFramework/WorldSettings.h"
+#include "Net/UnrealNetwork.h"
+#include "UObject/UObjectIterator.h"
 #include "NetworkPredictionProxyInit.h"
 #include "NetworkPredictionModelDefRegistry.h"
 #include "NetworkPredictionProxyWrite.h"
 
 float UMesaMovementComponent::GetDefaultMaxSpeed() { return 1200.f; }
 
+namespace MesaMovementComponentCVars
+{
+	static int32 GhostRollback = 1;
+	static FAutoConsoleVariableRef CVarGhostRollback(
+		TEXT("MesaMovement.GhostRollback"),
+		GhostRollback,
+		TEXT("Resimulate on a ghost transform and only write the real component once in FinalizeFrame.\n")
+		TEXT("Other pawns are queried where they were before the rollback rather than at the replayed frame."),
+		ECVF_Default
+	);
+
+	static int32 InputRedundancy = 3;
+	static FAutoConsoleVariableRef CVarInputRedundancy(
+		TEXT("MesaMovement.InputRedundancy"),
+		InputRedundancy,
+		TEXT("Previous commands sent again with every input command so the server can recover ones that were lost. 0 to 8."),
+		ECVF_Default
+	);
+
+	static int32 ProxyLOD = 1;
+	static FAutoConsoleVariableRef CVarProxyLOD(
+		TEXT("MesaMovement.LOD"),
+		ProxyLOD,
+		TEXT("Pick a simulation LOD per simulated proxy from distance and interaction. 0 forward predicts every proxy."),
+		ECVF_Default
+	);
+
+	static float LODForwardDistance = 2500.f;
+	static FAutoConsoleVariableRef CVarLODForwardDistance(
+		TEXT("MesaMovement.LOD.ForwardDistance"),
+		LODForwardDistance,
+		TEXT("Proxies closer than this to the local view are forward predicted with collision."),
+		ECVF_Default
+	);
+
+	static float LODFarDistance = 8000.f;
+	static FAutoConsoleVariableRef CVarLODFarDistance(
+		TEXT("MesaMovement.LOD.FarDistance"),
+		LODFarDistance,
+		TEXT("Proxies further than this from the local view step at a low rate."),
+		ECVF_Default
+	);
+
+	static int32 LODInteractionFrames = 30;
+	static FAutoConsoleVariableRef CVarLODInteractionFrames(
+		TEXT("MesaMovement.LOD.InteractionFrames"),
+		LODInteractionFrames,
+		TEXT("Frames a proxy stays forward predicted after another pawn's sweep hit it, whatever the distance."),
+		ECVF_Default
+	);
+
+	static float SmoothingHalfLife = 0.08f;
+	static FAutoConsoleVariableRef CVarSmoothingHalfLife(
+		TEXT("MesaMovement.SmoothingHalfLife"),
+		SmoothingHalfLife,
+		TEXT("Seconds for the visual offset left by a corrected resim to halve. 0 snaps every correction."),
+		ECVF_Default
+	);
+}
+
 // ----------------------------------------------------------------------------------------------------------
 //	FMesaMovementModelDef: the piece that ties everything together that we use to register with the NP system.
 // ----------------------------------------------------------------------------------------------------------
@@ -153,30 +220,266 @@ void UMesaMovementComponent::TickComponent(float DeltaTime, enum ELevelTick Tick
 	const ENetRole OwnerRole = GetOwnerRole();
 	static bool bDrawSimLocation = true;
 	static bool bDrawPresentationLocation = true;
+
+	if (OwnerRole == ROLE_SimulatedProxy && ActiveMovementSimulation)
+	{
+		UpdateProxyLOD();
+	}
+	else if (OwnerRole == ROLE_AutonomousProxy)
+	{
+		ApplyInputTimeDilation(1.f + InputTimeDilation / 1000.f);
+	}
+
+	if (!VisualOffset.IsZero())
+	{
+		const float HalfLife = MesaMovementComponentCVars::SmoothingHalfLife;
+		VisualOffset *= HalfLife > 0.f ? FMath::Exp2(-DeltaTime / HalfLife) : 0.f;
+		if (VisualOffset.SizeSquared() < FMath::Square(0.1))
+		{
+			VisualOffset = FVector::ZeroVector;
+		}
+
+		ApplyVisualOffset();
+	}
+}
+
+void UMesaMovementComponent::PreReplication(IRepChangedPropertyTracker& ChangedPropertyTracker)
+{
+	Super::PreReplication(ChangedPropertyTracker);
+
+	if (GetOwnerRole() != ROLE_Authority || !ActiveMovementSimulation)
+	{
+		return;
+	}
+
+	// Private to UNetworkPredictionComponent, so DOREPLIFETIME_ACTIVE_OVERRIDE can't name it. Same thing by hand.
+	static FProperty* SimulatedProxyProperty = []()
+	{
+		FProperty* Property = FindFProperty<FProperty>(UNetworkPredictionComponent::StaticClass(), TEXT("ReplicationProxy_Simulated"));
+		if (!Property)
+		{
+			UE_LOG(LogMesa, Warning, TEXT("UMesaMovementComponent: UNetworkPredictionComponent has no ReplicationProxy_Simulated, dead reckoning is off and every state is sent"));
+		}
+		return Property;
+	}();
+
+	if (SimulatedProxyProperty)
+	{
+		const bool bSend = ActiveMovementSimulation->ShouldSendToSimulatedProxies(GetWorld()->GetTimeSeconds());
+		ChangedPropertyTracker.SetCustomIsActiveOverride(this, SimulatedProxyProperty->RepIndex, bSend);
+	}
+
+	const FMesaInputReceiver& InputReceiver = ActiveMovementSimulation->GetInputReceiver();
+	InputTimeDilation = InputReceiver.bHasArrival ? (int8)FMath::Clamp(FMath::RoundToInt32((InputReceiver.TimeDilation - 1.f) * 1000.f), -100, 100) : 0;
+}
+
+void UMesaMovementComponent::GetLifetimeReplicatedProps(TArray<FLifetimeProperty>& OutLifetimeProps) const
+{
+	Super::GetLifetimeReplicatedProps(OutLifetimeProps);
+
+	DOREPLIFETIME_CONDITION(UMesaMovementComponent, InputTimeDilation, COND_OwnerOnly);
+}
+
+void UMesaMovementComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (GetOwnerRole() == ROLE_AutonomousProxy)
+	{
+		ApplyInputTimeDilation(1.f);
+	}
+
+	Super::EndPlay(EndPlayReason);
+}
+
+void UMesaMovementComponent::ProcessEvent(UFunction* Function, void* Parms)
+{
+	// NP deserializes the commands inside its input RPC, before buffering them, so this is when they arrive.
+	static const FName ServerInputFunctionName(TEXT("ServerReceiveClientInput"));
+	if (ActiveMovementSimulation && Function->GetFName() == ServerInputFunctionName)
+	{
+		TGuardValue<FMesaInputReceiver*> ArrivingGuard(FMesaInputReceiver::Arriving, &ActiveMovementSimulation->GetInputReceiver());
+		Super::ProcessEvent(Function, Parms);
+		return;
+	}
+
+	Super::ProcessEvent(Function, Parms);
+}
+
+void UMesaMovementComponent::ApplyInputTimeDilation(float TimeDilation)
+{
+	// NP steps the local sim by the world's dilated delta and has no rate of its own, so the world clock is the only
+	// one to bend, by at most MesaNet.InputBuffer.MaxDilation. DemoPlayTimeDilation is the one factor of the effective
+	// dilation that isn't replicated or owned by gameplay, it's only touched by replay playback, where there is no
+	// server to steer towards. Anything that has to track the server, like the net clock, runs on real time instead.
+	if (AWorldSettings* WorldSettings = GetWorld() ? GetWorld()->GetWorldSettings() : nullptr)
+	{
+		WorldSettings->DemoPlayTimeDilation = TimeDilation;
+	}
+}
+
+static FAutoConsoleCommand CmdInputBuffer(
+	TEXT("MesaNet.InputBuffer"),
+	TEXT("Prints every client's server side input buffer: depth, jitter, target, starvations, overflows and the time dilation sent back."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		for (TObjectIterator<UMesaMovementComponent> It; It; ++It)
+		{
+			It->LogInputBuffer();
+		}
+	})
+);
+
+void UMesaMovementComponent::LogInputBuffer() const
+{
+	const AActor* Owner = GetOwner();
+	if (!Owner || Owner->GetLocalRole() != ROLE_Authority || Owner->GetRemoteRole() != ROLE_AutonomousProxy || !ActiveMovementSimulation)
+	{
+		return;
+	}
+
+	const UNetConnection* Connection = Owner->GetNetConnection();
+	const FMesaInputReceiver& Receiver = ActiveMovementSimulation->GetInputReceiver();
+
+	UE_LOG(LogMesa, Display, TEXT("MesaNet.InputBuffer: %s (%s) depth %d, smoothed %.2f, jitter %.2f, target %.2f, %u starvations, %u overflows, dilation %.3f"),
+		*Owner->GetName(), Connection ? *Connection->LowLevelGetRemoteAddress(true) : TEXT("no connection"),
+		Receiver.Depth, Receiver.SmoothedDepth, Receiver.DepthJitter, Receiver.TargetDepth, Receiver.Starvations, Receiver.Overflows, Receiver.TimeDilation);
+}
+
+void UMesaMovementComponent::UpdateProxyLOD()
+{
+	using namespace MesaMovementComponentCVars;
+
+	EMesaProxyLOD NewLOD = EMesaProxyLOD::ForwardPredict;
+
+	const APlayerController* LocalController = GEngine ? GEngine->GetFirstLocalPlayerController(GetWorld()) : nullptr;
+	const bool bInteracting = GFrameCounter - ActiveMovementSimulation->GetLastContactFrame() <= (uint64)FMath::Max(LODInteractionFrames, 0);
+
+	if (ProxyLOD && LocalController && LocalController->PlayerCameraManager && !bInteracting)
+	{
+		// A little hysteresis so a proxy sitting on a boundary doesn't flip every frame.
+		const EMesaProxyLOD CurrentLOD = ActiveMovementSimulation->GetProxyLOD();
+		const double DistSquared = FVector::DistSquared(LocalController->PlayerCameraManager->GetCameraLocation(), UpdatedComponent->GetComponentLocation());
+		const double ForwardDistance = LODForwardDistance * (CurrentLOD == EMesaProxyLOD::ForwardPredict ? 1.1 : 1.0);
+		const double FarDistance = LODFarDistance * (CurrentLOD == EMesaProxyLOD::Far ? 0.9 : 1.0);
+
+		if (DistSquared > FMath::Square(FarDistance))
+		{
+			NewLOD = EMesaProxyLOD::Far;
+		}
+		else if (DistSquared > FMath::Square(ForwardDistance))
+		{
+			NewLOD = EMesaProxyLOD::Extrapolate;
+		}
+	}
+
+	if (NewLOD != ActiveMovementSimulation->GetProxyLOD() || !bProxyLODSet)
+	{
+		ActiveMovementSimulation->SetProxyLOD(NewLOD);
+		bProxyLODSet = true;
+	}
+}
+
+void UMesaMovementComponent::SetSmoothedComponent(USceneComponent* NewSmoothedComponent)
+{
+	if (SmoothedComponent)
+	{
+		SmoothedComponent->SetRelativeLocation(SmoothedComponentLocation);
+	}
+
+	SmoothedComponent = NewSmoothedComponent;
+	SmoothedComponentLocation = SmoothedComponent ? SmoothedComponent->GetRelativeLocation() : FVector::ZeroVector;
+	VisualOffset = FVector::ZeroVector;
+}
+
+void UMesaMovementComponent::ApplyVisualOffset()
+{
+	if (SmoothedComponent && UpdatedComponent)
+	{
+		const FVector LocalOffset = UpdatedComponent->GetComponentTransform().InverseTransformVectorNoScale(VisualOffset);
+		SmoothedComponent->SetRelativeLocation(SmoothedComponentLocation + LocalOffset, false, nullptr, ETeleportType::TeleportPhysics);
+	}
 }
 
 void UMesaMovementComponent::ProduceInput(const int32 DeltaTimeMS, FMesaMovementInputCmd* Cmd)
 {
 	// This isn't ideal. It probably makes sense for the component to do all the input binding rather.
 	ProduceInputDelegate.ExecuteIfBound(DeltaTimeMS, *Cmd);
+	Cmd->Quantize();
+	Cmd->StepMS = (uint8)FMath::Clamp(DeltaTimeMS, 0, (int32)MAX_uint8);
+
+	const int32 NumRedundant = FMath::Clamp(MesaMovementComponentCVars::InputRedundancy, 0, FMesaMovementInputCmd::MaxRedundant);
+	Cmd->Sequence = NextCommandSequence++;
+	Cmd->Redundant.Reset();
+	Cmd->Redundant.Append(RecentCommands.GetData(), FMath::Min(RecentCommands.Num(), NumRedundant));
+
+	FMesaRedundantCommand Sent;
+	Sent.Command = Cmd->Pack();
+	Sent.StepMS = Cmd->StepMS;
+	RecentCommands.Insert(Sent, 0);
+	RecentCommands.SetNum(FMath::Min(RecentCommands.Num(), FMesaMovementInputCmd::MaxRedundant), false);
 }
 
 void UMesaMovementComponent::RestoreFrame(const FMesaMovementSyncState* SyncState, const FMesaMovementAuxState* AuxState)
 {
-	FTransform Transform(SyncState->Rotation.Quaternion(), SyncState->Location, UpdatedComponent->GetComponentTransform().GetScale3D() );
-	UpdatedComponent->SetWorldTransform(Transform, false, nullptr, ETeleportType::TeleportPhysics);
-	UpdatedComponent->ComponentVelocity = SyncState->Velocity;
+	if (ActiveMovementSimulation)
+	{
+		ActiveMovementSimulation->BeginRollback(*SyncState);
+		ActiveMovementSimulation->BeginCorrection(UpdatedComponent->GetComponentLocation());
+	}
+
+	// Resimulate on the ghost, FinalizeFrame writes the component once we know where it ends up.
+	if (MesaMovementComponentCVars::GhostRollback && ActiveMovementSimulation)
+	{
+		ActiveMovementSimulation->BeginGhost(FTransform(SyncState->Rotation.Quaternion(), SyncState->Location, UpdatedComponent->GetComponentTransform().GetScale3D()));
+		return;
+	}
+
+	WriteComponentTransform(SyncState);
 }
 
 void UMesaMovementComponent::FinalizeFrame(const FMesaMovementSyncState* SyncState, const FMesaMovementAuxState* AuxState)
 {
+	if (ActiveMovementSimulation)
+	{
+		ActiveMovementSimulation->EndGhost();
+
+		FVector Correction;
+		if (ActiveMovementSimulation->ConsumeCorrection(Correction) && !Correction.IsNearlyZero())
+		{
+			// Keep the mesh where it was drawn and let TickComponent blend it onto the corrected location.
+			// Snap tier corrections, or offsets that have piled up that far, are shown as they are.
+			const FVector NewOffset = VisualOffset - Correction;
+			const bool bSmooth = SmoothedComponent && MesaMovementComponentCVars::SmoothingHalfLife > 0.f
+				&& FMesaMovementSimulation::ClassifyError(NewOffset, SyncState->Velocity) != EMesaReconcileTier::Snap;
+
+			VisualOffset = bSmooth ? NewOffset : FVector::ZeroVector;
+
+			FMesaReconcileStats& Stats = FMesaReconcileStats::Get();
+			++Stats.Resims;
+			++(bSmooth ? Stats.Smoothed : Stats.Snaps);
+
+			ApplyVisualOffset();
+		}
+	}
+
+	if (LagCompensationSubsystem)
+	{
+		LagCompensationSubsystem->RecordPawn(LagCompensationIndex, SyncState->Location, SyncState->Rotation.Yaw, Cast<UCapsuleComponent>(UpdatedComponent));
+	}
+
 	// The component will often be in the "right place" already on FinalizeFrame, so a comparison check makes sense before setting it.
 	if (UpdatedComponent->GetComponentLocation().Equals(SyncState->Location) == false || UpdatedComponent->GetComponentQuat().Rotator().Equals(SyncState->Rotation, FMesaMovementSimulation::ROTATOR_TOLERANCE) == false)
 	{
-		RestoreFrame(SyncState, AuxState);
+		WriteComponentTransform(SyncState);
 	}
 }
 
+void UMesaMovementComponent::WriteComponentTransform(const FMesaMovementSyncState* SyncState)
+{
+	FTransform Transform(SyncState->Rotation.Quaternion(), SyncState->Location, UpdatedComponent->GetComponentTransform().GetScale3D() );
+	UpdatedComponent->SetWorldTransform(Transform, false, nullptr, ETeleportType::TeleportPhysics);
+	UpdatedComponent->ComponentVelocity = SyncState->Velocity;
+}
+
 void UMesaMovementComponent::InitializeSimulationState(FMesaMovementSyncState* Sync, FMesaMovementAuxState* Aux)
 {
 	npCheckSlow(UpdatedComponent);
@@ -13,6 +13,7 @@ struct FMesaMovementInputCmd;
 struct FMesaMovementSyncState;
 struct FMesaMovementAuxState;
 class FMesaMovementSimulation;
+class UMesaLagCompensationSubsystem;
 
 /*
 	Base Component for Game Movement designed to be a lightweight VR alternative to CMC.
@@ -34,9 +35,23 @@ public:
 	virtual void OnRegister() override;
 	virtual void RegisterComponentTickFunctions(bool bRegister) override;
 
+	// Holds back the simulated proxy state while proxies can dead reckon it (MesaMovement.DeadReckoning).
+	virtual void PreReplication(IRepChangedPropertyTracker& ChangedPropertyTracker) override;
+	virtual void GetLifetimeReplicatedProps(TArray<FLifetimeProperty>& OutLifetimeProps) const override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	// Tells the input buffer which client the commands inside NP's input RPC came from.
+	virtual void ProcessEvent(UFunction* Function, void* Parms) override;
+
 	// Used by NetworkPrediction driver for physics interpolation case
 	UPrimitiveComponent* GetPhysicsPrimitiveComponent() const { return UpdatedPrimitive; }
 
+	// Child of the UpdatedComponent that carries the visual offset left by smoothed corrections, usually the mesh.
+	void SetSmoothedComponent(USceneComponent* NewSmoothedComponent);
+
+	// Server. Logs this client's input buffer, see MesaNet.InputBuffer.
+	void LogInputBuffer() const;
+
 protected:
 
 	// Basic "Update Component/Ticking"
@@ -73,6 +88,42 @@ public:
 
 protected:
 
+	// Teleports the UpdatedComponent to a sync state.
+	void WriteComponentTransform(const FMesaMovementSyncState* SyncState);
+
+	// Places the SmoothedComponent at its rest location plus VisualOffset.
+	void ApplyVisualOffset();
+
+	// Simulated proxies. Forward predicts anything near the local view or recently touched by another pawn, steps the
+	// rest without collision, at a low rate past MesaMovement.LOD.FarDistance.
+	void UpdateProxyLOD();
+	bool bProxyLODSet = false;
+
+	UPROPERTY(Transient)
+	USceneComponent* SmoothedComponent = nullptr;
+
+	FVector SmoothedComponentLocation = FVector::ZeroVector;	// Relative location when it was set.
+	FVector VisualOffset = FVector::ZeroVector;					// World space, decays in TickComponent.
+
+	// Last commands produced, newest first, for the redundant tail of the next one (MesaMovement.InputRedundancy).
+	TArray<FMesaRedundantCommand> RecentCommands;
+	uint16 NextCommandSequence = 1;
+
+	// Server to owning client. How fast the client should run its clock to keep the server's input buffer on target,
+	// in tenths of a percent off 1. See FMesaInputReceiver.
+	UPROPERTY(Transient, Replicated)
+	int8 InputTimeDilation = 0;
+
+	// Autonomous proxy. Runs the world at the rate the server asked for.
+	void ApplyInputTimeDilation(float TimeDilation);
+
+	// Server. Slot in the lag compensation history, FinalizeFrame records the capsule there.
+	friend class UMesaLagCompensationSubsystem;
+	int32 LagCompensationIndex = INDEX_NONE;
+
+	UPROPERTY(Transient)
+	UMesaLagCompensationSubsystem* LagCompensationSubsystem = nullptr;
+
 	// Network Prediction
 	virtual void InitializeNetworkPredictionProxy();
 	TPimplPtr<FMesaMovementSimulation> OwnedMovementSimulation; // If we instantiate the sim in InitializeNetworkPredictionProxy, its stored here
@@ -95,8 +146,4 @@ private:
 
 	UPROPERTY(Transient)
 	UCapsuleComponent*	OwnerCapsule 		= nullptr;
-
-	FHitResult			GroundTrace;
-	EMovementType 		MovementType 		= EMovementType::Falling;
-	bool				bPendingJump 		= false;
 };
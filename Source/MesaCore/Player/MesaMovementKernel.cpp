@@ -0,0 +1,113 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMovementKernel.h"
+#include "MesaCoreMacros.h"
+
+#include "HAL/IConsoleManager.h"
+
+namespace MesaGroundCVars
+{
+	static int32 GroundCache = 1;
+	static FAutoConsoleVariableRef CVarGroundCache(
+		TEXT("MesaMovement.GroundCache"),
+		GroundCache,
+		TEXT("Take ground state from the previous tick's movement sweeps when they are conclusive, instead of probing every tick."),
+		ECVF_Default
+	);
+
+	static int32 GroundCacheMaxAge = 8;
+	static FAutoConsoleVariableRef CVarGroundCacheMaxAge(
+		TEXT("MesaMovement.GroundCacheMaxAge"),
+		GroundCacheMaxAge,
+		TEXT("Probe anyway after this many ticks on cached ground state (max 15). Catches floors that move out from under a stationary pawn."),
+		ECVF_Default
+	);
+}
+
+FMesaGroundStats& FMesaGroundStats::Get()
+{
+	static FMesaGroundStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdGroundStats(
+	TEXT("MesaMovement.GroundStats"),
+	TEXT("Prints how many ground probes were made, how many were avoided through the ground cache and how many walking moves stepped down. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaGroundStats& Stats = FMesaGroundStats::Get();
+		const uint64 Total = Stats.Probes + Stats.Avoided;
+
+		// Step downs are sweeps too, they replace the walking probe rather than come for free.
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.GroundStats: %llu ground checks, %llu probed, %llu avoided (%.1f%%), %llu walking step downs"),
+			Total, Stats.Probes, Stats.Avoided, Total > 0 ? 100.0 * Stats.Avoided / Total : 0.0, Stats.StepDowns);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaGroundStats();
+		}
+	})
+);
+
+void MesaPMove::CategorizePosition(FMesaPMoveState& State, IMesaMoveCollision& Collision)
+{
+	FMesaGroundState& Ground = State.Ground;
+	FMesaGroundStats& Stats = FMesaGroundStats::Get();
+
+	const FVector Location = Collision.GetLocation();
+
+	if (MesaGroundCVars::GroundCache
+		&& Ground.Contact != EMesaGroundContact::Unknown
+		&& Ground.Age < FMath::Min<int32>(MesaGroundCVars::GroundCacheMaxAge, FMesaGroundState::MaxAge)
+		&& Ground.Location.Equals(Location, KINDA_SMALL_NUMBER))
+	{
+		++Ground.Age;
+		++Stats.Avoided;
+		State.MovementType = Ground.Contact == EMesaGroundContact::Ground ? EMovementType::Walking : EMovementType::Falling;
+		return;
+	}
+
+	++Stats.Probes;
+
+	// Steep hits are walls and surf ramps, standing on them would apply ground friction.
+	FMesaMoveHit GroundHit;
+	const bool bOnGround = Collision.ProbeGround(GroundHit) && GroundHit.Normal.Z >= MesaMovementConfig::MinWalkableNormalZ;
+
+	Ground.Normal = bOnGround ? GroundHit.Normal : FVector::ZeroVector;
+	Ground.Distance = bOnGround ? GroundHit.Time * MesaMovementConfig::GroundProbeDistance : 0.f;
+	Ground.Location = Location;
+	Ground.Contact = bOnGround ? EMesaGroundContact::Ground : EMesaGroundContact::Air;
+	Ground.Age = 0;
+
+	State.MovementType = bOnGround ? EMovementType::Walking : EMovementType::Falling;
+}
+
+void MesaPMove::UpdateGroundFromMove(FMesaGroundState& Ground, const FVector& Delta, const FMesaMoveHit& GroundHit, const FVector& EndLocation)
+{
+	const bool bHitWalkable = GroundHit.IsValidBlockingHit() && GroundHit.Normal.Z >= MesaMovementConfig::MinWalkableNormalZ;
+
+	if (bHitWalkable && Delta.Z <= 0.f)
+	{
+		// Swept into something we can stand on.
+		Ground.Normal = GroundHit.Normal;
+		Ground.Distance = 0.f;
+		Ground.Contact = EMesaGroundContact::Ground;
+		Ground.Age = 0;
+	}
+	else if (Delta.Z != 0.f && !bHitWalkable)
+	{
+		// Moving vertically and nothing caught us, rising or free falling.
+		Ground.Normal = FVector::ZeroVector;
+		Ground.Distance = 0.f;
+		Ground.Contact = EMesaGroundContact::Air;
+		Ground.Age = 0;
+	}
+	else if (!Delta.IsNearlyZero(1e-6f))
+	{
+		// Horizontal move that didn't step down, flying, could have gone off an edge.
+		Ground.Contact = EMesaGroundContact::Unknown;
+	}
+
+	// A move that didn't go anywhere keeps whatever contact we had, up to GroundCacheMaxAge.
+	Ground.Location = EndLocation;
+}
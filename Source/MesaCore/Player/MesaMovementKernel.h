@@ -0,0 +1,503 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaMovementTypes.h"
+
+#define QUAKESTYLE		0
+
+namespace MesaMovementConfig
+{
+	const float MovementSpeed 		= 500.f;
+	const float Gravity 			= 800.f;
+	const float StopSpeed 			= 100.f;
+	const float Acceleration 		= 10.f;
+	const float AirAcceleration 	= 1.f;
+	const float FlightAcceleration	= 8.f;
+	const float Friction 			= 6.f;
+	const float FlightFriction 		= 3.f;
+	const float JumpSpeed 			= 350.f;
+	const float MinWalkableNormalZ	= 0.7f;		// Anything steeper is a wall or a surf ramp, never ground.
+	const float GroundProbeDistance	= 1.f;
+	const float MaxNetSpeed			= 8192.f;	// Per axis velocity the sync state can carry, faster is clamped on the wire.
+}
+
+/*
+	PMove Kernel.
+	The pure math half of the movement simulation, kept free of UObjects, worlds and scene queries so it can be
+	ticked headless (benchmarks, automation, batching). Anything that needs to touch collision goes through
+	IMesaMoveCollision, which FMesaMovementSimulation implements on top of its UpdatedComponent.
+*/
+
+// Minimal hit description passed back from the collision layer. Mirrors the few FHitResult fields the kernel reads.
+struct FMesaMoveHit
+{
+	FVector Normal = FVector::ZeroVector;
+	float Time = 1.f;
+	bool bBlockingHit = false;
+	bool bStartPenetrating = false;
+
+	bool IsValidBlockingHit() const { return bBlockingHit && !bStartPenetrating; }
+};
+
+// Narrow collision interface the kernel moves through. The implementation owns the shape and its location.
+class IMesaMoveCollision
+{
+public:
+
+	virtual ~IMesaMoveCollision() = default;
+
+	// Sweep the shape by Delta, resolving any initial penetration, leaving it wherever the sweep stopped.
+	virtual void Sweep(const FVector& Delta, const FQuat& Rotation, FMesaMoveHit& OutHit) = 0;
+
+	// True if the shape placed at Location would overlap blocking geometry.
+	virtual bool Overlap(const FVector& Location, const FQuat& Rotation) const = 0;
+
+	// Probe for ground directly beneath the shape. Returns true if standing on something.
+	virtual bool ProbeGround(FMesaMoveHit& OutHit) = 0;
+
+	virtual FVector GetLocation() const = 0;
+};
+
+enum class EMesaGroundContact : uint8
+{
+	Unknown,	// Nothing the last move did tells us, needs a probe.
+	Ground,
+	Air
+};
+
+/*
+	Ground contact carried from one tick to the next. The collision phase already sweeps into the floor when we
+	land, and sweeps freely through the air when we jump or fall, so most ticks can take their ground state from the
+	previous tick's sweeps instead of probing again. Walking moves are flat, so they sweep down a little at the end
+	(MesaPMove::StepDown) to say either way. Anything else that can't, like flying sideways, leaves it Unknown.
+
+	Only trusted while we are still where the collision phase left us, so rollback and teleports fall back to a probe.
+*/
+struct FMesaGroundState
+{
+	// Age is replicated in 4 bits, GroundCacheMaxAge is clamped to this.
+	static constexpr uint8 MaxAge = 15;
+
+	FVector				Normal		= FVector::ZeroVector;
+	FVector				Location	= FVector::ZeroVector;
+	float				Distance	= 0.f;	// Gap to the ground below, only meaningful with Contact == Ground.
+	EMesaGroundContact	Contact		= EMesaGroundContact::Unknown;
+	uint8				Age			= 0;	// Ticks reused since the last real probe.
+};
+
+// Everything the velocity phase reads and writes for a single pawn.
+struct FMesaPMoveState
+{
+	FRotator		PlayerRotation	= FRotator::ZeroRotator;
+	FVector			MovementInput	= FVector::ZeroVector;
+	FVector			Velocity		= FVector::ZeroVector;
+	EMovementType	MovementType	= EMovementType::Falling;
+	bool			bPendingJump	= false;
+	FMesaGroundState Ground;
+};
+
+// Ground probes made vs avoided through FMesaGroundState, game thread only. See MesaMovement.GroundStats.
+struct FMesaGroundStats
+{
+	uint64 Probes = 0;
+	uint64 Avoided = 0;
+	uint64 StepDowns = 0;	// Walking moves that swept down after themselves, see MesaPMove::StepDown.
+
+	static MESACORE_API FMesaGroundStats& Get();
+};
+
+namespace MesaPMove
+{
+	inline bool IsExceedingMaxSpeed(const FVector& Velocity, float InMaxSpeed)
+	{
+		InMaxSpeed = FMath::Max(0.f, InMaxSpeed);
+		const float MaxSpeedSquared = FMath::Square(InMaxSpeed);
+
+		// Allow 1% error tolerance, to account for numeric imprecision.
+		const float OverVelocityPercent = 1.01f;
+		return (Velocity.SizeSquared() > MaxSpeedSquared * OverVelocityPercent);
+	}
+
+	// Handles user acceleration input (Quake 2 Style Acceleration)
+	inline void Accelerate(FVector& Velocity, float DeltaTime, const FVector& WishDirection, float WishSpeed, float Acceleration)
+	{
+		float AddSpeed, AccelerationSpeed, CurrentSpeed;
+
+		CurrentSpeed = Velocity | WishDirection;					// See if we are changing direction a bit
+		AddSpeed = WishSpeed - CurrentSpeed;						// Reduce wishspeed by the amount of veer.
+		if(AddSpeed <= 0) 											// If not going to add any speed, done.
+		{
+			return;
+		}
+
+		AccelerationSpeed = Acceleration * DeltaTime * WishSpeed;	// Determine amount of acceleration.
+		if(AccelerationSpeed > AddSpeed)							// Cap at addspeed
+		{
+			AccelerationSpeed = AddSpeed;
+		}
+
+		Velocity += AccelerationSpeed * WishDirection;				// Adjust velocity.
+	}
+
+	// QUAKE 3 ARENA STYLE
+	inline void ApplyFrictionQuake(FVector& Velocity, EMovementType MovementType, float DeltaTime)
+	{
+		float Speed, NewSpeed, Control, Drop;
+
+		if(MovementType == EMovementType::Walking)
+		{
+			Velocity.Z = 0.f; // Ignore slope movement.
+		}
+
+		Speed = Velocity.Size(); // Calculate speed.
+		if(Speed < 1.f) // If too slow, return.
+		{
+			Velocity = FVector(FVector2D(0.f), Velocity.Z);
+			return;
+		}
+
+		Drop = 0.f;
+
+		if(MovementType == EMovementType::Walking) // Apply ground friction
+		{
+			Control = Speed < MesaMovementConfig::StopSpeed ? MesaMovementConfig::StopSpeed : Speed;
+			Drop += Control * MesaMovementConfig::Friction * DeltaTime;
+		}
+
+		if(MovementType == EMovementType::Flying)
+		{
+			Drop += Speed * MesaMovementConfig::FlightFriction * DeltaTime;
+		}
+
+		NewSpeed = Speed - Drop; // Scale the velocity
+		if(NewSpeed < 0.f)
+		{
+			NewSpeed = 0.f;
+		}
+		NewSpeed /= Speed;
+		Velocity *= NewSpeed;
+	}
+
+	// SOURCE STYLE
+	inline void ApplyFrictionSource(FVector& Velocity, EMovementType MovementType, float DeltaTime)
+	{
+		float Speed, NewSpeed, Control, Drop;
+		float Friction;
+
+		Speed = Velocity.Size(); 	// Calculate speed.
+		if(Speed < 0.1f) 			// If too slow, return.
+		{
+			return;
+		}
+
+		Drop = 0.f;
+
+		if(MovementType == EMovementType::Walking)
+		{
+			Friction = MesaMovementConfig::Friction;
+
+			// Bleed of some speed, but if we have less than the bleed threshold, bleed the threshold value.
+			Control = (Speed < MesaMovementConfig::StopSpeed) ? MesaMovementConfig::StopSpeed : Speed;
+			Drop += Control * Friction * DeltaTime;
+		}
+
+		NewSpeed = Speed - Drop; 	// Scale the velocity.
+		if(NewSpeed < 0)
+		{
+			NewSpeed = 0;
+		}
+
+		if(NewSpeed != Speed)
+		{
+			NewSpeed /= Speed; 		// Determine proportion of old speed we are using.
+			Velocity *= NewSpeed; 	// Adjust velocity according to proportion.
+		}
+	}
+
+	inline void ApplyFriction(FVector& Velocity, EMovementType MovementType, float DeltaTime)
+	{
+#if QUAKESTYLE
+		ApplyFrictionQuake(Velocity, MovementType, DeltaTime);
+#else
+		ApplyFrictionSource(Velocity, MovementType, DeltaTime);
+#endif
+	}
+
+	inline bool CheckJump(FMesaPMoveState& State)
+	{
+		if(!State.bPendingJump) // We aren't jumping.
+		{
+			return false;
+		}
+
+		State.MovementType = EMovementType::Falling;
+		State.Velocity.Z = MesaMovementConfig::JumpSpeed;
+		return true;
+	}
+
+	inline void AirMove(FMesaPMoveState& State, float DeltaTime)
+	{
+		FVector WishDirection, WishVelocity;
+		float WishSpeed;
+
+		ApplyFriction(State.Velocity, State.MovementType, DeltaTime);
+
+		WishVelocity = State.PlayerRotation.RotateVector(State.MovementInput).GetSafeNormal();
+		WishVelocity.Z = 0.f;
+
+		WishDirection = WishVelocity;
+		WishSpeed = WishDirection.Size();
+		WishDirection.Normalize();
+
+		if(WishSpeed != 0.f)
+		{
+			WishVelocity *= MesaMovementConfig::MovementSpeed / WishSpeed;
+			WishSpeed = MesaMovementConfig::MovementSpeed;
+		}
+
+		Accelerate(State.Velocity, DeltaTime, WishDirection, WishSpeed, MesaMovementConfig::AirAcceleration); // Normal clamps movement to stop doubling.
+
+		// Base Velocity can be used for standing on treadmills ect.
+		// Velocity += BaseVelocity;
+
+		// Apply Gravity, we don't use UMovementComponent::GetGravityZ because it expects players to have the
+		// same gravity as Physics Objects (Feels bad), However this means Physics Volumes don't affect Players.
+		State.Velocity.Z -= MesaMovementConfig::Gravity * DeltaTime;
+	}
+
+	inline void WalkMove(FMesaPMoveState& State, float DeltaTime)
+	{
+		FVector WishDirection, WishVelocity;
+		float WishSpeed;
+
+		if(CheckJump(State)) // Check if we initiated a jump & swap to AirMove
+		{
+			AirMove(State, DeltaTime);
+			return;
+		}
+
+		ApplyFriction(State.Velocity, State.MovementType, DeltaTime);
+
+		// ClipVelocty here should project the forward and right directions onto the ground plane
+		// however I think we can just use FMath's vector projection here. We want to project our
+		// movement to the floor for walking up and down ramps.
+
+		WishVelocity = State.PlayerRotation.RotateVector(State.MovementInput).GetSafeNormal(); // Normalize clamps input to stop doubling while holding W + A ect.
+		WishVelocity.Z = 0.f;
+
+		WishDirection = WishVelocity;
+		WishSpeed = WishDirection.Size();
+
+		if(WishSpeed != 0.f)
+		{
+			WishVelocity *= MesaMovementConfig::MovementSpeed / WishSpeed;
+			WishSpeed = MesaMovementConfig::MovementSpeed;
+		}
+
+		State.Velocity.Z = 0;
+		Accelerate(State.Velocity, DeltaTime, WishDirection, WishSpeed, MesaMovementConfig::Acceleration);
+		State.Velocity.Z = 0;
+
+		// Base Velocity can be used for standing on treadmills ect.
+		// Velocity += BaseVelocity;
+
+		if(State.Velocity.Size() < 1.f) // Nullify Velocity if it's nearly dead. (Probably not necessary)
+		{
+			State.Velocity = FVector::ZeroVector;
+		}
+	}
+
+	inline void FlyMove(FMesaPMoveState& State, float DeltaTime)
+	{
+		ApplyFriction(State.Velocity, State.MovementType, DeltaTime);
+		Accelerate(State.Velocity, DeltaTime, State.PlayerRotation.RotateVector(State.MovementInput).GetSafeNormal(), MesaMovementConfig::MovementSpeed, MesaMovementConfig::FlightAcceleration); // Normal clamps movement to stop doubling.
+	}
+
+	// Velocity phase: friction, acceleration, jumping and gravity for the current movement type. No collision.
+	inline void UpdateVelocity(FMesaPMoveState& State, float DeltaTime)
+	{
+		switch(State.MovementType) // Select Movetype
+		{
+			case EMovementType::Walking:
+				WalkMove(State, DeltaTime);
+				break;
+			case EMovementType::Falling:
+				AirMove(State, DeltaTime);
+				break;
+			case EMovementType::Flying:
+				FlyMove(State, DeltaTime);
+				break;
+		}
+	}
+
+	// Pick the movement type, from the ground state the last move left behind if it can be trusted, else a probe.
+	MESACORE_API void CategorizePosition(FMesaPMoveState& State, IMesaMoveCollision& Collision);
+
+	// Derive the next tick's ground state from this tick's collision phase. GroundHit is the most upward facing hit.
+	MESACORE_API void UpdateGroundFromMove(FMesaGroundState& Ground, const FVector& Delta, const FMesaMoveHit& GroundHit, const FVector& EndLocation);
+
+	// Keep whichever blocking hit faces up the most, that's the one that can tell us we landed.
+	inline void AccumulateGroundHit(FMesaMoveHit* GroundHit, const FMesaMoveHit& Hit)
+	{
+		if (GroundHit && Hit.IsValidBlockingHit() && (!GroundHit->bBlockingHit || Hit.Normal.Z > GroundHit->Normal.Z))
+		{
+			*GroundHit = Hit;
+		}
+	}
+
+	inline FVector ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal)
+	{
+		// Commented out original plane project, which is the original way that UE handles movement
+		// against surfaces, you end up being clamped if you walk into a wall which breaks surfing.
+		// return (FVector::VectorPlaneProject(Delta, Normal) * Time;
+
+		// Normalize Plane Projected Delta, then Multiply it by Speed
+		return (FVector::VectorPlaneProject(Delta, Normal).GetSafeNormal() * Delta.Size()) * Time;
+	}
+
+	inline void TwoWallAdjust(FVector& OutDelta, const FMesaMoveHit& Hit, const FVector& OldHitNormal)
+	{
+		FVector Delta = OutDelta;
+		const FVector HitNormal = Hit.Normal;
+
+		if ((OldHitNormal | HitNormal) <= 0.f) //90 or less corner, so use cross product for direction
+		{
+			const FVector DesiredDir = Delta;
+			FVector NewDir = (HitNormal ^ OldHitNormal);
+			NewDir = NewDir.GetSafeNormal();
+			Delta = (Delta | NewDir) * (1.f - Hit.Time) * NewDir;
+			if ((DesiredDir | Delta) < 0.f)
+			{
+				Delta = -1.f * Delta;
+			}
+		}
+		else //adjust to new wall
+		{
+			const FVector DesiredDir = Delta;
+			Delta = ComputeSlideVector(Delta, 1.f - Hit.Time, HitNormal);
+			if ((Delta | DesiredDir) <= 0.f)
+			{
+				Delta = FVector::ZeroVector;
+			}
+			else if ( FMath::Abs((HitNormal | OldHitNormal) - 1.f) < KINDA_SMALL_NUMBER )
+			{
+				// we hit the same wall again even after adjusting to move along it the first time
+				// nudge away from it (this can happen due to precision issues)
+				Delta += HitNormal * 0.01f;
+			}
+		}
+
+		OutDelta = Delta;
+	}
+
+	inline float SlideAlongSurface(IMesaMoveCollision& Collision, const FVector& Delta, float Time, const FQuat& Rotation, const FVector Normal, FMesaMoveHit& Hit, FMesaMoveHit* GroundHit = nullptr)
+	{
+		if (!Hit.bBlockingHit)
+		{
+			return 0.f;
+		}
+
+		float PercentTimeApplied = 0.f;
+		const FVector OldHitNormal = Normal;
+
+		FVector SlideDelta = ComputeSlideVector(Delta, Time, Normal);
+
+		if ((SlideDelta | Delta) > 0.f)
+		{
+			Collision.Sweep(SlideDelta, Rotation, Hit);
+			AccumulateGroundHit(GroundHit, Hit);
+
+			const float FirstHitPercent = Hit.Time;
+			PercentTimeApplied = FirstHitPercent;
+			if (Hit.IsValidBlockingHit())
+			{
+				// Compute new slide normal when hitting multiple surfaces.
+				TwoWallAdjust(SlideDelta, Hit, OldHitNormal);
+
+				// Only proceed if the new direction is of significant length and not in reverse of original attempted move.
+				if (!SlideDelta.IsNearlyZero(1e-3f) && (SlideDelta | Delta) > 0.f)
+				{
+					// Perform second move
+					Collision.Sweep(SlideDelta, Rotation, Hit);
+					AccumulateGroundHit(GroundHit, Hit);
+					const float SecondHitPercent = Hit.Time * (1.f - FirstHitPercent);
+					PercentTimeApplied += SecondHitPercent;
+				}
+			}
+
+			return FMath::Clamp(PercentTimeApplied, 0.f, 1.f);
+		}
+
+		return 0.f;
+	}
+
+	// Collision phase: sweep the full delta, then slide the remainder along whatever we hit.
+	inline void SlideMove(IMesaMoveCollision& Collision, const FVector& Delta, const FQuat& Rotation, FMesaMoveHit* GroundHit = nullptr)
+	{
+		if (Delta.IsNearlyZero(1e-6f))
+		{
+			return;
+		}
+
+		FMesaMoveHit Hit;
+		Collision.Sweep(Delta, Rotation, Hit);
+		AccumulateGroundHit(GroundHit, Hit);
+
+		if (Hit.IsValidBlockingHit())
+		{
+			// Try to slide the remaining distance along the surface.
+			SlideAlongSurface(Collision, Delta, 1.f - Hit.Time, Rotation, Hit.Normal, Hit, GroundHit);
+		}
+	}
+
+	/**
+	 * Walking moves are flat, so on their own they can't say whether we are still on the ground. Push down by the probe
+	 * distance afterwards, like the end of Q3's StepSlideMove, which keeps us on the floor over small dips and leaves a
+	 * hit for the next tick's ground state instead of a probe. Returns the delta the move and step down add up to.
+	 */
+	inline FVector StepDown(IMesaMoveCollision& Collision, const FVector& Delta, const FQuat& Rotation, FMesaMoveHit& GroundHit)
+	{
+		const bool bFoundGround = GroundHit.IsValidBlockingHit() && GroundHit.Normal.Z >= MesaMovementConfig::MinWalkableNormalZ;
+		if (Delta.Z != 0.f || Delta.IsNearlyZero(1e-6f) || bFoundGround)
+		{
+			return Delta;
+		}
+
+		const FVector Down(0.f, 0.f, -MesaMovementConfig::GroundProbeDistance);
+		FMesaMoveHit Hit;
+		Collision.Sweep(Down, Rotation, Hit);
+		AccumulateGroundHit(&GroundHit, Hit);
+
+		++FMesaGroundStats::Get().StepDowns;
+		return Delta + Down;
+	}
+
+	// Collision phase plus the ground state it implies for the next tick.
+	inline void SlideMove(FMesaPMoveState& State, IMesaMoveCollision& Collision, const FVector& Delta, const FQuat& Rotation)
+	{
+		FMesaMoveHit GroundHit;
+		SlideMove(Collision, Delta, Rotation, &GroundHit);
+
+		const FVector GroundDelta = State.MovementType == EMovementType::Walking ? StepDown(Collision, Delta, Rotation, GroundHit) : Delta;
+		UpdateGroundFromMove(State.Ground, GroundDelta, GroundHit, Collision.GetLocation());
+	}
+
+	/**
+	 * One full PMove step, in the same order as FMesaMovementSimulation::SimulationTick.
+	 * InOutRotation is the sync rotation; the wish direction is built from the rotation we started the frame with.
+	 * YawInput is the command's turn in degrees, whatever the step, as in FMesaMovementInputCmd.
+	 */
+	inline void Tick(FMesaPMoveState& State, FRotator& InOutRotation, float YawInput, IMesaMoveCollision& Collision, float DeltaSeconds)
+	{
+		State.PlayerRotation = InOutRotation;
+
+		InOutRotation.Yaw += YawInput;
+		InOutRotation.Normalize();
+
+		CategorizePosition(State, Collision);
+		UpdateVelocity(State, DeltaSeconds);
+		SlideMove(State, Collision, State.Velocity * DeltaSeconds, InOutRotation.Quaternion());
+	}
+}
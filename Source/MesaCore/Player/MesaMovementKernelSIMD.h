@@ -0,0 +1,266 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MesaMovementKernel.h"
+
+/*
+	PMove Kernel, SIMD velocity phase.
+	Runs the velocity update (jump, friction, yaw rotation of MovementInput, wish direction, accelerate, gravity)
+	for four pawns at once using UE's VectorRegister, which maps to SSE/NEON and falls back to FPU code on
+	platforms without vector intrinsics.
+
+	Lanes are single precision and branch free, so results track MesaPMove::UpdateVelocity to within float error
+	rather than bit for bit. Only yaw is applied to MovementInput, pawns with pitch or roll must use the scalar kernel.
+*/
+
+struct FMesaPMoveLanes
+{
+	static constexpr int32 Width = 4;
+
+	alignas(16) float VelocityX[Width];
+	alignas(16) float VelocityY[Width];
+	alignas(16) float VelocityZ[Width];
+
+	alignas(16) float InputX[Width];
+	alignas(16) float InputY[Width];
+	alignas(16) float InputZ[Width];
+
+	// PlayerRotation.Yaw in degrees
+	alignas(16) float Yaw[Width];
+
+	EMovementType MovementType[Width];
+	bool bPendingJump[Width];
+
+	void Load(int32 Lane, const FMesaPMoveState& State)
+	{
+		VelocityX[Lane] = (float)State.Velocity.X;
+		VelocityY[Lane] = (float)State.Velocity.Y;
+		VelocityZ[Lane] = (float)State.Velocity.Z;
+		InputX[Lane] = (float)State.MovementInput.X;
+		InputY[Lane] = (float)State.MovementInput.Y;
+		InputZ[Lane] = (float)State.MovementInput.Z;
+		Yaw[Lane] = (float)State.PlayerRotation.Yaw;
+		MovementType[Lane] = State.MovementType;
+		bPendingJump[Lane] = State.bPendingJump;
+	}
+
+	void Store(int32 Lane, FMesaPMoveState& State) const
+	{
+		State.Velocity = FVector(VelocityX[Lane], VelocityY[Lane], VelocityZ[Lane]);
+		State.MovementType = MovementType[Lane];
+	}
+
+	// Pads unused lanes with a resting, inputless pawn so a partial group can still run through the vector path.
+	void Clear(int32 Lane)
+	{
+		Load(Lane, FMesaPMoveState());
+	}
+};
+
+namespace MesaPMoveSIMD
+{
+	struct FLaneMasks
+	{
+		VectorRegister4Float Walking;
+		VectorRegister4Float Falling;
+		VectorRegister4Float Flying;
+	};
+
+	FORCEINLINE VectorRegister4Float LengthSquared(const VectorRegister4Float& X, const VectorRegister4Float& Y, const VectorRegister4Float& Z)
+	{
+		return VectorMultiplyAdd(X, X, VectorMultiplyAdd(Y, Y, VectorMultiply(Z, Z)));
+	}
+
+	// Builds all-ones lane masks from a per lane flag.
+	FORCEINLINE VectorRegister4Float MakeMask(bool A, bool B, bool C, bool D)
+	{
+		return VectorCompareGT(MakeVectorRegisterFloat(A ? 1.f : 0.f, B ? 1.f : 0.f, C ? 1.f : 0.f, D ? 1.f : 0.f), VectorZeroFloat());
+	}
+
+	FORCEINLINE VectorRegister4Float MakeTypeMask(const FMesaPMoveLanes& Lanes, EMovementType Type)
+	{
+		return MakeMask(Lanes.MovementType[0] == Type, Lanes.MovementType[1] == Type, Lanes.MovementType[2] == Type, Lanes.MovementType[3] == Type);
+	}
+
+	FORCEINLINE void ApplyFrictionQuake(VectorRegister4Float& VX, VectorRegister4Float& VY, VectorRegister4Float& VZ, const FLaneMasks& Masks, const VectorRegister4Float& DeltaTime)
+	{
+		const VectorRegister4Float Zero = VectorZeroFloat();
+		VZ = VectorSelect(Masks.Walking, Zero, VZ);
+
+		const VectorRegister4Float Speed = VectorSqrt(LengthSquared(VX, VY, VZ));
+		const VectorRegister4Float TooSlow = VectorCompareLT(Speed, VectorSetFloat1(1.f));
+
+		const VectorRegister4Float Control = VectorMax(Speed, VectorSetFloat1(MesaMovementConfig::StopSpeed));
+		VectorRegister4Float Drop = VectorSelect(Masks.Walking, VectorMultiply(Control, VectorSetFloat1(MesaMovementConfig::Friction)), Zero);
+		Drop = VectorAdd(Drop, VectorSelect(Masks.Flying, VectorMultiply(Speed, VectorSetFloat1(MesaMovementConfig::FlightFriction)), Zero));
+		Drop = VectorMultiply(Drop, DeltaTime);
+
+		const VectorRegister4Float Scale = VectorDivide(VectorMax(VectorSubtract(Speed, Drop), Zero), Speed);
+
+		VX = VectorSelect(TooSlow, Zero, VectorMultiply(VX, Scale));
+		VY = VectorSelect(TooSlow, Zero, VectorMultiply(VY, Scale));
+		VZ = VectorSelect(TooSlow, VZ, VectorMultiply(VZ, Scale));
+	}
+
+	FORCEINLINE void ApplyFrictionSource(VectorRegister4Float& VX, VectorRegister4Float& VY, VectorRegister4Float& VZ, const FLaneMasks& Masks, const VectorRegister4Float& DeltaTime)
+	{
+		const VectorRegister4Float Zero = VectorZeroFloat();
+
+		// Only walking lanes lose speed in Source style friction, and only once above the cutoff.
+		const VectorRegister4Float Speed = VectorSqrt(LengthSquared(VX, VY, VZ));
+		const VectorRegister4Float Apply = VectorBitwiseAnd(Masks.Walking, VectorCompareGE(Speed, VectorSetFloat1(0.1f)));
+
+		const VectorRegister4Float Control = VectorMax(Speed, VectorSetFloat1(MesaMovementConfig::StopSpeed));
+		const VectorRegister4Float Drop = VectorMultiply(VectorMultiply(Control, VectorSetFloat1(MesaMovementConfig::Friction)), DeltaTime);
+		const VectorRegister4Float Scale = VectorDivide(VectorMax(VectorSubtract(Speed, Drop), Zero), Speed);
+
+		VX = VectorSelect(Apply, VectorMultiply(VX, Scale), VX);
+		VY = VectorSelect(Apply, VectorMultiply(VY, Scale), VY);
+		VZ = VectorSelect(Apply, VectorMultiply(VZ, Scale), VZ);
+	}
+
+	template<bool bQuakeStyle>
+	FORCEINLINE void ApplyFriction(FMesaPMoveLanes& Lanes, float DeltaTime)
+	{
+		VectorRegister4Float VX = VectorLoadAligned(Lanes.VelocityX);
+		VectorRegister4Float VY = VectorLoadAligned(Lanes.VelocityY);
+		VectorRegister4Float VZ = VectorLoadAligned(Lanes.VelocityZ);
+
+		FLaneMasks Masks;
+		Masks.Walking = MakeTypeMask(Lanes, EMovementType::Walking);
+		Masks.Falling = MakeTypeMask(Lanes, EMovementType::Falling);
+		Masks.Flying = MakeTypeMask(Lanes, EMovementType::Flying);
+
+		if (bQuakeStyle)
+		{
+			ApplyFrictionQuake(VX, VY, VZ, Masks, VectorSetFloat1(DeltaTime));
+		}
+		else
+		{
+			ApplyFrictionSource(VX, VY, VZ, Masks, VectorSetFloat1(DeltaTime));
+		}
+
+		VectorStoreAligned(VX, Lanes.VelocityX);
+		VectorStoreAligned(VY, Lanes.VelocityY);
+		VectorStoreAligned(VZ, Lanes.VelocityZ);
+	}
+
+	// Vector equivalent of MesaPMove::UpdateVelocity for four pawns.
+	template<bool bQuakeStyle = (QUAKESTYLE != 0)>
+	inline void UpdateVelocity(FMesaPMoveLanes& Lanes, float DeltaTime)
+	{
+		const VectorRegister4Float Zero = VectorZeroFloat();
+		const VectorRegister4Float DT = VectorSetFloat1(DeltaTime);
+		const VectorRegister4Float MovementSpeed = VectorSetFloat1(MesaMovementConfig::MovementSpeed);
+
+		VectorRegister4Float VX = VectorLoadAligned(Lanes.VelocityX);
+		VectorRegister4Float VY = VectorLoadAligned(Lanes.VelocityY);
+		VectorRegister4Float VZ = VectorLoadAligned(Lanes.VelocityZ);
+
+		// --------------------------------------------------------------
+		// Jump: walking lanes with a pending jump become falling lanes.
+		// --------------------------------------------------------------
+		const VectorRegister4Float WasWalking = MakeTypeMask(Lanes, EMovementType::Walking);
+		const VectorRegister4Float Jumping = VectorBitwiseAnd(WasWalking, MakeMask(Lanes.bPendingJump[0], Lanes.bPendingJump[1], Lanes.bPendingJump[2], Lanes.bPendingJump[3]));
+
+		FLaneMasks Masks;
+		Masks.Walking = VectorSelect(Jumping, Zero, WasWalking);
+		Masks.Falling = VectorBitwiseOr(MakeTypeMask(Lanes, EMovementType::Falling), Jumping);
+		Masks.Flying = MakeTypeMask(Lanes, EMovementType::Flying);
+
+		VZ = VectorSelect(Jumping, VectorSetFloat1(MesaMovementConfig::JumpSpeed), VZ);
+
+		for (int32 Lane = 0; Lane < FMesaPMoveLanes::Width; ++Lane)
+		{
+			if (Lanes.MovementType[Lane] == EMovementType::Walking && Lanes.bPendingJump[Lane])
+			{
+				Lanes.MovementType[Lane] = EMovementType::Falling;
+			}
+		}
+
+		// --------------------------------------------------------------
+		// Friction
+		// --------------------------------------------------------------
+		if (bQuakeStyle)
+		{
+			ApplyFrictionQuake(VX, VY, VZ, Masks, DT);
+		}
+		else
+		{
+			ApplyFrictionSource(VX, VY, VZ, Masks, DT);
+		}
+
+		// --------------------------------------------------------------
+		// Wish direction: yaw rotate MovementInput, then safe normalize.
+		// --------------------------------------------------------------
+		VectorRegister4Float SinYaw, CosYaw;
+		const VectorRegister4Float YawRadians = VectorMultiply(VectorLoadAligned(Lanes.Yaw), VectorSetFloat1(PI / 180.f));
+		VectorSinCos(&SinYaw, &CosYaw, &YawRadians);
+
+		const VectorRegister4Float IX = VectorLoadAligned(Lanes.InputX);
+		const VectorRegister4Float IY = VectorLoadAligned(Lanes.InputY);
+		const VectorRegister4Float IZ = VectorLoadAligned(Lanes.InputZ);
+
+		VectorRegister4Float WX = VectorSubtract(VectorMultiply(IX, CosYaw), VectorMultiply(IY, SinYaw));
+		VectorRegister4Float WY = VectorMultiplyAdd(IX, SinYaw, VectorMultiply(IY, CosYaw));
+		VectorRegister4Float WZ = IZ;
+
+		const VectorRegister4Float WishLengthSq = LengthSquared(WX, WY, WZ);
+		const VectorRegister4Float HasWish = VectorCompareGT(WishLengthSq, VectorSetFloat1(SMALL_NUMBER));
+		const VectorRegister4Float InvWishLength = VectorDivide(VectorOneFloat(), VectorSqrt(WishLengthSq));
+		WX = VectorSelect(HasWish, VectorMultiply(WX, InvWishLength), Zero);
+		WY = VectorSelect(HasWish, VectorMultiply(WY, InvWishLength), Zero);
+		WZ = VectorSelect(HasWish, VectorMultiply(WZ, InvWishLength), Zero);
+
+		// Ground and air moves flatten the wish direction, air moves renormalize it afterwards. Flying keeps Z.
+		const VectorRegister4Float Flat = VectorBitwiseOr(Masks.Walking, Masks.Falling);
+		WZ = VectorSelect(Flat, Zero, WZ);
+
+		const VectorRegister4Float FlatLengthSq = LengthSquared(WX, WY, WZ);
+		const VectorRegister4Float FlatLength = VectorSqrt(FlatLengthSq);
+		const VectorRegister4Float Renormalize = VectorBitwiseAnd(Masks.Falling, VectorCompareGT(FlatLengthSq, VectorSetFloat1(SMALL_NUMBER)));
+		const VectorRegister4Float InvFlatLength = VectorDivide(VectorOneFloat(), FlatLength);
+		WX = VectorSelect(Renormalize, VectorMultiply(WX, InvFlatLength), WX);
+		WY = VectorSelect(Renormalize, VectorMultiply(WY, InvFlatLength), WY);
+
+		// Flying always asks for full speed, walking and air only when there is input.
+		VectorRegister4Float WishSpeed = VectorSelect(VectorCompareNE(FlatLength, Zero), MovementSpeed, Zero);
+		WishSpeed = VectorSelect(Masks.Flying, MovementSpeed, WishSpeed);
+
+		// --------------------------------------------------------------
+		// Accelerate
+		// --------------------------------------------------------------
+		VZ = VectorSelect(Masks.Walking, Zero, VZ);
+
+		VectorRegister4Float Acceleration = VectorSelect(Masks.Walking, VectorSetFloat1(MesaMovementConfig::Acceleration), Zero);
+		Acceleration = VectorSelect(Masks.Falling, VectorSetFloat1(MesaMovementConfig::AirAcceleration), Acceleration);
+		Acceleration = VectorSelect(Masks.Flying, VectorSetFloat1(MesaMovementConfig::FlightAcceleration), Acceleration);
+
+		const VectorRegister4Float CurrentSpeed = VectorMultiplyAdd(VX, WX, VectorMultiplyAdd(VY, WY, VectorMultiply(VZ, WZ)));
+		const VectorRegister4Float AddSpeed = VectorSubtract(WishSpeed, CurrentSpeed);
+		VectorRegister4Float AccelerationSpeed = VectorMin(VectorMultiply(VectorMultiply(Acceleration, DT), WishSpeed), AddSpeed);
+		AccelerationSpeed = VectorSelect(VectorCompareGT(AddSpeed, Zero), AccelerationSpeed, Zero);
+
+		VX = VectorMultiplyAdd(AccelerationSpeed, WX, VX);
+		VY = VectorMultiplyAdd(AccelerationSpeed, WY, VY);
+		VZ = VectorMultiplyAdd(AccelerationSpeed, WZ, VZ);
+
+		// --------------------------------------------------------------
+		// Walking: stay flat and kill tiny velocities. Falling: gravity.
+		// --------------------------------------------------------------
+		VZ = VectorSelect(Masks.Walking, Zero, VZ);
+
+		const VectorRegister4Float Dead = VectorBitwiseAnd(Masks.Walking, VectorCompareLT(LengthSquared(VX, VY, VZ), VectorOneFloat()));
+		VX = VectorSelect(Dead, Zero, VX);
+		VY = VectorSelect(Dead, Zero, VY);
+		VZ = VectorSelect(Dead, Zero, VZ);
+
+		VZ = VectorSelect(Masks.Falling, VectorSubtract(VZ, VectorSetFloat1(MesaMovementConfig::Gravity * DeltaTime)), VZ);
+
+		VectorStoreAligned(VX, Lanes.VelocityX);
+		VectorStoreAligned(VY, Lanes.VelocityY);
+		VectorStoreAligned(VZ, Lanes.VelocityZ);
+	}
+}
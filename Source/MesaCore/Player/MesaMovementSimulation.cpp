@@ -2,8 +2,13 @@
 
 #include "MesaMovementSimulation.h"
 #include "System/MesaGameData.h"
+#include "Collision/MesaCollisionSubsystem.h"
+#include "MesaMovementTrace.h"
+#include "MesaMatchRecorder.h"
+#include "MesaCoreMacros.h"
 
 #include "Components/CapsuleComponent.h"
+#include "Engine/NetSerialization.h"
 #include "NetworkPredictionTrace.h"
 #include "DrawDebugHelpers.h"
 
@@ -18,11 +23,272 @@ namespace MesaPawnSimCVars
 	static FAutoConsoleVariableRef CVarErrorTolerance(
 		TEXT("MesaMovement.ErrorTolerance"),
 		ErrorTolerance,
-		TEXT("Location tolerance for reconcile"), 
+		TEXT("Horizontal location error accepted without a resim, before velocity scaling."), 
 		ECVF_Default
 	);
+
+	static float ErrorToleranceZ = 5.f;
+	static FAutoConsoleVariableRef CVarErrorToleranceZ(
+		TEXT("MesaMovement.ErrorToleranceZ"),
+		ErrorToleranceZ,
+		TEXT("Vertical location error accepted without a resim, before velocity scaling. Tighter, feet in the floor show."),
+		ECVF_Default
+	);
+
+	static float ErrorVelocityScale = 0.016f;
+	static FAutoConsoleVariableRef CVarErrorVelocityScale(
+		TEXT("MesaMovement.ErrorVelocityScale"),
+		ErrorVelocityScale,
+		TEXT("Seconds of authority velocity added to each axis budget. A frame of timing slop at speed is a bigger error than at rest."),
+		ECVF_Default
+	);
+
+	static float SnapDistance = 150.f;
+	static FAutoConsoleVariableRef CVarSnapDistance(
+		TEXT("MesaMovement.SnapDistance"),
+		SnapDistance,
+		TEXT("Horizontal correction, before velocity scaling, past which the presentation snaps instead of smoothing."),
+		ECVF_Default
+	);
+
+	static int32 SelectiveRollback = 0;
+	static FAutoConsoleVariableRef CVarSelectiveRollback(
+		TEXT("MesaMovement.SelectiveRollback"),
+		SelectiveRollback,
+		TEXT("On a rollback only resimulate pawns that diverged or touched one that did, the rest replay their stored frames. Needs MesaMovement.GhostRollback 0, a ghosted resim never replays. Off records no history."),
+		ECVF_Default
+	);
+
+	static int32 LODFarInterval = 4;
+	static FAutoConsoleVariableRef CVarLODFarInterval(
+		TEXT("MesaMovement.LOD.FarInterval"),
+		LODFarInterval,
+		TEXT("Frames between steps for far simulated proxies."),
+		ECVF_Default
+	);
+
+	static int32 DeadReckoning = 1;
+	static FAutoConsoleVariableRef CVarDeadReckoning(
+		TEXT("MesaMovement.DeadReckoning"),
+		DeadReckoning,
+		TEXT("Only replicate sync states to simulated proxies when they drift off what the proxies extrapolate, or on a heartbeat."),
+		ECVF_Default
+	);
+
+	static float DeadReckoningThreshold = 16.f;
+	static FAutoConsoleVariableRef CVarDeadReckoningThreshold(
+		TEXT("MesaMovement.DeadReckoning.Threshold"),
+		DeadReckoningThreshold,
+		TEXT("Location error between the real state and the extrapolated one that forces a send."),
+		ECVF_Default
+	);
+
+	static float DeadReckoningThresholdYaw = 5.f;
+	static FAutoConsoleVariableRef CVarDeadReckoningThresholdYaw(
+		TEXT("MesaMovement.DeadReckoning.ThresholdYaw"),
+		DeadReckoningThresholdYaw,
+		TEXT("Yaw error, in degrees, that forces a send."),
+		ECVF_Default
+	);
+
+	static float DeadReckoningHeartbeat = 1.f;
+	static FAutoConsoleVariableRef CVarDeadReckoningHeartbeat(
+		TEXT("MesaMovement.DeadReckoning.Heartbeat"),
+		DeadReckoningHeartbeat,
+		TEXT("Seconds after which a state is sent even if nothing diverged. Bounds how stale a late joining proxy can be."),
+		ECVF_Default
+	);
+
+	static int32 HermiteInterpolation = 1;
+	static FAutoConsoleVariableRef CVarHermiteInterpolation(
+		TEXT("MesaMovement.Interpolation.Hermite"),
+		HermiteInterpolation,
+		TEXT("Interpolate simulated proxies along a cubic Hermite curve through the replicated velocities instead of linearly."),
+		ECVF_Default
+	);
+
+	static float InputBufferSmoothing = 0.05f;
+	static FAutoConsoleVariableRef CVarInputBufferSmoothing(
+		TEXT("MesaNet.InputBuffer.Smoothing"),
+		InputBufferSmoothing,
+		TEXT("Per command weight of the newest sample in the smoothed input buffer depth and jitter."),
+		ECVF_Default
+	);
+
+	static float InputBufferJitterScale = 2.f;
+	static FAutoConsoleVariableRef CVarInputBufferJitterScale(
+		TEXT("MesaNet.InputBuffer.JitterScale"),
+		InputBufferJitterScale,
+		TEXT("Commands of extra target depth per command of measured depth jitter, on top of one. Capped at two in total."),
+		ECVF_Default
+	);
+
+	static float InputBufferGain = 0.01f;
+	static FAutoConsoleVariableRef CVarInputBufferGain(
+		TEXT("MesaNet.InputBuffer.Gain"),
+		InputBufferGain,
+		TEXT("Client time dilation per command the buffer is off its target."),
+		ECVF_Default
+	);
+
+	static float InputBufferMaxDilation = 0.03f;
+	static FAutoConsoleVariableRef CVarInputBufferMaxDilation(
+		TEXT("MesaNet.InputBuffer.MaxDilation"),
+		InputBufferMaxDilation,
+		TEXT("Most a client is asked to speed up or slow down, 0.03 = 3%."),
+		ECVF_Default
+	);
+
+	static int32 InputBufferMaxDepth = 6;
+	static FAutoConsoleVariableRef CVarInputBufferMaxDepth(
+		TEXT("MesaNet.InputBuffer.MaxDepth"),
+		InputBufferMaxDepth,
+		TEXT("Buffered commands past which the input buffer counts as overflowing."),
+		ECVF_Default
+	);
+
+	static float ConvergeHalfLife = 0.15f;
+	static FAutoConsoleVariableRef CVarConvergeHalfLife(
+		TEXT("MesaMovement.ConvergeHalfLife"),
+		ConvergeHalfLife,
+		TEXT("Seconds for an accepted prediction error to halve as it is bled into the following predicted frames. 0 moves it all at once."),
+		ECVF_Default
+	);
+
+	static float ConvergeMinError = 0.25f;
+	static FAutoConsoleVariableRef CVarConvergeMinError(
+		TEXT("MesaMovement.ConvergeMinError"),
+		ConvergeMinError,
+		TEXT("Accepted error left alone. Just above what sync state quantization alone leaves."),
+		ECVF_Default
+	);
+
+	static float SnapDistanceZ = 100.f;
+	static FAutoConsoleVariableRef CVarSnapDistanceZ(
+		TEXT("MesaMovement.SnapDistanceZ"),
+		SnapDistanceZ,
+		TEXT("Vertical correction, before velocity scaling, past which the presentation snaps instead of smoothing."),
+		ECVF_Default
+	);
+}
+
+FMesaReconcileStats& FMesaReconcileStats::Get()
+{
+	static FMesaReconcileStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdReconcileStats(
+	TEXT("MesaMovement.ReconcileStats"),
+	TEXT("Prints how many authority states were accepted, resimulated and snapped. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaReconcileStats& Stats = FMesaReconcileStats::Get();
+		const double Checks = FMath::Max<double>(Stats.Accepted + Stats.Resims, 1.0);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.ReconcileStats: %llu accepted (%.1f%%), %llu resims (%.1f%%), %llu corrections snapped, %llu smoothed, %llu ticks converging"),
+			Stats.Accepted, 100.0 * Stats.Accepted / Checks, Stats.Resims, 100.0 * Stats.Resims / Checks,
+			Stats.Snaps, Stats.Smoothed, Stats.Converging);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaReconcileStats();
+		}
+	})
+);
+
+FMesaRollbackStats& FMesaRollbackStats::Get()
+{
+	static FMesaRollbackStats Stats;
+	return Stats;
 }
 
+static FAutoConsoleCommand CmdRollbackStats(
+	TEXT("MesaMovement.RollbackStats"),
+	TEXT("Prints resimulated pawn frames per second, and how many a full rollback would have run. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaRollbackStats& Stats = FMesaRollbackStats::Get();
+		const double Seconds = FMath::Max(FPlatformTime::Seconds() - Stats.StartSeconds, 1e-3);
+		const uint64 Total = Stats.Resimulated + Stats.Replayed;
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.RollbackStats: %.1f resimulated pawn frames/s, %.1f without selective rollback (%llu of %llu replayed from history over %.1fs)"),
+			Stats.Resimulated / Seconds, Total / Seconds, Stats.Replayed, Total, Seconds);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaRollbackStats();
+		}
+	})
+);
+
+FMesaSimulationTickStats& FMesaSimulationTickStats::Get()
+{
+	static FMesaSimulationTickStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdTickStats(
+	TEXT("MesaMovement.TickStats"),
+	TEXT("Prints movement simulation ticks per second and what they cost, every role and resims included. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaSimulationTickStats& Stats = FMesaSimulationTickStats::Get();
+		const double Seconds = FMath::Max(FPlatformTime::Seconds() - Stats.StartSeconds, 1e-3);
+		const double TotalMS = FPlatformTime::ToMilliseconds64(Stats.Cycles);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.TickStats: %.1f ticks/s, %.3f ms/s, %.2f us/tick (%llu ticks over %.1fs)"),
+			Stats.Ticks / Seconds, TotalMS / Seconds, Stats.Ticks > 0 ? TotalMS * 1000.0 / Stats.Ticks : 0.0, Stats.Ticks, Seconds);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaSimulationTickStats();
+		}
+	})
+);
+
+FMesaProxyLODStats& FMesaProxyLODStats::Get()
+{
+	static FMesaProxyLODStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdProxyLODStats(
+	TEXT("MesaMovement.ProxyLODStats"),
+	TEXT("Prints simulated proxies per LOD tier, their tick cost, and the time saved against forward predicting all of them. Pass 'reset' to clear the timings."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaProxyLODStats& Stats = FMesaProxyLODStats::Get();
+		static const TCHAR* TierNames[] = { TEXT("ForwardPredict"), TEXT("Extrapolate"), TEXT("Far") };
+
+		auto AverageMS = [&Stats](int32 Tier) { return Stats.Ticks[Tier] > 0 ? FPlatformTime::ToMilliseconds64(Stats.Cycles[Tier]) / Stats.Ticks[Tier] : 0.0; };
+
+		// Saving is measured against the forward predicted average, so it needs some forward predicted ticks to mean anything.
+		const double ForwardMS = AverageMS((int32)EMesaProxyLOD::ForwardPredict);
+		double SavedMS = 0.0;
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.ProxyLODStats:"));
+		for (int32 Tier = 0; Tier < (int32)EMesaProxyLOD::Num; ++Tier)
+		{
+			const double TierMS = AverageMS(Tier);
+			SavedMS += Tier != (int32)EMesaProxyLOD::ForwardPredict && Stats.Ticks[Tier] > 0 ? (ForwardMS - TierMS) * Stats.Ticks[Tier] : 0.0;
+
+			UE_LOG(LogMesa, Display, TEXT("  %-14s %4d proxies, %llu ticks, %.4f ms/tick"), TierNames[Tier], Stats.Proxies[Tier], Stats.Ticks[Tier], TierMS);
+		}
+
+		UE_LOG(LogMesa, Display, TEXT("  Saved %.2f ms of proxy simulation since the last reset"), SavedMS);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			FMemory::Memzero(Stats.Ticks);
+			FMemory::Memzero(Stats.Cycles);
+		}
+	})
+);
+
+// Every live simulation by its updated primitive, so sweep hits can be turned into rollback dependencies. Game thread only.
+static TMap<const UPrimitiveComponent*, FMesaMovementSimulation*> GSimulationsByPrimitive;
+
 // -------------------------------------------------------------------------------------------------------
 
 bool FMesaMovementAuxState::ShouldReconcile(const FMesaMovementAuxState& AuthorityState) const
@@ -32,11 +298,478 @@ bool FMesaMovementAuxState::ShouldReconcile(const FMesaMovementAuxState& Authori
 
 bool FMesaMovementSyncState::ShouldReconcile(const FMesaMovementSyncState& AuthorityState) const
 {
-	const float ErrorTolerance = MesaPawnSimCVars::ErrorTolerance;
-	UE_NP_TRACE_RECONCILE(!AuthorityState.Location.Equals(Location, ErrorTolerance), "Loc:");
+	const FVector Error = AuthorityState.Location - Location;
+	const EMesaReconcileTier Tier = FMesaMovementSimulation::ClassifyError(Error, AuthorityState.Velocity);
+
+	// Nothing to roll back for, but the simulation that predicted us still walks the error off. Only recorded here,
+	// on NP's copy of the predicted state, the simulation picks it up on its next tick.
+	AcceptedError = Error;
+	bAcceptedError = Tier == EMesaReconcileTier::Accept;
+
+	// Resim and Snap both roll back, the driver decides how to present the correction.
+	UE_NP_TRACE_RECONCILE(Tier != EMesaReconcileTier::Accept, "Loc:");
 	return false;
 }
 
+void FMesaMovementSyncState::Interpolate(const FMesaMovementSyncState* From, const FMesaMovementSyncState* To, float PCT)
+{
+	Interpolate(From, To, PCT, MesaPawnSimCVars::HermiteInterpolation != 0);
+}
+
+void FMesaMovementSyncState::Interpolate(const FMesaMovementSyncState* From, const FMesaMovementSyncState* To, float PCT, bool bHermite)
+{
+	static constexpr float TeleportThreshold = 1000.f * 1000.f;
+	if (FVector::DistSquared(From->Location, To->Location) > TeleportThreshold)
+	{
+		*this = *To;
+		return;
+	}
+
+	// NP doesn't tell us how far apart the frames are. Projecting the move onto the mean velocity gets it back exactly
+	// under constant acceleration, and comes out short (flatter tangents, closer to linear) when something got in the way.
+	const FVector Delta = To->Location - From->Location;
+	const FVector MeanVelocity = (From->Velocity + To->Velocity) * 0.5;
+	const double MeanSpeedSquared = MeanVelocity.SizeSquared();
+	const double Interval = MeanSpeedSquared > UE_KINDA_SMALL_NUMBER ? FMath::Clamp((Delta | MeanVelocity) / MeanSpeedSquared, 0.0, 0.5) : 0.0;
+
+	if (bHermite && Interval > UE_KINDA_SMALL_NUMBER)
+	{
+		const double T = PCT;
+		const double T2 = T * T;
+		const double T3 = T2 * T;
+
+		const FVector Tangent0 = From->Velocity * Interval;
+		const FVector Tangent1 = To->Velocity * Interval;
+
+		Location = From->Location * (2.0 * T3 - 3.0 * T2 + 1.0) + Tangent0 * (T3 - 2.0 * T2 + T)
+			+ To->Location * (-2.0 * T3 + 3.0 * T2) + Tangent1 * (T3 - T2);
+
+		// Derivative of the same curve, so velocity agrees with how the location moves.
+		Velocity = (Delta * (6.0 * T - 6.0 * T2) + Tangent0 * (3.0 * T2 - 4.0 * T + 1.0) + Tangent1 * (3.0 * T2 - 2.0 * T)) / Interval;
+	}
+	else
+	{
+		Location = FMath::Lerp(From->Location, To->Location, PCT);
+		Velocity = FMath::Lerp(From->Velocity, To->Velocity, PCT);
+	}
+
+	Rotation = FRotator(
+		From->Rotation.Pitch + FRotator::NormalizeAxis(To->Rotation.Pitch - From->Rotation.Pitch) * PCT,
+		From->Rotation.Yaw + FRotator::NormalizeAxis(To->Rotation.Yaw - From->Rotation.Yaw) * PCT,
+		From->Rotation.Roll + FRotator::NormalizeAxis(To->Rotation.Roll - From->Rotation.Roll) * PCT).GetNormalized();
+
+	// Discrete, take the newer frame's.
+	MovementType = To->MovementType;
+	GroundContact = To->GroundContact;
+	GroundAge = To->GroundAge;
+	GroundDistance = To->GroundDistance;
+	GroundNormal = To->GroundNormal;
+}
+
+EMesaReconcileTier FMesaMovementSimulation::ClassifyError(const FVector& Error, const FVector& AuthorityVelocity)
+{
+	using namespace MesaPawnSimCVars;
+
+	// Horizontal error is measured in the plane rather than per world axis so the budget doesn't depend on facing.
+	const double ErrorXY = Error.Size2D();
+	const double ErrorZ = FMath::Abs(Error.Z);
+	const double SlackXY = AuthorityVelocity.Size2D() * ErrorVelocityScale;
+	const double SlackZ = FMath::Abs(AuthorityVelocity.Z) * ErrorVelocityScale;
+
+	if (ErrorXY > SnapDistance + SlackXY || ErrorZ > SnapDistanceZ + SlackZ)
+	{
+		return EMesaReconcileTier::Snap;
+	}
+
+	if (ErrorXY > ErrorTolerance + SlackXY || ErrorZ > ErrorToleranceZ + SlackZ)
+	{
+		return EMesaReconcileTier::Resim;
+	}
+
+	return EMesaReconcileTier::Accept;
+}
+
+FMovementCommand FMesaMovementInputCmd::Pack() const
+{
+	auto PackAxis = [](double Value) { return (int8)FMath::RoundToInt(FMath::Clamp(Value, -1.0, 1.0) * MAX_int8); };
+
+	FMovementCommand Command;
+	Command.Forward = PackAxis(MovementInput.X);
+	Command.Right = PackAxis(MovementInput.Y);
+	Command.YawDelta = (int16)FMath::RoundToInt(FRotator::NormalizeAxis(YawInput) / FMovementCommand::MaxYawDelta * MAX_int16);
+	Command.Buttons = (uint8)(bJumpPressed ? EMovementButtons::Jump : EMovementButtons::None);
+	return Command;
+}
+
+void FMesaMovementInputCmd::Unpack(const FMovementCommand& Command)
+{
+	MovementInput = FVector((double)Command.Forward / MAX_int8, (double)Command.Right / MAX_int8, 0.0);
+	YawInput = (float)Command.YawDelta / MAX_int16 * FMovementCommand::MaxYawDelta;
+	bJumpPressed = EnumHasAnyFlags((EMovementButtons)Command.Buttons, EMovementButtons::Jump);
+}
+
+/**
+ * Command wire format. The current command, 16 bit sequence, then up to MaxRedundant previous commands newest first.
+ * Each previous command is one bit when it matches the command after it and one more when its step does, so a held
+ * input costs a couple of bits per extra copy.
+ */
+void FMesaMovementInputCmd::NetSerialize(const FNetSerializeParams& P)
+{
+	FArchive& Ar = P.Ar;
+
+	FMovementCommand Command = Pack();
+	Command.Serialize(Ar);
+	if (Ar.IsLoading())
+	{
+		Unpack(Command);
+	}
+
+	Ar << Sequence;
+	Ar << StepMS;
+	if (Ar.IsLoading() && FMesaInputReceiver::Arriving)
+	{
+		FMesaInputReceiver::Arriving->Arrive(Sequence);
+	}
+
+	uint32 NumRedundant = FMath::Min(Redundant.Num(), MaxRedundant);
+	Ar.SerializeInt(NumRedundant, MaxRedundant + 1);
+	if (Ar.IsLoading())
+	{
+		Redundant.SetNum(FMath::Min<int32>(NumRedundant, MaxRedundant));
+	}
+
+	FMovementCommand Newer = Command;
+	uint8 NewerStepMS = StepMS;
+	for (FMesaRedundantCommand& Entry : Redundant)
+	{
+		uint8 bSameCommand = Entry.Command == Newer;
+		Ar.SerializeBits(&bSameCommand, 1);
+		if (bSameCommand)
+		{
+			Entry.Command = Newer;
+		}
+		else
+		{
+			Entry.Command.Serialize(Ar);
+		}
+
+		uint8 bSameStep = Entry.StepMS == NewerStepMS;
+		Ar.SerializeBits(&bSameStep, 1);
+		if (bSameStep)
+		{
+			Entry.StepMS = NewerStepMS;
+		}
+		else
+		{
+			Ar << Entry.StepMS;
+		}
+
+		Newer = Entry.Command;
+		NewerStepMS = Entry.StepMS;
+	}
+}
+
+FMesaInputStats& FMesaInputStats::Get()
+{
+	static FMesaInputStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdInputStats(
+	TEXT("MesaMovement.InputStats"),
+	TEXT("Prints how many client commands the server received, repeated, lost and recovered from redundancy. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaInputStats& Stats = FMesaInputStats::Get();
+		const double Sent = FMath::Max<double>(Stats.Received - Stats.Repeated + Stats.Lost + Stats.Recovered, 1.0);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.InputStats: %llu received, %llu repeated, %llu recovered (%.2f%%), %llu lost (%.2f%%)"),
+			Stats.Received, Stats.Repeated, Stats.Recovered, 100.0 * Stats.Recovered / Sent, Stats.Lost, 100.0 * Stats.Lost / Sent);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaInputStats();
+		}
+	})
+);
+
+FMesaDeadReckoningStats& FMesaDeadReckoningStats::Get()
+{
+	static FMesaDeadReckoningStats Stats;
+	return Stats;
+}
+
+static FAutoConsoleCommand CmdDeadReckoningStats(
+	TEXT("MesaMovement.DeadReckoningStats"),
+	TEXT("Prints how many sync states the server sent to simulated proxies and how many dead reckoning suppressed. Pass 'reset' to clear."),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		FMesaDeadReckoningStats& Stats = FMesaDeadReckoningStats::Get();
+		const double Checks = FMath::Max<double>(Stats.Checks, 1.0);
+
+		UE_LOG(LogMesa, Display, TEXT("MesaMovement.DeadReckoningStats: %llu checks, %llu suppressed (%.1f%%), %llu diverged, %llu heartbeats, max suppressed error %.2f"),
+			Stats.Checks, Stats.Suppressed, 100.0 * Stats.Suppressed / Checks, Stats.Diverged, Stats.Heartbeats, Stats.MaxSuppressedError);
+
+		if (Args.Num() > 0 && Args[0] == TEXT("reset"))
+		{
+			Stats = FMesaDeadReckoningStats();
+		}
+	})
+);
+
+bool FMesaDeadReckoning::IsEnabled()
+{
+	return MesaPawnSimCVars::DeadReckoning != 0;
+}
+
+void FMesaDeadReckoning::Step(const FMesaMovementInputCmd& Cmd, float DeltaSeconds, FMesaMovementSyncState& InOut)
+{
+	// SimulateFrame's velocity phase, from the rotation going in.
+	FMesaPMoveState PMove;
+	PMove.Velocity = InOut.Velocity;
+	PMove.PlayerRotation = InOut.Rotation;
+	PMove.MovementInput = Cmd.MovementInput;
+	PMove.bPendingJump = Cmd.bJumpPressed;
+	PMove.MovementType = InOut.MovementType;
+	MesaPMove::UpdateVelocity(PMove, DeltaSeconds);
+
+	// The command is held for however long it is stepped, so its turn is scaled like a forward predicted proxy's.
+	InOut.Rotation.Yaw += Cmd.GetYawInputFor(FMath::RoundToInt(DeltaSeconds * 1000.f));
+	InOut.Rotation.Normalize();
+	InOut.Velocity = PMove.Velocity;
+	InOut.MovementType = PMove.MovementType;
+	InOut.Location += PMove.Velocity * DeltaSeconds;
+}
+
+const FMesaMovementSyncState& FMesaDeadReckoning::Extrapolate(double Time)
+{
+	if (SentStepMS <= 0)
+	{
+		return Extrapolated;
+	}
+
+	const double StepSeconds = SentStepMS / 1000.0;
+	while (ExtrapolatedTime + StepSeconds <= Time)
+	{
+		Step(SentCmd, (float)StepSeconds, Extrapolated);
+		ExtrapolatedTime += StepSeconds;
+	}
+	return Extrapolated;
+}
+
+EMesaSendReason FMesaDeadReckoning::Update(const FMesaMovementSyncState& State, const FMesaMovementInputCmd& Cmd, int32 StepMS, double Time, double* OutError)
+{
+	using namespace MesaPawnSimCVars;
+
+	EMesaSendReason Reason = EMesaSendReason::None;
+	double Error = 0.0;
+
+	if (!bHasSent)
+	{
+		Reason = EMesaSendReason::Initial;
+	}
+	else
+	{
+		const FMesaMovementSyncState& Proxy = Extrapolate(Time);
+		Error = FVector::Dist(State.Location, Proxy.Location);
+		const float YawError = FMath::Abs(FRotator::NormalizeAxis(State.Rotation.Yaw - Proxy.Rotation.Yaw));
+
+		if (Error > DeadReckoningThreshold || YawError > DeadReckoningThresholdYaw || State.MovementType != Proxy.MovementType)
+		{
+			Reason = EMesaSendReason::Diverged;
+		}
+		else if (Time - SentTime >= DeadReckoningHeartbeat)
+		{
+			Reason = EMesaSendReason::Heartbeat;
+		}
+	}
+
+	if (Reason != EMesaSendReason::None)
+	{
+		Sent = State;
+		SentCmd = Cmd;
+		SentStepMS = StepMS;
+		SentTime = Time;
+		bHasSent = true;
+
+		Extrapolated = State;
+		ExtrapolatedTime = Time;
+	}
+
+	if (OutError)
+	{
+		*OutError = Error;
+	}
+	return Reason;
+}
+
+FMesaInputReceiver* FMesaInputReceiver::Arriving = nullptr;
+
+void FMesaInputReceiver::Arrive(uint16 Sequence)
+{
+	if (!bHasArrival || (int16)(uint16)(Sequence - NewestSequence) > 0)
+	{
+		NewestSequence = Sequence;
+		bHasArrival = true;
+	}
+}
+
+bool FMesaInputReceiver::Receive(const FMesaMovementInputCmd& Cmd, TArray<FMesaRedundantCommand, TInlineAllocator<8>>& OutRecovered)
+{
+	using namespace MesaPawnSimCVars;
+
+	OutRecovered.Reset();
+
+	FMesaInputStats& Stats = FMesaInputStats::Get();
+	++Stats.Received;
+
+	// How many arrived commands are still waiting behind this one, smoothed, and how much that wanders. The target
+	// is one tick of cushion, plus up to another when it wanders.
+	if (bHasArrival)
+	{
+		const int32 LastDepth = Depth;
+		Depth = FMath::Max<int32>((int16)(uint16)(NewestSequence - Cmd.Sequence), 0);
+
+		const float Alpha = FMath::Clamp(InputBufferSmoothing, 0.001f, 1.f);
+		SmoothedDepth += (Depth - SmoothedDepth) * Alpha;
+		DepthJitter += (FMath::Abs(Depth - SmoothedDepth) - DepthJitter) * Alpha;
+		TargetDepth = FMath::Clamp(1.f + DepthJitter * InputBufferJitterScale, 1.f, 2.f);
+
+		const float MaxDilation = FMath::Clamp(InputBufferMaxDilation, 0.f, 0.1f);
+		TimeDilation = 1.f + FMath::Clamp((TargetDepth - SmoothedDepth) * InputBufferGain, -MaxDilation, MaxDilation);
+
+		if (Depth > InputBufferMaxDepth && LastDepth <= InputBufferMaxDepth)
+		{
+			++Overflows;
+		}
+	}
+
+	if (!bHasSequence)
+	{
+		bHasSequence = true;
+		LastSequence = Cmd.Sequence;
+		return true;
+	}
+
+	const int32 Advance = (int16)(uint16)(Cmd.Sequence - LastSequence);
+	if (Advance <= 0)
+	{
+		++Stats.Repeated;
+		++Starvations;
+		return false;
+	}
+
+	// Redundant[0] is Sequence - 1, so the most recent of the missing commands are the ones we can get back.
+	const int32 Missing = Advance - 1;
+	const int32 NumRecovered = FMath::Min(Missing, Cmd.Redundant.Num());
+	for (int32 Index = NumRecovered - 1; Index >= 0; --Index)
+	{
+		OutRecovered.Add(Cmd.Redundant[Index]);
+	}
+
+	Stats.Recovered += NumRecovered;
+	Stats.Lost += Missing - NumRecovered;
+	LastSequence = Cmd.Sequence;
+	return true;
+}
+
+/**
+ * Sync state wire format, about 19 bytes walking where full precision doubles took 76. See MesaMovement.Bench.NetSync.
+ *   Location	Packed vector on a 0.1uu grid, bit count scales with distance from the origin.
+ *   Velocity	1 bit moving. If moving, X and Y as 16 bit fixed point over +-MaxNetSpeed, then 1 bit for Z and Z the same way.
+ *   Rotation	Yaw only in 16 bits. The simulation never writes pitch or roll.
+ *   Ground		NetSerializeGround.
+ * Quantization error stays far inside MesaMovement.ErrorTolerance so it never causes a reconcile on its own.
+ */
+void FMesaMovementSyncState::NetSerialize(const FNetSerializeParams& P)
+{
+	FArchive& Ar = P.Ar;
+
+	SerializePackedVector<10, 27>(Location, Ar);
+
+	static constexpr double VelocityStep = MesaMovementConfig::MaxNetSpeed / MAX_int16;
+	auto SerializeVelocityAxis = [&Ar](double& Value)
+	{
+		int16 Quantized = (int16)FMath::Clamp<int64>(FMath::RoundToInt64(Value / VelocityStep), -MAX_int16, MAX_int16);
+		Ar << Quantized;
+		if (Ar.IsLoading())
+		{
+			Value = Quantized * VelocityStep;
+		}
+	};
+
+	uint8 bMoving = !FMath::IsNearlyZero(Velocity.X, VelocityStep * 0.5) || !FMath::IsNearlyZero(Velocity.Y, VelocityStep * 0.5) || !FMath::IsNearlyZero(Velocity.Z, VelocityStep * 0.5);
+	Ar.SerializeBits(&bMoving, 1);
+
+	if (bMoving)
+	{
+		SerializeVelocityAxis(Velocity.X);
+		SerializeVelocityAxis(Velocity.Y);
+
+		// Walking velocity is flat, skip Z.
+		uint8 bVertical = !FMath::IsNearlyZero(Velocity.Z, VelocityStep * 0.5);
+		Ar.SerializeBits(&bVertical, 1);
+		if (bVertical)
+		{
+			SerializeVelocityAxis(Velocity.Z);
+		}
+		else if (Ar.IsLoading())
+		{
+			Velocity.Z = 0.0;
+		}
+	}
+	else if (Ar.IsLoading())
+	{
+		Velocity = FVector::ZeroVector;
+	}
+
+	uint16 Yaw = FRotator::CompressAxisToShort(Rotation.Yaw);
+	Ar << Yaw;
+	if (Ar.IsLoading())
+	{
+		Rotation = FRotator(0.0, FRotator::NormalizeAxis(FRotator::DecompressAxisFromShort(Yaw)), 0.0);
+	}
+
+	NetSerializeGround(Ar);
+}
+
+void FMesaMovementSyncState::NetSerializeGround(FArchive& Ar)
+{
+	uint8 Packed = (uint8)((uint8)MovementType | ((uint8)GroundContact << 2) | (FMath::Min(GroundAge, FMesaGroundState::MaxAge) << 4));
+	Ar << Packed;
+
+	if (Ar.IsLoading())
+	{
+		MovementType = (EMovementType)(Packed & 0x3);
+		GroundContact = (EMesaGroundContact)((Packed >> 2) & 0x3);
+		GroundAge = Packed >> 4;
+	}
+
+	if (GroundContact != EMesaGroundContact::Ground)
+	{
+		GroundNormal = FVector::ZeroVector;
+		GroundDistance = 0.f;
+		return;
+	}
+
+	// Walkable normals always point up, so X and Y are enough to rebuild them.
+	int8 NormalX = (int8)FMath::RoundToInt(FMath::Clamp(GroundNormal.X, -1.0, 1.0) * 127.0);
+	int8 NormalY = (int8)FMath::RoundToInt(FMath::Clamp(GroundNormal.Y, -1.0, 1.0) * 127.0);
+	uint8 Distance = (uint8)FMath::RoundToInt(FMath::Clamp(GroundDistance / MesaMovementConfig::GroundProbeDistance, 0.f, 1.f) * 255.f);
+
+	Ar << NormalX;
+	Ar << NormalY;
+	Ar << Distance;
+
+	if (Ar.IsLoading())
+	{
+		const double X = NormalX / 127.0;
+		const double Y = NormalY / 127.0;
+		GroundNormal = FVector(X, Y, FMath::Sqrt(FMath::Max(0.0, 1.0 - X * X - Y * Y)));
+		GroundDistance = (Distance / 255.f) * MesaMovementConfig::GroundProbeDistance;
+	}
+}
+
 // -------------------------------------------------------------------------------------------------------
 
 bool FMesaMovementSimulation::ForceMispredict = false;
@@ -94,9 +827,45 @@ FVector FMesaMovementSimulation::GetPenetrationAdjustment(const FHitResult& Hit)
 	const float PullBackDistance = FMath::Abs(BaseMovementCVars::PenetrationPullbackDistance);
 	const float PenetrationDepth = (Hit.PenetrationDepth > 0.f ? Hit.PenetrationDepth : 0.125f);
 
-	Result = Hit.Normal * (PenetrationDepth + PullBackDistance);
+	Result = Hit.Normal * (PenetrationDepth + PullBackDistance);
+
+	return Result;
+}
+
+FMesaMovementSimulation::~FMesaMovementSimulation()
+{
+	if (bProxyLODCounted)
+	{
+		--FMesaProxyLODStats::Get().Proxies[(int32)ProxyLOD];
+	}
+
+	if (UpdatedPrimitive)
+	{
+		GSimulationsByPrimitive.Remove(UpdatedPrimitive);
+	}
+}
+
+void FMesaMovementSimulation::SetComponents(USceneComponent* InUpdatedComponent, UPrimitiveComponent* InPrimitiveComponent)
+{
+	if (UpdatedPrimitive)
+	{
+		GSimulationsByPrimitive.Remove(UpdatedPrimitive);
+	}
+
+	if (InPrimitiveComponent)
+	{
+		GSimulationsByPrimitive.Add(InPrimitiveComponent, this);
+	}
+
+	History.Reset();
 
-	return Result;
+	UpdatedComponent = InUpdatedComponent;
+	UpdatedPrimitive = InPrimitiveComponent;
+	UpdatedCapsule = Cast<UCapsuleComponent>(InPrimitiveComponent);
+	TraceInstanceId = UpdatedComponent ? UpdatedComponent->GetUniqueID() : 0;
+
+	UWorld* World = UpdatedComponent ? UpdatedComponent->GetWorld() : nullptr;
+	CollisionSubsystem = World ? World->GetSubsystem<UMesaCollisionSubsystem>() : nullptr;
 }
 
 bool FMesaMovementSimulation::OverlapTest(const FVector& Location, const FQuat& RotationQuat, const ECollisionChannel CollisionChannel, const FCollisionShape& CollisionShape, const AActor* IgnoreActor) const
@@ -104,6 +873,18 @@ bool FMesaMovementSimulation::OverlapTest(const FVector& Location, const FQuat&
 	FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(MovementOverlapTest), false, IgnoreActor);
 	FCollisionResponseParams ResponseParam;
 	InitCollisionParams(QueryParams, ResponseParam);
+
+	if (CollisionShape.IsCapsule() && CanUseNativeCollision(RotationQuat))
+	{
+		if (CollisionSubsystem->GetBrushWorld().OverlapCapsule(Location, CollisionShape.GetCapsuleRadius(), CollisionShape.GetCapsuleHalfHeight()))
+		{
+			return true;
+		}
+
+		// Static geometry is covered by the brushes, only ask physics about things that move.
+		QueryParams.MobilityType = EQueryMobilityType::Dynamic;
+	}
+
 	return UpdatedComponent->GetWorld()->OverlapBlockingTestByChannel(Location, RotationQuat, CollisionChannel, CollisionShape, QueryParams, ResponseParam);
 }
 
@@ -226,147 +1007,419 @@ bool FMesaMovementSimulation::MoveUpdatedComponent(const FVector& Delta, const F
 	if (UpdatedComponent)
 	{
 		const FVector NewDelta = Delta;
+
+		if (bGhostActive)
+		{
+			FHitResult LocalHit;
+			return GhostMoveUpdatedComponent(NewDelta, NewRotation, bSweep, OutHit ? *OutHit : LocalHit);
+		}
+
+		if (bSweep && CanUseNativeCollision(NewRotation))
+		{
+			FHitResult LocalHit;
+			return NativeMoveUpdatedComponent(NewDelta, NewRotation, OutHit ? *OutHit : LocalHit, Teleport);
+		}
+
 		return UpdatedComponent->MoveComponent(NewDelta, NewRotation, bSweep, OutHit, MoveComponentFlags, Teleport);
 	}
 
 	return false;
 }
 
+bool FMesaMovementSimulation::CanUseNativeCollision(const FQuat& Rotation) const
+{
+	// Brush sweeps assume an upright capsule.
+	return UpdatedCapsule && CollisionSubsystem && CollisionSubsystem->IsNativeCollisionActive() && Rotation.GetAxisZ().Z > 0.9999f;
+}
 
-FTransform FMesaMovementSimulation::GetUpdateComponentTransform() const
+// First hit of a multi sweep along Delta that blocks it. Initial overlaps we are moving out of don't, the same rule
+// UPrimitiveComponent::MoveComponentImpl applies.
+static const FHitResult* FindBlockingHit(const TArray<FHitResult>& Hits, const FVector& Delta, EMoveComponentFlags MoveFlags)
 {
-	if (ensure(UpdatedComponent))
+	for (const FHitResult& Hit : Hits)
 	{
-		return UpdatedComponent->GetComponentTransform();		
+		if (!Hit.bBlockingHit)
+		{
+			continue;
+		}
+
+		if (Hit.bStartPenetrating && (Delta | Hit.Normal) > 0.f && !(MoveFlags & MOVECOMP_NeverIgnoreBlockingOverlaps))
+		{
+			continue;
+		}
+
+		return &Hit;
 	}
-	return FTransform::Identity;
-}
 
-bool IsExceedingMaxSpeed(const FVector& Velocity, float InMaxSpeed)
-{
-	InMaxSpeed = FMath::Max(0.f, InMaxSpeed);
-	const float MaxSpeedSquared = FMath::Square(InMaxSpeed);
-	
-	// Allow 1% error tolerance, to account for numeric imprecision.
-	const float OverVelocityPercent = 1.01f;
-	return (Velocity.SizeSquared() > MaxSpeedSquared * OverVelocityPercent);
+	return nullptr;
 }
 
-FVector ComputeSlideVector(const FVector& Delta, const float Time, const FVector& Normal, const FHitResult& Hit)
+bool FMesaMovementSimulation::NativeMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, FHitResult& OutHit, ETeleportType Teleport) const
 {
-	// Commented out original plane project, which is the original way that UE handles movement
-	// against surfaces, you end up being clamped if you walk into a wall which breaks surfing.
-	// return (FVector::VectorPlaneProject(Delta, Normal) * Time;
+	NativeSweep(UpdatedComponent->GetComponentLocation(), Delta, NewRotation, OutHit);
 
-	// Normalize Plane Projected Delta, then Multiply it by Speed
-	return (FVector::VectorPlaneProject(Delta, Normal).GetSafeNormal() * Delta.Size()) * Time;
+	// Already collision checked, just place the component.
+	UpdatedComponent->MoveComponent(Delta * OutHit.Time, NewRotation, false, nullptr, MoveComponentFlags, Teleport);
+	return !OutHit.bStartPenetrating;
 }
 
-void TwoWallAdjust(FVector& OutDelta, const FHitResult& Hit, const FVector& OldHitNormal)
+void FMesaMovementSimulation::NativeSweep(const FVector& Start, const FVector& Delta, const FQuat& NewRotation, FHitResult& OutHit) const
 {
-	FVector Delta = OutDelta;
-	const FVector HitNormal = Hit.Normal;
+	const FVector End = Start + Delta;
+
+	OutHit = FHitResult(1.f);
+	OutHit.TraceStart = Start;
+	OutHit.TraceEnd = End;
+
+	// Static geometry from the brush world.
+	FMesaBrushHit BrushHit;
+	if (CollisionSubsystem->GetBrushWorld().SweepCapsule(Start, Delta, UpdatedCapsule->GetScaledCapsuleRadius(), UpdatedCapsule->GetScaledCapsuleHalfHeight(), BrushHit))
+	{
+		OutHit.bBlockingHit = true;
+		OutHit.bStartPenetrating = BrushHit.bStartPenetrating;
+		OutHit.Time = BrushHit.Time;
+		OutHit.Normal = BrushHit.Normal;
+		OutHit.ImpactNormal = BrushHit.Normal;
+		OutHit.PenetrationDepth = BrushHit.PenetrationDepth;
+	}
 
-	if ((OldHitNormal | HitNormal) <= 0.f) //90 or less corner, so use cross product for direction
+	// Movable objects still come from the physics scene, and only need checking up to the static hit.
+	if (!OutHit.bStartPenetrating)
 	{
-		const FVector DesiredDir = Delta;
-		FVector NewDir = (HitNormal ^ OldHitNormal);
-		NewDir = NewDir.GetSafeNormal();
-		Delta = (Delta | NewDir) * (1.f - Hit.Time) * NewDir;
-		if ((DesiredDir | Delta) < 0.f)
+		FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(MovementNativeDynamicSweep), false, UpdatedComponent->GetOwner());
+		FCollisionResponseParams ResponseParam;
+		InitCollisionParams(QueryParams, ResponseParam);
+		QueryParams.MobilityType = EQueryMobilityType::Dynamic;
+
+		// Multi, so an initial overlap we are moving out of doesn't hide something solid further along.
+		const FVector DynamicDelta = Delta * OutHit.Time;
+		TArray<FHitResult> Hits;
+		UpdatedComponent->GetWorld()->SweepMultiByChannel(Hits, Start, Start + DynamicDelta, NewRotation,
+			UpdatedPrimitive->GetCollisionObjectType(), UpdatedPrimitive->GetCollisionShape(), QueryParams, ResponseParam);
+
+		if (const FHitResult* DynamicHit = FindBlockingHit(Hits, DynamicDelta, MoveComponentFlags))
 		{
-			Delta = -1.f * Delta;
+			const float StaticTime = OutHit.Time;
+			OutHit = *DynamicHit;
+
+			// Stop MESA_SURFACE_CLIP_EPSILON off the surface, as the brush sweep does, so the next move doesn't start inside it.
+			const double Into = -(DynamicDelta | OutHit.Normal);
+			if (!OutHit.bStartPenetrating && Into > UE_KINDA_SMALL_NUMBER)
+			{
+				OutHit.Time = FMath::Max(0.f, OutHit.Time - (float)(MESA_SURFACE_CLIP_EPSILON / Into));
+			}
+
+			OutHit.Time *= StaticTime;
+			OutHit.TraceStart = Start;
+			OutHit.TraceEnd = End;
 		}
 	}
-	else //adjust to new wall
+
+	OutHit.Location = Start + Delta * OutHit.Time;
+	if (OutHit.bBlockingHit && !OutHit.Component.IsValid())
+	{
+		OutHit.ImpactPoint = OutHit.Location - OutHit.ImpactNormal * UpdatedCapsule->GetScaledCapsuleRadius();
+	}
+}
+
+bool FMesaMovementSimulation::SweepTest(const FVector& Delta, const FQuat& Rotation, FHitResult& OutHit) const
+{
+	const FVector Start = GetLocation();
+
+	if (CanUseNativeCollision(Rotation))
+	{
+		NativeSweep(Start, Delta, Rotation, OutHit);
+		return OutHit.bBlockingHit;
+	}
+
+	FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(MovementSweepTest), false, UpdatedComponent->GetOwner());
+	FCollisionResponseParams ResponseParam;
+	InitCollisionParams(QueryParams, ResponseParam);
+
+	return UpdatedComponent->GetWorld()->SweepSingleByChannel(OutHit, Start, Start + Delta, Rotation,
+		UpdatedPrimitive->GetCollisionObjectType(), UpdatedPrimitive->GetCollisionShape(), QueryParams, ResponseParam);
+}
+
+
+void FMesaMovementSimulation::BeginGhost(const FTransform& Transform)
+{
+	GhostTransform = Transform;
+	bGhostActive = true;
+}
+
+bool FMesaMovementSimulation::EndGhost()
+{
+	const bool bWasActive = bGhostActive;
+	bGhostActive = false;
+	return bWasActive;
+}
+
+bool FMesaMovementSimulation::GhostMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult& OutHit) const
+{
+	const FVector Start = GhostTransform.GetLocation();
+
+	OutHit = FHitResult(1.f);
+	OutHit.TraceStart = Start;
+	OutHit.TraceEnd = Start + Delta;
+
+	if (bSweep && !Delta.IsNearlyZero())
 	{
-		const FVector DesiredDir = Delta;
-		Delta = ComputeSlideVector(Delta, 1.f - Hit.Time, HitNormal, Hit);
-		if ((Delta | DesiredDir) <= 0.f)
+		if (CanUseNativeCollision(NewRotation))
 		{
-			Delta = FVector::ZeroVector;
+			NativeSweep(Start, Delta, NewRotation, OutHit);
 		}
-		else if ( FMath::Abs((HitNormal | OldHitNormal) - 1.f) < KINDA_SMALL_NUMBER )
+		else if (UpdatedPrimitive)
 		{
-			// we hit the same wall again even after adjusting to move along it the first time
-			// nudge away from it (this can happen due to precision issues)
-			Delta += HitNormal * 0.01f;
+			// Our own primitive is still sitting wherever it was before the rollback, so leave the owner out of it.
+			FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(MovementGhostSweep), false, UpdatedComponent->GetOwner());
+			FCollisionResponseParams ResponseParam;
+			InitCollisionParams(QueryParams, ResponseParam);
+
+			TArray<FHitResult> Hits;
+			UpdatedComponent->GetWorld()->SweepMultiByChannel(Hits, Start, Start + Delta, NewRotation,
+				UpdatedPrimitive->GetCollisionObjectType(), UpdatedPrimitive->GetCollisionShape(), QueryParams, ResponseParam);
+
+			// Same rules as UPrimitiveComponent::MoveComponentImpl, so a ghost resim lands where a real one would:
+			// skip initial overlaps we are moving out of, and pull back a little from whatever blocks us.
+			if (const FHitResult* Hit = FindBlockingHit(Hits, Delta, MoveComponentFlags))
+			{
+				OutHit = *Hit;
+				if (!OutHit.bStartPenetrating)
+				{
+					const float DeltaSize = Delta.Size();
+					const float DesiredTimeBack = FMath::Clamp(0.1f, 0.1f / DeltaSize, 1.f / DeltaSize) + 0.001f;
+					OutHit.Time = FMath::Clamp(OutHit.Time - DesiredTimeBack, 0.f, 1.f);
+				}
+			}
+
+			OutHit.Location = Start + Delta * OutHit.Time;
 		}
 	}
 
-	OutDelta = Delta;
+	GhostTransform.SetLocation(Start + Delta * OutHit.Time);
+	GhostTransform.SetRotation(NewRotation);
+	return !OutHit.bStartPenetrating;
+}
+
+FTransform FMesaMovementSimulation::GetUpdateComponentTransform() const
+{
+	if (bGhostActive)
+	{
+		return GhostTransform;
+	}
+
+	if (ensure(UpdatedComponent))
+	{
+		return UpdatedComponent->GetComponentTransform();		
+	}
+	return FTransform::Identity;
+}
+
+void FMesaMovementSimulation::Sweep(const FVector& Delta, const FQuat& Rotation, FMesaMoveHit& OutHit)
+{
+	FHitResult Hit(1.f);
+	SafeMoveUpdatedComponent(Delta, Rotation, true, Hit, ETeleportType::None);
+
+	OutHit.Normal = Hit.Normal;
+	OutHit.Time = Hit.Time;
+	OutHit.bBlockingHit = Hit.bBlockingHit;
+	OutHit.bStartPenetrating = Hit.bStartPenetrating;
+
+	TraceNumHits += Hit.bBlockingHit ? 1 : 0;
+
+	if (Hit.bBlockingHit)
+	{
+		AddContact(Hit.GetComponent());
+	}
+}
+
+bool FMesaMovementSimulation::Overlap(const FVector& Location, const FQuat& Rotation) const
+{
+	if (!UpdatedPrimitive)
+	{
+		return false;
+	}
+
+	return OverlapTest(Location, Rotation, UpdatedPrimitive->GetCollisionObjectType(), UpdatedPrimitive->GetCollisionShape(), UpdatedComponent->GetOwner());
+}
+
+FVector FMesaMovementSimulation::GetLocation() const
+{
+	return GetUpdateComponentTransform().GetLocation();
 }
 
-float FMesaMovementSimulation::SlideAlongSurface(const FVector& Delta, float Time, const FQuat Rotation, const FVector& Normal, FHitResult& Hit, bool bHandleImpact)
+void FMesaMovementSimulation::SimulationTick(const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, const TNetSimOutput<MesaMovementStateTypes>& Output)
 {
-	if (!Hit.bBlockingHit)
+	const bool bResimulation = TimeStep.Frame <= LastSimulatedFrame;
+	if (!bResimulation && UpdatedComponent && UpdatedComponent->GetOwnerRole() != ROLE_Authority)
+	{
+		ConsumeAcceptedError();
+	}
+
+	*Output.Sync = *Input.Sync;
+	Output.Sync->bAcceptedError = false;
+	LastSimulatedFrame = FMath::Max(LastSimulatedFrame, TimeStep.Frame);
+
+	FMesaMoveTraceRecord* Trace = MesaMovementTrace::IsEnabled() ? &MesaMovementTrace::BeginRecord() : nullptr;
+	if (Trace)
 	{
-		return 0.f;
+		BeginTrace(*Trace, TimeStep, Input, bResimulation);
 	}
 
-	float PercentTimeApplied = 0.f;
-	const FVector OldHitNormal = Normal;
+	CurrentFrame = TimeStep.Frame;
+	CurrentContacts.Reset();
+	ReplayedOutput = nullptr;
 
-	FVector SlideDelta = ComputeSlideVector(Delta, Time, Normal, Hit);
+	const uint64 StartCycles = FPlatformTime::Cycles64();
 
-	if ((SlideDelta | Delta) > 0.f)
+	// Selective rollback, a pawn that didn't diverge and didn't touch one that did replays what it stored last time.
+	FMesaRollbackStats& RollbackStats = FMesaRollbackStats::Get();
+	if (bResimulation && ReplayFrame(TimeStep, Input, *Output.Sync))
+	{
+		ReplayedOutput = Output.Sync;
+		ReplayedFrame = TimeStep.Frame;
+		ReplayedStepMS = TimeStep.StepMS;
+		++RollbackStats.Replayed;
+		if (Trace)
+		{
+			Trace->Flags |= (uint8)EMesaMoveTraceFlags::Replayed;
+		}
+	}
+	else
 	{
-		SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, ETeleportType::None);
+		if (bResimulation)
+		{
+			MarkDirty(TimeStep.Frame);
+			++RollbackStats.Resimulated;
+		}
+
+		bResimulatingFrame = bResimulation;
+		const FMesaMovementSyncState* InSync = Input.Sync;
 
-		//DrawDebugLine(
-		//	UpdatedComponent->GetWorld(),
-		//	GetUpdateComponentTransform().GetLocation(),
-		//	SlideDelta + GetUpdateComponentTransform().GetLocation(),
-		//	FColor(1.f, 1.f, 0.f, 0.f),
-		//	false,
-		//	1.f,
-		//	255,
-		//	5.f
-		//);
+		// Commands the client sent that never arrived on their own, rebuilt from the redundant tail of this one.
+		// Run first so this command starts from where the client predicted it would.
+		FMesaMovementSyncState RecoveredSync;
+		TArray<FMesaRedundantCommand, TInlineAllocator<8>> Recovered;
+		const bool bAuthority = !bResimulation && UpdatedComponent && UpdatedComponent->GetOwnerRole() == ROLE_Authority;
+		const bool bNewCommand = !bAuthority || InputReceiver.Receive(*Input.Cmd, Recovered);
 
-		const float FirstHitPercent = Hit.Time;
-		PercentTimeApplied = FirstHitPercent;
-		if (Hit.IsValidBlockingHit())
+		const bool bRecordMatch = bAuthority && bNewCommand && MesaMatchRecorder::IsRecording();
+		if (Recovered.Num() > 0)
 		{
-			// Notify first impact
-			if (bHandleImpact)
-			{
-				// !HandleImpact(Hit, FirstHitPercent * Time, SlideDelta);
-			}
-		
-			// Compute new slide normal when hitting multiple surfaces.
-			TwoWallAdjust(SlideDelta, Hit, OldHitNormal);
-		
-			// Only proceed if the new direction is of significant length and not in reverse of original attempted move.
-			if (!SlideDelta.IsNearlyZero(1e-3f) && (SlideDelta | Delta) > 0.f)
+			RecoveredSync = *Input.Sync;
+			for (int32 Index = 0; Index < Recovered.Num(); ++Index)
 			{
-				// Perform second move
-				SafeMoveUpdatedComponent(SlideDelta, Rotation, true, Hit, ETeleportType::None);
-				const float SecondHitPercent = Hit.Time * (1.f - FirstHitPercent);
-				PercentTimeApplied += SecondHitPercent;
-		
-				// Notify second impact
-				if (bHandleImpact && Hit.bBlockingHit)
+				const FMesaRedundantCommand& Command = Recovered[Index];
+				FMesaMovementInputCmd RecoveredCmd;
+				RecoveredCmd.Unpack(Command.Command);
+
+				FMesaMovementSyncState StepSync = RecoveredSync;
+				SimulateFrame(Command.StepMS, RecoveredCmd, RecoveredSync, StepSync);
+
+				if (bRecordMatch)
 				{
-					// !HandleImpact(Hit, SecondHitPercent * Time, SlideDelta);
+					const uint16 Sequence = Input.Cmd->Sequence - (uint16)(Recovered.Num() - Index);
+					RecordMatchStep(TimeStep.Frame, Command.StepMS, Command.Command, Sequence, EMesaMatchRecordFlags::Recovered, RecoveredSync, StepSync);
 				}
+				RecoveredSync = StepSync;
+			}
+
+			*Output.Sync = RecoveredSync;
+			InSync = &RecoveredSync;
+		}
+
+		if (!bNewCommand)
+		{
+			// Starved, NP repeated the last command. The client only ran it once, so hold still until the next one arrives.
+			*Output.Sync = *Input.Sync;
+		}
+		else if (ProxyLOD == EMesaProxyLOD::ForwardPredict)
+		{
+			const bool bSimulatedProxy = UpdatedComponent && UpdatedComponent->GetOwnerRole() == ROLE_SimulatedProxy;
+			SimulateFrame(TimeStep.StepMS, *Input.Cmd, *InSync, *Output.Sync, bSimulatedProxy);
+
+			if (!bResimulation && !bAuthority)
+			{
+				Converge(TimeStep.StepMS, *Output.Sync);
+				PredictedStates[(uint32)TimeStep.Frame % HistorySize] = { TimeStep.Frame, Output.Sync };
 			}
 		}
+		else
+		{
+			SimulateProxyLOD(TimeStep.StepMS, *Input.Cmd, *InSync, *Output.Sync);
+		}
+		bResimulatingFrame = false;
+
+		if (bRecordMatch)
+		{
+			RecordMatchStep(TimeStep.Frame, TimeStep.StepMS, Input.Cmd->Pack(), Input.Cmd->Sequence, EMesaMatchRecordFlags::None, *InSync, *Output.Sync);
+		}
+
+		if (MesaPawnSimCVars::SelectiveRollback)
+		{
+			History.SetNum(HistorySize);
+
+			FMesaFrameRecord& Record = History[(uint32)TimeStep.Frame % HistorySize];
+			Record.Frame = TimeStep.Frame;
+			Record.Cmd = *Input.Cmd;
+			Record.InSync = *Input.Sync;
+			Record.OutSync = *Output.Sync;
+			Record.Contacts = CurrentContacts;
+			Record.bGhost = bGhostActive;
+		}
+		else if (History.Num() > 0)
+		{
+			History.Empty();
+		}
+	}
+
+	if (!bResimulation)
+	{
+		LatestSync = *Output.Sync;
+		LatestCmd = *Input.Cmd;
+		LatestStepMS = TimeStep.StepMS;
+		bHasLatestSync = true;
+	}
+
+	// Replayed the frame that was on screen when the rollback started, the difference is the correction.
+	if (TimeStep.Frame == CorrectionFrame)
+	{
+		CorrectionDelta = Output.Sync->Location - CorrectionFrom;
+		CorrectionFrame = INDEX_NONE;
+		bHasCorrection = true;
+	}
 
-		return FMath::Clamp(PercentTimeApplied, 0.f, 1.f);
+	const uint64 TickCycles = FPlatformTime::Cycles64() - StartCycles;
+	FMesaSimulationTickStats& TickStats = FMesaSimulationTickStats::Get();
+	++TickStats.Ticks;
+	TickStats.Cycles += TickCycles;
+
+	if (bProxyLODCounted)
+	{
+		FMesaProxyLODStats& LODStats = FMesaProxyLODStats::Get();
+		++LODStats.Ticks[(int32)ProxyLOD];
+		LODStats.Cycles[(int32)ProxyLOD] += TickCycles;
 	}
 
-	return 0.f;
+	if (Trace)
+	{
+		EndTrace(*Trace, *Output.Sync);
+	}
 }
 
-void FMesaMovementSimulation::SimulationTick(const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, const TNetSimOutput<MesaMovementStateTypes>& Output)
+void FMesaMovementSimulation::ReplayStep(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync)
 {
-	*Output.Sync = *Input.Sync;
+	TeleportUpdatedComponent(InSync);
+	CurrentContacts.Reset();
 
-	UE_LOG(LogTemp, Display, TEXT("MOVE MS SIMULATION - %f"), (float)TimeStep.StepMS);
+	OutSync = InSync;
+	SimulateFrame(StepMS, Cmd, InSync, OutSync);
+}
 
+void FMesaMovementSimulation::SimulateFrame(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync, bool bRepeatedCmd)
+{
 	//FTransform CachedLastMove = GetUpdateComponentTransform(); // Cache the last move for extrapolation based on speed.
-	const float DeltaSeconds = (float)TimeStep.StepMS / 1000.f;
+	const float DeltaSeconds = (float)StepMS / 1000.f;
 
 	// --------------------------------------------------------------
 	//	Rotation Update
@@ -375,283 +1428,398 @@ void FMesaMovementSimulation::SimulationTick(const FNetSimTimeStep& TimeStep, co
 	//	In this simulation, the rotation update isn't allowed to "fail". We don't expect the collision query to be able to fail the rotational update.
 	// --------------------------------------------------------------
 
-	Output.Sync->Rotation.Yaw += Input.Cmd->YawInput * DeltaSeconds;
-	Output.Sync->Rotation.Normalize();
+	// The turn is per command. A repeated one is scaled to the step, the client's own step reproduces it exactly.
+	OutSync.Rotation.Yaw += bRepeatedCmd ? Cmd.GetYawInputFor(StepMS) : Cmd.YawInput;
+	OutSync.Rotation.Normalize();
 
-	UE_LOG(LogTemp, Display, TEXT("SIM YAW - %f"), Output.Sync->Rotation.Yaw);
-
-	const FQuat OutputQuat = Output.Sync->Rotation.Quaternion();
+	const FQuat OutputQuat = OutSync.Rotation.Quaternion();
 	   	
 	// --------------------------------------------------------------
-	// Calculate Output.Sync->RelativeVelocity based on Input
+	// Calculate OutSync.RelativeVelocity based on Input
 	// --------------------------------------------------------------
 	{
-		Velocity = Input.Sync->Velocity;
-		PlayerRotation = Input.Sync->Rotation;
-		MovementInput = Input.Cmd->MovementInput;
-		bPendingJump = Input.Cmd->bJumpPressed;
-		
-		TraceForGround();
+		PMove.Velocity = InSync.Velocity;
+		PMove.PlayerRotation = InSync.Rotation;
+		PMove.MovementInput = Cmd.MovementInput;
+		PMove.bPendingJump = Cmd.bJumpPressed;
+		PMove.MovementType = InSync.MovementType;
+		InSync.ToGroundState(PMove.Ground);
 
-		switch(MovementType) // Select Movetype
-		{
-			case EMovementType::Walking:
-				WalkMove(DeltaSeconds);
-				break;
-			case EMovementType::Falling:
-				AirMove(DeltaSeconds);
-				break;
-			case EMovementType::Flying:
-				FlyMove(DeltaSeconds);
-				break;
-		}
+		MesaPMove::CategorizePosition(PMove, *this);
+		MesaPMove::UpdateVelocity(PMove, DeltaSeconds);
 
 		// Finally, output velocity that we calculated
-		Output.Sync->Velocity = Velocity;
+		OutSync.Velocity = PMove.Velocity;
+		OutSync.MovementType = PMove.MovementType;
 		
 		if (FMesaMovementSimulation::ForceMispredict)
 		{
-			Output.Sync->Velocity += ForceMispredictVelocityMagnitude;
+			OutSync.Velocity += ForceMispredictVelocityMagnitude;
 			ForceMispredict = false;
 		}
 	}
 
-	FVector Delta = Output.Sync->Velocity * DeltaSeconds;
+	// Naughty as fuck method that worked before to make surfing work on UMovementComponent, doesn't work here.
+	//FVector VelocityDelta = (GetUpdateComponentTransform().GetLocation() - CachedLastMove.GetLocation());
+	//OutSync.Velocity = VelocityDelta.GetSafeNormal() * Velocity.Size();
 
-	if (!Delta.IsNearlyZero(1e-6f))
-	{
-		// Naughty as fuck method that worked before to make surfing work on UMovementComponent, doesn't work here.
-		//FVector VelocityDelta = (GetUpdateComponentTransform().GetLocation() - CachedLastMove.GetLocation());
-		//Output.Sync->Velocity = VelocityDelta.GetSafeNormal() * Velocity.Size();
-
-		FHitResult Hit(1.f);
-		SafeMoveUpdatedComponent(Delta, OutputQuat, true, Hit, ETeleportType::None);
-
-		if (Hit.IsValidBlockingHit())
-		{
-			// Try to slide the remaining distance along the surface.
-			SlideAlongSurface(Delta, 1.f-Hit.Time, OutputQuat, Hit.Normal, Hit, true);
-		}
-	}
+	MesaPMove::SlideMove(PMove, *this, OutSync.Velocity * DeltaSeconds, OutputQuat);
 
 	const FTransform UpdateComponentTransform = GetUpdateComponentTransform();
-	Output.Sync->Location = UpdateComponentTransform.GetLocation();
+	OutSync.Location = UpdateComponentTransform.GetLocation();
+	OutSync.FromGroundState(PMove.Ground);
 
 	// Note that we don't pull the rotation out of the final update transform. Converting back from a quat will lead to a different FRotator than what we are storing
 	// here in the simulation layer. This may not be the best choice for all movement simulations, but is ok for this one.
 }
 
-void FMesaMovementSimulation::WalkMove(float DeltaTime)
+void FMesaMovementSimulation::BeginRollback(const FMesaMovementSyncState& RestoredState)
 {
-	FVector WishDirection, WishVelocity;
-	float WishSpeed;
+	RollbackPass = GFrameCounter;
+	DirtyFromFrame = MAX_int32;
+	ReplayedOutput = nullptr;
+	ConvergeRemaining = FVector::ZeroVector; // The resim lands on the authority anyway.
+
+	// NP restores from the buffers we wrote, so a pawn that didn't diverge gets one of its own input states back bit for bit.
+	// Anything else is a correction and dirties the whole pass, before any pawn replays a frame that touched us.
+	const bool bKnownState = History.ContainsByPredicate([&RestoredState](const FMesaFrameRecord& Record)
+	{
+		return Record.Frame != INDEX_NONE && Record.InSync.Identical(RestoredState);
+	});
+
+	if (!bKnownState)
+	{
+		DirtyFromFrame = MIN_int32;
+	}
+}
 
-	if(CheckJump()) // Check if we initiated a jump & swap to AirMove
+void FMesaMovementSimulation::MarkDirty(int32 Frame)
+{
+	if (RollbackPass != GFrameCounter)
 	{
-		// Play Jump SFX
-		//UFMODBlueprintStatics::PlayEventAttached(
-		//	UMesaGameData::Get().JumpAudioEvent.LoadSynchronous(), // @TODO, Dynamic Load.
-		//	UpdatedComponent,
-		//	NAME_None,
-		//	FVector::ZeroVector,
-		//	EAttachLocation::SnapToTarget,
-		//	false,
-		//	true,
-		//	true);
+		RollbackPass = GFrameCounter;
+		DirtyFromFrame = Frame;
+	}
+	else
+	{
+		DirtyFromFrame = FMath::Min(DirtyFromFrame, Frame);
+	}
 
-		AirMove(DeltaTime);
-		return;
+	// NP ticks every pawn through a frame before the next, so we may have replayed this one already, before whoever
+	// dirtied us ran it.
+	if (ReplayedOutput && ReplayedFrame == Frame)
+	{
+		RerunReplayedFrame();
 	}
+}
 
-	ApplyFriction(DeltaTime);
+void FMesaMovementSimulation::RerunReplayedFrame()
+{
+	FMesaMovementSyncState& OutSync = *ReplayedOutput;
+	ReplayedOutput = nullptr;
 
-	// ClipVelocty here should project the forward and right directions onto the ground plane
-	// however I think we can just use FMath's vector projection here. We want to project our
-	// movement to the floor for walking up and down ramps.
+	FMesaRollbackStats& RollbackStats = FMesaRollbackStats::Get();
+	--RollbackStats.Replayed;
+	++RollbackStats.Resimulated;
 
-	WishVelocity = PlayerRotation.RotateVector(MovementInput).GetSafeNormal(); // Normalize clamps input to stop doubling while holding W + A ect.
-	WishVelocity.Z = 0.f;
+	// Anything we hit now is dirtied in turn, and reruns too if it had replayed this frame.
+	FMesaFrameRecord& Record = History[(uint32)ReplayedFrame % HistorySize];
+	bResimulatingFrame = true;
+	ReplayStep(ReplayedStepMS, Record.Cmd, Record.InSync, OutSync);
+	bResimulatingFrame = false;
 
-	WishDirection = WishVelocity;
-	WishSpeed = WishDirection.Size();
+	Record.OutSync = OutSync;
+	Record.Contacts = CurrentContacts;
 
-	if(WishSpeed != 0.f)
+	if (bHasCorrection && ReplayedFrame == LastSimulatedFrame)
 	{
-		WishVelocity *= MesaMovementConfig::MovementSpeed / WishSpeed;
-		WishSpeed = MesaMovementConfig::MovementSpeed;
+		CorrectionDelta = OutSync.Location - CorrectionFrom;
 	}
+}
 
-	Velocity.Z = 0;
-	Accelerate(DeltaTime, WishDirection, WishSpeed, MesaMovementConfig::Acceleration);
-	Velocity.Z = 0;
-
-	// Base Velocity can be used for standing on treadmills ect.
-	// Velocity += BaseVelocity;
+bool FMesaMovementSimulation::IsDirtyAt(int32 Frame) const
+{
+	return RollbackPass == GFrameCounter && DirtyFromFrame <= Frame;
+}
 
-	if(Velocity.Size() < 1.f) // Nullify Velocity if it's nearly dead. (Probably not necessary)
+void FMesaMovementSimulation::AddContact(const UPrimitiveComponent* Component)
+{
+	FMesaMovementSimulation* const* Other = GSimulationsByPrimitive.Find(Component);
+	if (!Other || *Other == this)
 	{
-		Velocity = FVector::ZeroVector;
 		return;
 	}
-}
 
-void FMesaMovementSimulation::AirMove(float DeltaTime)
-{
-	FVector WishDirection, WishVelocity;
-	float WishSpeed;
+	(*Other)->LastContactFrame = GFrameCounter;
+
+	if (!MesaPawnSimCVars::SelectiveRollback)
+	{
+		return;
+	}
 
-	ApplyFriction(DeltaTime);
+	CurrentContacts.AddUnique(Component);
 
-	WishVelocity = PlayerRotation.RotateVector(MovementInput).GetSafeNormal();
-	WishVelocity.Z = 0.f;
+	// A pawn being resimulated may now be somewhere the other one never saw it, so that one can't trust its history either.
+	if (bResimulatingFrame)
+	{
+		(*Other)->MarkDirty(CurrentFrame);
+	}
+}
 
-	WishDirection = WishVelocity;
-	WishSpeed = WishDirection.Size();
-	WishDirection.Normalize();
+bool FMesaMovementSimulation::ReplayFrame(const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, FMesaMovementSyncState& OutSync)
+{
+	// A ghost's neighbours are still where the rollback found them, see BeginRollback.
+	if (!MesaPawnSimCVars::SelectiveRollback || bGhostActive || History.Num() == 0 || IsDirtyAt(TimeStep.Frame))
+	{
+		return false;
+	}
 
-	if(WishSpeed != 0.f)
+	const FMesaFrameRecord& Record = History[(uint32)TimeStep.Frame % HistorySize];
+	if (Record.Frame != TimeStep.Frame || Record.bGhost || !Record.Cmd.Identical(*Input.Cmd) || !Record.InSync.Identical(*Input.Sync))
 	{
-		WishVelocity *= MesaMovementConfig::MovementSpeed / WishSpeed;
-		WishSpeed = MesaMovementConfig::MovementSpeed;
+		return false;
 	}
 
-	Accelerate(DeltaTime, WishDirection, WishSpeed, MesaMovementConfig::AirAcceleration); // Normal clamps movement to stop doubling.
+	for (const UPrimitiveComponent* Contact : Record.Contacts)
+	{
+		FMesaMovementSimulation* const* Other = GSimulationsByPrimitive.Find(Contact);
+		if (Other && (*Other)->IsDirtyAt(TimeStep.Frame))
+		{
+			return false;
+		}
+	}
 
-	// Base Velocity can be used for standing on treadmills ect.
-	// Velocity += BaseVelocity;
+	OutSync = Record.OutSync;
 
-	// Apply Gravity, we don't use UMovementComponent::GetGravityZ because it expects players to have the
-	// same gravity as Physics Objects (Feels bad), However this means Physics Volumes don't affect Players.
-	Velocity.Z -= MesaMovementConfig::Gravity * DeltaTime;
+	// Leave the shape where the stored frame did, pawns resimulated after us in this frame sweep against it.
+	TeleportUpdatedComponent(OutSync);
+	return true;
 }
 
-void FMesaMovementSimulation::FlyMove(float DeltaTime)
+void FMesaMovementSimulation::TeleportUpdatedComponent(const FMesaMovementSyncState& Sync)
 {
-	ApplyFriction(DeltaTime);
-	Accelerate(DeltaTime, PlayerRotation.RotateVector(MovementInput).GetSafeNormal(), MesaMovementConfig::MovementSpeed, MesaMovementConfig::FlightAcceleration); // Normal clamps movement to stop doubling.
+	const FTransform Transform(Sync.Rotation.Quaternion(), Sync.Location, GetUpdateComponentTransform().GetScale3D());
+	if (bGhostActive)
+	{
+		GhostTransform = Transform;
+	}
+	else if (UpdatedComponent)
+	{
+		UpdatedComponent->SetWorldTransform(Transform, false, nullptr, ETeleportType::TeleportPhysics);
+	}
 }
 
-bool FMesaMovementSimulation::CheckJump()
+void FMesaMovementSimulation::SetProxyLOD(EMesaProxyLOD NewLOD)
 {
-	if(!bPendingJump) // We aren't jumping.
+	FMesaProxyLODStats& Stats = FMesaProxyLODStats::Get();
+	if (bProxyLODCounted)
 	{
-		return false;
+		--Stats.Proxies[(int32)ProxyLOD];
 	}
 
-	//AMesaPawn* OwnerPawn = GetPawnOwner<AMesaPawn>();
-	//if(OwnerPawn && OwnerPawn->bIsDead) // Cancel jump if dead.
-	//{
-	//	return false;
-	//}
-
-	GroundTrace = {};
-	MovementType = EMovementType::Falling;
-	Velocity.Z = MesaMovementConfig::JumpSpeed;
-	return true;
+	++Stats.Proxies[(int32)NewLOD];
+	bProxyLODCounted = true;
+	ProxyLOD = NewLOD;
 }
 
-// Handles user acceleration input (Quake 2 Style Acceleration)
-void FMesaMovementSimulation::Accelerate(float DeltaTime, FVector WishDirection, float WishSpeed, float Acceleration)
+void FMesaMovementSimulation::SimulateProxyLOD(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync)
 {
-	float AddSpeed, AccelerationSpeed, CurrentSpeed;
-
-	CurrentSpeed = Velocity | WishDirection;					// See if we are changing direction a bit
-	AddSpeed = WishSpeed - CurrentSpeed;						// Reduce wishspeed by the amount of veer.
-	if(AddSpeed <= 0) 											// If not going to add any speed, done.
+	// Far proxies hold still and catch up every FarInterval frames.
+	LODPendingMS += StepMS;
+	if (++LODHeldFrames < (ProxyLOD == EMesaProxyLOD::Far ? FMath::Max(MesaPawnSimCVars::LODFarInterval, 1) : 1))
 	{
 		return;
 	}
 
-	AccelerationSpeed = Acceleration * DeltaTime * WishSpeed;	// Determine amount of acceleration.
-	if(AccelerationSpeed > AddSpeed)							// Cap at addspeed
+	const float DeltaSeconds = (float)LODPendingMS / 1000.f / LODHeldFrames;
+	const int32 Commands = LODHeldFrames;
+	LODPendingMS = 0;
+	LODHeldFrames = 0;
+
+	// No queries, the step the server dead reckons with. Authority states pull it back and the driver smooths that out.
+	OutSync = InSync;
+	for (int32 Index = 0; Index < Commands; ++Index)
 	{
-		AccelerationSpeed = AddSpeed;
+		FMesaDeadReckoning::Step(Cmd, DeltaSeconds, OutSync);
 	}
 
-	Velocity += AccelerationSpeed * WishDirection;				// Adjust velocity.
+	TeleportUpdatedComponent(OutSync);
 }
 
-void FMesaMovementSimulation::ApplyFriction(float DeltaTime)
+bool FMesaMovementSimulation::ShouldSendToSimulatedProxies(double Time)
 {
-	float Speed, NewSpeed, Control, Drop;
-
-#if QUAKESTYLE // QUAKE 3 ARENA STYLE
-	if(MovementType == EMovementType::Walking)
+	if (!FMesaDeadReckoning::IsEnabled() || !bHasLatestSync)
 	{
-		Velocity.Z = 0.f; // Ignore slope movement.
+		DeadReckoning.bHasSent = false;
+		return true;
 	}
 
-	Speed = Velocity.Size(); // Calculate speed.
-	if(Speed < 1.f) // If too slow, return.
+	FMesaDeadReckoningStats& Stats = FMesaDeadReckoningStats::Get();
+	++Stats.Checks;
+
+	double Error;
+	switch (DeadReckoning.Update(LatestSync, LatestCmd, LatestStepMS, Time, &Error))
 	{
-		Velocity = FVector(FVector2D(0.f), Velocity.Z);
-		return;
+	case EMesaSendReason::None:
+		++Stats.Suppressed;
+		Stats.MaxSuppressedError = FMath::Max(Stats.MaxSuppressedError, Error);
+		return false;
+	case EMesaSendReason::Heartbeat:
+		++Stats.Heartbeats;
+		return true;
+	case EMesaSendReason::Diverged:
+		++Stats.Diverged;
+		return true;
+	default:
+		return true;
 	}
+}
 
-	Drop = 0.f;
+void FMesaMovementSimulation::ConsumeAcceptedError()
+{
+	const FMesaMovementSyncState* Predicted = nullptr;
+	int32 PredictedFrame = INDEX_NONE;
 
-	if(MovementType == EMovementType::Walking) // Apply ground friction
+	for (const FMesaPredictedState& Entry : PredictedStates)
 	{
-		Control = Speed < MesaMovementConfig::StopSpeed ? MesaMovementConfig::StopSpeed : Speed;
-		Drop += Control * MesaMovementConfig::Friction * DeltaTime;
-	}
+		if (Entry.State && Entry.State->bAcceptedError)
+		{
+			Entry.State->bAcceptedError = false;
+			++FMesaReconcileStats::Get().Accepted;
 
-	if(MovementType == EMovementType::Flying)
-	{
-		Drop += Speed * MesaMovementConfig::FlightFriction * DeltaTime;
+			if (Entry.Frame > PredictedFrame)
+			{
+				Predicted = Entry.State;
+				PredictedFrame = Entry.Frame;
+			}
+		}
 	}
 
-	NewSpeed = Speed - Drop; // Scale the velocity
-	if(NewSpeed < 0.f)
+	// Frames predicted since then already carry what was bled in meanwhile, only the rest is still owed.
+	// Replaced rather than accumulated, every authority state is a fresher measure of the same error.
+	if (Predicted)
 	{
-		NewSpeed = 0.f;
+		ConvergeRemaining = Predicted->AcceptedError - (LatestSync.Converged - Predicted->Converged);
 	}
-	NewSpeed /= Speed;
-	Velocity *= NewSpeed;
-#else // SOURCE STYLE
-	float Friction;
+}
 
-	Speed = Velocity.Size(); 	// Calculate speed.
-	if(Speed < 0.1f) 			// If too slow, return.
+void FMesaMovementSimulation::Converge(int32 StepMS, FMesaMovementSyncState& OutSync)
+{
+	if (ConvergeRemaining.SizeSquared() < FMath::Square(MesaPawnSimCVars::ConvergeMinError))
 	{
+		ConvergeRemaining = FVector::ZeroVector;
 		return;
 	}
 
-	Drop = 0.f;
+	const float HalfLife = MesaPawnSimCVars::ConvergeHalfLife;
+	const float Alpha = HalfLife > 0.f ? 1.f - FMath::Exp2(-((float)StepMS / 1000.f) / HalfLife) : 1.f;
+	const FVector Step = ConvergeRemaining * Alpha;
 
-	if(MovementType == EMovementType::Walking)
-	{
-		Friction = MesaMovementConfig::Friction;
+	// Swept like any other move, so it can't push us into a wall. A blocked part is dropped rather than retried,
+	// the next authority state says whether it still matters.
+	FMesaMoveHit Hit;
+	Sweep(Step, OutSync.Rotation.Quaternion(), Hit);
 
-		// Bleed of some speed, but if we have less than the bleed threshold, bleed the threshold value.
-		Control = (Speed < MesaMovementConfig::StopSpeed) ? MesaMovementConfig::StopSpeed : Speed;
-		Drop += Control * Friction * DeltaTime;
-	}
+	const FVector Location = GetLocation();
+	OutSync.Converged += Location - OutSync.Location;
+	OutSync.Location = Location;
+	ConvergeRemaining -= Step;
+
+	++FMesaReconcileStats::Get().Converging;
+}
+
+void FMesaMovementSimulation::BeginCorrection(const FVector& PresentedLocation)
+{
+	CorrectionFrame = LastSimulatedFrame;
+	CorrectionFrom = PresentedLocation;
+	bHasCorrection = false;
+}
+
+bool FMesaMovementSimulation::ConsumeCorrection(FVector& OutDelta)
+{
+	const bool bResult = bHasCorrection;
+	OutDelta = bHasCorrection ? CorrectionDelta : FVector::ZeroVector;
+	CorrectionFrame = INDEX_NONE;
+	bHasCorrection = false;
+	return bResult;
+}
+
+void FMesaMovementSimulation::RecordMatchStep(int32 Frame, int32 StepMS, const FMovementCommand& Command, uint16 Sequence, EMesaMatchRecordFlags Flags, const FMesaMovementSyncState& InSync, const FMesaMovementSyncState& OutSync) const
+{
+	FMesaMatchRecord Record;
+	FMemory::Memzero(Record);
+	Record.Tick = (uint32)GFrameCounter;
+	Record.InstanceId = TraceInstanceId;
+	Record.Frame = Frame;
+	Record.StepMS = (uint16)FMath::Clamp(StepMS, 0, (int32)MAX_uint16);
+	Record.Sequence = Sequence;
+	Record.Command = Command;
+	Record.Flags = (uint8)Flags;
+	Record.InSync.From(InSync);
+	Record.OutSync.From(OutSync);
+
+	MesaMatchRecorder::Record(Record);
+}
+
+void FMesaMovementSimulation::BeginTrace(FMesaMoveTraceRecord& Record, const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, bool bResimulation)
+{
+	Record.Cycles = FPlatformTime::Cycles64();
+	Record.InstanceId = TraceInstanceId;
+	Record.Frame = TimeStep.Frame;
+	Record.StepMS = (uint16)FMath::Clamp(TimeStep.StepMS, 0, (int32)MAX_uint16);
+	Record.Flags = (uint8)((bResimulation ? EMesaMoveTraceFlags::Resimulation : EMesaMoveTraceFlags::None)
+		| (Input.Cmd->bJumpPressed ? EMesaMoveTraceFlags::JumpPressed : EMesaMoveTraceFlags::None));
+	Record.NumHits = 0;
+	Record.YawInput = Input.Cmd->YawInput;
+	Record.MovementInput = FVector3f(Input.Cmd->MovementInput);
+	Record.InLocation = Input.Sync->Location;
+	Record.InVelocity = FVector3f(Input.Sync->Velocity);
+	Record.InYaw = Input.Sync->Rotation.Yaw;
+	Record.Pitch = Input.Sync->Rotation.Pitch;
+
+	TraceNumHits = 0;
+	bTraceGroundProbed = false;
+}
 
-	NewSpeed = Speed - Drop; 	// Scale the velocity.
-	if(NewSpeed < 0)
+void FMesaMovementSimulation::EndTrace(FMesaMoveTraceRecord& Record, const FMesaMovementSyncState& OutSync)
+{
+	EMesaMoveTraceFlags Flags = (EMesaMoveTraceFlags)Record.Flags;
+	Flags |= OutSync.MovementType == EMovementType::Walking ? EMesaMoveTraceFlags::Walking : EMesaMoveTraceFlags::None;
+	Flags |= OutSync.MovementType == EMovementType::Flying ? EMesaMoveTraceFlags::Flying : EMesaMoveTraceFlags::None;
+	Flags |= bTraceGroundProbed ? EMesaMoveTraceFlags::GroundProbed : EMesaMoveTraceFlags::None;
+
+	Record.Flags = (uint8)Flags;
+	Record.NumHits = (uint8)FMath::Min<int32>(TraceNumHits, MAX_uint8);
+	Record.OutLocation = OutSync.Location;
+	Record.OutVelocity = FVector3f(OutSync.Velocity);
+	Record.OutYaw = OutSync.Rotation.Yaw;
+
+	MesaMovementTrace::CommitRecord();
+}
+
+bool FMesaMovementSimulation::ProbeGround(FMesaMoveHit& OutHit)
+{
+	OutHit = FMesaMoveHit();
+	if (!UpdatedPrimitive)
 	{
-		NewSpeed = 0;
+		return false;
 	}
 
-	if(NewSpeed != Speed)
+	bTraceGroundProbed = true;
+
+	// Sweep the whole capsule down a little so ledges and slopes under the footprint count, not just the centre.
+	GroundTrace = FHitResult(1.f);
+	SweepTest(FVector(0.f, 0.f, -MesaMovementConfig::GroundProbeDistance), GetUpdateComponentTransform().GetRotation(), GroundTrace);
+
+	OutHit.Normal = GroundTrace.Normal;
+	OutHit.Time = GroundTrace.Time;
+	OutHit.bBlockingHit = GroundTrace.bBlockingHit;
+	OutHit.bStartPenetrating = GroundTrace.bStartPenetrating;
+
+	if (GroundTrace.bBlockingHit)
 	{
-		NewSpeed /= Speed; 		// Determine proportion of old speed we are using.
-		Velocity *= NewSpeed; 	// Adjust velocity according to proportion.
+		AddContact(GroundTrace.GetComponent());
 	}
-#endif
-}
 
-void FMesaMovementSimulation::TraceForGround()
-{
-	UCapsuleComponent* OwnerCapsule = Cast<UCapsuleComponent>(UpdatedComponent);
-	FVector CapsuleOrigin = OwnerCapsule->GetComponentLocation() - OwnerCapsule->GetScaledCapsuleHalfHeight();
-	
-	UpdatedComponent->GetWorld()->LineTraceSingleByChannel( // Trace down 1 unit for ground
-		GroundTrace,
-		CapsuleOrigin,
-		CapsuleOrigin - FVector(0.f, 0.f, 1.f),
-		ECollisionChannel::ECC_Visibility
-	);
-	MovementType = GroundTrace.bBlockingHit ? EMovementType::Walking : EMovementType::Falling;
-}
\ No newline at end of file
+	return GroundTrace.bBlockingHit;
+}
@@ -3,57 +3,132 @@
 #pragma once
 
 #include "MesaMovementTypes.h"
+#include "MesaMovementKernel.h"
 #include "Misc/StringBuilder.h"
 #include "NetworkPredictionReplicationProxy.h"
 #include "NetworkPredictionStateTypes.h"
 #include "NetworkPredictionTickState.h"
 #include "NetworkPredictionSimulation.h"
 
-#define QUAKESTYLE		0
-
-namespace MesaMovementConfig
-{
-	const float MovementSpeed 		= 500.f;
-	const float Gravity 			= 800.f;
-	const float StopSpeed 			= 100.f;
-	const float Acceleration 		= 10.f;
-	const float AirAcceleration 	= 1.f;
-	const float FlightAcceleration	= 8.f;
-	const float Friction 			= 6.f;
-	const float FlightFriction 		= 3.f;
-	const float JumpSpeed 			= 350.f;
-}
+class UCapsuleComponent;
+class UPrimitiveComponent;
+class UMesaCollisionSubsystem;
+struct FMesaMoveTraceRecord;
+enum class EMesaMatchRecordFlags : uint8;
 
 /*
 	Base Simulation for Game Movement designed to be a lightweight alternative to CMC.
 	The "Simulation" provides all the actual movement code, of which we derive from Quake.
+	The math itself lives in the PMove kernel (MesaMovementKernel.h), the simulation feeds it NP state and
+	provides collision through IMesaMoveCollision on top of the UpdatedComponent.
 */
 
+// Pawn frames simulated vs replayed from history during rollbacks, game thread only. See MesaMovement.RollbackStats.
+struct FMesaRollbackStats
+{
+	uint64 Resimulated = 0;
+	uint64 Replayed = 0;
+	double StartSeconds = FPlatformTime::Seconds();
+
+	static MESACORE_API FMesaRollbackStats& Get();
+};
+
+// Every SimulationTick and what it cost, game thread only. See MesaMovement.TickStats.
+struct FMesaSimulationTickStats
+{
+	uint64 Ticks = 0;
+	uint64 Cycles = 0;
+	double StartSeconds = FPlatformTime::Seconds();
+
+	static MESACORE_API FMesaSimulationTickStats& Get();
+};
+
+// How much of the simulation a simulated proxy runs, picked by its driver. See UMesaMovementComponent::UpdateProxyLOD.
+enum class EMesaProxyLOD : uint8
+{
+	ForwardPredict,	// Full move with collision.
+	Extrapolate,	// The last replicated command held, without collision, see FMesaDeadReckoning::Step.
+	Far,			// As Extrapolate, every MesaMovement.LOD.FarInterval frames.
+	Num
+};
+
+// Simulated proxies per LOD and what their ticks cost, game thread only. See MesaMovement.ProxyLODStats.
+struct FMesaProxyLODStats
+{
+	int32 Proxies[(int32)EMesaProxyLOD::Num] = {};
+	uint64 Ticks[(int32)EMesaProxyLOD::Num] = {};
+	uint64 Cycles[(int32)EMesaProxyLOD::Num] = {};
+
+	static MESACORE_API FMesaProxyLODStats& Get();
+};
+
 struct FMesaMovementInputCmd // Input Cmd generated by the Client
 {
-	float YawInput;
+	// Most previous commands a single command can carry, see MesaMovement.InputRedundancy.
+	static constexpr int32 MaxRedundant = 8;
+
+	float YawInput;			// Degrees to turn this command.
 	FVector MovementInput;
 	bool bJumpPressed;
 
+	uint16 Sequence;	// Client command number, wraps. Lets the server tell a lost command from a repeated one.
+	uint8 StepMS;		// Step the client produced the command for.
+	TArray<FMesaRedundantCommand, TInlineAllocator<4>> Redundant; // Newest first, Redundant[0] is Sequence - 1.
+
 	FMesaMovementInputCmd()
 		: 	YawInput(ForceInitToZero),
 			MovementInput(ForceInitToZero),
-			bJumpPressed(false)
+			bJumpPressed(false),
+			Sequence(0),
+			StepMS(0)
 	{}
 
-	void NetSerialize(const FNetSerializeParams& P)
+	// YawInput for running the command again over InStepMS. Simulated proxies repeat the last command they were sent
+	// every frame at their own step, scaled like this they turn at the rate the client did.
+	float GetYawInputFor(int32 InStepMS) const
 	{
-		P.Ar << YawInput;
-		P.Ar << MovementInput;
-		P.Ar << bJumpPressed;
+		return StepMS > 0 && InStepMS != StepMS ? YawInput * (float)InStepMS / (float)StepMS : YawInput;
 	}
 
+	// Sent as an FMovementCommand, sequence and step plus the redundant tail, delta coded. ProduceInput quantizes the
+	// local command the same way so the client predicts with exactly what the server will run.
+	void NetSerialize(const FNetSerializeParams& P);
+
+	FMovementCommand Pack() const;
+	void Unpack(const FMovementCommand& Command);
+	void Quantize() { Unpack(Pack()); }
+
 	void ToString(FAnsiStringBuilderBase& Out) const
 	{
 		Out.Appendf("YawInput: %.2f\n", YawInput);
 		Out.Appendf("MovementInput: X=%.2f Y=%.2f Z=%.2f\n", MovementInput.X, MovementInput.Y, MovementInput.Z);
 		Out.Appendf("bJumpPressed: X=%\n", bJumpPressed ? TEXT("True") : TEXT("False"));
 	}
+
+	bool Identical(const FMesaMovementInputCmd& Other) const
+	{
+		return YawInput == Other.YawInput && MovementInput == Other.MovementInput && bJumpPressed == Other.bJumpPressed;
+	}
+};
+
+// What a client does with a prediction error, see FMesaMovementSimulation::ClassifyError.
+enum class EMesaReconcileTier : uint8
+{
+	Accept,		// Inside the error budget. No resim, the error is bled into the next predicted frames instead.
+	Resim,		// Resimulate. The driver hides the correction behind a decaying visual offset.
+	Snap,		// Resimulate and snap the presentation, too far off to hide.
+};
+
+// Reconcile decisions, game thread only. See MesaMovement.ReconcileStats.
+struct FMesaReconcileStats
+{
+	uint64 Accepted = 0;	// Authority states inside the error budget, picked up by the simulation that predicted them.
+	uint64 Resims = 0;		// Rollbacks that moved one of this client's pawns.
+	uint64 Snaps = 0;		// Corrections the driver showed as they are.
+	uint64 Smoothed = 0;	// Corrections the driver blended out rather than snapped.
+	uint64 Converging = 0;	// Ticks that moved an accepted error's worth towards the authority.
+
+	static MESACORE_API FMesaReconcileStats& Get();
 };
 
 struct FMesaMovementSyncState // State we are evolving frame to frame and keeping in sync
@@ -62,19 +137,48 @@ struct FMesaMovementSyncState // State we are evolving frame to frame and keepin
 	FVector Velocity;
 	FRotator Rotation;
 
+	// Movement mode the last tick ran with, and the ground contact it left for the next one (see FMesaGroundState).
+	// Part of the sync state so a rollback restores them with everything else instead of re-probing.
+	EMovementType MovementType;
+	EMesaGroundContact GroundContact;
+	uint8 GroundAge;
+	float GroundDistance;
+	FVector GroundNormal;
+
+	// Local only, never sent or compared. How much accepted error the predicting client had bled in up to this state,
+	// and the Accept tier error ShouldReconcile found against the authority, left for the simulation's next tick.
+	FVector Converged;
+	mutable FVector AcceptedError;
+	mutable bool bAcceptedError;
+
 	FMesaMovementSyncState()
 	: Location(ForceInitToZero)
 	, Velocity(ForceInitToZero)
 	, Rotation(ForceInitToZero)
+	, MovementType(EMovementType::Falling)
+	, GroundContact(EMesaGroundContact::Unknown)
+	, GroundAge(0)
+	, GroundDistance(0.f)
+	, GroundNormal(ForceInitToZero)
+	, Converged(ForceInitToZero)
+	, AcceptedError(ForceInitToZero)
+	, bAcceptedError(false)
 	{ }
 
 	bool ShouldReconcile(const FMesaMovementSyncState& AuthorityState) const;
 
-	void NetSerialize(const FNetSerializeParams& P)
+	// Quantized, see the .cpp for the layout. Expects a bit archive, which is what NP replicates through.
+	void NetSerialize(const FNetSerializeParams& P);
+
+	// Mode, contact and age in one byte, plus three more for normal and distance when on the ground.
+	void NetSerializeGround(FArchive& Ar);
+
+	// Exact comparison, true only when a tick from this state would reproduce the same output.
+	bool Identical(const FMesaMovementSyncState& Other) const
 	{
-		P.Ar << Location;
-		P.Ar << Velocity;
-		P.Ar << Rotation;
+		return Location == Other.Location && Velocity == Other.Velocity && Rotation == Other.Rotation
+			&& MovementType == Other.MovementType && GroundContact == Other.GroundContact && GroundAge == Other.GroundAge
+			&& GroundDistance == Other.GroundDistance && GroundNormal == Other.GroundNormal;
 	}
 
 	void ToString(FAnsiStringBuilderBase& Out) const
@@ -82,22 +186,30 @@ struct FMesaMovementSyncState // State we are evolving frame to frame and keepin
 		Out.Appendf("Loc: X=%.2f Y=%.2f Z=%.2f\n", Location.X, Location.Y, Location.Z);
 		Out.Appendf("Vel: X=%.2f Y=%.2f Z=%.2f\n", Velocity.X, Velocity.Y, Velocity.Z);
 		Out.Appendf("Rot: P=%.2f Y=%.2f R=%.2f\n", Rotation.Pitch, Rotation.Yaw, Rotation.Roll);
+		Out.Appendf("Mode: %d Ground: %d Age: %d Dist: %.2f\n", (int32)MovementType, (int32)GroundContact, (int32)GroundAge, GroundDistance);
+		Out.Appendf("GroundNormal: X=%.2f Y=%.2f Z=%.2f\n", GroundNormal.X, GroundNormal.Y, GroundNormal.Z);
 	}
 
-	void Interpolate(const FMesaMovementSyncState* From, const FMesaMovementSyncState* To, float PCT)
+	void ToGroundState(FMesaGroundState& Out) const
 	{
-		static constexpr float TeleportThreshold = 1000.f * 1000.f;
-		if (FVector::DistSquared(From->Location, To->Location) > TeleportThreshold)
-		{
-			*this = *To;
-		}
-		else
-		{
-			Location = FMath::Lerp(From->Location, To->Location, PCT);
-			Velocity = FMath::Lerp(From->Velocity, To->Velocity, PCT);
-			Rotation = FMath::Lerp(From->Rotation, To->Rotation, PCT);
-		}
+		Out.Normal = GroundNormal;
+		Out.Location = Location;
+		Out.Distance = GroundDistance;
+		Out.Contact = GroundContact;
+		Out.Age = GroundAge;
 	}
+
+	void FromGroundState(const FMesaGroundState& Ground)
+	{
+		GroundNormal = Ground.Normal;
+		GroundDistance = Ground.Distance;
+		GroundContact = Ground.Contact;
+		GroundAge = Ground.Age;
+	}
+
+	// Cubic Hermite on location and velocity, or linear, per MesaMovement.Interpolation.Hermite. Yaw takes the short way round.
+	void Interpolate(const FMesaMovementSyncState* From, const FMesaMovementSyncState* To, float PCT);
+	void Interpolate(const FMesaMovementSyncState* From, const FMesaMovementSyncState* To, float PCT, bool bHermite);
 };
 
 // Epic naming is so shit, guess "Aux" just means "Extra" - fuck knows.
@@ -119,12 +231,108 @@ struct FMesaMovementAuxState
 	}
 };
 
+// Client commands the server saw, lost and recovered, game thread only. See MesaMovement.InputStats.
+struct FMesaInputStats
+{
+	uint64 Received = 0;
+	uint64 Repeated = 0;	// NP ran a command we already had, nothing new arrived in time.
+	uint64 Lost = 0;		// Never arrived, not even in a later command's redundant tail.
+	uint64 Recovered = 0;	// Arrived only in a later command's redundant tail.
+
+	static MESACORE_API FMesaInputStats& Get();
+};
+
+// Server side view of one client's command stream. De-duplicates by sequence and recovers lost commands from the
+// redundant tail of the next one that gets through.
+// Also watches the input buffer, commands that arrived but haven't run yet, and works out how much faster or slower
+// the client should run its clock to keep one or two ticks of them (MesaNet.InputBuffer.*).
+struct MESACORE_API FMesaInputReceiver
+{
+	// Fills OutRecovered, oldest first, with the commands that should run before Cmd. False when Cmd is one already
+	// run, NP repeating the last command because the next hasn't arrived. Nothing should be simulated for it then.
+	bool Receive(const FMesaMovementInputCmd& Cmd, TArray<FMesaRedundantCommand, TInlineAllocator<8>>& OutRecovered);
+
+	// A command arrived from the client, before NP buffered it.
+	void Arrive(uint16 Sequence);
+
+	// Set while the server deserializes a client's input RPC, so NetSerialize knows whose commands it is reading.
+	static FMesaInputReceiver* Arriving;
+
+	uint16 LastSequence = 0;
+	bool bHasSequence = false;
+
+	// Input buffer
+	uint16 NewestSequence = 0;
+	bool bHasArrival = false;
+	int32 Depth = 0;				// Commands buffered when the last one ran.
+	float SmoothedDepth = 0.f;
+	float DepthJitter = 0.f;		// Smoothed absolute deviation from SmoothedDepth.
+	float TargetDepth = 1.f;
+	float TimeDilation = 1.f;		// What the client should run at.
+	uint32 Starvations = 0;			// Ticks that ran with nothing new buffered.
+	uint32 Overflows = 0;			// Times the buffer went past MesaNet.InputBuffer.MaxDepth.
+};
+
+// Why a sync state went out to simulated proxies, see FMesaDeadReckoning.
+enum class EMesaSendReason : uint8
+{
+	None,		// Suppressed, proxies can extrapolate it.
+	Initial,
+	Diverged,	// Location, yaw or movement mode moved off the extrapolation.
+	Heartbeat,	// Nothing diverged for MesaMovement.DeadReckoning.Heartbeat seconds.
+};
+
+// Sync state sends to simulated proxies, server only. See MesaMovement.DeadReckoningStats.
+struct FMesaDeadReckoningStats
+{
+	uint64 Checks = 0;
+	uint64 Diverged = 0;
+	uint64 Heartbeats = 0;
+	uint64 Suppressed = 0;
+	double MaxSuppressedError = 0.0;	// Worst location error a proxy was left extrapolating with.
+
+	static MESACORE_API FMesaDeadReckoningStats& Get();
+};
+
+/*
+	Server side copy of what simulated proxies extrapolate from the last sync state and command they were sent: that
+	command held, stepped through the kernel's velocity phase without collision. LOD proxies run exactly this, forward
+	predicted ones the full move, which is the same until something gets in the way. As long as the real state stays
+	within MesaMovement.DeadReckoning.Threshold of it there is nothing new worth sending.
+*/
+struct MESACORE_API FMesaDeadReckoning
+{
+	static bool IsEnabled();
+
+	// One command from InOut without collision queries.
+	static void Step(const FMesaMovementInputCmd& Cmd, float DeltaSeconds, FMesaMovementSyncState& InOut);
+
+	// Decides whether State, simulated from Cmd over StepMS, has to be sent at Time (seconds), and rebases the
+	// extrapolation on them if so.
+	EMesaSendReason Update(const FMesaMovementSyncState& State, const FMesaMovementInputCmd& Cmd, int32 StepMS, double Time, double* OutError = nullptr);
+
+	// Where proxies have got to by Time, carries on from the last call. Steps at the sent command's own rate, proxies
+	// step at theirs but scale the turn to match (FMesaMovementInputCmd::GetYawInputFor), close enough without collision.
+	const FMesaMovementSyncState& Extrapolate(double Time);
+
+	FMesaMovementSyncState Sent;
+	FMesaMovementInputCmd SentCmd;
+	int32 SentStepMS = 0;
+	double SentTime = 0.0;
+	bool bHasSent = false;
+
+	FMesaMovementSyncState Extrapolated;
+	double ExtrapolatedTime = 0.0;
+};
+
 using MesaMovementStateTypes = TNetworkPredictionStateTypes<FMesaMovementInputCmd, FMesaMovementSyncState, FMesaMovementAuxState>;
 
-class FMesaMovementSimulation
+class FMesaMovementSimulation : public IMesaMoveCollision
 {
 public:
 
+	virtual ~FMesaMovementSimulation();
+
 	bool SafeMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult& OutHit, ETeleportType Teleport) const;
 	bool MoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult* OutHit, ETeleportType Teleport) const;
 	FTransform GetUpdateComponentTransform() const;
@@ -140,16 +348,155 @@ public:
 	/**  Flags that control the behavior of calls to MoveComponent() on our UpdatedComponent. */
 	mutable EMoveComponentFlags MoveComponentFlags = MOVECOMP_NoFlags; // Mutable because we sometimes need to disable these flags ::ResolvePenetration. Better way may be possible
 
-	void SetComponents(USceneComponent* InUpdatedComponent, UPrimitiveComponent* InPrimitiveComponent)
-	{
-		UpdatedComponent = InUpdatedComponent;
-		UpdatedPrimitive = InPrimitiveComponent;
-	}
+	void SetComponents(USceneComponent* InUpdatedComponent, UPrimitiveComponent* InPrimitiveComponent);
+
+	/**
+	 * Ghost mode, used for resimulation (MesaMovement.GhostRollback).
+	 * Between BeginGhost and EndGhost the simulation moves a transform of its own instead of the UpdatedComponent,
+	 * querying the scene with the primitive's shape but never writing to it. The driver writes the real component
+	 * once, from FinalizeFrame, so a rollback doesn't drag physics, overlaps and attached children through every
+	 * replayed frame.
+	 */
+	void BeginGhost(const FTransform& Transform);
+	bool EndGhost(); // Returns true if a ghost was active.
+	bool IsGhostActive() const { return bGhostActive; }
+
+	/**
+	 * Correction tracking. Call BeginCorrection from RestoreFrame with where the component is presented, then once the
+	 * resim has replayed that frame ConsumeCorrection returns how far the rollback moved it.
+	 */
+	void BeginCorrection(const FVector& PresentedLocation);
+	bool ConsumeCorrection(FVector& OutDelta);
+
+	/**
+	 * Selective rollback (MesaMovement.SelectiveRollback). Call BeginRollback from RestoreFrame. While resimulating, a
+	 * frame whose input and command match what was stored for it, and whose recorded contacts aren't dirty, replays
+	 * the stored output instead of running the move. Pawns that do run are dirty from that frame on, as is anything
+	 * they touch, and a pawn dirtied after it already replayed the frame runs it again. Off while ghosting: other
+	 * pawns sweep the real components, so neither the contacts nor a replayed ghost position would be right. Since
+	 * ghosting is the default it ships off, and nothing is recorded for it then.
+	 */
+	void BeginRollback(const FMesaMovementSyncState& RestoredState);
+
+	// Simulated proxies only. The first call also starts counting this sim in FMesaProxyLODStats.
+	void SetProxyLOD(EMesaProxyLOD NewLOD);
+	EMesaProxyLOD GetProxyLOD() const { return ProxyLOD; }
+
+	// GFrameCounter of the last time another simulated pawn's sweep hit this one.
+	uint64 GetLastContactFrame() const { return LastContactFrame; }
+
+	// Authority. The client's command stream and input buffer.
+	FMesaInputReceiver& GetInputReceiver() { return InputReceiver; }
+
+	// Authority. True if the newest simulated state has to go to simulated proxies, see FMesaDeadReckoning.
+	bool ShouldSendToSimulatedProxies(double Time);
+
+	// Runs one authoritative step outside NP, starting with the component teleported to InSync. For the match replay.
+	void ReplayStep(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync);
+
+	// Tiers a location error against the per axis, velocity scaled budgets (MesaMovement.ErrorTolerance etc).
+	static MESACORE_API EMesaReconcileTier ClassifyError(const FVector& Error, const FVector& AuthorityVelocity);
 
 protected:
 
+	// Native brush collision (MesaMovement.NativeCollision), sits underneath MoveUpdatedComponent and OverlapTest.
+	bool CanUseNativeCollision(const FQuat& Rotation) const;
+	bool NativeMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, FHitResult& OutHit, ETeleportType Teleport) const;
+	void NativeSweep(const FVector& Start, const FVector& Delta, const FQuat& NewRotation, FHitResult& OutHit) const;
+
+	// Sweeps the updated primitive from where it is without moving it.
+	bool SweepTest(const FVector& Delta, const FQuat& Rotation, FHitResult& OutHit) const;
+
+	bool GhostMoveUpdatedComponent(const FVector& Delta, const FQuat& NewRotation, bool bSweep, FHitResult& OutHit) const;
+
+	mutable FTransform GhostTransform;
+	bool bGhostActive = false;
+
 	USceneComponent* UpdatedComponent = nullptr;
 	UPrimitiveComponent* UpdatedPrimitive = nullptr;
+	UCapsuleComponent* UpdatedCapsule = nullptr;
+	UMesaCollisionSubsystem* CollisionSubsystem = nullptr;
+
+	// Movement trace (MesaMovementTrace.h), filled in alongside the tick.
+	void BeginTrace(FMesaMoveTraceRecord& Record, const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, bool bResimulation);
+	void EndTrace(FMesaMoveTraceRecord& Record, const FMesaMovementSyncState& OutSync);
+
+	// Match recorder (MesaMatchRecorder.h), one record per authoritative SimulateFrame.
+	void RecordMatchStep(int32 Frame, int32 StepMS, const FMovementCommand& Command, uint16 Sequence, EMesaMatchRecordFlags Flags, const FMesaMovementSyncState& InSync, const FMesaMovementSyncState& OutSync) const;
+
+	uint32 TraceInstanceId = 0;
+	int32 TraceNumHits = 0;
+	bool bTraceGroundProbed = false;
+
+	int32 LastSimulatedFrame = INDEX_NONE;
+
+	// Selective rollback
+	struct FMesaFrameRecord
+	{
+		int32 Frame = INDEX_NONE;
+		FMesaMovementInputCmd Cmd;
+		FMesaMovementSyncState InSync;
+		FMesaMovementSyncState OutSync;
+		TArray<const UPrimitiveComponent*, TInlineAllocator<2>> Contacts; // Other simulated pawns the frame hit. Keys only, never dereferenced.
+		bool bGhost = false; // Simulated as a ghost, the contacts came from stale components.
+	};
+
+	static constexpr uint32 HistorySize = 64; // Frames, covers NP's default rollback buffer.
+
+	void SimulateFrame(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync, bool bRepeatedCmd = false);
+	bool ReplayFrame(const FNetSimTimeStep& TimeStep, const TNetSimInput<MesaMovementStateTypes>& Input, FMesaMovementSyncState& OutSync);
+	void MarkDirty(int32 Frame);
+	bool IsDirtyAt(int32 Frame) const;
+	void RerunReplayedFrame();
+	void AddContact(const UPrimitiveComponent* Component);
+
+	TArray<FMesaFrameRecord> History;
+	TArray<const UPrimitiveComponent*, TInlineAllocator<2>> CurrentContacts;
+	uint64 RollbackPass = 0;			// GFrameCounter of the rollback DirtyFromFrame belongs to.
+	int32 DirtyFromFrame = MAX_int32;
+	int32 CurrentFrame = INDEX_NONE;
+	bool bResimulatingFrame = false;
+	FMesaMovementSyncState* ReplayedOutput = nullptr;	// NP's output for ReplayedFrame, only valid until our next tick.
+	int32 ReplayedFrame = INDEX_NONE;
+	int32 ReplayedStepMS = 0;
+
+	FMesaInputReceiver InputReceiver; // Authority only.
+
+	FMesaDeadReckoning DeadReckoning;	// Authority only.
+	FMesaMovementSyncState LatestSync;	// Newest state simulated, not resimulated.
+	FMesaMovementInputCmd LatestCmd;	// And the command it was simulated from,
+	int32 LatestStepMS = 0;				// over this step.
+	bool bHasLatestSync = false;
+
+	// Proxy LOD
+	void SimulateProxyLOD(int32 StepMS, const FMesaMovementInputCmd& Cmd, const FMesaMovementSyncState& InSync, FMesaMovementSyncState& OutSync);
+	void TeleportUpdatedComponent(const FMesaMovementSyncState& Sync);
+
+	EMesaProxyLOD ProxyLOD = EMesaProxyLOD::ForwardPredict;
+	bool bProxyLODCounted = false;
+	int32 LODPendingMS = 0;
+	int32 LODHeldFrames = 0;
+	uint64 LastContactFrame = 0;
+
+	// Accept tier convergence
+	struct FMesaPredictedState
+	{
+		int32 Frame = INDEX_NONE;
+		const FMesaMovementSyncState* State = nullptr; // NP's buffer entry, where ShouldReconcile leaves the accepted error.
+	};
+
+	// Picks up the newest error ShouldReconcile accepted against a state we predicted. The part not already bled in
+	// since then is moved off over the next ticks, see MesaMovement.ConvergeHalfLife.
+	void ConsumeAcceptedError();
+	void Converge(int32 StepMS, FMesaMovementSyncState& OutSync);
+
+	FMesaPredictedState PredictedStates[HistorySize];
+	FVector ConvergeRemaining = FVector::ZeroVector;
+
+	int32 CorrectionFrame = INDEX_NONE;
+	FVector CorrectionFrom = FVector::ZeroVector;
+	FVector CorrectionDelta = FVector::ZeroVector;
+	bool bHasCorrection = false;
 
 public:
 
@@ -163,28 +510,16 @@ public:
 	/** Dev tool to force simple mispredict */
 	static bool ForceMispredict;
 
-protected:
-
-	float SlideAlongSurface(const FVector& Delta, float Time, const FQuat Rotation, const FVector& Normal,
-	    FHitResult& Hit, bool bHandleImpact);
-
-
 public:
 
-	FRotator			PlayerRotation		= FRotator::ZeroRotator;
-	FVector				MovementInput		= FVector::ZeroVector;
-	FVector				Velocity			= FVector::ZeroVector;
-	FHitResult			GroundTrace			= {};
-	EMovementType 		MovementType 		= EMovementType::Falling;
-	bool				bPendingJump 		= false;
-
-	void Accelerate(float DeltaTime, FVector WishDirection, float WishSpeed, float Acceleration);
-	void ApplyFriction(float DeltaTime);
-
-	void WalkMove(float DeltaTime);
-	void AirMove(float DeltaTime);
-	void FlyMove(float DeltaTime);
+	// ~Begin IMesaMoveCollision
+	virtual void Sweep(const FVector& Delta, const FQuat& Rotation, FMesaMoveHit& OutHit) override;
+	virtual bool Overlap(const FVector& Location, const FQuat& Rotation) const override;
+	virtual bool ProbeGround(FMesaMoveHit& OutHit) override;
+	virtual FVector GetLocation() const override;
+	// ~End IMesaMoveCollision
 
-	bool CheckJump();
-	void TraceForGround();
+	// Kernel state for the frame being simulated, rebuilt from NP input every tick.
+	FMesaPMoveState		PMove;
+	FHitResult			GroundTrace			= {};	// Last real ground probe.
 };
\ No newline at end of file
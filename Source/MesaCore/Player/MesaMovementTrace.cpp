@@ -0,0 +1,224 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaMovementTrace.h"
+#include "MesaCoreMacros.h"
+
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "UObject/UObjectArray.h"
+
+#include <atomic>
+
+namespace MesaMovementTraceCVars
+{
+	static int32 Enabled = 1;
+	static FAutoConsoleVariableRef CVarEnabled(
+		TEXT("MesaMovement.Trace"),
+		Enabled,
+		TEXT("Record every movement simulation tick into the per thread trace buffers. See MesaMovement.Trace.Dump."),
+		ECVF_Default
+	);
+}
+
+namespace MesaMovementTrace
+{
+	static_assert(FMath::IsPowerOfTwo(RecordsPerThread), "RecordsPerThread must be a power of two");
+
+	struct FThreadBuffer
+	{
+		FMesaMoveTraceRecord Records[RecordsPerThread];
+		std::atomic<uint64> WriteCount { 0 };
+	};
+
+	// Buffers are never freed. Only threads that tick movement get one and those live as long as the process.
+	static FCriticalSection BuffersLock;
+	static TArray<FThreadBuffer*> Buffers;
+
+	static FThreadBuffer& GetThreadBuffer()
+	{
+		static thread_local FThreadBuffer* ThreadBuffer = nullptr;
+		if (!ThreadBuffer)
+		{
+			ThreadBuffer = new FThreadBuffer();
+
+			FScopeLock Lock(&BuffersLock);
+			Buffers.Add(ThreadBuffer);
+		}
+
+		return *ThreadBuffer;
+	}
+
+	bool IsEnabled()
+	{
+		return MesaMovementTraceCVars::Enabled != 0;
+	}
+
+	FMesaMoveTraceRecord& BeginRecord()
+	{
+		FThreadBuffer& Buffer = GetThreadBuffer();
+		return Buffer.Records[Buffer.WriteCount.load(std::memory_order_relaxed) & (RecordsPerThread - 1)];
+	}
+
+	void CommitRecord()
+	{
+		FThreadBuffer& Buffer = GetThreadBuffer();
+		Buffer.WriteCount.store(Buffer.WriteCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	int32 DumpToFile(const FString& Filename)
+	{
+		TArray<FMesaMoveTraceRecord> Records;
+		{
+			FScopeLock Lock(&BuffersLock);
+			for (const FThreadBuffer* Buffer : Buffers)
+			{
+				const uint64 WriteCount = Buffer->WriteCount.load(std::memory_order_acquire);
+				const uint64 NumRecords = FMath::Min<uint64>(WriteCount, RecordsPerThread);
+
+				for (uint64 Index = WriteCount - NumRecords; Index < WriteCount; ++Index)
+				{
+					Records.Add(Buffer->Records[Index & (RecordsPerThread - 1)]);
+				}
+			}
+		}
+
+		Records.Sort([](const FMesaMoveTraceRecord& A, const FMesaMoveTraceRecord& B) { return A.Cycles < B.Cycles; });
+
+		TUniquePtr<FArchive> Writer(IFileManager::Get().CreateFileWriter(*Filename));
+		if (!Writer)
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovementTrace: Failed to open %s for writing"), *Filename);
+			return INDEX_NONE;
+		}
+
+		FMesaMoveTraceFileHeader Header;
+		Header.NumRecords = Records.Num();
+		Header.SecondsPerCycle = FPlatformTime::GetSecondsPerCycle64();
+
+		Writer->Serialize(&Header, sizeof(Header));
+		Writer->Serialize(Records.GetData(), Records.Num() * sizeof(FMesaMoveTraceRecord));
+		if (!Writer->Close())
+		{
+			return INDEX_NONE;
+		}
+
+		// Ids aren't stable across runs, so log what they point at now rather than bloating the file with names.
+		TSet<uint32> InstanceIds;
+		for (const FMesaMoveTraceRecord& Record : Records)
+		{
+			InstanceIds.Add(Record.InstanceId);
+		}
+
+		for (const uint32 InstanceId : InstanceIds)
+		{
+			const FUObjectItem* Item = GUObjectArray.IndexToObject(InstanceId);
+			UE_LOG(LogMesa, Display, TEXT("MesaMovementTrace: Instance %u = %s"), InstanceId, Item ? *GetPathNameSafe(static_cast<UObject*>(Item->Object)) : TEXT("<gone>"));
+		}
+
+		return Records.Num();
+	}
+
+	bool LoadFromFile(const FString& Filename, FMesaMoveTraceFileHeader& OutHeader, TArray<FMesaMoveTraceRecord>& OutRecords)
+	{
+		TArray<uint8> Data;
+		if (!FFileHelper::LoadFileToArray(Data, *Filename))
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovementTrace: Failed to read %s"), *Filename);
+			return false;
+		}
+
+		if (Data.Num() < (int32)sizeof(FMesaMoveTraceFileHeader))
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovementTrace: %s is truncated"), *Filename);
+			return false;
+		}
+
+		FMemory::Memcpy(&OutHeader, Data.GetData(), sizeof(OutHeader));
+
+		if (OutHeader.Magic != FMesaMoveTraceFileHeader::MagicValue || OutHeader.Version != FMesaMoveTraceFileHeader::CurrentVersion
+			|| OutHeader.RecordSize != sizeof(FMesaMoveTraceRecord)
+			|| sizeof(OutHeader) + (uint64)OutHeader.NumRecords * sizeof(FMesaMoveTraceRecord) > (uint64)Data.Num())
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaMovementTrace: %s is not a version %u trace"), *Filename, FMesaMoveTraceFileHeader::CurrentVersion);
+			return false;
+		}
+
+		OutRecords.SetNumUninitialized(OutHeader.NumRecords);
+		FMemory::Memcpy(OutRecords.GetData(), Data.GetData() + sizeof(OutHeader), OutHeader.NumRecords * sizeof(FMesaMoveTraceRecord));
+		return true;
+	}
+
+	bool DecodeToCSV(const FString& TraceFilename, const FString& CSVFilename)
+	{
+		FMesaMoveTraceFileHeader Header;
+		TArray<FMesaMoveTraceRecord> Records;
+		if (!LoadFromFile(TraceFilename, Header, Records))
+		{
+			return false;
+		}
+
+		FString CSV = TEXT("Seconds,Instance,Frame,StepMS,Resim,Replayed,Jump,MoveType,GroundProbed,Hits,YawInput,MoveX,MoveY,MoveZ,")
+			TEXT("InLocX,InLocY,InLocZ,InVelX,InVelY,InVelZ,InYaw,OutLocX,OutLocY,OutLocZ,OutVelX,OutVelY,OutVelZ,OutYaw,Pitch\n");
+
+		const uint64 FirstCycles = Records.Num() > 0 ? Records[0].Cycles : 0;
+		for (const FMesaMoveTraceRecord& Record : Records)
+		{
+			const EMesaMoveTraceFlags Flags = (EMesaMoveTraceFlags)Record.Flags;
+			const TCHAR* MoveType = EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Walking) ? TEXT("Walking") : (EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Flying) ? TEXT("Flying") : TEXT("Falling"));
+
+			CSV += FString::Printf(TEXT("%.6f,%u,%d,%u,%d,%d,%d,%s,%d,%u,%.3f,%.3f,%.3f,%.3f,"),
+				(Record.Cycles - FirstCycles) * Header.SecondsPerCycle, Record.InstanceId, Record.Frame, Record.StepMS,
+				EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Resimulation), EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::Replayed),
+				EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::JumpPressed), MoveType,
+				EnumHasAnyFlags(Flags, EMesaMoveTraceFlags::GroundProbed), Record.NumHits, Record.YawInput,
+				Record.MovementInput.X, Record.MovementInput.Y, Record.MovementInput.Z);
+
+			CSV += FString::Printf(TEXT("%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n"),
+				Record.InLocation.X, Record.InLocation.Y, Record.InLocation.Z, Record.InVelocity.X, Record.InVelocity.Y, Record.InVelocity.Z, Record.InYaw,
+				Record.OutLocation.X, Record.OutLocation.Y, Record.OutLocation.Z, Record.OutVelocity.X, Record.OutVelocity.Y, Record.OutVelocity.Z, Record.OutYaw,
+				Record.Pitch);
+		}
+
+		return FFileHelper::SaveStringToFile(CSV, *CSVFilename);
+	}
+}
+
+static FAutoConsoleCommand CmdTraceDump(
+	TEXT("MesaMovement.Trace.Dump"),
+	TEXT("Writes the movement trace buffers to a .mtr file. Optional filename, defaults to Saved/MovementTrace/<timestamp>.mtr"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		const FString Filename = Args.Num() > 0
+			? Args[0]
+			: FPaths::ProjectSavedDir() / TEXT("MovementTrace") / FDateTime::Now().ToString() + TEXT(".mtr");
+
+		const int32 NumRecords = MesaMovementTrace::DumpToFile(Filename);
+		if (NumRecords != INDEX_NONE)
+		{
+			UE_LOG(LogMesa, Display, TEXT("MesaMovementTrace: Wrote %d records to %s"), NumRecords, *Filename);
+		}
+	})
+);
+
+static FAutoConsoleCommand CmdTraceDecode(
+	TEXT("MesaMovement.Trace.Decode"),
+	TEXT("Decodes a .mtr movement trace to CSV. Args: <trace file> [csv file, defaults to the trace file with .csv]"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		if (Args.Num() == 0)
+		{
+			UE_LOG(LogMesa, Display, TEXT("Usage: MesaMovement.Trace.Decode <trace file> [csv file]"));
+			return;
+		}
+
+		const FString CSVFilename = Args.Num() > 1 ? Args[1] : FPaths::ChangeExtension(Args[0], TEXT("csv"));
+		if (MesaMovementTrace::DecodeToCSV(Args[0], CSVFilename))
+		{
+			UE_LOG(LogMesa, Display, TEXT("MesaMovementTrace: Decoded %s to %s"), *Args[0], *CSVFilename);
+		}
+	})
+);
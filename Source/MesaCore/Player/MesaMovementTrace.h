@@ -0,0 +1,88 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/*
+	Movement Trace.
+	Always on flight recorder for FMesaMovementSimulation. Every SimulationTick writes one fixed size binary record
+	into a ring buffer owned by the ticking thread, no locks, no formatting, no IO. Nothing is read until someone
+	asks for it with MesaMovement.Trace.Dump, which writes every thread's buffer to Saved/MovementTrace as a .mtr
+	file. MesaMovement.Trace.Decode turns a .mtr back into CSV.
+
+	Each buffer has a single writer (its thread), so only the write cursor is atomic. A dump taken while other
+	threads are ticking can catch a record mid write, which is fine for a diagnostics tool.
+*/
+
+enum class EMesaMoveTraceFlags : uint8
+{
+	None			= 0,
+	Resimulation	= 1 << 0,	// Frame was simulated before, this is a rollback replay.
+	JumpPressed		= 1 << 1,
+	Walking			= 1 << 2,	// Movement type the velocity phase ran with.
+	Flying			= 1 << 3,
+	GroundProbed	= 1 << 4,	// Ground state came from a real probe rather than the previous move.
+	Replayed		= 1 << 5,	// Resimulation served from the pawn's stored frame (MesaMovement.SelectiveRollback).
+};
+ENUM_CLASS_FLAGS(EMesaMoveTraceFlags);
+
+// Ordered so there is no padding, the file is just these structs back to back.
+struct FMesaMoveTraceRecord
+{
+	uint64		Cycles;				// FPlatformTime::Cycles64 at the start of the tick.
+
+	// Sync location going in and coming out, kept double so large maps still decode exactly.
+	FVector		InLocation;
+	FVector		OutLocation;
+
+	uint32		InstanceId;			// UObject unique id of the updated component.
+	int32		Frame;
+	uint16		StepMS;
+	uint8		Flags;				// EMesaMoveTraceFlags
+	uint8		NumHits;			// Blocking hits across the collision phase.
+
+	float		YawInput;
+	FVector3f	MovementInput;
+	FVector3f	InVelocity;
+	FVector3f	OutVelocity;
+	float		InYaw;
+	float		OutYaw;
+	float		Pitch;
+};
+
+static_assert(sizeof(FMesaMoveTraceRecord) == 120, "FMesaMoveTraceRecord is part of the .mtr format");
+
+// Header of a dumped .mtr file, followed by NumRecords records sorted by Cycles.
+struct FMesaMoveTraceFileHeader
+{
+	static constexpr uint32 MagicValue = 0x4352544D; // "MTRC"
+	static constexpr uint32 CurrentVersion = 1;
+
+	uint32 Magic = MagicValue;
+	uint32 Version = CurrentVersion;
+	uint32 RecordSize = sizeof(FMesaMoveTraceRecord);
+	uint32 NumRecords = 0;
+	double SecondsPerCycle = 0.0;
+};
+
+namespace MesaMovementTrace
+{
+	// Records per thread, a power of two. 3.75MB per ticking thread, about 17 seconds of 32 pawns at 60Hz.
+	static constexpr uint32 RecordsPerThread = 32768;
+
+	MESACORE_API bool IsEnabled();
+
+	// Claims the next slot in the calling thread's buffer. Fill it in, then Commit.
+	MESACORE_API FMesaMoveTraceRecord& BeginRecord();
+	MESACORE_API void CommitRecord();
+
+	// Writes every thread's records to Filename. Returns the number written, or INDEX_NONE on failure.
+	MESACORE_API int32 DumpToFile(const FString& Filename);
+
+	// Reads a .mtr back in. Logs and returns false if it's missing, truncated or another version.
+	MESACORE_API bool LoadFromFile(const FString& Filename, FMesaMoveTraceFileHeader& OutHeader, TArray<FMesaMoveTraceRecord>& OutRecords);
+
+	// Writes a .mtr as CSV, one row per record.
+	MESACORE_API bool DecodeToCSV(const FString& TraceFilename, const FString& CSVFilename);
+}
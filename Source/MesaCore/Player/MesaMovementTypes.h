@@ -13,23 +13,57 @@ enum class EMovementType : uint8
 	Flying
 };
 
-// FMovementCommand is sent to the server each client frame.
+UENUM(meta=(Bitflags, UseEnumValuesAsMaskValuesInEditor="true"))
+enum class EMovementButtons : uint8
+{
+	None	= 0,
+	Jump	= 1 << 0,
+	// Room for seven more, FMovementCommand::Buttons is a byte.
+};
+ENUM_CLASS_FLAGS(EMovementButtons);
+
+// FMovementCommand is the packed form of FMesaMovementInputCmd, sent to the server each client frame. 5 bytes.
 USTRUCT()
 struct FMovementCommand
 {
 	GENERATED_BODY()
 
+	// Yaw the 16 bits cover, in degrees either way. Turns are wrapped into it rather than clamped, so nothing the
+	// mouse can do gets lost: half a revolution or more one way is the same as the rest of it the other way.
+	static constexpr float MaxYawDelta = 180.f;
+
+	// Local movement axes scaled to +-127. Movement input is always flat, Z isn't sent.
+	UPROPERTY()
+	int8 Forward = 0;
+
 	UPROPERTY()
-	uint32 CommandNumber = 0;
+	int8 Right = 0;
 
 	UPROPERTY()
-	float Timestamp	= 0.f;
+	int16 YawDelta = 0; // Degrees turned by the command, not a rate, so it doesn't depend on the step.
 
 	UPROPERTY()
-	uint8 MovementInputs = 0;
+	uint8 Buttons = 0; // EMovementButtons
 
 	FMovementCommand() = default;
 
-	FMovementCommand(uint32 CommandNumber, float Timestamp, uint8 MovementInputs)
-		: CommandNumber(CommandNumber), Timestamp(Timestamp), MovementInputs(MovementInputs) {}
-};
\ No newline at end of file
+	bool operator==(const FMovementCommand& Other) const
+	{
+		return Forward == Other.Forward && Right == Other.Right && YawDelta == Other.YawDelta && Buttons == Other.Buttons;
+	}
+
+	void Serialize(FArchive& Ar)
+	{
+		Ar << Forward;
+		Ar << Right;
+		Ar << YawDelta;
+		Ar << Buttons;
+	}
+};
+
+// A previous command sent again for loss recovery, with the step it ran for.
+struct FMesaRedundantCommand
+{
+	FMovementCommand Command;
+	uint8 StepMS = 0;
+};
@@ -3,6 +3,7 @@
 #include "MesaPawn.h"
 #include "Player/MesaPlayerController.h"
 #include "System/MesaGameData.h"
+#include "Network/MesaLagCompensationSubsystem.h"
 #include "MesaCoreMacros.h"
 
 #include "Components/CapsuleComponent.h"
@@ -93,6 +94,25 @@ void AMesaPawn::BeginPlay()
 
 	check(MovementComponent)
 	MovementComponent->ProduceInputDelegate.BindUObject(this, &ThisClass::ProduceInput);
+	MovementComponent->SetSmoothedComponent(BodyMeshComponent);
+
+	if (HasAuthority())
+	{
+		if (UMesaLagCompensationSubsystem* LagCompensationSubsystem = GetWorld()->GetSubsystem<UMesaLagCompensationSubsystem>())
+		{
+			LagCompensationSubsystem->AddPawn(this);
+		}
+	}
+}
+
+void AMesaPawn::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (UMesaLagCompensationSubsystem* LagCompensationSubsystem = GetWorld()->GetSubsystem<UMesaLagCompensationSubsystem>())
+	{
+		LagCompensationSubsystem->RemovePawn(this);
+	}
+
+	Super::EndPlay(EndPlayReason);
 }
 
 void AMesaPawn::Tick( float DeltaSeconds)
@@ -144,6 +164,10 @@ void AMesaPawn::ProduceInput(const int32 DeltaMS, FMesaMovementInputCmd& Cmd)
 {
 	if (!Controller) // no local controller, this is ok. sim proxies just use previous input when extrapolating
 	{
+		if (bFakeAutonomousProxy && HasAuthority())
+		{
+			BotInput.Produce(DeltaMS, Cmd);
+		}
 		return;
 	}
 
@@ -152,11 +176,16 @@ void AMesaPawn::ProduceInput(const int32 DeltaMS, FMesaMovementInputCmd& Cmd)
 	static float ControllerLookRateYaw = 5.0f;
 
 	AddActorWorldRotation(FRotator(0.f, LastLookInput.X * LookRateYaw, 0.f));
-	Cmd.YawInput = LastLookInput.X * LookRateYaw;
+	Cmd.YawInput = LastLookInput.X * LookRateYaw; // The same turn the view just took, in degrees.
 
 	Cmd.MovementInput = GetPendingMovementInputVector();
 	Cmd.bJumpPressed = bJumpPressed;
 
 	Internal_ConsumeMovementInputVector();
 	LastLookInput = FVector2D::ZeroVector;
-}
\ No newline at end of file
+}
+
+void AMesaPawn::SetBotPattern(EMesaBotPattern Pattern, int32 Seed)
+{
+	BotInput.Init(Pattern, Seed);
+}
@@ -8,6 +8,7 @@
 #include "MesaMovementComponent.h"
 #include "MesaMovementSimulation.h"
 #include "MesaCoreTypes.h"
+#include "MesaBotInput.h"
 #include "InputActionValue.h"
 #include "MesaPawn.generated.h"
 
@@ -35,6 +36,7 @@ public:
 	virtual EMesaInputPriority 		GetInputPriority() { return EMesaInputPriority::Desktop; }
 
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	virtual void Tick(float DeltaSeconds) override;
 
 	void Move(const FInputActionValue& Value);
@@ -56,6 +58,10 @@ public:
 
 	void ProduceInput(const int32 DeltaMS, FMesaMovementInputCmd& Cmd);
 
+	// Server. Scripted input for a pawn with no controller, used with bFakeAutonomousProxy. Seed picks the phase.
+	void SetBotPattern(EMesaBotPattern Pattern, int32 Seed);
+	EMesaBotPattern GetBotPattern() const { return BotInput.Pattern; }
+
 //////////////////////////////////////////////////////////////////////
 //	~End Movement Netcode
 //////////////////////////////////////////////////////////////////////
@@ -78,4 +84,6 @@ private:
 
 	bool bIsDead = false;
 	FVector2D LastLookInput;
+
+	FMesaBotInput BotInput;
 };
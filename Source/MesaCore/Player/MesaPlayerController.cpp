@@ -1,20 +1,48 @@
 // Copyright Snaps 2022, All Rights Reserved.
 
 #include "MesaPlayerController.h"
+#include "MesaMovementSimulation.h"
+#include "GameModes/MesaBenchmarkGameMode.h"
 #include "MesaCoreMacros.h"
 
+#include "HAL/IConsoleManager.h"
+
 /////////////////////////////////////////////////////////////////////////////////////
 //	~Begin Network Clock
 /////////////////////////////////////////////////////////////////////////////////////
 
-float AMesaPlayerController::GetServerWorldTimeDelta() const
+namespace MesaNetClockCVars
+{
+	static float ConvergedErrorMS = 4.f;
+	static FAutoConsoleVariableRef CVarConvergedErrorMS(
+		TEXT("MesaNet.Clock.ConvergedErrorMS"),
+		ConvergedErrorMS,
+		TEXT("Clock error under which the client starts backing off how often it resyncs."),
+		ECVF_Default
+	);
+
+	static int32 ConvergedSamples = 8;
+	static FAutoConsoleVariableRef CVarConvergedSamples(
+		TEXT("MesaNet.Clock.ConvergedSamples"),
+		ConvergedSamples,
+		TEXT("Samples needed before the clock can count as converged."),
+		ECVF_Default
+	);
+}
+
+double AMesaPlayerController::GetServerWorldTimeDelta() const
+{
+	return NetClock.GetOffset(GetNetClockTime());
+}
+
+double AMesaPlayerController::GetServerWorldTime() const
 {
-	return ServerWorldTimeDelta;
+	return NetClock.ToServerTime(GetNetClockTime());
 }
 
-float AMesaPlayerController::GetServerWorldTime() const
+double AMesaPlayerController::GetNetClockTime() const
 {
-	return GetWorld()->GetTimeSeconds() + ServerWorldTimeDelta;
+	return GetWorld()->GetRealTimeSeconds();
 }
 
 void AMesaPlayerController::PostNetInit()
@@ -22,52 +50,84 @@ void AMesaPlayerController::PostNetInit()
 	Super::PostNetInit();
 	if (GetLocalRole() != ROLE_Authority)
 	{
+		NetClock.Reset();
+		NetClockResyncInterval = NetClockResyncFrequency;
 		RequestWorldTime();
-		if (NetClockResyncFrequency > 0.f)
-		{
-			FTimerHandle TimerHandle;
-			GetWorldTimerManager().SetTimer(TimerHandle, this, &ThisClass::RequestWorldTime, NetClockResyncFrequency, true);
-		}
 	}
 }
 
 void AMesaPlayerController::RequestWorldTime()
 {
-	ServerRequestWorldTime(GetWorld()->GetTimeSeconds());
+	ServerRequestWorldTime(GetNetClockTime());
+
+	// Armed from the request rather than the reply so a lost RPC doesn't stop the clock syncing.
+	if (NetClockResyncInterval > 0.f)
+	{
+		GetWorldTimerManager().SetTimer(NetClockTimerHandle, this, &ThisClass::RequestWorldTime, NetClockResyncInterval, false);
+	}
 }
 
-void AMesaPlayerController::ClientUpdateWorldTime_Implementation(float ClientTimestamp, float ServerTimestamp)
+void AMesaPlayerController::ClientUpdateWorldTime_Implementation(double ClientTimestamp, double ServerTimestamp)
 {
 	//MESA_PROFILE_SCOPED(MesaSysScope::Network, AMesaPlayerController::ClientUpdateWorldTime_Implementation);
-	float AdjustedRTT = 0;
-	const float RoundTripTime = GetWorld()->GetTimeSeconds() - ClientTimestamp;
+	const double Now = GetNetClockTime();
+	NetClock.AddSample(ClientTimestamp, Now, ServerTimestamp);
 
-	RTTCircularBuffer.Add(RoundTripTime);
-	if (RTTCircularBuffer.Num() == 10)
+	// Back off while the clock holds, start over at the base rate the moment it doesn't.
+	if (NetClockResyncFrequency > 0.f)
 	{
-		TArray<float> TempBuffer = RTTCircularBuffer;
-		TempBuffer.Sort();
-		for (int32 Index = 1; Index < 9; ++Index)
-		{
-			AdjustedRTT += TempBuffer[Index];
-		}
-		AdjustedRTT /= 8;
-		RTTCircularBuffer.RemoveAt(0);
+		NetClockResyncInterval = NetClock.IsConverged(MesaNetClockCVars::ConvergedSamples, MesaNetClockCVars::ConvergedErrorMS / 1000.0)
+			? FMath::Min(NetClockResyncInterval * 2.f, FMath::Max(NetClockMaxResyncInterval, NetClockResyncFrequency))
+			: NetClockResyncFrequency;
 	}
-	else
+
+	if (IsLocalController())
 	{
-		AdjustedRTT = RoundTripTime;
+		FMesaNetClockStats& Stats = FMesaNetClockStats::Get();
+		Stats.ErrorMS = NetClock.GetError() * 1000.0;
+		Stats.OffsetMS = NetClock.GetOffset(Now) * 1000.0;
+		Stats.SkewPPM = NetClock.GetSkew() * 1e6;
+		Stats.RoundTripMS = NetClock.GetRoundTripTime() * 1000.0;
+		Stats.ResyncInterval = NetClockResyncInterval;
+		++Stats.Samples;
 	}
-	
-	ServerWorldTimeDelta = ServerTimestamp - ClientTimestamp - AdjustedRTT / 2.f;
 }
 
-void AMesaPlayerController::ServerRequestWorldTime_Implementation(float ClientTimestamp)
+void AMesaPlayerController::ServerRequestWorldTime_Implementation(double ClientTimestamp)
 {
-	const float Timestamp = GetWorld()->GetTimeSeconds();
+	const double Timestamp = GetWorld()->GetTimeSeconds();
 	ClientUpdateWorldTime(ClientTimestamp, Timestamp);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
 //	~End Network Clock
-/////////////////////////////////////////////////////////////////////////////////////
\ No newline at end of file
+/////////////////////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////////////////////
+//	~Begin Benchmark
+/////////////////////////////////////////////////////////////////////////////////////
+
+void AMesaPlayerController::ClientBenchmarkStats_Implementation(bool bReset)
+{
+	if (bReset)
+	{
+		FMesaRollbackStats::Get() = FMesaRollbackStats();
+		FMesaSimulationTickStats::Get() = FMesaSimulationTickStats();
+		return;
+	}
+
+	const FMesaRollbackStats& RollbackStats = FMesaRollbackStats::Get();
+	ServerReportBenchmarkStats(RollbackStats.Resimulated, RollbackStats.Replayed, FMesaSimulationTickStats::Get().Ticks);
+}
+
+void AMesaPlayerController::ServerReportBenchmarkStats_Implementation(int64 Resimulated, int64 Replayed, int64 MovementTicks)
+{
+	if (AMesaBenchmarkGameMode* GameMode = GetWorld()->GetAuthGameMode<AMesaBenchmarkGameMode>())
+	{
+		GameMode->AddClientStats(Resimulated, Replayed, MovementTicks);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+//	~End Benchmark
+/////////////////////////////////////////////////////////////////////////////////////
@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "GameFramework/PlayerController.h"
+#include "Network/MesaNetClock.h"
 #include "MesaPlayerController.generated.h"
 
 /*
@@ -19,37 +20,71 @@ public:
 //	~Begin Network Clock
 //		We don't use the built in network clock because epic can't make up their
 //      mind on if we use floats or doubles for net time and it's inaccurate.
-//		We use a modified version of Vori's circular buffer netclock.
+//		Started from Vori's circular buffer netclock, the estimate itself now lives in
+//		FMesaNetClock (offset and skew fit over a ring of samples).
 //		https://vorixo.github.io/devtricks/non-destructive-synced-net-clock/
 /////////////////////////////////////////////////////////////////////////////////////
 
+	// Server world time minus this client's real time, see GetNetClockTime.
 	UFUNCTION(BlueprintPure)
-	float GetServerWorldTimeDelta() const;
+	double GetServerWorldTimeDelta() const;
 
 	UFUNCTION(BlueprintPure)
-	float GetServerWorldTime() const;
+	double GetServerWorldTime() const;
+
+	const FMesaNetClock& GetNetClock() const { return NetClock; }
 
 	void PostNetInit() override;
 
 private:
 
-	// Frequency that the client requests to adjust it's local clock. Set to zero to disable periodic updates.
+	// Seconds between clock samples until the clock converges. Set to zero to disable periodic updates.
 	UPROPERTY(EditDefaultsOnly, meta=(AllowPrivateAccess = "true"))
 	float NetClockResyncFrequency = 1.f;
 
+	// Once converged the interval doubles with every sample up to this, and drops back if the error grows.
+	UPROPERTY(EditDefaultsOnly, meta=(AllowPrivateAccess = "true"))
+	float NetClockMaxResyncInterval = 16.f;
+
 	void RequestWorldTime();
+
+	// What the client side of the clock runs on. Real time, the world's is bent by input time dilation
+	// (UMesaMovementComponent::ApplyInputTimeDilation) and would read as skew.
+	double GetNetClockTime() const;
 	
 	UFUNCTION(Server, Unreliable)
-	void ServerRequestWorldTime(float ClientTimestamp);
+	void ServerRequestWorldTime(double ClientTimestamp);
 	
 	UFUNCTION(Client, Unreliable)
-	void ClientUpdateWorldTime(float ClientTimestamp, float ServerTimestamp);
+	void ClientUpdateWorldTime(double ClientTimestamp, double ServerTimestamp);
 
-	float ServerWorldTimeDelta = 0.f;
-	TArray<float> RTTCircularBuffer;
+	FMesaNetClock NetClock;
+	float NetClockResyncInterval = 0.f;
+	FTimerHandle NetClockTimerHandle;
 
 /////////////////////////////////////////////////////////////////////////////////////
 //	~End Network Clock
 /////////////////////////////////////////////////////////////////////////////////////
 
+/////////////////////////////////////////////////////////////////////////////////////
+//	~Begin Benchmark
+//		AMesaBenchmarkGameMode asks connected clients for what only they can see,
+//		their rollbacks, at the start and end of a run.
+/////////////////////////////////////////////////////////////////////////////////////
+
+public:
+
+	// Server to client. Resets the client's rollback stats, or sends them back with ServerReportBenchmarkStats.
+	UFUNCTION(Client, Reliable)
+	void ClientBenchmarkStats(bool bReset);
+
+private:
+
+	UFUNCTION(Server, Reliable)
+	void ServerReportBenchmarkStats(int64 Resimulated, int64 Replayed, int64 MovementTicks);
+
+/////////////////////////////////////////////////////////////////////////////////////
+//	~End Benchmark
+/////////////////////////////////////////////////////////////////////////////////////
+
 };
@@ -0,0 +1,236 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#include "MesaBakeCollisionCommandlet.h"
+#include "MesaCoreMacros.h"
+#include "Collision/MesaBrushCollision.h"
+#include "Collision/MesaCollisionSubsystem.h"
+#include "Player/MesaPawn.h"
+
+#include "Components/CapsuleComponent.h"
+#include "Engine/World.h"
+#include "GameFramework/GameModeBase.h"
+#include "GameFramework/WorldSettings.h"
+#include "GameMapsSettings.h"
+#include "HAL/FileManager.h"
+#include "Misc/PackageName.h"
+#include "Misc/Paths.h"
+#include "UObject/Package.h"
+
+namespace MesaBakeCollision
+{
+	static constexpr float MaxSweepLength = 512.f;
+
+	// Allowed disagreement in hit distance. Brush sweeps stop MESA_SURFACE_CLIP_EPSILON short, physics doesn't.
+	static constexpr float DistanceTolerance = 1.f;
+
+	// Plane expansion is conservative around brush edges, so a few disagreements on diagonal edges are expected.
+	static constexpr float MaxMismatchFraction = 0.01f;
+
+	// The sweeps we validate should look like the sweeps movement does, so use the capsule of the pawn the map spawns.
+	static const UCapsuleComponent* GetPawnCapsule(const UWorld& World)
+	{
+		const AWorldSettings* WorldSettings = World.GetWorldSettings();
+		const UClass* GameModeClass = WorldSettings && WorldSettings->DefaultGameMode
+			? WorldSettings->DefaultGameMode.Get()
+			: LoadClass<AGameModeBase>(nullptr, *UGameMapsSettings::GetGlobalDefaultGameMode());
+
+		const UClass* PawnClass = GameModeClass ? GameModeClass->GetDefaultObject<AGameModeBase>()->DefaultPawnClass.Get() : nullptr;
+		if (!PawnClass || !PawnClass->IsChildOf<AMesaPawn>())
+		{
+			PawnClass = AMesaPawn::StaticClass();
+		}
+
+		return Cast<UCapsuleComponent>(PawnClass->GetDefaultObject<AActor>()->GetRootComponent());
+	}
+}
+
+int32 UMesaBakeCollisionCommandlet::Main(const FString& Params)
+{
+	TArray<FString> MapPackageNames;
+
+	FString MapParam;
+	if (FParse::Value(*Params, TEXT("Map="), MapParam))
+	{
+		MapPackageNames.Add(MapParam);
+	}
+	else
+	{
+		TArray<FString> MapFiles;
+		IFileManager::Get().FindFilesRecursive(MapFiles, *FPaths::ProjectContentDir(), *(FString(TEXT("*")) + FPackageName::GetMapPackageExtension()), true, false);
+
+		for (const FString& MapFile : MapFiles)
+		{
+			FString PackageName;
+			if (FPackageName::TryConvertFilenameToLongPackageName(MapFile, PackageName))
+			{
+				MapPackageNames.Add(PackageName);
+			}
+		}
+	}
+
+	int32 NumValidationSweeps = 0;
+	if (FParse::Param(*Params, TEXT("Validate")))
+	{
+		NumValidationSweeps = 10000;
+		FParse::Value(*Params, TEXT("Validate="), NumValidationSweeps);
+	}
+
+	int32 NumFailed = 0;
+	for (const FString& MapPackageName : MapPackageNames)
+	{
+		if (!BakeMap(MapPackageName, NumValidationSweeps))
+		{
+			++NumFailed;
+		}
+
+		CollectGarbage(RF_NoFlags);
+	}
+
+	UE_LOG(LogMesa, Display, TEXT("MesaBakeCollision: Baked %d of %d maps"), MapPackageNames.Num() - NumFailed, MapPackageNames.Num());
+	return NumFailed > 0 ? 1 : 0;
+}
+
+bool UMesaBakeCollisionCommandlet::BakeMap(const FString& MapPackageName, int32 NumValidationSweeps)
+{
+	UPackage* Package = LoadPackage(nullptr, *MapPackageName, LOAD_None);
+	UWorld* World = Package ? UWorld::FindWorldInPackage(Package) : nullptr;
+	if (!World)
+	{
+		UE_LOG(LogMesa, Error, TEXT("MesaBakeCollision: Failed to load %s"), *MapPackageName);
+		return false;
+	}
+
+	World->AddToRoot();
+	World->WorldType = EWorldType::Editor;
+
+	if (!World->bIsWorldInitialized)
+	{
+		World->InitWorld(UWorld::InitializationValues()
+			.AllowAudioPlayback(false)
+			.CreatePhysicsScene(true)
+			.RequiresHitProxies(false)
+			.CreateNavigation(false)
+			.CreateAISystem(false)
+			.ShouldSimulatePhysics(false));
+	}
+
+	World->UpdateWorldComponents(true, false);
+	World->FlushLevelStreaming(EFlushLevelStreamingType::Full);
+
+	bool bSuccess = false;
+	FMesaBrushWorld BrushWorld;
+	int32 NumPrimitives = 0;
+
+	if (UMesaCollisionSubsystem::GatherStaticBrushes(*World, BrushWorld, &NumPrimitives))
+	{
+		BrushWorld.BuildBVH();
+
+		const int32 NumMismatches = NumValidationSweeps > 0 ? Validate(*World, BrushWorld, NumValidationSweeps) : 0;
+		if (NumMismatches > NumValidationSweeps * MesaBakeCollision::MaxMismatchFraction)
+		{
+			UE_LOG(LogMesa, Error, TEXT("MesaBakeCollision: %s failed validation, %d of %d sweeps disagree with the physics scene"),
+				*MapPackageName, NumMismatches, NumValidationSweeps);
+		}
+		else
+		{
+			const FString Filename = UMesaCollisionSubsystem::GetCookedCollisionFilename(*World);
+			bSuccess = BrushWorld.SaveToFile(Filename);
+
+			// Read it back the way the runtime will, so a bad write fails the bake rather than the server.
+			FMesaBrushWorld Written;
+			if (bSuccess && !Written.LoadFromFile(Filename, true))
+			{
+				UE_LOG(LogMesa, Error, TEXT("MesaBakeCollision: %s didn't load back from %s"), *MapPackageName, *Filename);
+				bSuccess = false;
+			}
+
+			UE_LOG(LogMesa, Display, TEXT("MesaBakeCollision: %s -> %s, %d brushes from %d primitives, %d BVH nodes, %d validation mismatches"),
+				*MapPackageName, *Filename, BrushWorld.NumBrushes(), NumPrimitives, BrushWorld.GetNodes().Num(), NumMismatches);
+		}
+	}
+	else
+	{
+		// Make sure a stale file can't be picked up for a map that is no longer bakeable.
+		IFileManager::Get().Delete(*UMesaCollisionSubsystem::GetCookedCollisionFilename(*World), false, false, true);
+		UE_LOG(LogMesa, Warning, TEXT("MesaBakeCollision: %s can't be represented as brushes, it will use the physics scene"), *MapPackageName);
+		bSuccess = true;
+	}
+
+	World->DestroyWorld(false);
+	World->RemoveFromRoot();
+	return bSuccess;
+}
+
+int32 UMesaBakeCollisionCommandlet::Validate(UWorld& World, const FMesaBrushWorld& BrushWorld, int32 NumSweeps) const
+{
+	FBox3f Bounds(ForceInit);
+	for (const FMesaBrush& Brush : BrushWorld.GetBrushes())
+	{
+		Bounds += FBox3f(Brush.Min, Brush.Max);
+	}
+
+	if (!Bounds.IsValid)
+	{
+		return 0;
+	}
+
+	const UCapsuleComponent* PawnCapsule = MesaBakeCollision::GetPawnCapsule(World);
+	if (!PawnCapsule)
+	{
+		UE_LOG(LogMesa, Warning, TEXT("MesaBakeCollision: The default pawn has no capsule root, skipping validation"));
+		return 0;
+	}
+
+	const float CapsuleRadius = PawnCapsule->GetUnscaledCapsuleRadius();
+	const float CapsuleHalfHeight = PawnCapsule->GetUnscaledCapsuleHalfHeight();
+
+	const FBox SampleBounds = FBox(Bounds).ExpandBy(CapsuleHalfHeight);
+	const FCollisionShape Capsule = FCollisionShape::MakeCapsule(CapsuleRadius, CapsuleHalfHeight);
+
+	FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(MesaBakeCollision), false);
+	QueryParams.MobilityType = EQueryMobilityType::Static;
+
+	FRandomStream Random(0x4D455341);
+	int32 NumMismatches = 0;
+	int32 NumOverlapMismatches = 0;
+
+	for (int32 SweepIndex = 0; SweepIndex < NumSweeps; ++SweepIndex)
+	{
+		const FVector Start = Random.RandPointInBox(SampleBounds);
+		const FVector Delta = Random.VRand() * Random.FRandRange(1.f, MesaBakeCollision::MaxSweepLength);
+
+		const bool bPhysicsOverlap = World.OverlapBlockingTestByChannel(Start, FQuat::Identity, ECC_Pawn, Capsule, QueryParams);
+		const bool bBrushOverlap = BrushWorld.OverlapCapsule(Start, CapsuleRadius, CapsuleHalfHeight);
+		if (bPhysicsOverlap != bBrushOverlap)
+		{
+			++NumOverlapMismatches;
+			++NumMismatches;
+			continue;
+		}
+
+		// Initial penetration handling differs by design, only compare clean sweeps.
+		if (bPhysicsOverlap)
+		{
+			continue;
+		}
+
+		FHitResult PhysicsHit;
+		World.SweepSingleByChannel(PhysicsHit, Start, Start + Delta, FQuat::Identity, ECC_Pawn, Capsule, QueryParams);
+
+		FMesaBrushHit BrushHit;
+		BrushWorld.SweepCapsule(Start, Delta, CapsuleRadius, CapsuleHalfHeight, BrushHit);
+
+		const float PhysicsDistance = PhysicsHit.bBlockingHit ? PhysicsHit.Distance : Delta.Size();
+		const float BrushDistance = BrushHit.Time * Delta.Size();
+
+		if (FMath::Abs(PhysicsDistance - BrushDistance) > MesaBakeCollision::DistanceTolerance + MESA_SURFACE_CLIP_EPSILON)
+		{
+			++NumMismatches;
+			UE_LOG(LogMesa, Verbose, TEXT("MesaBakeCollision: Sweep from %s by %s, physics %.2f, brushes %.2f"),
+				*Start.ToString(), *Delta.ToString(), PhysicsDistance, BrushDistance);
+		}
+	}
+
+	UE_LOG(LogMesa, Display, TEXT("MesaBakeCollision: Validated %d sweeps, %d mismatches (%d overlap)"), NumSweeps, NumMismatches, NumOverlapMismatches);
+	return NumMismatches;
+}
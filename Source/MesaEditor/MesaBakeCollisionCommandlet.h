@@ -0,0 +1,36 @@
+// Copyright Snaps 2022, All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "MesaBakeCollisionCommandlet.generated.h"
+
+class FMesaBrushWorld;
+
+/*
+	Bake Collision Commandlet.
+	Bakes the static pawn blocking collision of maps into the cooked .mcol files UMesaCollisionSubsystem maps at
+	runtime. Run after changing level geometry, the output goes to Content/MovementCollision and is staged as is.
+
+		UnrealEditor-Cmd Mesa.uproject -run=MesaBakeCollision [-Map=/Game/Maps/Foo] [-Validate[=N]]
+
+	Without -Map every map in the project is baked. -Validate sweeps N random capsules (default 10000) through
+	both the baked brushes and the physics scene and fails the run if they disagree.
+*/
+UCLASS()
+class UMesaBakeCollisionCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+
+	virtual int32 Main(const FString& Params) override;
+
+protected:
+
+	bool BakeMap(const FString& MapPackageName, int32 NumValidationSweeps);
+
+	// Returns the number of sweeps the brush world and physics scene disagree on.
+	int32 Validate(UWorld& World, const FMesaBrushWorld& BrushWorld, int32 NumSweeps) const;
+};
@@ -18,7 +18,9 @@ public class MesaEditor : ModuleRules
 		PrivateDependencyModuleNames.AddRange(new string[] {
 			"Core",
 			"CoreUObject",
-			"Engine"
+			"Engine",
+			"EngineSettings",
+			"MesaCore"
 		});
 	}
 }